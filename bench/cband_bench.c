@@ -0,0 +1,391 @@
+/*
+ * mod_cband - A per-user, per-virtualhost and per-destination bandwidth limiter for the Apache HTTP Server Version 2
+ *
+ * Copyright (c) 2005 Lukasz Dembinski <dembol@cband.linux.pl>
+ * All Rights Reserved
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+
+/*
+ * Microbenchmarks of the per-request hot path of libcband.
+ *
+ * usage: cband_bench [-t max_threads] [-n ops_per_thread] [-f filter]
+ *
+ * Every case runs with 1, 2, 4 ... max_threads threads and prints the time
+ * of one operation seen by one thread (ns/op) and the throughput of all
+ * threads together (ops/s)
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <pthread.h>
+#include <arpa/inet.h>
+
+#include "cband_core.h"
+
+#define BENCH_OPS		200000
+#define BENCH_MAX_THREADS	64
+#define BENCH_DST_PREFIXES	100000
+#define BENCH_VHOSTS		10000
+#define BENCH_CALIBRATE_OPS	1000
+#define BENCH_CASE_NSEC		200000000ULL	/* upper bound of one run with one thread */
+
+typedef struct bench_case bench_case;
+
+typedef struct {
+    bench_case *c;
+    unsigned long ops;
+    unsigned int seed;
+    unsigned long sink;
+} bench_thread;
+
+struct bench_case {
+    const char *name;
+    int size;					/* table fill, number of prefixes, vhosts ... */
+    int single;					/* not thread safe, runs with one thread only */
+    void (*run)(bench_thread *t);
+};
+
+static mod_cband_config_header *config;
+static pthread_barrier_t barrier;
+
+static in_addr_t *remote_addrs;
+static int remote_fill;
+static char **vhost_names;
+static int vhost_count;
+static int dst_count;
+static mod_cband_virtualhost_config_entry *bench_entry;
+
+static void *bench_alloc(void *ctx, size_t size)
+{
+    return malloc(size);
+}
+
+static inline unsigned int bench_rand(bench_thread *t)
+{
+    /* xorshift, rand() takes a lock in glibc */
+    t->seed ^= t->seed << 13;
+    t->seed ^= t->seed >> 17;
+    t->seed ^= t->seed << 5;
+
+    return t->seed;
+}
+
+static unsigned long long bench_nsec(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return (unsigned long long)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/*
+ * fills the remote host table with fill hosts of one virtualhost
+ */
+static void bench_remote_fill(int fill)
+{
+    int i;
+
+    memset(config->remote_hosts.hosts, 0, sizeof(mod_cband_remote_host) * MAX_REMOTE_HOSTS);
+
+    for (i = 0; i < fill; i++) {
+	remote_addrs[i] = htonl(0x0a000000 + i);
+	mod_cband_get_remote_host_(remote_addrs[i], bench_entry->virtual_name, 1);
+    }
+
+    remote_fill = fill;
+}
+
+static void bench_remote_host(bench_thread *t)
+{
+    unsigned long i;
+    in_addr_t addr;
+
+    for (i = 0; i < t->ops; i++) {
+	if (remote_fill > 0)
+	    addr = remote_addrs[bench_rand(t) % remote_fill];
+	else
+	    addr = htonl(0x0b000000 + (bench_rand(t) & 0xffff));
+	t->sink += mod_cband_get_remote_host_(addr, bench_entry->virtual_name, 0);
+    }
+}
+
+/*
+ * adds /24 networks 1.0.0.0/24, 1.0.1.0/24 ... up to count prefixes
+ */
+static void bench_dst_fill(int count)
+{
+    char net[32];
+    int i;
+
+    for (i = dst_count; i < count; i++) {
+	sprintf(net, "%d.%d.%d.0/24", 1 + (i >> 16), (i >> 8) & 0xff, i & 0xff);
+	mod_cband_add_class_dst(net, i % DST_CLASS);
+    }
+
+    dst_count = count;
+}
+
+static void bench_get_dst(bench_thread *t)
+{
+    unsigned long i;
+    unsigned int n;
+
+    for (i = 0; i < t->ops; i++) {
+	/* 3 of 4 lookups hit one of the networks */
+	n = bench_rand(t) % (dst_count + dst_count / 3 + 1);
+	t->sink += mod_cband_get_dst_(htonl(((1 + (n >> 16)) << 24) | ((n & 0xffff) << 8) | 1));
+    }
+}
+
+static void bench_vhost_fill(int count)
+{
+    char name[MAX_VIRTUALHOST_NAME];
+    int i;
+
+    for (i = vhost_count; i < count; i++) {
+	sprintf(name, "www%d.example.org", i);
+	vhost_names[i] = strdup(name);
+	mod_cband_get_virtualhost_entry_(vhost_names[i], 80, i, 1);
+    }
+
+    vhost_count = count;
+}
+
+static void bench_vhost_entry(bench_thread *t)
+{
+    unsigned long i;
+    int n;
+
+    for (i = 0; i < t->ops; i++) {
+	n = bench_rand(t) % vhost_count;
+	t->sink += (unsigned long)mod_cband_get_virtualhost_entry_(vhost_names[n], 80, n, 0);
+    }
+}
+
+static void bench_update_speed_score(bench_thread *t)
+{
+    unsigned long long bytes = 8192;
+    unsigned long i;
+
+    for (i = 0; i < t->ops; i++) {
+	mod_cband_update_speed(bench_entry->shmem_data, (unsigned long)bytes, 0, -1);
+	mod_cband_update_score(bench_entry->virtual_scoreboard, &bytes, 0, &(bench_entry->shmem_data->total_usage));
+    }
+}
+
+static void bench_log_bytes(bench_thread *t)
+{
+    unsigned long i;
+
+    for (i = 0; i < t->ops; i++)
+	mod_cband_log_bytes(bench_entry, NULL, 8192, 0, -1);
+}
+
+static void bench_sem(bench_thread *t)
+{
+    unsigned long i;
+
+    for (i = 0; i < t->ops; i++) {
+	mod_cband_sem_down(config->sem_id);
+	mod_cband_sem_up(config->sem_id);
+    }
+}
+
+static void bench_seq_write(bench_thread *t)
+{
+    unsigned long i;
+
+    for (i = 0; i < t->ops; i++) {
+	mod_cband_shmem_write_begin(bench_entry->shmem_data);
+	mod_cband_shmem_write_end(bench_entry->shmem_data);
+    }
+}
+
+static void bench_seq_read(bench_thread *t)
+{
+    mod_cband_shmem_data copy;
+    unsigned long i;
+
+    for (i = 0; i < t->ops; i++)
+	t->sink += mod_cband_shmem_read(bench_entry->shmem_data, &copy);
+}
+
+static void *bench_thread_main(void *arg)
+{
+    bench_thread *t = (bench_thread *)arg;
+
+    pthread_barrier_wait(&barrier);
+    t->c->run(t);
+    pthread_barrier_wait(&barrier);
+
+    return NULL;
+}
+
+static unsigned long long bench_run(bench_case *c, int threads, unsigned long ops, int print)
+{
+    pthread_t tid[BENCH_MAX_THREADS];
+    bench_thread t[BENCH_MAX_THREADS];
+    unsigned long long start, elapsed;
+    int i;
+
+    pthread_barrier_init(&barrier, NULL, threads + 1);
+
+    for (i = 0; i < threads; i++) {
+	memset(&t[i], 0, sizeof(bench_thread));
+	t[i].c    = c;
+	t[i].ops  = ops;
+	t[i].seed = 0x9e3779b9 * (i + 1);
+	pthread_create(&tid[i], NULL, bench_thread_main, &t[i]);
+    }
+
+    pthread_barrier_wait(&barrier);
+    start = bench_nsec();
+    pthread_barrier_wait(&barrier);
+    elapsed = bench_nsec() - start;
+
+    for (i = 0; i < threads; i++)
+	pthread_join(tid[i], NULL);
+
+    pthread_barrier_destroy(&barrier);
+
+    if (elapsed == 0)
+	elapsed = 1;
+
+    if (!print)
+	return elapsed;
+
+    printf("%-28s %8d %8d %12.1f %14.0f\n", c->name, c->size, threads,
+	   (double)elapsed / ops, (double)ops * threads * 1e9 / elapsed);
+    fflush(stdout);
+
+    return elapsed;
+}
+
+static void bench_case_run(bench_case *c, int max_threads, unsigned long ops, const char *filter)
+{
+    unsigned long long elapsed;
+    unsigned long max_ops;
+    int threads;
+
+    if (filter != NULL && strstr(c->name, filter) == NULL)
+	return;
+
+    /* big tables are scanned linearly, keep every run short */
+    elapsed = bench_run(c, 1, BENCH_CALIBRATE_OPS, 0);
+    max_ops = BENCH_CASE_NSEC * BENCH_CALIBRATE_OPS / elapsed;
+    if (max_ops < BENCH_CALIBRATE_OPS)
+	max_ops = BENCH_CALIBRATE_OPS;
+    if (ops > max_ops)
+	ops = max_ops;
+
+    for (threads = 1; threads <= max_threads; threads *= 2) {
+	bench_run(c, threads, ops, 1);
+	if (c->single)
+	    break;
+    }
+}
+
+int main(int argc, char **argv)
+{
+    bench_case remote  = { "get_remote_host",    0, 0, bench_remote_host };
+    bench_case dst     = { "get_dst",            0, 0, bench_get_dst };
+    bench_case vhost   = { "get_virtualhost_entry", 0, 0, bench_vhost_entry };
+    bench_case cases[] = {
+	{ "update_speed+update_score", 1, 1, bench_update_speed_score },
+	{ "log_bytes (locked)",        1, 0, bench_log_bytes },
+	{ "sem_down+sem_up",           1, 0, bench_sem },
+	{ "shmem_write_begin+end",     1, 0, bench_seq_write },
+	{ "shmem_read",                1, 0, bench_seq_read },
+    };
+    int remote_fills[] = { 0, 64, 1024, MAX_REMOTE_HOSTS / 2, MAX_REMOTE_HOSTS };
+    int dst_sizes[]    = { 10, 1000, BENCH_DST_PREFIXES };
+    int vhost_sizes[]  = { 10, 1000, BENCH_VHOSTS };
+    unsigned long ops = BENCH_OPS;
+    int max_threads;
+    char *filter = NULL;
+    unsigned int i;
+    int opt;
+
+    max_threads = sysconf(_SC_NPROCESSORS_ONLN);
+
+    while ((opt = getopt(argc, argv, "t:n:f:")) != -1) {
+	switch (opt) {
+	    case 't':
+		max_threads = atoi(optarg);
+		break;
+	    case 'n':
+		ops = strtoul(optarg, NULL, 10);
+		break;
+	    case 'f':
+		filter = optarg;
+		break;
+	    default:
+		fprintf(stderr, "usage: %s [-t max_threads] [-n ops_per_thread] [-f filter]\n", argv[0]);
+		return 1;
+	}
+    }
+
+    if (max_threads < 1)
+	max_threads = 1;
+    if (max_threads > BENCH_MAX_THREADS)
+	max_threads = BENCH_MAX_THREADS;
+    if (ops == 0)
+	ops = BENCH_OPS;
+
+    if ((config = mod_cband_core_init(bench_alloc, NULL)) == NULL || config->remote_hosts.hosts == NULL) {
+	fprintf(stderr, "cband_bench: cannot create shared memory or semaphores\n");
+	mod_cband_core_remove();
+	return 1;
+    }
+
+    remote_addrs = calloc(MAX_REMOTE_HOSTS, sizeof(in_addr_t));
+    vhost_names  = calloc(BENCH_VHOSTS, sizeof(char *));
+    bench_vhost_fill(1);
+    bench_entry = mod_cband_get_virtualhost_entry_(vhost_names[0], 80, 0, 0);
+
+    printf("%-28s %8s %8s %12s %14s\n", "case", "size", "threads", "ns/op", "ops/s");
+
+    for (i = 0; i < sizeof(remote_fills) / sizeof(int); i++) {
+	bench_remote_fill(remote_fills[i]);
+	remote.size = remote_fills[i];
+	bench_case_run(&remote, max_threads, ops, filter);
+    }
+
+    for (i = 0; i < sizeof(dst_sizes) / sizeof(int); i++) {
+	bench_dst_fill(dst_sizes[i]);
+	dst.size = dst_sizes[i];
+	bench_case_run(&dst, max_threads, ops, filter);
+    }
+
+    for (i = 0; i < sizeof(vhost_sizes) / sizeof(int); i++) {
+	bench_vhost_fill(vhost_sizes[i]);
+	vhost.size = vhost_sizes[i];
+	bench_case_run(&vhost, max_threads, ops, filter);
+    }
+
+    for (i = 0; i < sizeof(cases) / sizeof(bench_case); i++)
+	bench_case_run(&cases[i], max_threads, ops, filter);
+
+    mod_cband_core_remove();
+
+    return 0;
+}
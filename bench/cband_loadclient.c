@@ -0,0 +1,308 @@
+/*
+ * mod_cband - A per-user, per-virtualhost and per-destination bandwidth limiter for the Apache HTTP Server Version 2
+ *
+ * Copyright (c) 2005 Lukasz Dembinski <dembol@cband.linux.pl>
+ * All Rights Reserved
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+
+/*
+ * HTTP/1.1 keep-alive load generator used by bench/loadtest.sh. Every thread
+ * keeps one connection to 127.0.0.1 and requests the path from the virtual
+ * hosts vh0.loadtest ... vh<N-1>.loadtest in turn.
+ *
+ * usage: cband_loadclient -p port [-c connections] [-d seconds] [-v vhosts] [-u path]
+ *
+ * Prints "key value" lines: requests, errors, bytes, seconds, p50_ms, p90_ms,
+ * p99_ms, max_ms
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <unistd.h>
+#include <time.h>
+#include <errno.h>
+#include <pthread.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <sys/socket.h>
+
+#define CLIENT_BUF_LEN		0x10000
+#define CLIENT_MAX_HEADER	0x4000
+
+typedef struct {
+    int id;
+    unsigned long long requests;
+    unsigned long long errors;
+    unsigned long long bytes;
+    double *latency;			/* in ms */
+    unsigned long latency_count;
+    unsigned long latency_max;
+} client_thread;
+
+static int opt_port = 0;
+static int opt_connections = 10;
+static int opt_duration = 10;
+static int opt_vhosts = 1;
+static const char *opt_path = "/";
+static double deadline;
+
+static double client_time(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static int client_connect(void)
+{
+    struct sockaddr_in addr;
+    struct timeval tv;
+    int fd, one = 1;
+
+    if ((fd = socket(AF_INET, SOCK_STREAM, 0)) < 0)
+	return -1;
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family      = AF_INET;
+    addr.sin_port        = htons(opt_port);
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+    /* a shaped response may pause for seconds, but not for ever */
+    tv.tv_sec  = 30;
+    tv.tv_usec = 0;
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+    if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+	close(fd);
+	return -1;
+    }
+
+    return fd;
+}
+
+static void client_latency(client_thread *t, double ms)
+{
+    if (t->latency_count == t->latency_max) {
+	t->latency_max = t->latency_max ? t->latency_max * 2 : 4096;
+	t->latency = realloc(t->latency, t->latency_max * sizeof(double));
+    }
+
+    t->latency[t->latency_count++] = ms;
+}
+
+/*
+ * sends one request and reads the whole response, returns the status code,
+ * -1 when the connection has to be reopened
+ */
+static int client_request(client_thread *t, int fd, int vhost, int *keepalive)
+{
+    char buf[CLIENT_BUF_LEN];
+    char *end, *p;
+    long long content_length = -1;
+    long long body;
+    int len, n, status, minor;
+
+    len = snprintf(buf, sizeof(buf), "GET %s HTTP/1.1\r\nHost: vh%d.loadtest\r\nUser-Agent: cband_loadclient\r\n\r\n",
+		   opt_path, vhost);
+
+    if (write(fd, buf, len) != len)
+	return -1;
+
+    /* headers */
+    len = 0;
+    end = NULL;
+    while (end == NULL) {
+	if (len >= CLIENT_MAX_HEADER)
+	    return -1;
+	if ((n = read(fd, buf + len, CLIENT_MAX_HEADER - len)) <= 0)
+	    return -1;
+	len += n;
+	buf[len] = 0;
+	end = strstr(buf, "\r\n\r\n");
+    }
+
+    if (sscanf(buf, "HTTP/1.%d %d", &minor, &status) != 2)
+	return -1;
+
+    /* HTTP/1.0 closes the connection unless told otherwise */
+    *keepalive = (minor > 0);
+    for (p = strstr(buf, "\r\n"); (p != NULL) && (p < end); p = strstr(p + 2, "\r\n")) {
+	if (!strncasecmp(p + 2, "Content-Length:", 15))
+	    content_length = atoll(p + 17);
+	else
+	if (!strncasecmp(p + 2, "Connection: close", 17))
+	    *keepalive = 0;
+	else
+	if (!strncasecmp(p + 2, "Connection: keep-alive", 22))
+	    *keepalive = 1;
+    }
+
+    if (content_length < 0) {
+	/* without a length the body ends with the connection */
+	*keepalive = 0;
+	content_length = 1LL << 62;
+    }
+
+    body = len - (end + 4 - buf);
+    t->bytes += body;
+
+    while (body < content_length) {
+	if ((n = read(fd, buf, sizeof(buf))) <= 0) {
+	    if ((n == 0) && (*keepalive == 0))
+		break;
+	    return -1;
+	}
+	body    += n;
+	t->bytes += n;
+    }
+
+    return status;
+}
+
+static void *client_main(void *arg)
+{
+    client_thread *t = (client_thread *)arg;
+    int fd = -1, keepalive, status, reused = 0;
+    unsigned long n = 0;
+    double start;
+
+    while (client_time() < deadline) {
+	if ((fd < 0) && ((fd = client_connect()) < 0)) {
+	    t->errors++;
+	    usleep(100000);
+	    continue;
+	}
+
+	start  = client_time();
+	status = client_request(t, fd, (t->id + n) % opt_vhosts, &keepalive);
+
+	if (status == 200) {
+	    t->requests++;
+	    client_latency(t, (client_time() - start) * 1000);
+	} else
+	/* the server may close an idle keep-alive connection, the request is repeated */
+	if ((status >= 0) || !reused)
+	    t->errors++;
+
+	if ((status >= 0) || !reused)
+	    n++;
+
+	if ((status < 0) || !keepalive) {
+	    close(fd);
+	    fd = -1;
+	    reused = 0;
+	} else
+	    reused = 1;
+    }
+
+    if (fd >= 0)
+	close(fd);
+
+    return NULL;
+}
+
+static int client_cmp(const void *a, const void *b)
+{
+    double x = *(const double *)a, y = *(const double *)b;
+
+    return (x > y) - (x < y);
+}
+
+static double client_percentile(double *v, unsigned long n, double p)
+{
+    unsigned long i;
+
+    if (n == 0)
+	return 0;
+
+    i = (unsigned long)(p * (n - 1) + 0.5);
+
+    return v[i];
+}
+
+int main(int argc, char **argv)
+{
+    client_thread *threads;
+    pthread_t *tid;
+    unsigned long long requests = 0, errors = 0, bytes = 0;
+    unsigned long count = 0, i, j;
+    double *all, start, elapsed;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "p:c:d:v:u:")) != -1) {
+	switch (opt) {
+	    case 'p': opt_port        = atoi(optarg); break;
+	    case 'c': opt_connections = atoi(optarg); break;
+	    case 'd': opt_duration    = atoi(optarg); break;
+	    case 'v': opt_vhosts      = atoi(optarg); break;
+	    case 'u': opt_path        = optarg; break;
+	    default:
+		fprintf(stderr, "usage: %s -p port [-c connections] [-d seconds] [-v vhosts] [-u path]\n", argv[0]);
+		return 1;
+	}
+    }
+
+    if ((opt_port <= 0) || (opt_connections < 1) || (opt_duration < 1) || (opt_vhosts < 1)) {
+	fprintf(stderr, "usage: %s -p port [-c connections] [-d seconds] [-v vhosts] [-u path]\n", argv[0]);
+	return 1;
+    }
+
+    threads = calloc(opt_connections, sizeof(client_thread));
+    tid     = calloc(opt_connections, sizeof(pthread_t));
+
+    start    = client_time();
+    deadline = start + opt_duration;
+
+    for (i = 0; i < opt_connections; i++) {
+	threads[i].id = i;
+	pthread_create(&tid[i], NULL, client_main, &threads[i]);
+    }
+
+    for (i = 0; i < opt_connections; i++) {
+	pthread_join(tid[i], NULL);
+	requests += threads[i].requests;
+	errors   += threads[i].errors;
+	bytes    += threads[i].bytes;
+	count    += threads[i].latency_count;
+    }
+
+    elapsed = client_time() - start;
+
+    all = malloc((count + 1) * sizeof(double));
+    for (i = 0, count = 0; i < opt_connections; i++)
+	for (j = 0; j < threads[i].latency_count; j++)
+	    all[count++] = threads[i].latency[j];
+    qsort(all, count, sizeof(double), client_cmp);
+
+    printf("requests %llu\n", requests);
+    printf("errors %llu\n", errors);
+    printf("bytes %llu\n", bytes);
+    printf("seconds %.3f\n", elapsed);
+    printf("p50_ms %.2f\n", client_percentile(all, count, 0.5));
+    printf("p90_ms %.2f\n", client_percentile(all, count, 0.9));
+    printf("p99_ms %.2f\n", client_percentile(all, count, 0.99));
+    printf("max_ms %.2f\n", count ? all[count - 1] : 0.0);
+
+    return 0;
+}
@@ -0,0 +1,507 @@
+/*
+ * mod_cband - A per-user, per-virtualhost and per-destination bandwidth limiter for the Apache HTTP Server Version 2
+ *
+ * Copyright (c) 2005 Lukasz Dembinski <dembol@cband.linux.pl>
+ * All Rights Reserved
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+
+/*
+ * Multi-process contention benchmark. The parent creates the configuration,
+ * semaphores and shared memory the same way the module does in the Apache
+ * parent, then forks N workers x M threads (prefork: N x 1, worker: N x 25)
+ * which replay a synthetic traffic mix through the request admission,
+ * accounting and shaping code of libcband.
+ *
+ * usage: cband_mpbench [-M prefork|worker] [-p processes] [-t threads] [-d seconds]
+ *			[-v vhosts] [-u users] [-z skew] [-k keepalive] [-c clients]
+ *			[-m size:weight,...] [-s vhost_kbps] [-r remote_kbps]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <math.h>
+#include <time.h>
+#include <signal.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+#include <arpa/inet.h>
+
+#include "cband_core.h"
+
+#define MPBENCH_MAX_THREADS	256
+#define MPBENCH_MAX_SIZES	16
+#define MPBENCH_HIST		48		/* log2 buckets of the wait time in ns */
+#define MPBENCH_LOCKS		2		/* global semaphore, remote hosts semaphore */
+
+typedef struct {
+    unsigned long long count;
+    unsigned long long sum;
+    unsigned long long max;
+    unsigned long long hist[MPBENCH_HIST];
+} mpbench_lock_stats;
+
+typedef struct {
+    unsigned long long requests;
+    unsigned long long rejected;
+    unsigned long long bytes;
+    unsigned long long chunks;
+    mpbench_lock_stats lock[MPBENCH_LOCKS];
+} mpbench_stats;
+
+typedef struct {
+    int size;
+    int weight;
+} mpbench_size;
+
+static mod_cband_config_header *config;
+static mod_cband_virtualhost_config_entry **vhosts;
+static double *vhost_cdf;
+static mpbench_size sizes[MPBENCH_MAX_SIZES];
+static int sizes_count, sizes_weight;
+static mpbench_stats *results;
+static unsigned long long deadline;
+
+static int opt_processes = 4;
+static int opt_threads   = 1;
+static int opt_duration  = 5;
+static int opt_vhosts    = 100;
+static int opt_users     = 0;
+static double opt_skew   = 1.0;
+static double opt_keepalive = 0.8;
+static int opt_clients   = 1000;
+static unsigned long opt_vhost_kbps  = 0;
+static unsigned long opt_remote_kbps = 0;
+static const char *opt_mpm = "custom";
+
+static __thread mpbench_stats *thread_stats;
+
+static void *mpbench_alloc(void *ctx, size_t size)
+{
+    return malloc(size);
+}
+
+static unsigned long long mpbench_nsec(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return (unsigned long long)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static inline unsigned int mpbench_rand(unsigned int *seed)
+{
+    *seed ^= *seed << 13;
+    *seed ^= *seed >> 17;
+    *seed ^= *seed << 5;
+
+    return *seed;
+}
+
+static inline double mpbench_uniform(unsigned int *seed)
+{
+    return (double)mpbench_rand(seed) / 4294967296.0;
+}
+
+static void mpbench_sem_wait(int sem_id, unsigned long long wait_nsec)
+{
+    mpbench_lock_stats *l;
+    int bucket = 0;
+
+    if (thread_stats == NULL)
+	return;
+
+    l = &thread_stats->lock[(sem_id == config->sem_id) ? 0 : 1];
+
+    while ((bucket < MPBENCH_HIST - 1) && ((wait_nsec >> bucket) > 1))
+	bucket++;
+
+    l->count++;
+    l->sum += wait_nsec;
+    l->hist[bucket]++;
+    if (wait_nsec > l->max)
+	l->max = wait_nsec;
+}
+
+static int mpbench_vhost(unsigned int *seed)
+{
+    double u = mpbench_uniform(seed);
+    int lo = 0, hi = opt_vhosts - 1, mid;
+
+    while (lo < hi) {
+	mid = (lo + hi) / 2;
+	if (vhost_cdf[mid] < u)
+	    lo = mid + 1;
+	else
+	    hi = mid;
+    }
+
+    return lo;
+}
+
+static int mpbench_size_pick(unsigned int *seed)
+{
+    int w = mpbench_rand(seed) % sizes_weight;
+    int i;
+
+    for (i = 0; i < sizes_count - 1; i++) {
+	if (w < sizes[i].weight)
+	    break;
+	w -= sizes[i].weight;
+    }
+
+    return sizes[i].size;
+}
+
+/*
+ * one request as the module does it: request handler (refresh, admission,
+ * limit check) followed by the output filter (shaping and accounting)
+ */
+static void mpbench_request(mod_cband_virtualhost_config_entry *entry, in_addr_t addr, int size)
+{
+    mod_cband_user_config_entry *entry_user = NULL;
+    mod_cband_limits_usages virtual_lu, user_lu;
+    mod_cband_shaper shaper;
+    unsigned long time_now;
+    int remote_idx, bytes, bytes_split;
+
+    memset(&virtual_lu, 0, sizeof(mod_cband_limits_usages));
+    memset(&user_lu, 0, sizeof(mod_cband_limits_usages));
+
+    time_now = (unsigned long)(mod_cband_time_now() / 1e6);
+    mod_cband_get_virtualhost_limits(entry, &virtual_lu, -1);
+    mod_cband_check_virtualhost_refresh(entry, time_now);
+
+    if ((entry->virtual_user != NULL) && ((entry_user = mod_cband_get_user_entry_(entry->virtual_user, 0)) != NULL)) {
+	mod_cband_get_user_limits(entry_user, &user_lu, -1);
+	mod_cband_check_user_refresh(entry_user, time_now);
+    }
+
+    remote_idx = mod_cband_get_remote_host_(addr, entry->virtual_name, 1);
+    if (mod_cband_admit(entry, entry_user, remote_idx, -1) < 0) {
+	thread_stats->rejected++;
+	return;
+    }
+
+    /* BEGIN CRITICAL SECTION */
+    mod_cband_sem_down(config->sem_id);
+    mod_cband_get_virtualhost_usages(entry, &virtual_lu, -1);
+    mod_cband_get_user_usages(entry_user, &user_lu, -1);
+    mod_cband_sem_up(config->sem_id);
+    /* END CRITICAL SECTION */
+
+    if (mod_cband_limit_reached(virtual_lu.limit, virtual_lu.slice_limit, virtual_lu.limit_mult, virtual_lu.usage)) {
+	thread_stats->rejected++;
+	return;
+    }
+
+    remote_idx = mod_cband_get_remote_host_(addr, entry->virtual_name, 1);
+    mod_cband_shaper_open(&shaper, entry, entry_user, remote_idx, -1);
+    mod_cband_shaper_bucket(&shaper);
+
+    bytes = size;
+    while (bytes > 0) {
+	bytes_split = mod_cband_shaper_chunk(&shaper, bytes);
+	bytes -= bytes_split;
+	mod_cband_shaper_sent(&shaper, bytes_split, 0);
+	thread_stats->chunks++;
+    }
+
+    mod_cband_shaper_close(&shaper);
+
+    thread_stats->requests++;
+    thread_stats->bytes += size;
+}
+
+static void *mpbench_thread(void *arg)
+{
+    mod_cband_virtualhost_config_entry *entry = NULL;
+    unsigned int seed;
+    in_addr_t addr = 0;
+    long idx = (long)arg;
+
+    thread_stats = &results[idx];
+    seed = 0x9e3779b9 * (unsigned int)(idx + 1);
+
+    while (mpbench_nsec() < deadline) {
+	/* a new connection comes from another client, possibly to another virtualhost */
+	if ((entry == NULL) || (mpbench_uniform(&seed) >= opt_keepalive)) {
+	    entry = vhosts[mpbench_vhost(&seed)];
+	    addr  = htonl(0x0a000000 + (mpbench_rand(&seed) % opt_clients));
+	}
+
+	mpbench_request(entry, addr, mpbench_size_pick(&seed));
+    }
+
+    return NULL;
+}
+
+static void mpbench_worker(int worker)
+{
+    pthread_t tid[MPBENCH_MAX_THREADS];
+    long i;
+
+    srand(getpid());
+
+    for (i = 0; i < opt_threads; i++)
+	pthread_create(&tid[i], NULL, mpbench_thread, (void *)(long)(worker * opt_threads + i));
+
+    for (i = 0; i < opt_threads; i++)
+	pthread_join(tid[i], NULL);
+}
+
+static int mpbench_parse_sizes(const char *mix)
+{
+    const char *p = mix;
+    int size, weight, n;
+
+    sizes_count = sizes_weight = 0;
+
+    while ((*p != 0) && (sizes_count < MPBENCH_MAX_SIZES)) {
+	if (sscanf(p, "%d:%d%n", &size, &weight, &n) != 2 || size <= 0 || weight <= 0)
+	    return -1;
+
+	sizes[sizes_count].size   = size;
+	sizes[sizes_count].weight = weight;
+	sizes_count++;
+	sizes_weight += weight;
+
+	p += n;
+	if (*p == ',')
+	    p++;
+    }
+
+    return (sizes_count > 0) ? 0 : -1;
+}
+
+static void mpbench_setup(void)
+{
+    char name[MAX_VIRTUALHOST_NAME];
+    mod_cband_user_config_entry *entry_user;
+    double sum = 0;
+    int i;
+
+    vhosts    = calloc(opt_vhosts, sizeof(mod_cband_virtualhost_config_entry *));
+    vhost_cdf = calloc(opt_vhosts, sizeof(double));
+
+    for (i = 0; i < opt_users; i++) {
+	sprintf(name, "user%d", i);
+	entry_user = mod_cband_get_user_entry_(strdup(name), 1);
+	entry_user->shmem_data->max_speed.kbps = entry_user->shmem_data->curr_speed.kbps = opt_vhost_kbps * 4;
+	entry_user->shmem_data->shared_kbps    = entry_user->shmem_data->curr_speed.kbps;
+    }
+
+    for (i = 0; i < opt_vhosts; i++) {
+	sprintf(name, "www%d.example.org", i);
+	vhosts[i] = mod_cband_get_virtualhost_entry_(strdup(name), 80, i + 1, 1);
+	vhosts[i]->shmem_data->max_speed.kbps = vhosts[i]->shmem_data->curr_speed.kbps = opt_vhost_kbps;
+	vhosts[i]->shmem_data->shared_kbps    = vhosts[i]->shmem_data->curr_speed.kbps;
+	vhosts[i]->shmem_data->remote_speed.kbps = opt_remote_kbps;
+
+	if (opt_users > 0) {
+	    sprintf(name, "user%d", i % opt_users);
+	    vhosts[i]->virtual_user = mod_cband_get_user_entry_(name, 0)->user_name;
+	}
+
+	/* Zipf distribution of the requests over the virtualhosts */
+	sum += 1.0 / pow(i + 1, opt_skew);
+	vhost_cdf[i] = sum;
+    }
+
+    for (i = 0; i < opt_vhosts; i++)
+	vhost_cdf[i] /= sum;
+}
+
+static unsigned long long mpbench_percentile(mpbench_lock_stats *l, double p)
+{
+    unsigned long long n = 0, target;
+    int i;
+
+    if (l->count == 0)
+	return 0;
+
+    target = (unsigned long long)ceil(l->count * p);
+
+    for (i = 0; i < MPBENCH_HIST; i++) {
+	n += l->hist[i];
+	if (n >= target)
+	    return 1ULL << (i + 1);
+    }
+
+    return l->max;
+}
+
+static void mpbench_report(double elapsed)
+{
+    static const char *lock_names[MPBENCH_LOCKS] = { "global", "remote_hosts" };
+    mpbench_stats total;
+    mpbench_lock_stats *l;
+    mod_cband_lock_site sites[MAX_LOCK_SITES];
+    int i, j, k, sites_number;
+
+    memset(&total, 0, sizeof(mpbench_stats));
+
+    for (i = 0; i < opt_processes * opt_threads; i++) {
+	total.requests += results[i].requests;
+	total.rejected += results[i].rejected;
+	total.bytes    += results[i].bytes;
+	total.chunks   += results[i].chunks;
+
+	for (j = 0; j < MPBENCH_LOCKS; j++) {
+	    l = &results[i].lock[j];
+	    total.lock[j].count += l->count;
+	    total.lock[j].sum   += l->sum;
+	    if (l->max > total.lock[j].max)
+		total.lock[j].max = l->max;
+	    for (k = 0; k < MPBENCH_HIST; k++)
+		total.lock[j].hist[k] += l->hist[k];
+	}
+    }
+
+    printf("mpm %s: %d processes x %d threads, %.1f s, %d vhosts (skew %.2f), %d users, %d clients, keep-alive %.2f\n",
+	   opt_mpm, opt_processes, opt_threads, elapsed, opt_vhosts, opt_skew, opt_users, opt_clients, opt_keepalive);
+    printf("requests  %14llu %14.0f req/s\n", total.requests, total.requests / elapsed);
+    printf("rejected  %14llu\n", total.rejected);
+    printf("bytes     %14llu %14.1f MB/s accounted\n", total.bytes, total.bytes / elapsed / 1048576);
+    printf("chunks    %14llu %14.0f chunks/s\n", total.chunks, total.chunks / elapsed);
+    printf("\n%-14s %12s %10s %10s %10s %10s %10s %12s %8s\n", "lock wait", "acquisitions", "avg ns",
+	   "p50 ns", "p90 ns", "p99 ns", "p99.9 ns", "max ns", "wait %");
+
+    for (j = 0; j < MPBENCH_LOCKS; j++) {
+	l = &total.lock[j];
+	printf("%-14s %12llu %10.0f %10llu %10llu %10llu %10llu %12llu %8.2f\n", lock_names[j], l->count,
+	       l->count ? (double)l->sum / l->count : 0.0,
+	       mpbench_percentile(l, 0.5), mpbench_percentile(l, 0.9), mpbench_percentile(l, 0.99),
+	       mpbench_percentile(l, 0.999), l->max,
+	       100.0 * l->sum / (elapsed * 1e9 * opt_processes * opt_threads));
+    }
+    printf("\npercentiles are upper bounds of power of two buckets, wait %% is the share of the thread time\n");
+
+    sites_number = mod_cband_lock_sites_read(sites);
+    printf("\n%-50s %-7s %12s %12s %14s %12s\n", "call site", "sem", "acquisitions", "contended", "wait ms", "max ns");
+    for (i = 0; i < sites_number; i++)
+	printf("%-50s %-7s %12llu %12llu %14.1f %12llu\n", sites[i].name, sites[i].remote ? "remote" : "global",
+	       sites[i].acquisitions, sites[i].contended, sites[i].wait_nsec / 1e6, sites[i].max_wait_nsec);
+}
+
+static void mpbench_usage(const char *name)
+{
+    fprintf(stderr, "usage: %s [-M prefork|worker] [-p processes] [-t threads] [-d seconds]\n"
+		    "\t[-v vhosts] [-u users] [-z skew] [-k keepalive] [-c clients]\n"
+		    "\t[-m size:weight,...] [-s vhost_kbps] [-r remote_kbps]\n", name);
+}
+
+int main(int argc, char **argv)
+{
+    unsigned long long start;
+    pid_t *pids;
+    int opt, i, failed = 0;
+
+    mpbench_parse_sizes("4096:60,65536:30,1048576:10");
+
+    while ((opt = getopt(argc, argv, "M:p:t:d:v:u:z:k:c:m:s:r:")) != -1) {
+	switch (opt) {
+	    case 'M':
+		opt_mpm = optarg;
+		if (!strcmp(optarg, "prefork")) {
+		    opt_processes = 16;
+		    opt_threads   = 1;
+		} else
+		if (!strcmp(optarg, "worker")) {
+		    opt_processes = 4;
+		    opt_threads   = 25;
+		} else {
+		    mpbench_usage(argv[0]);
+		    return 1;
+		}
+		break;
+	    case 'p': opt_processes = atoi(optarg); break;
+	    case 't': opt_threads   = atoi(optarg); break;
+	    case 'd': opt_duration  = atoi(optarg); break;
+	    case 'v': opt_vhosts    = atoi(optarg); break;
+	    case 'u': opt_users     = atoi(optarg); break;
+	    case 'z': opt_skew      = atof(optarg); break;
+	    case 'k': opt_keepalive = atof(optarg); break;
+	    case 'c': opt_clients   = atoi(optarg); break;
+	    case 's': opt_vhost_kbps  = strtoul(optarg, NULL, 10); break;
+	    case 'r': opt_remote_kbps = strtoul(optarg, NULL, 10); break;
+	    case 'm':
+		if (mpbench_parse_sizes(optarg) < 0) {
+		    fprintf(stderr, "cband_mpbench: invalid size mix %s\n", optarg);
+		    return 1;
+		}
+		break;
+	    default:
+		mpbench_usage(argv[0]);
+		return 1;
+	}
+    }
+
+    if (opt_processes < 1 || opt_threads < 1 || opt_threads > MPBENCH_MAX_THREADS || opt_vhosts < 1 ||
+	opt_clients < 1 || opt_duration < 1 || opt_users < 0) {
+	mpbench_usage(argv[0]);
+	return 1;
+    }
+
+    if ((config = mod_cband_core_init(mpbench_alloc, NULL)) == NULL || config->remote_hosts.hosts == NULL) {
+	fprintf(stderr, "cband_mpbench: cannot create shared memory or semaphores\n");
+	mod_cband_core_remove();
+	return 1;
+    }
+
+    mpbench_setup();
+    mod_cband_sem_wait_hook = mpbench_sem_wait;
+
+    results = mmap(NULL, sizeof(mpbench_stats) * opt_processes * opt_threads, PROT_READ | PROT_WRITE,
+		   MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (results == MAP_FAILED) {
+	mod_cband_core_remove();
+	return 1;
+    }
+    memset(results, 0, sizeof(mpbench_stats) * opt_processes * opt_threads);
+
+    pids  = calloc(opt_processes, sizeof(pid_t));
+    start = mpbench_nsec();
+    deadline = start + (unsigned long long)opt_duration * 1000000000ULL;
+
+    /* the children inherit the attached segments like Apache children do */
+    for (i = 0; i < opt_processes; i++) {
+	if ((pids[i] = fork()) == 0) {
+	    mpbench_worker(i);
+	    _exit(0);
+	}
+	if (pids[i] < 0)
+	    failed = 1;
+    }
+
+    for (i = 0; i < opt_processes; i++)
+	if (pids[i] > 0)
+	    waitpid(pids[i], NULL, 0);
+
+    if (!failed)
+	mpbench_report((mpbench_nsec() - start) / 1e9);
+    else
+	fprintf(stderr, "cband_mpbench: cannot fork workers\n");
+
+    mod_cband_core_remove();
+
+    return failed;
+}
@@ -0,0 +1,343 @@
+/*
+ * mod_cband - A per-user, per-virtualhost and per-destination bandwidth limiter for the Apache HTTP Server Version 2
+ *
+ * Copyright (c) 2005 Lukasz Dembinski <dembol@cband.linux.pl>
+ * All Rights Reserved
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+
+/*
+ * Deterministic simulator of the bandwidth shaping. Every client is a thread
+ * running the admission and the shaping loop of libcband, but only one of them
+ * runs at a time and libcband sleeps on a virtual clock: when every client
+ * sleeps the clock jumps to the earliest wake up. Minutes of traffic are
+ * simulated in a fraction of a second and the same seed gives the same result.
+ *
+ * usage: cband_sim [-s kbps] [-q rps] [-C max_conn] [-r remote_kbps] [-c clients]
+ *		    [-d seconds] [-b response_bytes] [-B bucket_bytes] [-l link_kbps]
+ *		    [-P] [-S seed] [-v]
+ *
+ * The defaults simulate "CBandSpeed 1024 10 30" with 30 clients downloading
+ * 1MB responses for 60 seconds
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <math.h>
+#include <pthread.h>
+#include <arpa/inet.h>
+
+#include "cband_core.h"
+
+#define SIM_START_TIME		1000000000UL	/* virtual microseconds at the start */
+#define SIM_REJECT_BACKOFF	1000000UL	/* a rejected client retries after 1s */
+
+#define SIM_READY		0
+#define SIM_SLEEPING		1
+#define SIM_DONE		2
+
+typedef struct {
+    int id;
+    int state;
+    unsigned long wake;
+    pthread_t tid;
+    pthread_cond_t cond;
+    unsigned long long bytes;
+    unsigned long requests;
+    unsigned long rejected;
+} sim_client;
+
+static mod_cband_config_header *config;
+static mod_cband_virtualhost_config_entry *sim_entry;
+static sim_client *clients;
+static pthread_mutex_t sim_mutex = PTHREAD_MUTEX_INITIALIZER;
+static unsigned long sim_now = SIM_START_TIME;
+static unsigned long sim_end;
+static unsigned int sim_seed;
+static int sim_token = -1;
+static __thread sim_client *sim_self;
+
+static unsigned long opt_kbps      = 1024;
+static unsigned long opt_rps       = 10;
+static unsigned long opt_max_conn  = 30;
+static unsigned long opt_remote_kbps = 0;
+static int opt_clients             = 30;
+static int opt_duration            = 60;
+static int opt_bytes               = 1048576;
+static int opt_bucket              = 8000;
+static unsigned long opt_link_kbps = 0;
+static int opt_verbose             = 0;
+
+static void *sim_alloc(void *ctx, size_t size)
+{
+    return malloc(size);
+}
+
+static unsigned long sim_clock_now(void)
+{
+    return sim_now;
+}
+
+static int sim_clock_rand(void)
+{
+    sim_seed = sim_seed * 1103515245 + 12345;
+
+    return (int)((sim_seed >> 1) & 0x7fffffff);
+}
+
+/*
+ * hands the token to the next ready client, advances the clock when nobody is
+ * ready. Called with sim_mutex held
+ */
+static void sim_schedule(void)
+{
+    unsigned long wake = 0;
+    int i, next = -1;
+
+    for (i = 0; i < opt_clients; i++) {
+	if (clients[i].state == SIM_READY) {
+	    next = i;
+	    break;
+	}
+    }
+
+    if (next < 0) {
+	for (i = 0; i < opt_clients; i++)
+	    if ((clients[i].state == SIM_SLEEPING) && ((next < 0) || (clients[i].wake < wake))) {
+		wake = clients[i].wake;
+		next = i;
+	    }
+
+	if (next < 0) {
+	    sim_token = -1;
+	    return;
+	}
+
+	sim_now = wake;
+	for (i = 0; i < opt_clients; i++)
+	    if ((clients[i].state == SIM_SLEEPING) && (clients[i].wake == wake))
+		clients[i].state = SIM_READY;
+    }
+
+    sim_token = next;
+    pthread_cond_signal(&clients[next].cond);
+}
+
+static void sim_clock_sleep(unsigned long usec)
+{
+    sim_client *me = sim_self;
+
+    pthread_mutex_lock(&sim_mutex);
+    me->wake  = sim_now + usec;
+    me->state = SIM_SLEEPING;
+    sim_schedule();
+
+    while (sim_token != me->id)
+	pthread_cond_wait(&me->cond, &sim_mutex);
+
+    pthread_mutex_unlock(&sim_mutex);
+}
+
+/*
+ * one client: downloads responses one after another through the request
+ * admission and the Fairness Bandwidth Sharing loop of the output filter
+ */
+static void *sim_client_main(void *arg)
+{
+    sim_client *me = (sim_client *)arg;
+    mod_cband_shaper shaper;
+    in_addr_t addr;
+    unsigned long send_time;
+    int remote_idx, bytes, bucket, bytes_split;
+
+    sim_self = me;
+    addr = htonl(0x0a000000 + me->id);
+
+    pthread_mutex_lock(&sim_mutex);
+    while (sim_token != me->id)
+	pthread_cond_wait(&me->cond, &sim_mutex);
+    pthread_mutex_unlock(&sim_mutex);
+
+    while (sim_now < sim_end) {
+	remote_idx = mod_cband_get_remote_host_(addr, sim_entry->virtual_name, 1);
+
+	if (mod_cband_admit(sim_entry, NULL, remote_idx, -1) < 0) {
+	    me->rejected++;
+	    mod_cband_sleep(SIM_REJECT_BACKOFF);
+	    continue;
+	}
+
+	mod_cband_shaper_open(&shaper, sim_entry, NULL, remote_idx, -1);
+	me->requests++;
+
+	bytes = opt_bytes;
+	while ((bytes > 0) && (sim_now < sim_end)) {
+	    /* the filter gets the response in buckets of opt_bucket bytes */
+	    bucket = (bytes > opt_bucket) ? opt_bucket : bytes;
+	    bytes -= bucket;
+	    mod_cband_shaper_bucket(&shaper);
+
+	    while ((bucket > 0) && (sim_now < sim_end)) {
+		bytes_split = mod_cband_shaper_chunk(&shaper, bucket);
+
+		send_time = 0;
+		if (opt_link_kbps > 0) {
+		    send_time = (unsigned long)((unsigned long long)bytes_split * 8 * 1000000 / (opt_link_kbps * 1024));
+		    mod_cband_sleep(send_time);
+		}
+
+		me->bytes += bytes_split;
+		bucket -= bytes_split;
+		mod_cband_shaper_sent(&shaper, bytes_split, send_time);
+	    }
+	}
+
+	mod_cband_shaper_close(&shaper);
+    }
+
+    pthread_mutex_lock(&sim_mutex);
+    me->state = SIM_DONE;
+    sim_schedule();
+    pthread_mutex_unlock(&sim_mutex);
+
+    return NULL;
+}
+
+static void sim_report(void)
+{
+    double rate, sum = 0, sum2 = 0, min = -1, max = 0, aggregate, expected;
+    unsigned long requests = 0, rejected = 0;
+    int i;
+
+    for (i = 0; i < opt_clients; i++) {
+	rate = clients[i].bytes * 8.0 / 1024 / opt_duration;
+	sum  += rate;
+	sum2 += rate * rate;
+	if ((min < 0) || (rate < min))
+	    min = rate;
+	if (rate > max)
+	    max = rate;
+	requests += clients[i].requests;
+	rejected += clients[i].rejected;
+
+	if (opt_verbose)
+	    printf("client %4d %10.1f kbps %6lu requests %6lu rejected\n", i, rate, clients[i].requests, clients[i].rejected);
+    }
+
+    aggregate = sum;
+
+    printf("CBandSpeed %lu %lu %lu, CBandRemoteSpeed %lu, %d clients, %d s, %d byte responses, link %lu kbps%s\n",
+	   opt_kbps, opt_rps, opt_max_conn, opt_remote_kbps, opt_clients, opt_duration, opt_bytes, opt_link_kbps,
+	   config->random_pulse ? ", random pulse" : "");
+    printf("requests           %10lu (%lu rejected)\n", requests, rejected);
+    printf("aggregate rate     %10.1f kbps", aggregate);
+
+    /* the configured limit of the whole traffic */
+    expected = opt_kbps;
+    if ((opt_remote_kbps > 0) && ((expected == 0) || (opt_remote_kbps * opt_clients < expected)))
+	expected = opt_remote_kbps * opt_clients;
+    if (opt_link_kbps > 0 && ((expected == 0) || (opt_link_kbps * opt_clients < expected)))
+	expected = opt_link_kbps * opt_clients;
+
+    if (expected > 0)
+	printf(", limit %lu kbps, deviation %+.1f %%", (unsigned long)expected, 100.0 * (aggregate - expected) / expected);
+    printf("\n");
+    printf("per client rate    %10.1f kbps avg, %.1f min, %.1f max\n", sum / opt_clients, min, max);
+    printf("fairness index     %10.3f (Jain, 1 = equal shares)\n", (sum2 > 0) ? (sum * sum) / (opt_clients * sum2) : 1.0);
+}
+
+static void sim_usage(const char *name)
+{
+    fprintf(stderr, "usage: %s [-s kbps] [-q rps] [-C max_conn] [-r remote_kbps] [-c clients]\n"
+		    "\t[-d seconds] [-b response_bytes] [-B bucket_bytes] [-l link_kbps] [-P] [-S seed] [-v]\n", name);
+}
+
+int main(int argc, char **argv)
+{
+    mod_cband_clock clock = { sim_clock_now, sim_clock_sleep, sim_clock_rand };
+    int opt, i, random_pulse = 0;
+
+    sim_seed = 1;
+
+    while ((opt = getopt(argc, argv, "s:q:C:r:c:d:b:B:l:PS:v")) != -1) {
+	switch (opt) {
+	    case 's': opt_kbps        = strtoul(optarg, NULL, 10); break;
+	    case 'q': opt_rps         = strtoul(optarg, NULL, 10); break;
+	    case 'C': opt_max_conn    = strtoul(optarg, NULL, 10); break;
+	    case 'r': opt_remote_kbps = strtoul(optarg, NULL, 10); break;
+	    case 'c': opt_clients     = atoi(optarg); break;
+	    case 'd': opt_duration    = atoi(optarg); break;
+	    case 'b': opt_bytes       = atoi(optarg); break;
+	    case 'B': opt_bucket      = atoi(optarg); break;
+	    case 'l': opt_link_kbps   = strtoul(optarg, NULL, 10); break;
+	    case 'P': random_pulse    = 1; break;
+	    case 'S': sim_seed        = strtoul(optarg, NULL, 10); break;
+	    case 'v': opt_verbose     = 1; break;
+	    default:
+		sim_usage(argv[0]);
+		return 1;
+	}
+    }
+
+    if (opt_clients < 1 || opt_duration < 1 || opt_bytes < 1 || opt_bucket < 1) {
+	sim_usage(argv[0]);
+	return 1;
+    }
+
+    mod_cband_set_clock(&clock);
+
+    if ((config = mod_cband_core_init(sim_alloc, NULL)) == NULL || config->remote_hosts.hosts == NULL) {
+	fprintf(stderr, "cband_sim: cannot create shared memory or semaphores\n");
+	mod_cband_core_remove();
+	return 1;
+    }
+
+    config->random_pulse = random_pulse;
+    sim_entry = mod_cband_get_virtualhost_entry_("sim.example.org", 80, 1, 1);
+    sim_entry->shmem_data->max_speed.kbps     = sim_entry->shmem_data->curr_speed.kbps     = opt_kbps;
+    sim_entry->shmem_data->max_speed.rps      = sim_entry->shmem_data->curr_speed.rps      = opt_rps;
+    sim_entry->shmem_data->max_speed.max_conn = sim_entry->shmem_data->curr_speed.max_conn = opt_max_conn;
+    sim_entry->shmem_data->shared_kbps        = sim_entry->shmem_data->curr_speed.kbps;
+    sim_entry->shmem_data->remote_speed.kbps  = opt_remote_kbps;
+
+    sim_end = sim_now + (unsigned long)opt_duration * 1000000UL;
+    clients = calloc(opt_clients, sizeof(sim_client));
+
+    pthread_mutex_lock(&sim_mutex);
+    for (i = 0; i < opt_clients; i++) {
+	clients[i].id    = i;
+	clients[i].state = SIM_READY;
+	pthread_cond_init(&clients[i].cond, NULL);
+	if (pthread_create(&clients[i].tid, NULL, sim_client_main, &clients[i]) != 0) {
+	    fprintf(stderr, "cband_sim: cannot create client %d\n", i);
+	    opt_clients = i;
+	    break;
+	}
+    }
+    sim_schedule();
+    pthread_mutex_unlock(&sim_mutex);
+
+    for (i = 0; i < opt_clients; i++)
+	pthread_join(clients[i].tid, NULL);
+
+    sim_report();
+    mod_cband_core_remove();
+
+    return 0;
+}
@@ -0,0 +1,215 @@
+#!/bin/sh
+#
+# mod_cband - A per-user, per-virtualhost and per-destination bandwidth limiter for the Apache HTTP Server Version 2
+#
+# Copyright (c) 2005 Lukasz Dembinski <dembol@cband.linux.pl>
+#
+# This program is free software; you can redistribute it and/or modify
+# it under the terms of the GNU General Public License as published by
+# the Free Software Foundation; either version 2 of the License, or
+# (at your option) any later version.
+#
+# This program is distributed in the hope that it will be useful,
+# but WITHOUT ANY WARRANTY; without even the implied warranty of
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+# GNU General Public License for more details.
+#
+# You should have received a copy of the GNU General Public License
+# along with this program; if not, write to the Free Software
+# Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+#
+# End-to-end load test: starts a throwaway httpd on 127.0.0.1 with a generated
+# configuration (VHOSTS virtualhosts shared by USERS <CBandUser>s, CLASSES
+# destination classes), drives it with bench/cband_loadclient and reports
+# requests/s, latency percentiles, achieved speed versus the configured one
+# and the CPU time of httpd per GB served.
+#
+# Settings come from the environment:
+#
+#   APXS	apxs binary (apxs)		MODULE	  module (src/.libs/mod_cband.so)
+#   PORT	listen port (18080)		DURATION  seconds of load (20)
+#   VHOSTS	virtualhosts (10)		USERS	  <CBandUser>s (2), 0 = none
+#   CLASSES	destination classes (1)		SPEED	  CBandSpeed of a vhost in kbps (8192), 0 = none
+#   USER_SPEED	CBandUserSpeed in kbps (0)	REMOTE_SPEED  CBandRemoteSpeed in kbps (0)
+#   CONNECTIONS	client connections (50)		SIZE	  response size in bytes (1048576)
+#   KEEP	keep the test directory when 1
+#
+
+APXS=${APXS:-apxs}
+MODULE=${MODULE:-src/.libs/mod_cband.so}
+PORT=${PORT:-18080}
+DURATION=${DURATION:-20}
+VHOSTS=${VHOSTS:-10}
+USERS=${USERS:-2}
+CLASSES=${CLASSES:-1}
+SPEED=${SPEED:-8192}
+USER_SPEED=${USER_SPEED:-0}
+REMOTE_SPEED=${REMOTE_SPEED:-0}
+CONNECTIONS=${CONNECTIONS:-50}
+SIZE=${SIZE:-1048576}
+CLIENT=${CLIENT:-bench/cband_loadclient}
+
+fail() {
+    echo "loadtest: $*" >&2
+    exit 1
+}
+
+[ -f "$MODULE" ] || fail "module $MODULE not found, run make first"
+[ -x "$CLIENT" ] || fail "client $CLIENT not found"
+
+SBINDIR=$($APXS -q SBINDIR 2>/dev/null) || fail "cannot run $APXS"
+TARGET=$($APXS -q TARGET 2>/dev/null)
+LIBEXECDIR=$($APXS -q LIBEXECDIR 2>/dev/null)
+HTTPD="$SBINDIR/${TARGET:-httpd}"
+[ -x "$HTTPD" ] || fail "httpd binary $HTTPD not found"
+
+MODULE=$(cd $(dirname $MODULE) && pwd)/$(basename $MODULE)
+DIR=$(mktemp -d ${TMPDIR:-/tmp}/cband-loadtest.XXXXXX) || fail "cannot create temporary directory"
+mkdir -p "$DIR/htdocs" "$DIR/scores" "$DIR/logs"
+dd if=/dev/urandom of="$DIR/htdocs/file" bs=$SIZE count=1 2>/dev/null
+
+cleanup() {
+    if [ -f "$DIR/httpd.pid" ]; then
+	kill -TERM $(cat "$DIR/httpd.pid") 2>/dev/null
+	sleep 1
+    fi
+    [ "$KEEP" = "1" ] || rm -rf "$DIR"
+}
+trap cleanup EXIT INT TERM
+
+#
+# configuration
+#
+CONF="$DIR/httpd.conf"
+STATIC=$($HTTPD -l 2>/dev/null)
+
+{
+    echo "ServerRoot \"$DIR\""
+    echo "PidFile \"$DIR/httpd.pid\""
+    echo "ErrorLog \"$DIR/logs/error.log\""
+    echo "LogLevel warn"
+    echo "Listen 127.0.0.1:$PORT"
+
+    # modules which are not compiled in, an MPM first
+    if ! echo "$STATIC" | grep -Eq "prefork\.c|worker\.c|event\.c"; then
+	for mpm in ${MPM:-event worker prefork}; do
+	    if [ -f "$LIBEXECDIR/mod_mpm_$mpm.so" ]; then
+		echo "LoadModule mpm_${mpm}_module \"$LIBEXECDIR/mod_mpm_$mpm.so\""
+		break
+	    fi
+	done
+    fi
+    for mod in unixd authz_core; do
+	if ! echo "$STATIC" | grep -q "mod_$mod.c" && [ -f "$LIBEXECDIR/mod_$mod.so" ]; then
+	    echo "LoadModule ${mod}_module \"$LIBEXECDIR/mod_$mod.so\""
+	fi
+    done
+    echo "LoadModule cband_module \"$MODULE\""
+
+    echo "ServerName localhost"
+    echo "DocumentRoot \"$DIR/htdocs\""
+    echo "KeepAlive On"
+    echo "MaxKeepAliveRequests 0"
+    echo "KeepAliveTimeout 5"
+    echo "StartServers 4"
+    echo "MaxClients $((CONNECTIONS + 50))"
+    echo "ServerLimit $((CONNECTIONS + 50))"
+    echo "CBandScoreFlushPeriod 100"
+    [ -n "$($HTTPD -v | grep 'Apache/2\.[02]\.')" ] && echo "NameVirtualHost 127.0.0.1:$PORT"
+
+    i=0
+    while [ $i -lt $CLASSES ]; do
+	echo "<CBandClass class$i>"
+	if [ $i -eq 0 ]; then
+	    echo "    CBandClassDst 127.0.0.0/8"
+	else
+	    echo "    CBandClassDst 10.$i.0.0/16"
+	fi
+	echo "</CBandClass>"
+	i=$((i + 1))
+    done
+
+    i=0
+    while [ $i -lt $USERS ]; do
+	echo "<CBandUser user$i>"
+	echo "    CBandUserScoreboard \"$DIR/scores/user$i\""
+	[ "$USER_SPEED" != "0" ] && echo "    CBandUserSpeed $USER_SPEED 0 0"
+	echo "</CBandUser>"
+	i=$((i + 1))
+    done
+
+    i=0
+    while [ $i -lt $VHOSTS ]; do
+	echo "<VirtualHost 127.0.0.1:$PORT>"
+	echo "    ServerName vh$i.loadtest"
+	echo "    DocumentRoot \"$DIR/htdocs\""
+	echo "    CBandScoreboard \"$DIR/scores/vh$i\""
+	[ "$SPEED" != "0" ] && echo "    CBandSpeed $SPEED 0 0"
+	[ "$REMOTE_SPEED" != "0" ] && echo "    CBandRemoteSpeed $REMOTE_SPEED 0 0"
+	[ $USERS -gt 0 ] && echo "    CBandUser user$((i % USERS))"
+	[ $i -eq 0 ] && printf "    <Location /cband-status>\n\tSetHandler cband-status\n    </Location>\n"
+	echo "</VirtualHost>"
+	i=$((i + 1))
+    done
+} > "$CONF"
+
+$HTTPD -t -f "$CONF" >/dev/null 2>&1 || { $HTTPD -t -f "$CONF"; fail "invalid configuration $CONF"; }
+$HTTPD -f "$CONF" -k start || fail "cannot start $HTTPD"
+
+i=0
+while [ ! -f "$DIR/httpd.pid" ] && [ $i -lt 50 ]; do
+    sleep 0.1
+    i=$((i + 1))
+done
+[ -f "$DIR/httpd.pid" ] || fail "httpd did not start, see $DIR/logs/error.log"
+MASTER=$(cat "$DIR/httpd.pid")
+sleep 1
+
+#
+# CPU time (clock ticks) of the master, its reaped children and the living children
+#
+cpu_ticks() {
+    total=$(awk '{ print $14 + $15 + $16 + $17 }' /proc/$MASTER/stat 2>/dev/null)
+    for pid in $(ps -o pid= --ppid $MASTER 2>/dev/null); do
+	t=$(awk '{ print $14 + $15 }' /proc/$pid/stat 2>/dev/null)
+	total=$((total + ${t:-0}))
+    done
+    echo ${total:-0}
+}
+
+CPU_START=$(cpu_ticks)
+RESULT=$($CLIENT -p $PORT -c $CONNECTIONS -d $DURATION -v $VHOSTS -u /file) || fail "client failed"
+CPU_END=$(cpu_ticks)
+HZ=$(getconf CLK_TCK)
+
+get() {
+    echo "$RESULT" | awk -v k=$1 '$1 == k { print $2 }'
+}
+
+REQUESTS=$(get requests)
+ERRORS=$(get errors)
+BYTES=$(get bytes)
+SECONDS_RUN=$(get seconds)
+
+awk -v req=$REQUESTS -v err=$ERRORS -v bytes=$BYTES -v sec=$SECONDS_RUN \
+    -v p50=$(get p50_ms) -v p90=$(get p90_ms) -v p99=$(get p99_ms) -v max=$(get max_ms) \
+    -v cpu=$((CPU_END - CPU_START)) -v hz=$HZ -v vhosts=$VHOSTS -v users=$USERS \
+    -v speed=$SPEED -v user_speed=$USER_SPEED -v conns=$CONNECTIONS -v size=$SIZE 'BEGIN {
+    printf("%d vhosts, %d users, %d connections, %d byte responses, %.1f s\n", vhosts, users, conns, size, sec);
+    printf("requests/s      %12.1f  (%d requests, %d errors)\n", req / sec, req, err);
+    printf("latency         %12.1f ms p50, %.1f ms p90, %.1f ms p99, %.1f ms max\n", p50, p90, p99, max);
+    kbps = bytes * 8 / 1024 / sec;
+    printf("throughput      %12.1f kbps", kbps);
+    # the configured speed of the whole server: vhost speeds, or user speeds when lower
+    limit = (speed > 0) ? speed * vhosts : 0;
+    if (user_speed > 0 && users > 0 && (limit == 0 || user_speed * users < limit))
+	limit = user_speed * users;
+    if (limit > 0)
+	printf(", configured %d kbps (%.1f %%)", limit, 100 * kbps / limit);
+    printf("\n");
+    if (bytes > 0)
+	printf("httpd CPU       %12.2f s per GB served (%.2f s total)\n", (cpu / hz) / (bytes / 1e9), cpu / hz);
+}'
+
+[ "$KEEP" = "1" ] && echo "test directory $DIR"
+exit 0
@@ -0,0 +1,2950 @@
+/*
+ * mod_cband - A per-user, per-virtualhost and per-destination bandwidth limiter for the Apache HTTP Server Version 2
+ *
+ * Copyright (c) 2005 Lukasz Dembinski <dembol@cband.linux.pl>
+ * All Rights Reserved
+ * 
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *	     
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *		     
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *					 
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <time.h>
+#include <sys/shm.h>
+#include <arpa/inet.h>
+
+#include "cband_core.h"
+
+static mod_cband_config_header *config = NULL;
+
+/* called after every acquisition of a semaphore when set, used by the benchmarks */
+void (*mod_cband_sem_wait_hook)(int sem_id, unsigned long long wait_nsec) = NULL;
+
+static unsigned long mod_cband_clock_now(void)
+{
+    struct timeval tv;
+    
+    gettimeofday(&tv, NULL);
+    
+    return (unsigned long)tv.tv_sec * 1000000UL + (unsigned long)tv.tv_usec;
+}
+
+static void mod_cband_clock_sleep(unsigned long usec)
+{
+    usleep(usec);
+}
+
+static mod_cband_clock clock_ops = { mod_cband_clock_now, mod_cband_clock_sleep, rand };
+
+/*
+ * replaces the time, sleep and random number sources, NULL restores the system ones
+ */
+void mod_cband_set_clock(const mod_cband_clock *clock)
+{
+    if (clock == NULL) {
+	clock_ops.now   = mod_cband_clock_now;
+	clock_ops.sleep = mod_cband_clock_sleep;
+	clock_ops.rand  = rand;
+    } else
+	clock_ops = *clock;
+}
+
+/*
+ * current time in microseconds
+ */
+unsigned long mod_cband_time_now(void)
+{
+    return clock_ops.now();
+}
+
+void mod_cband_sleep(unsigned long usec)
+{
+    clock_ops.sleep(usec);
+}
+
+int mod_cband_rand(void)
+{
+    return clock_ops.rand();
+}
+
+/*
+ * creates the config header, the semaphores and the first shared memory segments.
+ * Entries are allocated with alloc(alloc_ctx, size) and never freed
+ */
+mod_cband_config_header *mod_cband_core_init(void *(*alloc)(void *alloc_ctx, size_t size), void *alloc_ctx)
+{
+    if (config != NULL)
+	return config;
+	
+    if ((config = (mod_cband_config_header *) alloc(alloc_ctx, sizeof(mod_cband_config_header))) == NULL)
+	return NULL;
+	
+    memset(config, 0, sizeof(mod_cband_config_header));
+    config->alloc = alloc;
+    config->alloc_ctx = alloc_ctx;
+    config->start_time = (unsigned long)(mod_cband_time_now() / 1e6);
+    config->sem_id = semget(IPC_PRIVATE, 1, IPC_CREAT | 0666);
+    config->shmem_seg_idx = -1;
+    config->default_limit_exceeded_code = 503;
+    config->max_chunk_len = MAX_CHUNK_LEN;
+	
+    mod_cband_remote_hosts_init();
+    mod_cband_sem_init(config->sem_id);
+    mod_cband_shmem_init();
+    
+    config->lock_shmem_id = shmget(IPC_PRIVATE, sizeof(mod_cband_lock_site) * MAX_LOCK_SITES, IPC_CREAT | 0666);
+    if (config->lock_shmem_id >= 0) {
+	config->lock_sites = (mod_cband_lock_site *)shmat(config->lock_shmem_id, 0, 0);
+	if (config->lock_sites == (void *)-1)
+	    config->lock_sites = NULL;
+	else
+	    memset(config->lock_sites, 0, sizeof(mod_cband_lock_site) * MAX_LOCK_SITES);
+    }
+    
+    return config;
+}
+
+/*
+ * removes the shared memory segments and the semaphores
+ */
+void mod_cband_core_remove(void)
+{
+    int i;
+    
+    if (config == NULL)
+	return;
+	
+    for (i = 0; i <= config->shmem_seg_idx; i++)
+	mod_cband_shmem_remove(config->shmem_seg[i].shmem_id);
+
+    mod_cband_shmem_remove(config->remote_hosts.shmem_id);
+    if (config->lock_shmem_id >= 0)
+	mod_cband_shmem_remove(config->lock_shmem_id);
+    mod_cband_sem_remove(config->remote_hosts.sem_id);
+    mod_cband_sem_remove(config->sem_id);
+}
+
+int mod_cband_shmem_seg_new(void)
+{
+    int seg_idx;
+    int shmem_id;
+
+    seg_idx  = ++config->shmem_seg_idx;
+    shmem_id = config->shmem_seg[seg_idx].shmem_id;
+    
+    if (shmem_id == 0) {
+	shmem_id = shmget(IPC_PRIVATE, sizeof(mod_cband_shmem_data) * MAX_SHMEM_ENTRIES, IPC_CREAT | 0666);
+	
+	if (shmem_id < 0) {
+	    fprintf(stderr, "apache2_mod_cband: cannot create shared memory segment for virtual hosts\n");
+	    fflush(stderr);
+	    return -1;
+	}
+	
+        config->shmem_seg[seg_idx].shmem_id = shmem_id;
+	config->shmem_seg[seg_idx].shmem_data = (mod_cband_shmem_data *)shmat(shmem_id, 0, 0);
+	memset(config->shmem_seg[seg_idx].shmem_data, 0, sizeof(mod_cband_shmem_data) * MAX_SHMEM_ENTRIES);
+    }
+
+    config->shmem_seg[seg_idx].shmem_entry_idx = 0;
+
+    return seg_idx;
+}
+
+mod_cband_shmem_data *mod_cband_shmem_init(void)
+{
+    mod_cband_shmem_data *data;
+    int seg_idx, entry_idx;
+    
+    seg_idx = config->shmem_seg_idx;
+    if ((seg_idx < 0) || (config->shmem_seg[seg_idx].shmem_entry_idx >= MAX_SHMEM_ENTRIES - 1))
+	config->shmem_seg_idx = seg_idx = mod_cband_shmem_seg_new();
+
+    if (seg_idx < 0)
+	return NULL;
+
+    entry_idx = config->shmem_seg[seg_idx].shmem_entry_idx++;
+    data = (mod_cband_shmem_data *)(config->shmem_seg[seg_idx].shmem_data + entry_idx * sizeof(mod_cband_shmem_data));
+    data->total_last_refresh = mod_cband_time_now();
+
+    return data;
+}
+
+void mod_cband_shmem_remove(int shmem_id)
+{
+    shmctl(shmem_id, IPC_RMID, 0);
+}
+
+void mod_cband_sem_init(int sem_id)
+{
+    union semun arg;
+    unsigned short values[1];
+    
+    values[0] = 1;
+    arg.val   = 1;
+    arg.array = values;
+    
+    semctl(sem_id, 0, SETALL, arg);    
+    
+    /* 
+     * We should also set owner of the semaphore ...
+     */
+}
+
+void mod_cband_sem_remove(int sem_id)
+{
+    union semun arg;
+
+    arg.val   = 0;    
+    semctl(sem_id, 0, IPC_RMID, arg);    
+}
+
+/*
+ * finds or claims the slot of a call site, MAX_LOCK_SITES when the table is full
+ */
+static int mod_cband_lock_site_find(int sem_id, const char *func, int line)
+{
+    mod_cband_lock_site *site;
+    unsigned long key = 5381;
+    const char *p;
+    int i, n;
+
+    for (p = func; *p != 0; p++)
+	key = key * 33 + (unsigned char)*p;
+    key = key * 33 + line;
+    if (key == 0)
+	key = 1;
+
+    for (n = 0, i = key % MAX_LOCK_SITES; n < MAX_LOCK_SITES; n++, i = (i + 1) % MAX_LOCK_SITES) {
+	site = &config->lock_sites[i];
+	
+	if (site->key == key)
+	    return i;
+	    
+	if ((site->key == 0) && __sync_bool_compare_and_swap(&site->key, 0, key)) {
+	    snprintf(site->name, MAX_LOCK_SITE_NAME, "%s:%d", func, line);
+	    site->remote = (sem_id == config->remote_hosts.sem_id);
+	    return i;
+	}
+    }
+    
+    return MAX_LOCK_SITES;
+}
+
+static void mod_cband_lock_account(int sem_id, int *site_idx, const char *func, int line, int contended, unsigned long long wait_nsec)
+{
+    mod_cband_lock_site *site;
+    unsigned long long max;
+
+    if ((config == NULL) || (config->lock_sites == NULL))
+	return;
+	
+    if (*site_idx < 0)
+	*site_idx = mod_cband_lock_site_find(sem_id, func, line);
+	
+    if (*site_idx >= MAX_LOCK_SITES)
+	return;
+	
+    site = &config->lock_sites[*site_idx];
+    __sync_fetch_and_add(&site->acquisitions, 1);
+    
+    if (!contended)
+	return;
+	
+    __sync_fetch_and_add(&site->contended, 1);
+    __sync_fetch_and_add(&site->wait_nsec, wait_nsec);
+    
+    while ((max = site->max_wait_nsec) < wait_nsec)
+	if (__sync_bool_compare_and_swap(&site->max_wait_nsec, max, wait_nsec))
+	    break;
+}
+
+/*
+ * called through the mod_cband_sem_down macro. The semaphore is tried without
+ * waiting first, so an uncontended acquisition costs no clock reads
+ */
+void mod_cband_sem_down_at(int sem_id, int *site, const char *func, int line)
+{
+    struct sembuf sops;
+    struct timespec t1, t2;
+    unsigned long long wait_nsec = 0;
+    int contended = 0;
+    
+    sops.sem_num  = 0;
+    sops.sem_op   = -1;
+    sops.sem_flg  = SEM_UNDO | IPC_NOWAIT;
+    
+    if (semop(sem_id, &sops, 1) < 0) {
+	sops.sem_flg = SEM_UNDO;
+	contended = 1;
+	
+	clock_gettime(CLOCK_MONOTONIC, &t1);
+	semop(sem_id, &sops, 1);
+	clock_gettime(CLOCK_MONOTONIC, &t2);
+	
+	wait_nsec = (unsigned long long)(t2.tv_sec - t1.tv_sec) * 1000000000ULL + t2.tv_nsec - t1.tv_nsec;
+    }
+    
+    mod_cband_lock_account(sem_id, site, func, line, contended, wait_nsec);
+    
+    if (mod_cband_sem_wait_hook != NULL)
+	mod_cband_sem_wait_hook(sem_id, wait_nsec);
+}
+
+void mod_cband_sem_up(int sem_id)
+{
+    struct sembuf sops;
+        
+    sops.sem_num  = 0;
+    sops.sem_op   = 1;
+    sops.sem_flg  = SEM_UNDO;
+    
+    semop(sem_id, &sops, 1);
+}
+
+/*
+ * copies the used lock statistics slots, returns their number. The counters
+ * are read without a lock and may be a few updates apart from each other
+ */
+int mod_cband_lock_sites_read(mod_cband_lock_site *copy)
+{
+    int i, n = 0;
+
+    if ((config == NULL) || (config->lock_sites == NULL))
+	return 0;
+	
+    for (i = 0; i < MAX_LOCK_SITES; i++) {
+	if (config->lock_sites[i].key == 0)
+	    continue;
+	    
+	copy[n] = config->lock_sites[i];
+	copy[n].name[MAX_LOCK_SITE_NAME - 1] = 0;
+	n++;
+    }
+    
+    return n;
+}
+
+/*
+ * Writers of mod_cband_shmem_data hold config->sem_id and make the sequence
+ * number odd while they modify the entry. Status pages read the entry without
+ * the semaphore and retry when the sequence number has changed under them
+ */
+void mod_cband_shmem_write_begin(mod_cband_shmem_data *shmem_data)
+{
+    __sync_fetch_and_add(&shmem_data->seq, 1);
+}
+
+void mod_cband_shmem_write_end(mod_cband_shmem_data *shmem_data)
+{
+    __sync_fetch_and_add(&shmem_data->seq, 1);
+}
+
+/*
+ * never blocks: after MAX_SNAPSHOT_LOOPS unsuccessful tries the last copy is 
+ * returned as it is and -1 is returned
+ */
+int mod_cband_shmem_read(mod_cband_shmem_data *shmem_data, mod_cband_shmem_data *copy)
+{
+    unsigned int seq;
+    int loops;
+
+    for (loops = 0; loops < MAX_SNAPSHOT_LOOPS; loops++) {
+	seq = *(volatile unsigned int *)&shmem_data->seq;
+	__sync_synchronize();
+	
+	if (seq & 1)
+	    continue;
+
+	memcpy(copy, shmem_data, sizeof(mod_cband_shmem_data));
+	__sync_synchronize();
+	
+	if (*(volatile unsigned int *)&shmem_data->seq == seq)
+	    return 0;
+    }
+
+    memcpy(copy, shmem_data, sizeof(mod_cband_shmem_data));
+    
+    return -1;
+}
+
+int mod_cband_remote_hosts_init(void)
+{
+    int shmem_id, sem_id;
+    int seg_size;
+
+    shmem_id = config->remote_hosts.shmem_id;
+    seg_size = sizeof(mod_cband_remote_host) * MAX_REMOTE_HOSTS + sizeof(mod_cband_remote_stats);
+
+    if (shmem_id == 0) {
+	config->remote_hosts.shmem_id = shmem_id = shmget(IPC_PRIVATE, seg_size , IPC_CREAT | 0666);
+        if (shmem_id < 0) {
+	    fprintf(stderr, "apache2_mod_cband: cannot create shared memory segment for remote hosts\n");
+	    fflush(stderr);
+	    return -1;
+	}
+	
+        config->remote_hosts.hosts = (mod_cband_remote_host *)shmat(shmem_id, 0, 0);
+	config->remote_hosts.stats = (mod_cband_remote_stats *)(config->remote_hosts.hosts + MAX_REMOTE_HOSTS);
+    }
+    
+    if (config->remote_hosts.hosts != NULL)
+	memset(config->remote_hosts.hosts, 0, seg_size);
+    
+    config->remote_hosts.sem_id = sem_id = semget(IPC_PRIVATE, 1, IPC_CREAT | 0666);
+    mod_cband_sem_init(sem_id);
+    
+    return 0;
+}
+
+/*
+ * entry of the list *head or a new one, virtualhosts and directories have
+ * lists of their own
+ */
+static mod_cband_virtualhost_config_entry *mod_cband_get_entry_(mod_cband_virtualhost_config_entry **head, int *entries, 
+	char *virtualhost, unsigned short port, unsigned line, int create)
+{
+    mod_cband_virtualhost_config_entry *entry;
+    mod_cband_virtualhost_config_entry *new_entry;
+    int i;
+
+    if (virtualhost == NULL || config == NULL)
+	return NULL;
+    
+    entry = *head;
+    
+    while(entry != NULL) {
+
+        if (!strcmp(entry->virtual_name, virtualhost) && (line == entry->virtual_defn_line))
+	    return entry;
+    
+	if (entry->next == NULL)
+	    break;
+	    
+	entry = entry->next;
+    }
+
+    if (create) {
+	if ((new_entry = config->alloc(config->alloc_ctx, sizeof(mod_cband_virtualhost_config_entry))) == NULL) {
+	    fprintf(stderr, "apache2_mod_cband: cannot alloc memory for virtualhost entry\n");
+	    fflush(stderr);
+	    return NULL;
+	}
+	
+	memset(new_entry, 0, sizeof(mod_cband_virtualhost_config_entry));
+	new_entry->virtual_name       = virtualhost;
+	new_entry->virtual_defn_line  = line;
+	new_entry->virtual_port       = port;
+	new_entry->virtual_limit_mult = 1024;
+	
+	if (new_entry->shmem_data == NULL)
+	    new_entry->shmem_data = mod_cband_shmem_init();
+
+	for (i = 0; i < DST_CLASS; i++)
+	    new_entry->virtual_class_limit_mult[i] = 1024;
+	
+	if (entry == NULL)
+	    *head = new_entry;
+	else
+	    entry->next = new_entry;
+
+	(*entries)++;
+	
+	return new_entry;    
+    }
+    
+    return NULL;    
+}
+
+/**
+ * get virtualhost entry or create new one
+ */
+mod_cband_virtualhost_config_entry *mod_cband_get_virtualhost_entry_(char *virtualhost, unsigned short port, unsigned line, int create)
+{
+    if (config == NULL)
+	return NULL;
+
+    return mod_cband_get_entry_(&config->next_virtualhost, &config->virtualhost_entries, virtualhost, port, line, create);
+}
+
+/*
+ * get the entry of the <Location> or <Directory> section at line or create
+ * new one
+ */
+mod_cband_virtualhost_config_entry *mod_cband_get_dir_entry_(char *path, unsigned line, int create)
+{
+    if (config == NULL)
+	return NULL;
+
+    return mod_cband_get_entry_(&config->next_dir, &config->dir_entries, path, 0, line, create);
+}
+
+/*
+ * the server-wide limits, an entry outside of the virtualhost list
+ */
+mod_cband_virtualhost_config_entry *mod_cband_get_global_entry_(int create)
+{
+    int entries = 0;
+
+    if (config == NULL)
+	return NULL;
+
+    return mod_cband_get_entry_(&config->global, &entries, "global", 0, 0, create);
+}
+
+static const char *mod_cband_day_names[7] = { "Sun", "Mon", "Tue", "Wed", "Thu", "Fri", "Sat" };
+
+static int mod_cband_parse_day(const char **p)
+{
+    int i;
+
+    for (i = 0; i < 7; i++)
+	if (!strncasecmp(*p, mod_cband_day_names[i], 3)) {
+	    *p += 3;
+	    return i;
+	}
+
+    return -1;
+}
+
+/*
+ * HH:MM as the minute of the day, 24:00 ends the day
+ */
+static int mod_cband_parse_minute(const char **p)
+{
+    int hour, min, len;
+
+    if ((sscanf(*p, "%2d:%2d%n", &hour, &min, &len) != 2) || (hour < 0) || (min < 0) || (min > 59) || 
+	(hour > 24) || ((hour == 24) && (min > 0)))
+	return -1;
+
+    *p += len;
+
+    return hour * 60 + min;
+}
+
+/*
+ * "Mon-Fri 08:00-20:00", "Sat,Sun", "* 22:00-06:00" - days (a list of days 
+ * and ranges or *) and an optional time window, the whole day without it
+ */
+static int mod_cband_parse_schedule(mod_cband_schedule *sched, const char *spec)
+{
+    const char *p = spec;
+    int from, to, start, end;
+
+    sched->days = 0;
+
+    if (*p == '*') {
+	sched->days = 0x7f;
+	p++;
+    } else
+    for (;;) {
+	if ((from = to = mod_cband_parse_day(&p)) < 0)
+	    return -1;
+
+	if ((*p == '-') && (p++, (to = mod_cband_parse_day(&p)) < 0))
+	    return -1;
+
+	for (;; from = (from + 1) % 7) {
+	    sched->days |= 1 << from;
+	    if (from == to)
+		break;
+	}
+
+	if (*p != ',')
+	    break;
+	p++;
+    }
+
+    while ((*p == ' ') || (*p == '\t'))
+	p++;
+
+    start = 0;
+    end   = 24 * 60;
+
+    if ((*p != 0) && (((start = mod_cband_parse_minute(&p)) < 0) || (*p++ != '-') || ((end = mod_cband_parse_minute(&p)) < 0) || (*p != 0)))
+	return -1;
+
+    sched->start = start;
+    sched->end   = end;
+
+    return 0;
+}
+
+/*
+ * the schedule of the entry with the specification spec, created when it 
+ * doesn't exist. NULL when spec is invalid
+ */
+mod_cband_schedule *mod_cband_get_schedule_(mod_cband_virtualhost_config_entry *entry, char *spec, int create)
+{
+    mod_cband_schedule *sched, *last = NULL;
+
+    if ((entry == NULL) || (spec == NULL) || (config == NULL))
+	return NULL;
+
+    for (sched = entry->virtual_schedule; sched != NULL; last = sched, sched = sched->next)
+	if (!strcmp(sched->spec, spec))
+	    return sched;
+
+    if (!create)
+	return NULL;
+
+    if ((sched = config->alloc(config->alloc_ctx, sizeof(mod_cband_schedule))) == NULL) {
+	fprintf(stderr, "apache2_mod_cband: cannot alloc memory for schedule\n");
+	fflush(stderr);
+	return NULL;
+    }
+
+    memset(sched, 0, sizeof(mod_cband_schedule));
+    sched->spec = spec;
+
+    if (mod_cband_parse_schedule(sched, spec) < 0)
+	return NULL;
+
+    if (last == NULL)
+	entry->virtual_schedule = sched;
+    else
+	last->next = sched;
+
+    return sched;
+}
+
+static int mod_cband_schedule_active(mod_cband_schedule *sched, int wday, int minute)
+{
+    if (sched->start < sched->end)
+	return (sched->days & (1 << wday)) && (minute >= (int)sched->start) && (minute < (int)sched->end);
+
+    /* the window from the day before */
+    return ((sched->days & (1 << wday)) && (minute >= (int)sched->start)) || 
+	   ((sched->days & (1 << ((wday + 6) % 7))) && (minute < (int)sched->end));
+}
+
+/*
+ * number of the first schedule in effect, 0 = none
+ */
+static int mod_cband_schedule_find(mod_cband_virtualhost_config_entry *entry, int wday, int minute)
+{
+    mod_cband_schedule *sched;
+    int idx = 1;
+
+    for (sched = entry->virtual_schedule; sched != NULL; sched = sched->next, idx++)
+	if (mod_cband_schedule_active(sched, wday, minute))
+	    return idx;
+
+    return 0;
+}
+
+/*
+ * keeps the configured speeds of the entries with schedules, called from 
+ * mod_cband_post_config
+ */
+int mod_cband_schedule_init(void)
+{
+    mod_cband_virtualhost_config_entry *entry;
+
+    for (entry = config->next_virtualhost; entry != NULL; entry = entry->next) {
+	if (entry->virtual_schedule == NULL)
+	    continue;
+
+	entry->virtual_base_speed[SCHEDULE_SPEED]    = entry->shmem_data->max_speed;
+	entry->virtual_base_speed[SCHEDULE_REMOTE]   = entry->shmem_data->remote_speed;
+	entry->virtual_base_speed[SCHEDULE_EXCEEDED] = entry->shmem_data->over_speed;
+	entry->shmem_data->schedule_next = 0;
+	entry->shmem_data->schedule_idx  = 0;
+    }
+
+    return 0;
+}
+
+/*
+ * switches the speeds of the entry to the schedule in effect. The schedules
+ * are evaluated only when schedule_next passes, then the next switch is 
+ * searched for minute by minute, at most MAX_SCHEDULE_SCAN minutes ahead
+ */
+void mod_cband_check_schedule(mod_cband_virtualhost_config_entry *entry, unsigned long time_now)
+{
+    mod_cband_shmem_data *shmem_data;
+    mod_cband_schedule *sched;
+    unsigned long next;
+    struct tm tm;
+    time_t t;
+    int wday, minute, idx, i;
+
+    if ((entry == NULL) || (entry->virtual_schedule == NULL) || (time_now < entry->shmem_data->schedule_next))
+	return;
+
+    t = (time_t)time_now;
+    localtime_r(&t, &tm);
+    wday   = tm.tm_wday;
+    minute = tm.tm_hour * 60 + tm.tm_min;
+    idx    = mod_cband_schedule_find(entry, wday, minute);
+
+    next = time_now - tm.tm_sec + 60;
+    for (i = 1; i < MAX_SCHEDULE_SCAN; i++, next += 60) {
+	if (++minute == 24 * 60) {
+	    minute = 0;
+	    wday   = (wday + 1) % 7;
+	}
+
+	if (mod_cband_schedule_find(entry, wday, minute) != idx)
+	    break;
+    }
+
+    for (i = 1, sched = entry->virtual_schedule; (sched != NULL) && (i < idx); i++)
+	sched = sched->next;
+
+    if (idx == 0)
+	sched = NULL;
+
+    shmem_data = entry->shmem_data;
+
+    /* BEGIN CRITICAL SECTION */
+    mod_cband_sem_down(config->sem_id);
+    mod_cband_shmem_write_begin(shmem_data);
+
+    if (idx != shmem_data->schedule_idx) {
+	shmem_data->max_speed    = ((sched != NULL) && (sched->speed_set & (1 << SCHEDULE_SPEED))) ? 
+				   sched->speed[SCHEDULE_SPEED] : entry->virtual_base_speed[SCHEDULE_SPEED];
+	shmem_data->remote_speed = ((sched != NULL) && (sched->speed_set & (1 << SCHEDULE_REMOTE))) ? 
+				   sched->speed[SCHEDULE_REMOTE] : entry->virtual_base_speed[SCHEDULE_REMOTE];
+	shmem_data->over_speed   = ((sched != NULL) && (sched->speed_set & (1 << SCHEDULE_EXCEEDED))) ? 
+				   sched->speed[SCHEDULE_EXCEEDED] : entry->virtual_base_speed[SCHEDULE_EXCEEDED];
+
+	if (shmem_data->overlimit)
+	    mod_cband_set_overlimit_speed(shmem_data);
+	else
+	    mod_cband_set_normal_speed(shmem_data);
+
+	shmem_data->schedule_idx = idx;
+    }
+
+    shmem_data->schedule_next = next;
+
+    mod_cband_shmem_write_end(shmem_data);
+    mod_cband_sem_up(config->sem_id);
+    /* END CRITICAL SECTION */
+}
+
+/**
+ * get user entry or create new one
+ */
+mod_cband_user_config_entry *mod_cband_get_user_entry_(char *user, int create)
+{
+    mod_cband_user_config_entry *entry;
+    mod_cband_user_config_entry *new_entry;
+    int i;
+
+    if (user == NULL || config == NULL)
+	return NULL;
+    
+    entry = config->next_user;
+    
+    while(entry != NULL) {
+	if (!strcmp(entry->user_name, user))
+	    return entry;
+    
+	if (entry->next == NULL)
+	    break;
+	    
+	entry = entry->next;
+    }
+    
+    if (create) {
+	if ((new_entry = config->alloc(config->alloc_ctx, sizeof(mod_cband_user_config_entry))) == NULL) {
+	    fprintf(stderr, "apache2_mod_cband: cannot alloc memory for user entry\n");
+	    fflush(stderr);
+	    return NULL;
+	}
+	
+	memset(new_entry, 0, sizeof(mod_cband_user_config_entry));
+	new_entry->user_name       = user;
+	new_entry->user_limit_mult = 1024;
+
+	if (new_entry->shmem_data == NULL)
+	    new_entry->shmem_data = mod_cband_shmem_init();
+
+	for (i = 0; i < DST_CLASS; i++)
+	    new_entry->user_class_limit_mult[i] = 1024;
+
+	if (entry == NULL)
+	    config->next_user = new_entry;
+	else
+	    entry->next = new_entry;
+
+	config->user_entries++;
+	
+	return new_entry;    
+    }
+	
+    return NULL;    
+}
+
+/**
+ * get class entry or create new one
+ */
+mod_cband_class_config_entry *mod_cband_get_class_entry_(char *dest, int create)
+{
+    mod_cband_class_config_entry *entry;
+    mod_cband_class_config_entry *new_entry;
+
+    if (dest == NULL || config == NULL)
+	return NULL;
+    
+    entry = config->next_class;
+    
+    while(entry != NULL) {
+	if (!strcmp(entry->class_name, dest))
+	    return entry;
+    
+	if (entry->next == NULL)
+	    break;
+	    
+	entry = entry->next;
+    }
+
+    if (create) {
+	if ((new_entry = config->alloc(config->alloc_ctx, sizeof(mod_cband_class_config_entry))) == NULL) {
+	    fprintf(stderr, "apache2_mod_cband: cannot alloc memory for class entry\n");
+	    fflush(stderr);
+	    return NULL;
+	}
+	
+	memset(new_entry, 0, sizeof(mod_cband_class_config_entry));
+	new_entry->class_name = dest;
+    
+	if (entry == NULL)
+	    config->next_class = new_entry;
+	else
+	    entry->next = new_entry;
+	
+	return new_entry;    
+    }
+    
+    return NULL;    
+}
+
+/*
+ * destination class of the address (in network byte order), -1 when it is in no class
+ */
+int mod_cband_get_dst_(in_addr_t addr)
+{
+    patricia_node_t *node;
+    prefix_t p;
+    char *leaf;
+	      
+    if (config->tree == NULL)
+	return -1;
+    
+    p.bitlen = 32;
+    p.ref_count = 0;
+    p.family = AF_INET;
+    p.add.sin.s_addr = addr;
+	      
+    node = patricia_search_best(config->tree, &p);
+				    
+    if (node) {
+        leaf = node->user1;
+					            
+        if (leaf) {
+#ifdef DEBUG
+            fprintf(stderr,"%s leaf %s\n",inet_ntoa(p.add.sin),leaf);
+            fflush(stderr);
+#endif
+	    return atoi(leaf);
+        }
+    }
+    
+    return -1;
+}
+
+/*
+ * adds the network (a.b.c.d/n) to the destination class
+ */
+int mod_cband_add_class_dst(char *dst, int class_nr)
+{
+    patricia_node_t *node;
+    char class_nr_str[MAX_CLASS_STR_LEN];
+
+    if (config->tree == NULL)
+	config->tree = New_Patricia(32); 
+
+    sprintf(class_nr_str, "%d", class_nr);
+    node = make_and_lookup(config->tree, dst);
+		
+    if (node == NULL)
+	return -1;
+
+    node->user1 = config->alloc(config->alloc_ctx, strlen(class_nr_str) + 1);
+    strcpy(node->user1, class_nr_str);
+    
+    return 0;
+}
+
+/*
+ * key of a string value of CBandKey (64-bit FNV-1a). The top bit keeps it apart
+ * from the addresses, which are keys too
+ */
+unsigned long long mod_cband_key_hash(const char *str)
+{
+    unsigned long long h = 0xcbf29ce484222325ULL;
+
+    while (*str != 0) {
+	h ^= (unsigned char)*str++;
+	h *= 0x100000001b3ULL;
+    }
+
+    return h | (1ULL << 63);
+}
+
+/*
+ * key of the remote client with the address ip, its network with 
+ * CBandRemotePrefixLen. addr is the (network) address of an IPv4 client, 
+ * INADDR_NONE of an IPv6 one, whose key is the hash of its network. name
+ * (MAX_REMOTE_NAME bytes) gets the address or the network to print
+ */
+unsigned long long mod_cband_remote_addr_key(const char *ip, in_addr_t *addr, char *name)
+{
+    struct in6_addr addr6;
+    char buf[INET6_ADDRSTRLEN];
+    int i, bits;
+
+    *addr = INADDR_NONE;
+    name[0] = 0;
+
+    if (inet_pton(AF_INET6, ip, &addr6) == 1) {
+	if (!IN6_IS_ADDR_V4MAPPED(&addr6)) {
+	    bits = (config->remote_prefix_v6 > 0) ? config->remote_prefix_v6 : 128;
+
+	    for (i = 0; i < 16; i++, bits -= 8)
+		if (bits < 8)
+		    addr6.s6_addr[i] &= (bits > 0) ? (0xff << (8 - bits)) & 0xff : 0;
+
+	    if (inet_ntop(AF_INET6, &addr6, buf, sizeof(buf)) == NULL)
+		return (unsigned long long)*addr;
+
+	    if ((config->remote_prefix_v6 > 0) && (config->remote_prefix_v6 < 128))
+		snprintf(name, MAX_REMOTE_NAME, "%s/%d", buf, config->remote_prefix_v6);
+	    else
+		snprintf(name, MAX_REMOTE_NAME, "%s", buf);
+
+	    return mod_cband_key_hash(buf);
+	}
+
+	memcpy(addr, &addr6.s6_addr[12], sizeof(in_addr_t));
+    } else
+    if (inet_pton(AF_INET, ip, addr) != 1)
+	return (unsigned long long)*addr;
+
+    if ((config->remote_prefix_v4 > 0) && (config->remote_prefix_v4 < 32))
+	*addr &= htonl(0xffffffffUL << (32 - config->remote_prefix_v4));
+
+    if (inet_ntop(AF_INET, addr, buf, sizeof(buf)) != NULL) {
+	if ((config->remote_prefix_v4 > 0) && (config->remote_prefix_v4 < 32))
+	    snprintf(name, MAX_REMOTE_NAME, "%s/%d", buf, config->remote_prefix_v4);
+	else
+	    snprintf(name, MAX_REMOTE_NAME, "%s", buf);
+    }
+
+    return (unsigned long long)*addr;
+}
+
+/*
+ * first slot of the remote client in the hashed remote table
+ */
+static int mod_cband_remote_slot(unsigned long long key, char *virtual_name)
+{
+    unsigned long long h;
+
+    h  = key ^ ((unsigned long long)(size_t)virtual_name * 0x9e3779b97f4a7c15ULL);
+    h ^= h >> 33;
+    h *= 0xff51afd7ed558ccdULL;
+    h ^= h >> 33;
+
+    return (int)(h % MAX_REMOTE_HOSTS);
+}
+
+/*
+ * 1 when the slot holds a client seen in the last MAX_REMOTE_HOST_LIFE seconds
+ * or one with open connections, expired slots are taken by new clients
+ */
+static int mod_cband_remote_live(mod_cband_remote_host *host, unsigned long time_now)
+{
+    return (host->used && ((((time_now - host->remote_last_time) / 1000000) <= MAX_REMOTE_HOST_LIFE) || (host->remote_conn > 0)));
+}
+
+/*
+ * index of the remote client (key, virtual_name), a new one when create is set.
+ * Open addressing: a client lives in one of MAX_REMOTE_PROBES slots after the
+ * slot of its hash. When all of them hold live clients it takes a free slot,
+ * or the longest expired one, anywhere in the table and is counted in
+ * remote_overflow of its hash slot; only lookups of such slots scan the whole
+ * table. -1 when the whole table is in use, counted in stats->refused
+ */
+int mod_cband_get_remote_key_(unsigned long long key, in_addr_t addr, const char *name, char *virtual_name, int create)
+{
+    int i, n, home, free_idx = -1, outside = 0;
+    unsigned long overflow;
+    mod_cband_remote_host *hosts;
+    unsigned long time_now;
+    
+    if (virtual_name == NULL)
+	return -1;
+    
+    time_now = mod_cband_time_now();     
+    hosts = config->remote_hosts.hosts;
+
+    if (hosts == NULL)
+	return -1;
+    
+    /* BEGIN CRITICAL SECTION */
+    mod_cband_sem_down(config->remote_hosts.sem_id);
+    home = mod_cband_remote_slot(key, virtual_name);
+    for (n = 0, i = home; n < MAX_REMOTE_PROBES; n++, i = (i + 1) % MAX_REMOTE_HOSTS) {
+	if (!hosts[i].used) {
+	    if (free_idx < 0)
+		free_idx = i;
+	    break;
+	}
+
+	if (mod_cband_remote_live(&hosts[i], time_now)) {
+	    if ((hosts[i].remote_key == key) && (hosts[i].virtual_name == virtual_name)) {
+		mod_cband_sem_up(config->remote_hosts.sem_id);
+		/* END CRITICAL SECTION */
+		return i; 
+	    }
+	} else
+	if (free_idx < 0)
+	    free_idx = i;
+    }
+
+    /* the client may be kept outside the window, expired ones no longer count */
+    if (hosts[home].remote_overflow > 0) {
+	for (i = 0; i < MAX_REMOTE_HOSTS; i++) {
+	    if (!hosts[i].remote_outside || (hosts[i].remote_home != home))
+		continue;
+	    
+	    if (!mod_cband_remote_live(&hosts[i], time_now)) {
+		hosts[i].remote_outside = 0;
+		hosts[home].remote_overflow--;
+		continue;
+	    }
+	    
+	    if ((hosts[i].remote_key == key) && (hosts[i].virtual_name == virtual_name)) {
+		mod_cband_sem_up(config->remote_hosts.sem_id);
+		/* END CRITICAL SECTION */
+		return i; 
+	    }
+	}
+    }
+
+    if (create && (free_idx < 0)) {
+	for (n = 0, i = (home + MAX_REMOTE_PROBES) % MAX_REMOTE_HOSTS; n < MAX_REMOTE_HOSTS - MAX_REMOTE_PROBES; n++, i = (i + 1) % MAX_REMOTE_HOSTS) {
+	    if (!hosts[i].used) {
+		free_idx = i;
+		break;
+	    }
+	    
+	    if (!mod_cband_remote_live(&hosts[i], time_now) && ((free_idx < 0) || (hosts[i].remote_last_time < hosts[free_idx].remote_last_time)))
+		free_idx = i;
+	}
+	
+	if (free_idx >= 0)
+	    outside = 1;
+	else
+	if (config->remote_hosts.stats != NULL)
+	    config->remote_hosts.stats->refused++;
+    }
+
+    if (create && (free_idx >= 0)) {    
+	i = free_idx;
+	if (hosts[i].remote_outside)
+	    mod_cband_safe_change(&hosts[hosts[i].remote_home].remote_overflow, -1);
+	overflow = hosts[i].remote_overflow;
+	memset(&hosts[i], 0, sizeof(mod_cband_remote_host));
+	hosts[i].used                = 1;
+	hosts[i].remote_key          = key;
+	hosts[i].remote_addr         = addr;
+	if ((name != NULL) && (name[0] != 0))
+	    snprintf(hosts[i].remote_name, MAX_REMOTE_NAME, "%s", name);
+	else
+	    inet_ntop(AF_INET, &addr, hosts[i].remote_name, MAX_REMOTE_NAME);
+	hosts[i].remote_last_time    = time_now;
+	hosts[i].remote_last_refresh = time_now;
+	hosts[i].virtual_name        = virtual_name;
+	hosts[i].remote_overflow     = overflow;
+	if (outside) {
+	    hosts[i].remote_outside  = 1;
+	    hosts[i].remote_home     = home;
+	    hosts[home].remote_overflow++;
+	    if (config->remote_hosts.stats != NULL)
+		config->remote_hosts.stats->overflows++;
+	}
+	mod_cband_sem_up(config->remote_hosts.sem_id);
+	/* END CRITICAL SECTION */
+	return i; 
+    }
+    mod_cband_sem_up(config->remote_hosts.sem_id);
+    /* END CRITICAL SECTION */
+
+    return -1;
+}
+
+int mod_cband_get_remote_host_(in_addr_t addr, char *virtual_name, int create)
+{
+    return mod_cband_get_remote_key_((unsigned long long)addr, addr, NULL, virtual_name, create);
+}
+
+void mod_cband_safe_change(unsigned long *val, int diff)
+{
+    if (val == NULL)
+	return;
+
+    if ((diff > 0) || (diff < 0 && *val >= -diff))
+	*val += diff;
+    else
+	*val = 0;
+}
+
+int mod_cband_change_remote_connections_lock(int index, int diff)
+{
+    if (index < 0)
+	return -1;
+
+    /* BEGIN CRITICAL SECTION */
+    mod_cband_sem_down(config->remote_hosts.sem_id);
+    mod_cband_safe_change(&config->remote_hosts.hosts[index].remote_conn, diff);
+    mod_cband_sem_up(config->remote_hosts.sem_id);
+    /* END CRITICAL SECTION */
+
+    return 0;
+}
+
+/* 
+ * Nie trzeba semafora, poniewaz operacje na liczbach 32-bit sa atomowe
+ */
+int mod_cband_set_remote_request_time(int index, unsigned long time)
+{
+    if (index < 0)
+	return -1;
+
+    config->remote_hosts.hosts[index].remote_last_time = time;
+
+    return 0;
+}
+
+/* 
+ * Nie trzeba semafora, poniewaz operacje na liczbach 32-bit sa atomowe
+ */
+int mod_cband_set_remote_current_speed(int index, unsigned long kbps)
+{
+    if (index < 0)
+	return -1;
+
+    config->remote_hosts.hosts[index].remote_kbps = kbps;
+
+    return 0;
+}
+
+/* 
+ * Nie trzeba semafora, poniewaz operacje na liczbach 32-bit sa atomowe
+ */
+int mod_cband_set_remote_max_connections(int index, unsigned long max)
+{
+    if (index < 0)
+	return -1;
+
+    config->remote_hosts.hosts[index].remote_max_conn = max;
+
+    return 0;
+}
+
+/* 
+ * Nie trzeba semafora, poniewaz operacje na liczbach 32-bit sa atomowe
+ */
+int mod_cband_set_remote_last_refresh(int index, unsigned long time)
+{
+    if (index < 0)
+	return -1;
+
+    config->remote_hosts.hosts[index].remote_last_refresh = time;
+
+    return 0;
+}
+
+/* 
+ * Nie trzeba semafora, poniewaz operacje na liczbach 32-bit sa atomowe
+ */
+int mod_cband_set_remote_total_connections(int index, unsigned long set)
+{
+    if (index < 0)
+	return -1;
+
+    config->remote_hosts.hosts[index].remote_total_conn = set;
+
+    return 0;
+}
+
+/* 
+ * Nie trzeba semafora, poniewaz operacje na liczbach 32-bit sa atomowe
+ */
+int mod_cband_get_remote_total_connections(int index)
+{
+    if (index < 0)
+	return -1;
+
+    return config->remote_hosts.hosts[index].remote_conn;
+}
+
+float mod_cband_get_remote_connections_speed_lock(int index)
+{
+    unsigned long time_now;
+    float time_delta;
+    float rps = 0;
+    
+    if (index < 0)
+	return 0;
+
+    time_now = mod_cband_time_now();
+    
+    /* BEGIN CRITICAL SECTION */
+    mod_cband_sem_down(config->remote_hosts.sem_id);
+    time_delta = (float)(time_now - config->remote_hosts.hosts[index].remote_last_refresh) / 1e6;
+    if (time_delta > 0)
+	rps = (float)(config->remote_hosts.hosts[index].remote_total_conn) / time_delta;
+    mod_cband_sem_up(config->remote_hosts.sem_id);
+    /* END CRITICAL SECTION */
+
+    return rps;
+}
+
+int mod_cband_change_remote_total_connections_lock(int index, unsigned long diff)
+{
+    if (index < 0)
+	return -1;
+
+    /* BEGIN CRITICAL SECTION */
+    mod_cband_sem_down(config->remote_hosts.sem_id);
+    mod_cband_safe_change(&config->remote_hosts.hosts[index].remote_total_conn, diff);
+    mod_cband_sem_up(config->remote_hosts.sem_id);
+    /* END CRITICAL SECTION */
+
+    return 0;
+}
+
+/* 
+ * Nie trzeba semafora, poniewaz operacje na liczbach 32-bit sa atomowe
+ */
+unsigned long mod_cband_get_remote_connection_time(int index)
+{
+    if (index < 0)
+	return 0;
+
+    return config->remote_hosts.hosts[index].remote_last_time;
+}
+
+/* 
+ * Nie trzeba semafora, poniewaz operacje na liczbach 32-bit sa atomowe
+ */
+int mod_cband_get_remote_connections(int index)
+{
+    if (index < 0)
+	return 0;
+	
+    return config->remote_hosts.hosts[index].remote_conn;
+}
+
+/* 
+ * Nie trzeba semafora, poniewaz operacje na liczbach 32-bit sa atomowe
+ */
+int mod_cband_remove_remote_host(int index)
+{
+    if (index < 0)
+	return -1;
+
+    /* the slot stays used, it would break the probe sequences of other clients */
+    config->remote_hosts.hosts[index].remote_conn      = 0;
+    config->remote_hosts.hosts[index].remote_last_time = 0;
+
+    return 0;
+}
+
+int mod_cband_get_dst_speed_lock(mod_cband_virtualhost_config_entry *entry, mod_cband_user_config_entry *entry_user, unsigned long *remote_kbps, unsigned long *remote_rps, unsigned long *remote_max_conn, int dst)
+{
+    unsigned long virtualhost_kbps = 0;
+    unsigned long user_kbps = 0;
+    unsigned long virtualhost_rps = 0;
+    unsigned long user_rps = 0;
+    unsigned long virtualhost_max_conn = 0;
+    unsigned long user_max_conn = 0;
+
+    if (entry != NULL) {
+        /* BEGIN CRITICAL SECTION */
+	mod_cband_sem_down(config->sem_id);
+        virtualhost_kbps     = entry->shmem_data->remote_speed.kbps;
+	virtualhost_rps      = entry->shmem_data->remote_speed.rps;	
+	virtualhost_max_conn = entry->shmem_data->remote_speed.max_conn;	
+        mod_cband_sem_up(config->sem_id);
+	/* BEGIN CRITICAL SECTION */
+
+	if (dst >= 0 && dst <= DST_CLASS) {
+	    if (entry->virtual_class_speed[dst].kbps > 0)
+		virtualhost_kbps = entry->virtual_class_speed[dst].kbps;
+		
+	    if (entry->virtual_class_speed[dst].rps > 0)
+		virtualhost_rps  = entry->virtual_class_speed[dst].rps;
+
+	    if (entry->virtual_class_speed[dst].max_conn > 0)
+		virtualhost_max_conn  = entry->virtual_class_speed[dst].max_conn;
+	}
+    }
+
+    if (entry_user != NULL) {
+        /* BEGIN CRITICAL SECTION */
+	mod_cband_sem_down(config->sem_id);
+        user_kbps     = entry_user->shmem_data->remote_speed.kbps;
+	user_rps      = entry_user->shmem_data->remote_speed.rps;	
+	user_max_conn = entry_user->shmem_data->remote_speed.max_conn;	
+        mod_cband_sem_up(config->sem_id);
+	/* BEGIN CRITICAL SECTION */
+	
+	if (dst >= 0 && dst <= DST_CLASS) {
+	    if (entry_user->user_class_speed[dst].kbps > 0)
+		user_kbps = entry_user->user_class_speed[dst].kbps;
+	    
+	    if (entry_user->user_class_speed[dst].rps > 0)
+		user_rps  = entry_user->user_class_speed[dst].rps;
+
+	    if (entry_user->user_class_speed[dst].max_conn > 0)
+		user_max_conn  = entry_user->user_class_speed[dst].max_conn;
+	}
+    }
+
+    if (remote_kbps != NULL) {
+	if ((user_kbps > 0) && (virtualhost_kbps > user_kbps)) 
+	    *remote_kbps = user_kbps;
+        else
+	if (virtualhost_kbps > 0)
+	    *remote_kbps = virtualhost_kbps;
+        else
+	    *remote_kbps = user_kbps;
+    }
+
+    if (remote_rps != NULL) {
+	if ((user_rps > 0) && (virtualhost_rps > user_rps)) 
+	    *remote_rps = virtualhost_rps;
+        else
+	if (virtualhost_rps > 0)
+	    *remote_rps = virtualhost_rps;
+        else
+    	    *remote_rps = user_rps;
+    }
+
+    if (remote_max_conn != NULL) {
+    	if ((user_max_conn > 0) && (virtualhost_max_conn > user_max_conn)) 
+	    *remote_max_conn = virtualhost_max_conn;
+        else
+	if (virtualhost_max_conn > 0)
+	    *remote_max_conn = virtualhost_max_conn;
+        else
+    	    *remote_max_conn = user_max_conn;
+    }
+    
+    return 0;
+}
+
+/* 
+ * Nie trzeba semafora, poniewaz operacje na liczbach 32-bit sa atomowe
+ */
+int mod_cband_get_score(char *path, unsigned long long *val, int dst, mod_cband_shmem_data *shmem_data)
+{
+    if (val == NULL || shmem_data == NULL)
+	return -1;
+
+    if (dst < 0)
+	*val = shmem_data->total_usage.total_bytes;
+    else
+	*val = shmem_data->total_usage.class_bytes[dst];
+    
+    return 0;
+}
+
+
+/*
+ * semafor opuszczany w mod_cband_update_score_cache.
+ * The rolling quota follows the scoreboard in the file, it stays cleared
+ * with the files written before it was kept there
+ */
+int mod_cband_get_score_all(char *path, mod_cband_scoreboard_entry *val, mod_cband_roll *roll)
+{
+    int fd;
+    
+    if (path == NULL || val == NULL)
+	return -1;
+    
+    if ((fd = open(path, O_RDONLY)) < 0)
+	return -1;
+    
+    if (read(fd, val, sizeof(mod_cband_scoreboard_entry)) < 0) {
+	close(fd);
+	return -1;
+    }
+    
+    if ((roll != NULL) && (read(fd, roll, sizeof(mod_cband_roll)) != sizeof(mod_cband_roll)))
+	memset(roll, 0, sizeof(mod_cband_roll));
+    close(fd);
+    
+    return 0;
+}
+
+/* 
+ * semafor opuszczany w mod_cband_save_score_cache i mod_cband_flush_score_lock
+ */
+int mod_cband_save_score(char *path, mod_cband_scoreboard_entry *scoreboard, mod_cband_roll *roll)
+{
+    struct flock lock;
+    int fd;
+    
+    if (path == NULL || scoreboard == NULL || scoreboard->was_request == 0)
+	return -1;
+	
+    if ((fd = open(path, O_CREAT | O_RDWR, S_IRUSR | S_IWUSR)) < 0) {
+	fprintf(stderr, "apache2_mod_cband: cannot open scoreboard file %s\n", path);
+	fflush(stderr);
+	
+	return -1;
+    }
+   
+    memset(&lock, 0, sizeof(struct flock));
+    lock.l_type   = F_WRLCK;
+    lock.l_whence = SEEK_SET;
+    fcntl(fd, F_SETLKW, &lock);
+    
+    if ((write(fd, scoreboard, sizeof(mod_cband_scoreboard_entry)) != sizeof(mod_cband_scoreboard_entry)) ||
+	((roll != NULL) && (write(fd, roll, sizeof(mod_cband_roll)) != sizeof(mod_cband_roll)))) {
+	fprintf(stderr, "apache2_mod_cband: cannot write scoreboard file %s\n", path);
+	fflush(stderr);
+    }
+    
+    lock.l_type   = F_UNLCK;
+    fcntl(fd, F_SETLK, &lock);
+    close(fd);
+    
+    return 0;
+}
+
+int mod_cband_flush_score_lock(char *path, mod_cband_shmem_data *shmem_data)
+{
+    mod_cband_scoreboard_entry *scoreboard;
+
+    if ((path == NULL) || (shmem_data == NULL))
+	return -1;
+
+    scoreboard = &(shmem_data->total_usage);
+
+    /* BEGIN CRITICAL SECTION */
+    mod_cband_sem_down(config->sem_id);
+    mod_cband_shmem_write_begin(shmem_data);
+    
+    scoreboard->was_request = 1;
+    if (--(scoreboard->score_flush_count) <= 0) {
+	CBAND_PROBE2(score__flush, path, scoreboard->total_bytes);
+	mod_cband_save_score(path, scoreboard, &(shmem_data->roll));
+	scoreboard->score_flush_count = config->score_flush_period;
+    }
+    
+    mod_cband_shmem_write_end(shmem_data);
+    mod_cband_sem_up(config->sem_id);
+    /* END CRITICAL SECTION */        
+    
+    return 0;
+}
+
+/*
+ * semafor opuszczany poza funkcje mod_cband_log_bucket
+ */
+int mod_cband_update_score(char *path, unsigned long long *bytes_served, int dst, mod_cband_scoreboard_entry *scoreboard)
+{
+    if (scoreboard == NULL || bytes_served == NULL)
+	return -1;
+
+    scoreboard->total_bytes	     += (unsigned long long)(*bytes_served);
+    if (dst >= 0)
+	scoreboard->class_bytes[dst] += (unsigned long long)(*bytes_served);
+
+    return 0;
+}
+
+/*
+ * clears the scoreboard and starts a new period at start_time
+ */
+int mod_cband_clear_score_lock(mod_cband_shmem_data *shmem_data, unsigned long start_time)
+{
+    if (shmem_data == NULL)
+	return -1;
+
+    /* BEGIN CRITICAL SECTION */        
+    mod_cband_sem_down(config->sem_id);
+    mod_cband_shmem_write_begin(shmem_data);
+    memset(&(shmem_data->total_usage), 0, sizeof(mod_cband_scoreboard_entry));    
+    shmem_data->total_usage.start_time = start_time;
+    shmem_data->upload_bytes = 0;
+    mod_cband_shmem_write_end(shmem_data);
+    mod_cband_sem_up(config->sem_id);
+    /* END CRITICAL SECTION */        
+
+    return 0;
+}
+
+/*
+ * drops a restored rolling quota kept with another bucket length (the window
+ * was changed) or none at all, its slot is then ahead of the current one
+ */
+static void mod_cband_roll_restore(mod_cband_roll *roll, unsigned long window)
+{
+    unsigned long len;
+
+    if ((len = window / ROLL_BUCKETS) == 0)
+	len = 1;
+
+    if ((window == 0) || (roll->slot > (unsigned long)(mod_cband_time_now() / 1000000) / len))
+	memset(roll, 0, sizeof(mod_cband_roll));
+}
+
+/* semafor opuszczany przez funkcje mod_cband_post_config */
+int mod_cband_update_score_cache(void)
+{
+    mod_cband_virtualhost_config_entry *entry = NULL;
+    mod_cband_user_config_entry *entry_user = NULL;
+
+    entry = config->next_virtualhost;
+    while(entry != NULL) {
+        if (mod_cband_get_score_all(entry->virtual_scoreboard, &(entry->shmem_data->total_usage), &(entry->shmem_data->roll)) == 0)
+	    mod_cband_roll_restore(&(entry->shmem_data->roll), entry->roll_window);
+        if ((entry = entry->next) == NULL)
+	    break;
+    }
+
+    for (entry = config->next_dir; entry != NULL; entry = entry->next)
+        if (mod_cband_get_score_all(entry->virtual_scoreboard, &(entry->shmem_data->total_usage), &(entry->shmem_data->roll)) == 0)
+	    mod_cband_roll_restore(&(entry->shmem_data->roll), entry->roll_window);
+
+    entry_user = config->next_user;
+    while(entry_user != NULL) {
+        if (mod_cband_get_score_all(entry_user->user_scoreboard, &(entry_user->shmem_data->total_usage), &(entry_user->shmem_data->roll)) == 0)
+	    mod_cband_roll_restore(&(entry_user->shmem_data->roll), entry_user->roll_window);
+        if ((entry_user = entry_user->next) == NULL)
+	    break;
+    }
+    
+    return 0;
+}
+
+int mod_cband_save_score_cache(void)
+{
+    mod_cband_virtualhost_config_entry *entry = NULL;
+    mod_cband_user_config_entry *entry_user = NULL;
+
+    entry = config->next_virtualhost;
+    while(entry != NULL) {
+        mod_cband_save_score(entry->virtual_scoreboard, &(entry->shmem_data->total_usage), &(entry->shmem_data->roll));
+        if ((entry = entry->next) == NULL)
+	    break;
+    }
+
+    for (entry = config->next_dir; entry != NULL; entry = entry->next)
+        mod_cband_save_score(entry->virtual_scoreboard, &(entry->shmem_data->total_usage), &(entry->shmem_data->roll));
+
+    entry_user = config->next_user;
+    while(entry_user != NULL) {
+        mod_cband_save_score(entry_user->user_scoreboard, &(entry_user->shmem_data->total_usage), &(entry_user->shmem_data->roll));
+        if ((entry_user = entry_user->next) == NULL)
+	    break;
+    }
+    
+    return 0;
+}
+
+unsigned long mod_cband_get_start_time(mod_cband_scoreboard_entry *scoreboard)
+{
+    if (scoreboard == NULL)
+	return 0;
+
+    return scoreboard->start_time;
+}
+
+int mod_cband_set_start_time(mod_cband_scoreboard_entry *scoreboard, unsigned long start_time)
+{
+    if (scoreboard == NULL)
+	return 0;
+
+    scoreboard->start_time = start_time;
+    
+    return 0;
+}
+
+static int mod_cband_hist_index(unsigned long value)
+{
+    int e, idx;
+
+    if (value < (1 << HIST_SUB_BITS))
+	return value;
+
+    for (e = HIST_SUB_BITS; (value >> (e + 1)) != 0; e++);
+    idx = (e - HIST_SUB_BITS + 1) * (1 << HIST_SUB_BITS) + ((value >> (e - HIST_SUB_BITS)) & ((1 << HIST_SUB_BITS) - 1));
+
+    return (idx < HIST_BUCKETS) ? idx : HIST_BUCKETS - 1;
+}
+
+/*
+ * the largest value which falls into the bucket
+ */
+static unsigned long mod_cband_hist_upper(int idx)
+{
+    int e;
+
+    if (idx + 1 < (1 << HIST_SUB_BITS))
+	return idx;
+
+    idx++;
+    e = idx / (1 << HIST_SUB_BITS) + HIST_SUB_BITS - 1;
+
+    return (((unsigned long)(1 << HIST_SUB_BITS) + idx % (1 << HIST_SUB_BITS)) << (e - HIST_SUB_BITS)) - 1;
+}
+
+void mod_cband_hist_add(mod_cband_hist *hist, unsigned long value)
+{
+    __sync_fetch_and_add(&hist->bucket[mod_cband_hist_index(value)], 1);
+    __sync_fetch_and_add(&hist->count, 1);
+    __sync_fetch_and_add(&hist->sum, value);
+}
+
+/*
+ * count, sum and the 50th, 90th and 99th percentile of a copy of the histogram
+ */
+void mod_cband_hist_summarize(mod_cband_hist *hist, mod_cband_hist_summary *summary)
+{
+    static const float p[3] = { 0.5, 0.9, 0.99 };
+    unsigned long *v[3];
+    unsigned long long total = 0, sum = 0;
+    int i, k;
+
+    memset(summary, 0, sizeof(mod_cband_hist_summary));
+    summary->count = hist->count;
+    summary->sum   = hist->sum;
+    v[0] = &summary->p50;
+    v[1] = &summary->p90;
+    v[2] = &summary->p99;
+
+    /* the buckets and the count are updated separately, the buckets are authoritative */
+    for (i = 0; i < HIST_BUCKETS; i++)
+	total += hist->bucket[i];
+
+    if (total == 0)
+	return;
+
+    for (i = 0, k = 0; (i < HIST_BUCKETS) && (k < 3); i++) {
+	sum += hist->bucket[i];
+	
+	while ((k < 3) && (sum >= (unsigned long long)(p[k] * total + 0.999)))
+	    *v[k++] = mod_cband_hist_upper(i);
+    }
+}
+
+/*
+ * adds the value to the histogram of the virtualhost and of its user
+ */
+void mod_cband_log_hist(mod_cband_virtualhost_config_entry *entry, mod_cband_user_config_entry *entry_user, int type, unsigned long value)
+{
+    if (entry != NULL)
+	mod_cband_hist_add(&entry->shmem_data->hist[type], value);
+
+    if (entry_user != NULL)
+	mod_cband_hist_add(&entry_user->shmem_data->hist[type], value);
+}
+
+/*
+ * adds bytes and connections to the current bucket of the sliding window,
+ * the bucket is cleared first if it holds data from an older time slot
+ */
+void mod_cband_rate_add(mod_cband_rate *rate, unsigned long time_now, unsigned long bytes, unsigned long conn)
+{
+    unsigned long slot;
+    int idx;
+
+    slot = time_now / RATE_BUCKET_LEN;
+    idx  = slot % RATE_BUCKETS;
+
+    if (rate->slot[idx] != slot) {
+	rate->slot[idx] = slot;
+	rate->TX[idx]   = 0;
+	rate->conn[idx] = 0;
+    }
+
+    rate->TX[idx]   += bytes;
+    rate->conn[idx] += conn;
+}
+
+/*
+ * sums buckets from the last RATE_BUCKETS time slots. The window is made of 
+ * RATE_BUCKETS - 1 full buckets and the elapsed part of the current one, so
+ * the rate moves smoothly instead of jumping at PERIOD_LEN boundaries
+ */
+void mod_cband_rate_get(mod_cband_rate *rate, unsigned long time_now, float *bps, float *rps)
+{
+    unsigned long slot;
+    unsigned long TX = 0, conn = 0;
+    float window;
+    int i;
+
+    slot = time_now / RATE_BUCKET_LEN;
+
+    for (i = 0; i < RATE_BUCKETS; i++) {
+	if ((rate->slot[i] <= slot) && (rate->slot[i] + RATE_BUCKETS > slot)) {
+	    TX   += rate->TX[i];
+	    conn += rate->conn[i];
+	}
+    }
+
+    window = (float)((RATE_BUCKETS - 1) * RATE_BUCKET_LEN + (time_now % RATE_BUCKET_LEN)) / 1e6;
+
+    if (bps != NULL)
+	*bps = ((float)TX * 8) / window;
+
+    if (rps != NULL)
+	*rps = (float)conn / window;
+}
+
+/*
+ * speed aproximation function
+ */
+int mod_cband_get_speed_lock(mod_cband_shmem_data *shmem_data, float *bps, float *rps)
+{
+    unsigned long time_now;
+
+    if (shmem_data == NULL)
+	return -1;
+
+    time_now = mod_cband_time_now();
+
+    /* BEGIN CRITICAL SECTION */
+    mod_cband_sem_down(config->sem_id);
+    mod_cband_rate_get(&shmem_data->rate, time_now, bps, rps);
+    mod_cband_sem_up(config->sem_id);
+    /* END CRITICAL SECTION */
+
+    return 0;
+}
+
+/* 
+ * semafor opuszczany przez funkcje check_connections_speed
+ */
+int mod_cband_get_real_speed(mod_cband_shmem_data *shmem_data, float *bps, float *rps)
+{
+    if (shmem_data == NULL)
+	return -1;
+
+    mod_cband_rate_get(&shmem_data->rate, mod_cband_time_now(), bps, rps);
+
+    return 0;
+}
+
+/*
+ * semafor opuszczany przez mod_cband_log_bucket, mod_cband_update_speed_lock, mod_cband_check_connections_speed
+ */
+int mod_cband_update_speed(mod_cband_shmem_data *shmem_data, unsigned long bytes_served, int new_connection, int remote_idx)
+{
+    unsigned long time_now;
+    
+    if (shmem_data == NULL)
+	return -1;
+    
+    time_now = mod_cband_time_now();
+    
+    if ((bytes_served > 0) || (new_connection > 0))
+	mod_cband_rate_add(&shmem_data->rate, time_now, bytes_served, new_connection);
+    
+    if (new_connection) {
+    	shmem_data->total_last_time = time_now;
+	shmem_data->total_requests += new_connection;
+        mod_cband_set_remote_request_time(remote_idx, time_now);
+	mod_cband_change_remote_total_connections_lock(remote_idx, 1);
+    }
+
+    /* remote hosts still count their requests per PERIOD_LEN */
+    if (time_now - shmem_data->total_last_refresh > PERIOD_LEN * 1000000UL) {
+	shmem_data->total_last_refresh = time_now;
+	mod_cband_set_remote_total_connections(remote_idx, 0);
+        mod_cband_set_remote_last_refresh(remote_idx, time_now);
+    }
+        
+    return 0;
+}
+
+int mod_cband_update_speed_lock(mod_cband_shmem_data *shmem_data, unsigned long bytes_served, int new_connection, int remote_idx)
+{
+    /* BEGIN CRITICAL SECTION */
+    mod_cband_sem_down(config->sem_id);
+    mod_cband_shmem_write_begin(shmem_data);
+    mod_cband_update_speed(shmem_data, bytes_served, new_connection, remote_idx);
+    mod_cband_shmem_write_end(shmem_data);
+    mod_cband_sem_up(config->sem_id);
+    /* END CRITICAL SECTION */
+
+    return 0;
+}
+
+int mod_cband_set_overlimit_speed(mod_cband_shmem_data *shmem_data)
+{
+    if (shmem_data == NULL)
+	return -1;
+
+    shmem_data->curr_speed.kbps     = shmem_data->over_speed.kbps;
+    shmem_data->curr_speed.rps      = shmem_data->over_speed.rps;
+    shmem_data->curr_speed.max_conn = shmem_data->over_speed.max_conn;
+    shmem_data->shared_kbps         = shmem_data->over_speed.kbps;
+
+    if (!shmem_data->overlimit)
+	CBAND_PROBE2(overlimit, shmem_data, 1);
+    shmem_data->overlimit           = 1;
+
+    return 0;
+}
+
+int mod_cband_set_overlimit_speed_lock(mod_cband_shmem_data *shmem_data)
+{
+    if (shmem_data == NULL)
+	return -1;
+
+    /* BEGIN CRITICAL SECTION */
+    mod_cband_sem_down(config->sem_id);
+    mod_cband_shmem_write_begin(shmem_data);
+    mod_cband_set_overlimit_speed(shmem_data);
+    mod_cband_shmem_write_end(shmem_data);
+    mod_cband_sem_up(config->sem_id);
+    /* END CRITICAL SECTION */
+
+    return 0;
+}
+
+int mod_cband_set_normal_speed(mod_cband_shmem_data *shmem_data)
+{
+    if (shmem_data == NULL)
+	return -1;
+
+    shmem_data->curr_speed.kbps     = shmem_data->max_speed.kbps;
+    shmem_data->curr_speed.rps      = shmem_data->max_speed.rps;
+    shmem_data->curr_speed.max_conn = shmem_data->max_speed.max_conn;
+    shmem_data->shared_kbps         = shmem_data->max_speed.kbps;
+
+    if (shmem_data->overlimit)
+	CBAND_PROBE2(overlimit, shmem_data, 0);
+    shmem_data->overlimit           = 0;
+
+    return 0;
+}
+
+int mod_cband_set_normal_speed_lock(mod_cband_shmem_data *shmem_data)
+{
+    if (shmem_data == NULL)
+	return -1;
+
+    /* BEGIN CRITICAL SECTION */
+    mod_cband_sem_down(config->sem_id);
+    mod_cband_shmem_write_begin(shmem_data);
+    mod_cband_set_normal_speed(shmem_data);
+    mod_cband_shmem_write_end(shmem_data);
+    mod_cband_sem_up(config->sem_id);
+    /* END CRITICAL SECTION */
+
+    return 0;
+}
+
+void mod_cband_check_virtualhost_refresh(mod_cband_virtualhost_config_entry *entry_virtual, unsigned long sec)
+{
+    mod_cband_scoreboard_entry *scoreboard;
+
+    if (entry_virtual == NULL || entry_virtual->refresh_time == 0)
+	return;
+
+    scoreboard = &(entry_virtual->shmem_data->total_usage);
+
+    if (mod_cband_get_start_time(scoreboard) < 0)
+    	mod_cband_set_start_time(scoreboard, sec);
+    
+    if ((mod_cband_get_start_time(scoreboard) + entry_virtual->refresh_time) < sec) {
+    	mod_cband_clear_score_lock(entry_virtual->shmem_data, sec);
+	mod_cband_set_normal_speed_lock(entry_virtual->shmem_data);
+    }
+}
+
+void mod_cband_check_user_refresh(mod_cband_user_config_entry *entry_user, unsigned long sec)
+{
+    mod_cband_scoreboard_entry *scoreboard;
+
+    if (entry_user == NULL || entry_user->refresh_time == 0)
+	return;
+
+    scoreboard = &(entry_user->shmem_data->total_usage);
+
+    if (mod_cband_get_start_time(scoreboard) < 0)
+    	mod_cband_set_start_time(scoreboard, sec);
+    
+    if ((mod_cband_get_start_time(scoreboard) + entry_user->refresh_time) < sec) {
+    	mod_cband_clear_score_lock(entry_user->shmem_data, sec);
+	mod_cband_set_normal_speed_lock(entry_user->shmem_data);
+    }
+}
+
+/*
+ * consistent copy of the shared data for the status pages. When the period has
+ * passed, the copy looks as if mod_cband_check_*_refresh had cleared it, but the
+ * shared memory is left for the next request to clear
+ */
+void mod_cband_status_snapshot(mod_cband_shmem_data *shmem_data, unsigned long refresh_time, unsigned long sec, mod_cband_shmem_data *copy)
+{
+    mod_cband_shmem_read(shmem_data, copy);
+
+    if ((refresh_time > 0) && ((copy->total_usage.start_time + refresh_time) < sec)) {
+	memset(&(copy->total_usage), 0, sizeof(mod_cband_scoreboard_entry));
+	copy->total_usage.start_time = sec;
+	copy->upload_bytes = 0;
+	mod_cband_set_normal_speed(copy);
+    }
+}
+
+int mod_cband_reset(mod_cband_shmem_data *shmem_data)
+{
+    if (shmem_data == NULL)
+	return -1;
+
+    mod_cband_clear_score_lock(shmem_data, (unsigned long)(mod_cband_time_now() / 1e6));
+    mod_cband_set_normal_speed_lock(shmem_data);
+
+    return 0;
+}
+
+int mod_cband_reset_virtualhost(char *name)
+{
+    mod_cband_virtualhost_config_entry *entry;
+    char virtualhost[MAX_VIRTUALHOST_NAME];
+    unsigned port, line;
+
+    if (name == NULL)
+	return -1;
+
+    if (!strcasecmp(name, "all")) {
+        entry = config->next_virtualhost;
+    
+	while(entry != NULL) {
+	    mod_cband_reset(entry->shmem_data);
+
+	    if (entry->next == NULL)
+		break;
+	    
+	    entry = entry->next;
+        }
+    } else {
+	sscanf(name, "%[^:]:%u:%u", virtualhost, &port, &line);
+	
+	if ((entry = mod_cband_get_virtualhost_entry_(virtualhost, (unsigned short)port, line, 0)) != NULL)
+	    mod_cband_reset(entry->shmem_data);
+    }
+    
+    return 0;
+}
+
+int mod_cband_reset_user(char *name)
+{
+    mod_cband_user_config_entry *entry;
+
+    if (name == NULL)
+	return -1;
+
+    if (!strcasecmp(name, "all")) {
+        entry = config->next_user;
+    
+	while(entry != NULL) {
+	    mod_cband_reset(entry->shmem_data);
+    
+	    if (entry->next == NULL)
+		break;
+	    
+	    entry = entry->next;
+        }
+    } else {
+	if ((entry = mod_cband_get_user_entry_(name, 0)) != NULL)
+	    mod_cband_reset(entry->shmem_data);
+    }
+    
+    return 0;
+}
+
+unsigned long mod_cband_get_slice_limit(unsigned long start_time, unsigned long refresh_time, 
+	unsigned long slice_len, unsigned long limit)
+{
+    unsigned long slice_limit, slice;
+    unsigned int slice_no;
+
+    if (slice_len > 0 && refresh_time > 0) {
+        slice_limit = (unsigned long)(((float)slice_len / refresh_time) * limit);
+	slice_no    = (((unsigned long)(mod_cband_time_now() / 1e6) - start_time) / slice_len) + 1;
+	slice       = slice_no * slice_limit;
+	
+	if (slice > limit)
+	    slice = limit;
+	
+	return slice;
+    }
+    
+    return limit;
+}
+
+int mod_cband_get_virtualhost_limits(mod_cband_virtualhost_config_entry *entry, mod_cband_limits_usages *lu, int dst)
+{
+    if (entry == NULL || lu == NULL)
+	return -1;
+
+    lu->limit       = entry->virtual_limit;
+    lu->limit_mult  = entry->virtual_limit_mult;
+    lu->slice_limit = mod_cband_get_slice_limit(entry->shmem_data->total_usage.start_time, 
+                      entry->refresh_time, entry->slice_len, entry->virtual_limit);
+    lu->limit_exceeded = entry->virtual_limit_exceeded;
+    lu->scoreboard  = entry->virtual_scoreboard;
+    
+    if (dst >= 0) {
+	lu->class_limit        = entry->virtual_class_limit[dst];
+	lu->class_limit_mult   = entry->virtual_class_limit_mult[dst];
+	lu->class_slice_limit  = mod_cband_get_slice_limit(entry->shmem_data->total_usage.start_time, 
+                                 entry->refresh_time, entry->slice_len, entry->virtual_class_limit[dst]);
+    }
+
+    return 0;
+}
+
+/*
+ * semafor opuszczany przez funkcje mod_cband_request_handler
+ */
+int mod_cband_get_virtualhost_usages(mod_cband_virtualhost_config_entry *entry, mod_cband_limits_usages *lu, int dst)
+{
+    if (entry == NULL || lu == NULL)
+	return -1;
+
+    mod_cband_get_score(entry->virtual_scoreboard, &lu->usage, -1, entry->shmem_data);
+    
+    if (dst >= 0) 
+	mod_cband_get_score(lu->scoreboard, &lu->class_usage, dst, entry->shmem_data);
+
+    return 0;
+}
+
+int mod_cband_get_user_limits(mod_cband_user_config_entry *entry_user, mod_cband_limits_usages *lu, int dst)
+{
+    if (entry_user == NULL || lu == NULL)
+	return -1;
+
+    lu->limit          = entry_user->user_limit;
+    lu->limit_mult     = entry_user->user_limit_mult;
+    lu->limit_exceeded = entry_user->user_limit_exceeded;
+    lu->slice_limit    = mod_cband_get_slice_limit(entry_user->shmem_data->total_usage.start_time, 
+                         entry_user->refresh_time, entry_user->slice_len, entry_user->user_limit);
+    lu->scoreboard     = entry_user->user_scoreboard;
+    
+    if (dst >= 0) {
+        lu->class_limit       = entry_user->user_class_limit[dst];
+        lu->class_limit_mult  = entry_user->user_class_limit_mult[dst];
+        lu->class_slice_limit = mod_cband_get_slice_limit(entry_user->shmem_data->total_usage.start_time, 
+	                        entry_user->refresh_time, entry_user->slice_len, entry_user->user_class_limit[dst]);
+    }
+    
+    return 0;
+}
+
+/*
+ * semafor opuszczany przez funkcje mod_cband_request_handler
+ */
+int mod_cband_get_user_usages(mod_cband_user_config_entry *entry_user, mod_cband_limits_usages *lu, int dst)
+{
+    if (entry_user == NULL || lu == NULL)
+	return -1;
+
+    mod_cband_get_score(lu->scoreboard, &lu->usage, -1, entry_user->shmem_data);
+
+    if (dst >= 0)
+	mod_cband_get_score(lu->scoreboard, &lu->class_usage, dst, entry_user->shmem_data);
+	
+    return 0;
+}
+
+/*
+ * share of a shared speed of one more connection with the priority: what 
+ * the higher priorities leave of it, split evenly within the priority. 
+ * MIN_SPEED when nothing is left, 0 when the speed isn't limited
+ */
+static unsigned long mod_cband_shared_share(mod_cband_shmem_data *shmem_data, int priority)
+{
+    unsigned long bps = shmem_data->shared_kbps * 1024;
+    int i;
+
+    if (shmem_data->shared_kbps == 0)
+	return 0;
+
+    for (i = priority + 1; i < MAX_PRIORITY; i++)
+	bps = (shmem_data->prio_bps[i] < bps) ? bps - shmem_data->prio_bps[i] : 0;
+
+    if (bps == 0)
+	return MIN_SPEED;
+
+    if (shmem_data->prio_connections[priority] > 0)
+	bps /= (shmem_data->prio_connections[priority] + 1);
+
+    return bps;
+}
+
+/*
+ * share of the shared speed of one more connection in bits per second,
+ * -1 when neither the virtualhost nor its user has a speed limit
+ */
+long mod_cband_get_shared_speed_lock(mod_cband_virtualhost_config_entry *entry, mod_cband_user_config_entry *entry_user, int priority)
+{
+    unsigned long next_user_bps = 0, next_virtualhost_bps = 0;
+
+    if (entry == NULL)
+        return -1;
+
+    if ((entry->shmem_data->curr_speed.kbps <= 0) && 
+	((entry_user == NULL) || (entry_user->shmem_data->curr_speed.kbps <= 0)))
+	return -1;
+
+    /* BEGIN CRITICAL SECTION */
+    mod_cband_sem_down(config->sem_id);
+
+    next_user_bps = 0;
+    next_virtualhost_bps = mod_cband_shared_share(entry->shmem_data, priority);
+
+    if (entry_user != NULL)
+	next_user_bps = mod_cband_shared_share(entry_user->shmem_data, priority);
+
+    mod_cband_sem_up(config->sem_id);
+    /* END CRITICAL SECTION */
+
+    if ((next_user_bps > 0) && (next_virtualhost_bps > next_user_bps))
+	return next_user_bps;
+    else
+    if (next_virtualhost_bps > 0)
+	return next_virtualhost_bps;
+    else
+	return next_user_bps;
+}
+
+/*
+ * moves the rolling quota to the time sec, the buckets which fell out of the
+ * window are subtracted from the sum. Only the buckets passed since the last 
+ * call are touched, at most ROLL_BUCKETS of them
+ */
+static void mod_cband_roll_advance(mod_cband_roll *roll, unsigned long window, unsigned long sec)
+{
+    unsigned long len, slot, i;
+
+    if ((len = window / ROLL_BUCKETS) == 0)
+	len = 1;
+
+    slot = sec / len;
+
+    if (slot <= roll->slot)
+	return;
+
+    if (slot - roll->slot >= ROLL_BUCKETS) {
+	memset(roll, 0, sizeof(mod_cband_roll));
+	roll->slot = slot;
+	return;
+    }
+
+    for (i = roll->slot + 1; i <= slot; i++) {
+	roll->sum -= roll->bytes[i % ROLL_BUCKETS];
+	roll->bytes[i % ROLL_BUCKETS] = 0;
+    }
+
+    roll->slot = slot;
+}
+
+static void mod_cband_roll_add(mod_cband_roll *roll, unsigned long window, unsigned long long bytes)
+{
+    if (window == 0)
+	return;
+
+    mod_cband_roll_advance(roll, window, (unsigned long)(mod_cband_time_now() / 1000000));
+    roll->bytes[roll->slot % ROLL_BUCKETS] += bytes;
+    roll->sum += bytes;
+}
+
+/*
+ * bytes within the last window seconds (CBandRollingLimit). Sets roll_overlimit
+ * to whether they reached limit, *was_overlimit gets its previous value
+ */
+unsigned long long mod_cband_get_roll_usage_lock(mod_cband_shmem_data *shmem_data, unsigned long window, unsigned long limit, 
+	unsigned int mult, int *was_overlimit)
+{
+    unsigned long long sum;
+
+    if (was_overlimit != NULL)
+	*was_overlimit = 0;
+
+    if ((shmem_data == NULL) || (window == 0))
+	return 0;
+
+    /* BEGIN CRITICAL SECTION */
+    mod_cband_sem_down(config->sem_id);
+    mod_cband_shmem_write_begin(shmem_data);
+    mod_cband_roll_advance(&shmem_data->roll, window, (unsigned long)(mod_cband_time_now() / 1000000));
+    sum = shmem_data->roll.sum;
+    if (was_overlimit != NULL)
+	*was_overlimit = shmem_data->roll_overlimit;
+    shmem_data->roll_overlimit = mod_cband_limit_reached(limit, limit, mult, sum);
+    mod_cband_shmem_write_end(shmem_data);
+    mod_cband_sem_up(config->sem_id);
+    /* END CRITICAL SECTION */
+
+    return sum;
+}
+
+/*
+ * accounts bytes sent to a client of destination class dst
+ */
+int mod_cband_log_bytes(mod_cband_virtualhost_config_entry *entry, mod_cband_user_config_entry *entry_user, 
+		    unsigned long bucket_bytes, int dst, int remote_idx)
+{
+    unsigned long long bytes;
+    
+    bytes = (unsigned long long)bucket_bytes;
+
+    if (entry == NULL)
+        return 0;
+
+    /* BEGIN CRITICAL SECTION */
+    mod_cband_sem_down(config->sem_id);
+    mod_cband_shmem_write_begin(entry->shmem_data);
+    mod_cband_update_speed(entry->shmem_data, bucket_bytes, 0, remote_idx);            
+    mod_cband_update_score(entry->virtual_scoreboard, &bytes, dst, &(entry->shmem_data->total_usage));
+    mod_cband_roll_add(&entry->shmem_data->roll, entry->roll_window, bytes);
+    mod_cband_shmem_write_end(entry->shmem_data);
+    	
+    if (entry_user != NULL) {
+	mod_cband_shmem_write_begin(entry_user->shmem_data);
+        mod_cband_update_speed(entry_user->shmem_data, bucket_bytes, 0, remote_idx);            
+	mod_cband_update_score(entry_user->user_scoreboard, &bytes, dst, &(entry_user->shmem_data->total_usage));
+	mod_cband_roll_add(&entry_user->shmem_data->roll, entry_user->roll_window, bytes);
+	mod_cband_shmem_write_end(entry_user->shmem_data);
+    }
+    
+    mod_cband_sem_up(config->sem_id);
+    /* END CRITICAL SECTION */
+    
+    return 0;
+}
+
+void mod_cband_change_total_connections_lock(mod_cband_virtualhost_config_entry *entry, mod_cband_user_config_entry *entry_user, int diff)
+{
+    /* BEGIN CRITICAL SECTION */
+    mod_cband_sem_down(config->sem_id);
+
+    if ((entry != NULL) && (entry->shmem_data != NULL)) {
+	mod_cband_shmem_write_begin(entry->shmem_data);
+        mod_cband_safe_change(&entry->shmem_data->total_conn, diff);
+	mod_cband_shmem_write_end(entry->shmem_data);
+    }
+
+    if ((entry_user != NULL) && (entry_user->shmem_data != NULL)) {
+	mod_cband_shmem_write_begin(entry_user->shmem_data);
+        mod_cband_safe_change(&entry_user->shmem_data->total_conn, diff);
+	mod_cband_shmem_write_end(entry_user->shmem_data);
+    }
+    
+    mod_cband_sem_up(config->sem_id);
+    /* END CRITICAL SECTION */
+}
+
+/*
+ * a connection (diff 1) taking bps of the shared speed with the priority, 
+ * or giving it back (diff -1)
+ */
+static void mod_cband_change_shared_connections(mod_cband_shmem_data *shmem_data, int priority, int diff, unsigned long bps)
+{
+    mod_cband_shmem_write_begin(shmem_data);
+    mod_cband_safe_change(&shmem_data->shared_connections, diff);
+    mod_cband_safe_change(&shmem_data->prio_connections[priority], diff);
+
+    if (diff > 0)
+	shmem_data->prio_bps[priority] += bps;
+    else
+	shmem_data->prio_bps[priority] = (shmem_data->prio_bps[priority] > bps) ? shmem_data->prio_bps[priority] - bps : 0;
+
+    mod_cband_shmem_write_end(shmem_data);
+}
+
+void mod_cband_change_shared_connections_lock(mod_cband_virtualhost_config_entry *entry, mod_cband_user_config_entry *entry_user, int priority, int diff, unsigned long bps)
+{
+    /* BEGIN CRITICAL SECTION */
+    mod_cband_sem_down(config->sem_id);
+
+    if (entry != NULL)
+	mod_cband_change_shared_connections(entry->shmem_data, priority, diff, bps);
+
+    if (entry_user != NULL)
+	mod_cband_change_shared_connections(entry_user->shmem_data, priority, diff, bps);
+
+    mod_cband_sem_up(config->sem_id);
+    /* END CRITICAL SECTION */
+}
+
+void mod_cband_change_shared_speed_lock(mod_cband_virtualhost_config_entry *entry, mod_cband_user_config_entry *entry_user, int diff)
+{
+    /* BEGIN CRITICAL SECTION */
+    mod_cband_sem_down(config->sem_id);
+
+    if (entry != NULL) {
+	mod_cband_shmem_write_begin(entry->shmem_data);
+        mod_cband_safe_change(&entry->shmem_data->shared_kbps, diff);
+	if (entry->shmem_data->overlimit && (entry->shmem_data->shared_kbps > entry->shmem_data->over_speed.kbps))
+	    mod_cband_set_overlimit_speed(entry->shmem_data);
+	else
+	if (!entry->shmem_data->overlimit && (entry->shmem_data->shared_kbps > entry->shmem_data->max_speed.kbps))
+	    mod_cband_set_normal_speed(entry->shmem_data);
+	mod_cband_shmem_write_end(entry->shmem_data);
+    }
+
+    if (entry_user != NULL) {
+	mod_cband_shmem_write_begin(entry_user->shmem_data);
+        mod_cband_safe_change(&entry_user->shmem_data->shared_kbps, diff);
+	if (entry_user->shmem_data->overlimit && (entry_user->shmem_data->shared_kbps > entry_user->shmem_data->over_speed.kbps))
+	    mod_cband_set_overlimit_speed(entry_user->shmem_data);
+	else
+	if (!entry_user->shmem_data->overlimit && (entry_user->shmem_data->shared_kbps > entry_user->shmem_data->max_speed.kbps))
+	    mod_cband_set_normal_speed(entry_user->shmem_data);
+	mod_cband_shmem_write_end(entry_user->shmem_data);
+    }
+
+    mod_cband_sem_up(config->sem_id);
+    /* END CRITICAL SECTION */
+}
+
+/*
+ * 1 when the usage is over the limit or over the current slice of the limit
+ */
+int mod_cband_limit_reached(unsigned long limit, unsigned long slice_limit, unsigned int mult, unsigned long long usage)
+{
+    if ((limit > 0) && ((((unsigned long long)limit * (unsigned long long)mult) < usage) || 
+			(((unsigned long long)slice_limit * (unsigned long long)mult) < usage)))
+	return 1;
+
+    return 0;
+}
+
+/*
+ * admission of a new request. Rejects it (ADMIT_CONNECTIONS) when the virtualhost, 
+ * the user or the remote host has reached its max_conn, waits while their rps is 
+ * over the limit (ADMIT_RPS after MAX_DELAY_LOOPS)
+ */
+static int mod_cband_admit_wait(mod_cband_virtualhost_config_entry *entry, mod_cband_user_config_entry *entry_user, int remote_idx, int dst,
+	unsigned long *wait, int *retries)
+{
+    float virtualhost_rps, virtualhost_curr_rps;
+    float user_rps, user_curr_rps;
+    float remote_rps;
+    unsigned long max_remote_kbps, remote_curr_rps, remote_max_conn, remote_total_conn;
+    unsigned long sleep_time;
+    //unsigned long time_now;
+    int loops;
+    int overlimit;
+
+    mod_cband_get_dst_speed_lock(entry, entry_user, &max_remote_kbps, &remote_curr_rps, &remote_max_conn, dst);
+    mod_cband_set_remote_max_connections(remote_idx, remote_max_conn);
+
+    virtualhost_curr_rps   = 0;
+    user_curr_rps          = 0;
+    virtualhost_rps        = 0;
+    user_rps               = 0;
+    remote_rps             = 0;
+    //time_now               = mod_cband_time_now();
+
+    loops = 0;
+    do {
+        /* BEGIN CRITICAL SECTION */
+	mod_cband_sem_down(config->sem_id);
+    
+        if (entry != NULL) {
+	
+	    mod_cband_shmem_write_begin(entry->shmem_data);
+	    mod_cband_update_speed(entry->shmem_data, 0, 0, remote_idx);            
+	    mod_cband_shmem_write_end(entry->shmem_data);
+	    if ((entry->shmem_data->curr_speed.max_conn > 0) && 
+		(entry->shmem_data->total_conn >= entry->shmem_data->curr_speed.max_conn)) {
+		    
+		    mod_cband_sem_up(config->sem_id);
+		    /* END CRITICAL SECTION */
+
+		    return ADMIT_CONNECTIONS;
+		}
+	    
+            mod_cband_get_real_speed(entry->shmem_data, NULL, &virtualhost_rps);
+	    virtualhost_curr_rps = entry->shmem_data->curr_speed.rps;
+	}
+		
+        if (entry_user != NULL) {
+
+	    mod_cband_shmem_write_begin(entry_user->shmem_data);
+	    mod_cband_update_speed(entry_user->shmem_data, 0, 0, remote_idx);            
+	    mod_cband_shmem_write_end(entry_user->shmem_data);
+	    if ((entry_user->shmem_data->curr_speed.max_conn > 0) && 
+		(entry_user->shmem_data->total_conn >= entry_user->shmem_data->curr_speed.max_conn)) {
+		
+		mod_cband_sem_up(config->sem_id);
+		/* END CRITICAL SECTION */
+
+		return ADMIT_CONNECTIONS;
+	    }
+
+	    mod_cband_get_real_speed(entry_user->shmem_data, NULL, &user_rps);
+    	    user_curr_rps = entry_user->shmem_data->curr_speed.rps;
+	}
+
+	if (remote_idx >= 0) {
+	    if (remote_max_conn > 0) {
+		remote_total_conn = mod_cband_get_remote_total_connections(remote_idx);
+	    
+		if ((remote_total_conn > 0) && (remote_max_conn <= remote_total_conn)) {
+		
+		    mod_cband_sem_up(config->sem_id);
+		    /* END CRITICAL SECTION */
+
+		    return ADMIT_CONNECTIONS;
+		}
+	    } 
+			
+	    /* semafor na remote_hosts */
+	    remote_rps = mod_cband_get_remote_connections_speed_lock(remote_idx);
+	}
+
+	overlimit = 0;
+	if ((entry != NULL) && (virtualhost_curr_rps > 0) && (virtualhost_rps > virtualhost_curr_rps))
+	    overlimit = 1;
+
+	if ((entry_user != NULL) && (user_curr_rps > 0) && (user_rps > user_curr_rps))
+	    overlimit = 1;
+
+	if ((remote_idx >= 0) && (remote_curr_rps > 0) && (remote_rps > remote_curr_rps))
+	    overlimit = 1;
+
+	mod_cband_sem_up(config->sem_id);
+	/* END CRITICAL SECTION */
+
+	if (overlimit) {
+	    sleep_time = MAX_SLEEP_TIME + (mod_cband_rand() % MAX_SLEEP_TIME);
+	    mod_cband_sleep(sleep_time);
+	    *wait += sleep_time;
+	    (*retries)++;
+	}
+
+	loops++;
+    } while (overlimit && loops <= MAX_DELAY_LOOPS);
+
+    if (loops > MAX_DELAY_LOOPS)
+	return ADMIT_RPS;
+	
+    return 0;
+}
+
+/*
+ * mod_cband_admit_wait which logs the wait and the retry loops to the histograms
+ */
+int mod_cband_admit(mod_cband_virtualhost_config_entry *entry, mod_cband_user_config_entry *entry_user, int remote_idx, int dst)
+{
+    unsigned long wait = 0;
+    int retries = 0;
+    int ret;
+
+    ret = mod_cband_admit_wait(entry, entry_user, remote_idx, dst, &wait, &retries);
+
+    mod_cband_log_hist(entry, entry_user, HIST_ADMIT, wait);
+    mod_cband_log_hist(entry, entry_user, HIST_LOOPS, retries);
+
+    return ret;
+}
+
+/*
+ * one more shared speed of the shaper, the remote client is already counted
+ * by the virtualhost
+ */
+static void mod_cband_shaper_add(mod_cband_shaper *s, int idx, mod_cband_virtualhost_config_entry *extra)
+{
+    /* a virtualhost without an entry is shaped with the global one */
+    if ((extra == NULL) || (extra == s->entry))
+	return;
+
+    s->extra[idx] = extra;
+
+    mod_cband_flush_score_lock(extra->virtual_scoreboard, extra->shmem_data);
+    mod_cband_update_speed_lock(extra->shmem_data, 0, 1, -1);
+
+    if (mod_cband_get_shared_speed_lock(extra, NULL, 0) >= 0)
+	s->not_limit = 0;
+
+    mod_cband_change_total_connections_lock(extra, NULL, 1);
+}
+
+/*
+ * starts shaping of one response: counts the new connection and decides 
+ * whether the response is limited at all
+ */
+void mod_cband_shaper_open(mod_cband_shaper *s, mod_cband_virtualhost_config_entry *entry, mod_cband_user_config_entry *entry_user, int remote_idx, int dst)
+{
+    unsigned long remote_rps;
+
+    memset(s, 0, sizeof(mod_cband_shaper));
+    s->entry      = entry;
+    s->entry_user = entry_user;
+    s->remote_idx = remote_idx;
+    s->dst        = dst;
+    s->global_remote_idx = -1;
+
+    if ((dst >= 0) && (dst < DST_CLASS))
+	s->priority = config->class_priority[dst];
+    
+    if (entry != NULL) {
+        mod_cband_flush_score_lock(entry->virtual_scoreboard, entry->shmem_data);
+        mod_cband_update_speed_lock(entry->shmem_data, 0, 1, remote_idx);            
+    }
+
+    if (entry_user != NULL) {
+    	mod_cband_flush_score_lock(entry_user->user_scoreboard, entry_user->shmem_data);
+    	mod_cband_update_speed_lock(entry_user->shmem_data, 0, 1, remote_idx);            
+    }
+
+    mod_cband_get_dst_speed_lock(entry, entry_user, &s->max_remote_kbps, &remote_rps, NULL, dst);
+
+    if ((mod_cband_get_shared_speed_lock(entry, entry_user, 0) < 0) && (s->max_remote_kbps == 0))
+	s->not_limit = 1;
+	
+    mod_cband_change_total_connections_lock(entry, entry_user, 1);
+    mod_cband_change_remote_connections_lock(remote_idx, 1);
+
+    mod_cband_shaper_add(s, SHAPER_GLOBAL, config->global);
+}
+
+/*
+ * adds the limits of a <Location> or <Directory> to the shaper opened by 
+ * mod_cband_shaper_open
+ */
+void mod_cband_shaper_set_dir(mod_cband_shaper *s, mod_cband_virtualhost_config_entry *entry_dir)
+{
+    mod_cband_shaper_add(s, SHAPER_DIR, entry_dir);
+}
+
+/*
+ * adds the remote host of CBandGlobalRemoteSpeed, the same client in all 
+ * virtualhosts, to the shaper opened by mod_cband_shaper_open
+ */
+void mod_cband_shaper_set_global_remote(mod_cband_shaper *s, int global_remote_idx)
+{
+    unsigned long remote_rps;
+
+    if ((config->global == NULL) || (global_remote_idx < 0) || (global_remote_idx == s->remote_idx))
+	return;
+
+    s->global_remote_idx = global_remote_idx;
+    mod_cband_get_dst_speed_lock(config->global, NULL, &s->max_global_kbps, &remote_rps, NULL, s->dst);
+
+    if (s->max_global_kbps > 0)
+	s->not_limit = 0;
+
+    mod_cband_set_remote_request_time(global_remote_idx, mod_cband_time_now());
+    mod_cband_change_remote_total_connections_lock(global_remote_idx, 1);
+    mod_cband_change_remote_connections_lock(global_remote_idx, 1);
+}
+
+/*
+ * the measured speed is kept only within one bucket of the response
+ */
+void mod_cband_shaper_bucket(mod_cband_shaper *s)
+{
+    s->measured_bps     = 0;	
+    s->measured_bps_old = 0;
+    s->t1 = mod_cband_time_now();
+}
+
+/*
+ * Fairness Bandwidth Sharing algorithm - returns the number of bytes which 
+ * may be sent now, s->sleep_time is the pause after them. The connection 
+ * takes its share of the shared speed until mod_cband_shaper_sent
+ */
+int mod_cband_shaper_chunk(mod_cband_shaper *s, int bytes)
+{
+    long shared_bps, extra_bps;
+    unsigned long remote_bps, global_bps, allowed_bps;
+    unsigned long remote_connections;
+    int bytes_split;
+    int i;
+
+    mod_cband_set_remote_request_time(s->remote_idx, mod_cband_time_now());
+    mod_cband_set_remote_request_time(s->global_remote_idx, mod_cband_time_now());
+    		
+    if (!s->not_limit) {
+	if (s->upload) {
+	    shared_bps = -1;
+	    remote_bps = mod_cband_get_upload_speed_lock(s->entry, s->entry_user) * 1024;
+	} else {
+	    shared_bps = mod_cband_get_shared_speed_lock(s->entry, s->entry_user, s->priority);
+	    remote_bps = s->max_remote_kbps * 1024;
+
+	    for (i = 0; i < SHAPER_EXTRA; i++)
+		if ((s->extra[i] != NULL) && ((extra_bps = mod_cband_get_shared_speed_lock(s->extra[i], NULL, s->priority)) >= 0) &&
+		    ((shared_bps < 0) || (extra_bps < shared_bps)))
+		    shared_bps = extra_bps;
+	}
+	remote_connections = mod_cband_get_remote_connections(s->remote_idx);
+		
+	if (remote_connections > 0)
+	    remote_bps /= remote_connections;
+
+	/* the share of the client in all virtualhosts, 0 is unlimited as remote_bps */
+	if ((s->global_remote_idx >= 0) && (s->max_global_kbps > 0)) {
+	    global_bps = s->max_global_kbps * 1024;
+	    if ((remote_connections = mod_cband_get_remote_connections(s->global_remote_idx)) > 0)
+		global_bps /= remote_connections;
+
+	    if ((remote_bps == 0) || (global_bps < remote_bps))
+		remote_bps = global_bps;
+	}
+
+	if (shared_bps < 0)
+	    shared_bps = 0;
+
+	if (config->random_pulse)
+	    s->sleep_time = ((MAX_PULSE_LEN / 2) + (mod_cband_rand() % (MAX_PULSE_LEN / 2))) * ((mod_cband_rand() % (MAX_PULSES)) + 1);
+	else
+	    s->sleep_time = MAX_PULSE_LEN * MAX_PULSES;
+
+	/* a client slower than the lower of both speeds, not than the higher one */
+	allowed_bps = remote_bps;
+	if ((shared_bps > 0) && ((allowed_bps == 0) || ((unsigned long)shared_bps < allowed_bps)))
+	    allowed_bps = shared_bps;
+
+	if ((s->measured_bps > 0) && (allowed_bps > s->measured_bps)) {
+	    s->slow_remote = MAX_SLOW_REMOTE_LOOPS;
+	    s->measured_bps_old = s->measured_bps;
+	}
+	
+	if (s->slow_remote > 0) {
+	    remote_bps = s->measured_bps_old;
+	    s->slow_remote--;
+	}
+		    
+	s->remote_kbps = (remote_bps / 1024);
+	s->next_bps    = remote_bps;	    
+
+	s->shared_case = 0;
+	if (!s->upload && (((shared_bps > 0) && ((unsigned long)shared_bps < remote_bps)) || (remote_bps <= 0))) {
+	    s->next_bps    = shared_bps;
+	    s->shared_case = 1;
+	    s->shared_bps  = ((unsigned long)shared_bps > MIN_SPEED) ? (unsigned long)shared_bps : MIN_SPEED;
+
+	    /* a client which can't take its share leaves the rest to the lower priorities */
+	    if ((s->link_bps > 0) && (s->link_bps < s->shared_bps))
+		s->shared_bps = s->link_bps;
+
+	    mod_cband_change_shared_connections_lock(s->entry, s->entry_user, s->priority, 1, s->shared_bps);
+	    for (i = 0; i < SHAPER_EXTRA; i++)
+		if (s->extra[i] != NULL)
+		    mod_cband_change_shared_connections_lock(s->extra[i], NULL, s->priority, 1, s->shared_bps);
+	} else
+	if (!s->upload) {
+	    mod_cband_change_shared_speed_lock(s->entry, s->entry_user, -s->remote_kbps);
+	    for (i = 0; i < SHAPER_EXTRA; i++)
+		if (s->extra[i] != NULL)
+		    mod_cband_change_shared_speed_lock(s->extra[i], NULL, -s->remote_kbps);
+	}
+
+	if (s->next_bps <= MIN_SPEED)
+	    s->next_bps = MIN_SPEED;
+
+	/* bits of one pulse */
+	s->next_bps = (unsigned long)((unsigned long long)s->next_bps * s->sleep_time / CONST_PULSE_LEN);
+	bytes_split = (int)(s->next_bps / 8);
+    } else {
+	s->next_bps    = 0;
+	s->remote_kbps = 0;
+	s->sleep_time  = 0;
+	bytes_split    = MAX_CHUNK_LEN;
+		    
+	if (bytes_split > bytes)
+	    bytes_split = bytes;
+    }
+
+    /* 
+     * jezeli mamy mniej do przeslania niz bytes_split bajtow w sekundzie
+     * to wysylamy wszystko, ale czekamy tylko t = ile_bajtow/speed zeby male dokumenty
+     * albo ich koncowki tez byly transportowane z zadana predkoscia
+     */
+    if (!s->not_limit && (bytes_split > bytes)) {
+	if (bytes_split > 0)
+	    s->sleep_time = (unsigned long)((unsigned long long)bytes * 1000000 / bytes_split);
+	else
+	    s->sleep_time = 0;
+		
+	bytes_split = bytes;
+    }
+
+    if (bytes_split > MAX_CHUNK_LEN) {
+	s->sleep_time = (unsigned long)((unsigned long long)s->sleep_time * MAX_CHUNK_LEN / bytes_split);
+	bytes_split = MAX_CHUNK_LEN;
+    }
+
+    CBAND_PROBE4(chunk, (s->entry != NULL) ? s->entry->virtual_name : NULL, bytes_split, s->sleep_time, s->shared_case);
+
+    s->chunk_bytes = bytes_split;
+
+    return bytes_split;
+}
+
+/*
+ * accounts the chunk which has been sent in send_time microseconds, sleeps 
+ * s->sleep_time and gives back the share of the shared speed
+ */
+void mod_cband_shaper_sent(mod_cband_shaper *s, int bytes_split, unsigned long send_time)
+{
+    unsigned long remote_bytes_in_second;
+    unsigned long t2;
+    int i;
+
+    if (s->upload)
+	mod_cband_log_upload_bytes(s->entry, s->entry_user, (unsigned long)bytes_split);
+    else
+	mod_cband_log_bytes(s->entry, s->entry_user, (unsigned long)bytes_split, s->dst, s->remote_idx);
+
+    for (i = 0; i < SHAPER_EXTRA; i++)
+	if (s->extra[i] != NULL)
+	    mod_cband_log_bytes(s->extra[i], NULL, (unsigned long)bytes_split, s->dst, (i == SHAPER_GLOBAL) ? s->global_remote_idx : -1);
+
+    s->remote_bytes_sum += bytes_split;		
+    t2 = mod_cband_time_now();
+
+    if (t2 > s->t1 + 1000000) {
+	remote_bytes_in_second = (unsigned long)((unsigned long long)s->remote_bytes_sum * 1000000 / (t2 - s->t1));
+	mod_cband_set_remote_current_speed(s->remote_idx, (remote_bytes_in_second * 8) / 1024);
+	s->t1 = mod_cband_time_now();
+	s->remote_bytes_sum = 0;
+    }
+
+    if (!s->not_limit) {
+	if (send_time > 0)
+	    s->measured_bps = (unsigned long)((unsigned long long)bytes_split * 8 * 1000000 / send_time);
+	else
+	    s->measured_bps = s->next_bps;
+
+	s->link_bps = (send_time > 0) ? s->measured_bps : 0;
+
+	/* a request body may come in smaller pieces than asked for */
+	if ((bytes_split < s->chunk_bytes) && (s->chunk_bytes > 0))
+	    s->sleep_time = (unsigned long)((unsigned long long)s->sleep_time * bytes_split / s->chunk_bytes);
+
+	mod_cband_sleep(s->sleep_time);
+	s->slept += s->sleep_time;
+
+	if (s->shared_case) {
+	    mod_cband_change_shared_connections_lock(s->entry, s->entry_user, s->priority, -1, s->shared_bps);
+	    for (i = 0; i < SHAPER_EXTRA; i++)
+		if (s->extra[i] != NULL)
+		    mod_cband_change_shared_connections_lock(s->extra[i], NULL, s->priority, -1, s->shared_bps);
+	} else
+	if (!s->upload) {
+	    mod_cband_change_shared_speed_lock(s->entry, s->entry_user, s->remote_kbps);
+	    for (i = 0; i < SHAPER_EXTRA; i++)
+		if (s->extra[i] != NULL)
+		    mod_cband_change_shared_speed_lock(s->extra[i], NULL, s->remote_kbps);
+	}
+    }
+}
+
+void mod_cband_shaper_close(mod_cband_shaper *s)
+{
+    int i;
+
+    mod_cband_change_total_connections_lock(s->entry, s->entry_user, -1);
+    mod_cband_change_remote_connections_lock(s->remote_idx, -1);
+    mod_cband_change_remote_connections_lock(s->global_remote_idx, -1);
+
+    for (i = 0; i < SHAPER_EXTRA; i++)
+	if (s->extra[i] != NULL)
+	    mod_cband_change_total_connections_lock(s->extra[i], NULL, -1);
+}
+
+/*
+ * logs the sleep of a whole response to the histograms of the entries of
+ * its shaper, once per response: a shaper is opened for every brigade
+ */
+void mod_cband_shaper_log_sleep(mod_cband_shaper *s, unsigned long slept)
+{
+    int i;
+
+    mod_cband_log_hist(s->entry, s->entry_user, HIST_SLEEP, slept);
+
+    for (i = 0; i < SHAPER_EXTRA; i++)
+	if (s->extra[i] != NULL)
+	    mod_cband_log_hist(s->extra[i], NULL, HIST_SLEEP, slept);
+}
+
+/*
+ * share of CBandUploadSpeed of one request body in kbps, the lower of the
+ * virtualhost and user shares. 0 when neither of them has an upload speed
+ */
+unsigned long mod_cband_get_upload_speed_lock(mod_cband_virtualhost_config_entry *entry, mod_cband_user_config_entry *entry_user)
+{
+    unsigned long kbps = 0, user_kbps = 0;
+
+    if (entry == NULL)
+	return 0;
+
+    /* BEGIN CRITICAL SECTION */
+    mod_cband_sem_down(config->sem_id);
+
+    if (entry->shmem_data->upload_kbps > 0) {
+	kbps = entry->shmem_data->upload_kbps;
+	if (entry->shmem_data->upload_connections > 1)
+	    kbps /= entry->shmem_data->upload_connections;
+    }
+
+    if ((entry_user != NULL) && (entry_user->shmem_data->upload_kbps > 0)) {
+	user_kbps = entry_user->shmem_data->upload_kbps;
+	if (entry_user->shmem_data->upload_connections > 1)
+	    user_kbps /= entry_user->shmem_data->upload_connections;
+    }
+
+    mod_cband_sem_up(config->sem_id);
+    /* END CRITICAL SECTION */
+
+    if ((user_kbps > 0) && ((kbps == 0) || (user_kbps < kbps)))
+	return user_kbps;
+
+    return kbps;
+}
+
+void mod_cband_change_upload_connections_lock(mod_cband_virtualhost_config_entry *entry, mod_cband_user_config_entry *entry_user, int diff)
+{
+    /* BEGIN CRITICAL SECTION */
+    mod_cband_sem_down(config->sem_id);
+
+    if (entry != NULL) {
+	mod_cband_shmem_write_begin(entry->shmem_data);
+        mod_cband_safe_change(&entry->shmem_data->upload_connections, diff);
+	mod_cband_shmem_write_end(entry->shmem_data);
+    }
+
+    if (entry_user != NULL) {
+	mod_cband_shmem_write_begin(entry_user->shmem_data);
+        mod_cband_safe_change(&entry_user->shmem_data->upload_connections, diff);
+	mod_cband_shmem_write_end(entry_user->shmem_data);
+    }
+
+    mod_cband_sem_up(config->sem_id);
+    /* END CRITICAL SECTION */
+}
+
+/*
+ * accounts bytes of a request body, they don't count to CBandLimit
+ */
+int mod_cband_log_upload_bytes(mod_cband_virtualhost_config_entry *entry, mod_cband_user_config_entry *entry_user, unsigned long bytes)
+{
+    if (entry == NULL)
+        return 0;
+
+    /* BEGIN CRITICAL SECTION */
+    mod_cband_sem_down(config->sem_id);
+    mod_cband_shmem_write_begin(entry->shmem_data);
+    entry->shmem_data->upload_bytes += bytes;
+    mod_cband_shmem_write_end(entry->shmem_data);
+
+    if (entry_user != NULL) {
+	mod_cband_shmem_write_begin(entry_user->shmem_data);
+	entry_user->shmem_data->upload_bytes += bytes;
+	mod_cband_shmem_write_end(entry_user->shmem_data);
+    }
+
+    mod_cband_sem_up(config->sem_id);
+    /* END CRITICAL SECTION */
+
+    return 0;
+}
+
+/*
+ * 1 when the virtualhost or its user is over CBandUploadLimit or over the
+ * current slice of it
+ */
+int mod_cband_upload_limit_reached(mod_cband_virtualhost_config_entry *entry, mod_cband_user_config_entry *entry_user)
+{
+    unsigned long slice_limit;
+
+    if (entry == NULL)
+	return 0;
+
+    if (entry->virtual_upload_limit > 0) {
+	slice_limit = mod_cband_get_slice_limit(entry->shmem_data->total_usage.start_time,
+		      entry->refresh_time, entry->slice_len, entry->virtual_upload_limit);
+	if (mod_cband_limit_reached(entry->virtual_upload_limit, slice_limit, entry->virtual_upload_limit_mult, entry->shmem_data->upload_bytes))
+	    return 1;
+    }
+
+    if ((entry_user != NULL) && (entry_user->user_upload_limit > 0)) {
+	slice_limit = mod_cband_get_slice_limit(entry_user->shmem_data->total_usage.start_time,
+		      entry_user->refresh_time, entry_user->slice_len, entry_user->user_upload_limit);
+	if (mod_cband_limit_reached(entry_user->user_upload_limit, slice_limit, entry_user->user_upload_limit_mult, entry_user->shmem_data->upload_bytes))
+	    return 1;
+    }
+
+    return 0;
+}
+
+/*
+ * starts shaping of one request body. The body is shaped by mod_cband_shaper_chunk
+ * and mod_cband_shaper_sent like a response of a single remote client with its
+ * share of CBandUploadSpeed, it doesn't take part in the CBandSpeed sharing
+ */
+void mod_cband_upload_open(mod_cband_shaper *s, mod_cband_virtualhost_config_entry *entry, mod_cband_user_config_entry *entry_user)
+{
+    memset(s, 0, sizeof(mod_cband_shaper));
+    s->entry      = entry;
+    s->entry_user = entry_user;
+    s->remote_idx = -1;
+    s->dst        = -1;
+    s->upload     = 1;
+    s->global_remote_idx = -1;
+
+    mod_cband_change_upload_connections_lock(entry, entry_user, 1);
+
+    if (mod_cband_get_upload_speed_lock(entry, entry_user) == 0)
+	s->not_limit = 1;
+
+    mod_cband_shaper_bucket(s);
+}
+
+void mod_cband_upload_close(mod_cband_shaper *s)
+{
+    mod_cband_change_upload_connections_lock(s->entry, s->entry_user, -1);
+}
@@ -0,0 +1,489 @@
+/*
+ * mod_cband - A per-user, per-virtualhost and per-destination bandwidth limiter for the Apache HTTP Server Version 2
+ *
+ * Copyright (c) 2005 Lukasz Dembinski <dembol@cband.linux.pl>
+ * All Rights Reserved
+ * 
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *	     
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *		     
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *					 
+ */
+
+/*
+ * libcband - accounting, rate estimation, limit checking, destination classes
+ * and scoreboards of mod_cband. It doesn't depend on Apache nor APR, the module
+ * is a thin adapter over it
+ */
+
+#ifndef _CBAND_CORE_H
+#define _CBAND_CORE_H
+
+#include <stddef.h>
+#include <sys/types.h>
+#include <sys/ipc.h>
+#include <sys/sem.h>
+#include <netinet/in.h>
+
+#include "libpatricia.h"
+#include "cband_probes.h"
+
+#define MAX_CLASS_STR_LEN		16
+#define MAX_VIRTUALHOST_NAME		0x100
+#define MAX_REMOTE_HOSTS		8192
+#define MAX_REMOTE_NAME			52		/* an IPv6 network with its prefix length */
+#define MAX_SHMEM_SEGMENTS		0x1000
+#define MAX_SHMEM_ENTRIES		0x1000
+#define MAX_REMOTE_HOST_LIFE		10
+#define MAX_REMOTE_PROBES		64		/* slots searched from the hash of a remote client */
+#define MAX_CHUNK_LEN			0x8000
+#define MAX_SNAPSHOT_LOOPS		100
+#define PERIOD_LEN			1
+#define RATE_BUCKETS			10
+#define RATE_BUCKET_LEN			100000		/* in microseconds, RATE_BUCKETS * RATE_BUCKET_LEN = PERIOD_LEN */
+#define MAX_SLOW_REMOTE_LOOPS		5
+#define MAX_DELAY_LOOPS			100
+#define MAX_PULSE_LEN			250000
+#define MAX_PULSES			4
+#define CONST_PULSE_LEN			1000000
+#define MAX_SLEEP_TIME			100000
+#define MIN_SPEED			1024
+#define MAX_PRIORITY			8		/* CBandClassPriority 0 ... MAX_PRIORITY - 1 */
+#define SCHEDULE_SPEED			0		/* mod_cband_schedule.speed: CBandSpeed */
+#define SCHEDULE_REMOTE			1		/* CBandRemoteSpeed */
+#define SCHEDULE_EXCEEDED		2		/* CBandExceededSpeed */
+#define SCHEDULE_SPEEDS			3
+#define MAX_SCHEDULE_SCAN		60		/* in minutes, the schedule is evaluated at least hourly */
+#define ROLL_BUCKETS			60		/* buckets of a rolling quota, each 1/60 of the window */
+#define MAX_LOCK_SITES			64
+#define HIST_SUB_BITS			2		/* 4 linear buckets in every power of two */
+#define HIST_BUCKETS			112		/* values up to 2^29 */
+#define HIST_SLEEP			0		/* injected sleep of a response, in microseconds */
+#define HIST_ADMIT			1		/* admission wait of a request, in microseconds */
+#define HIST_LOOPS			2		/* admission retry loops of a request */
+#define HIST_TYPES			3
+#define ADMIT_CONNECTIONS		-1		/* mod_cband_admit: max_conn reached */
+#define ADMIT_RPS			-2		/* mod_cband_admit: rps stayed over the limit */
+#define MAX_LOCK_SITE_NAME		64
+#define SHAPER_DIR			0		/* mod_cband_shaper.extra: <Location>, <Directory> */
+#define SHAPER_GLOBAL			1		/* mod_cband_shaper.extra: CBandGlobalSpeed */
+#define SHAPER_EXTRA			2
+
+#if (defined(__GNU_LIBRARY__) && !defined(_SEM_SEMUN_UNDEFINED)) || defined(__FreeBSD__)
+/* union semun is defined by including <sys/sem.h> */
+#else
+/* according to X/OPEN we have to define it ourselves */
+union semun {
+    int val;
+    struct semid_ds *buf;
+    unsigned short *array;
+    struct seminfo *__buf;
+};					            
+#endif
+
+typedef struct mod_cband_virtualhost_config_entry mod_cband_virtualhost_config_entry;
+typedef struct mod_cband_user_config_entry mod_cband_user_config_entry;
+typedef struct mod_cband_class_config_entry mod_cband_class_config_entry;
+typedef struct mod_cband_schedule mod_cband_schedule;
+
+typedef struct {
+    unsigned long long total_bytes; 			/* in bytes - total traffic */
+    unsigned long long class_bytes[DST_CLASS]; 		/* in bytes - class traffic */
+    unsigned long start_time;
+    long score_flush_count;
+    int was_request;
+} mod_cband_scoreboard_entry;
+
+typedef struct {
+    unsigned long kbps, rps, max_conn;
+} mod_cband_speed;
+
+/*
+ * sliding window of RATE_BUCKETS buckets, each RATE_BUCKET_LEN microseconds long.
+ * A bucket is valid only when its slot number matches the current time slot
+ */
+typedef struct {
+    unsigned long slot[RATE_BUCKETS];			/* time slot (time / RATE_BUCKET_LEN) of the bucket */
+    unsigned long TX[RATE_BUCKETS];			/* in bytes */
+    unsigned long conn[RATE_BUCKETS];
+} mod_cband_rate;
+
+/*
+ * log-linear histogram: values below 4 have a bucket each, every next power
+ * of two is split into 4 equal buckets. Updated with atomic operations
+ */
+typedef struct {
+    unsigned long long count;
+    unsigned long long sum;
+    unsigned int bucket[HIST_BUCKETS];
+} mod_cband_hist;
+
+/*
+ * rolling quota: bytes of the last ROLL_BUCKETS buckets and their running sum.
+ * The buckets which fall out of the window are subtracted from the sum
+ */
+typedef struct {
+    unsigned long long bytes[ROLL_BUCKETS];
+    unsigned long long sum;				/* in bytes */
+    unsigned long slot;					/* number (time / bucket length) of the newest bucket */
+} mod_cband_roll;
+
+typedef struct {
+    unsigned long long count, sum;
+    unsigned long p50, p90, p99;			/* upper bounds of the buckets */
+} mod_cband_hist_summary;
+
+typedef struct {
+    unsigned int seq;					/* odd while the entry is being modified */
+    mod_cband_speed max_speed;
+    mod_cband_speed over_speed;
+    mod_cband_speed curr_speed;
+    mod_cband_speed remote_speed;
+    unsigned long shared_kbps, shared_connections, total_conn;
+    unsigned long prio_connections[MAX_PRIORITY];	/* shared_connections by CBandClassPriority */
+    unsigned long prio_bps[MAX_PRIORITY];		/* bps taken by the shared connections of each priority */
+    unsigned long total_last_refresh;
+    unsigned long total_last_time;
+    mod_cband_scoreboard_entry total_usage;
+    mod_cband_rate rate;
+    unsigned long long total_requests;
+    int overlimit;
+    mod_cband_hist hist[HIST_TYPES];
+    unsigned long upload_kbps;				/* CBandUploadSpeed */
+    unsigned long upload_connections;			/* request bodies being read */
+    unsigned long long upload_bytes;			/* in bytes - request bodies in the current period */
+    unsigned long schedule_next;			/* in seconds, when the CBandSchedule is evaluated again */
+    int schedule_idx;					/* CBandSchedule in effect, 1 = the first one, 0 = none */
+    mod_cband_roll roll;				/* CBandRollingLimit */
+    int roll_overlimit;					/* CBandExceededSpeed set by CBandRollingLimit */
+} mod_cband_shmem_data;
+
+typedef struct {
+    int shmem_id;
+    int shmem_entry_idx;
+    void *shmem_data;
+} mod_cband_shmem_segment;
+
+struct mod_cband_virtualhost_config_entry {
+    char *virtual_name;
+    unsigned short virtual_port;
+    unsigned virtual_defn_line;
+    char *virtual_limit_exceeded;
+    char *virtual_scoreboard;
+    char *virtual_user;
+    unsigned long virtual_limit;  			/* in units of *_mult bytes - total limit  */
+    unsigned long virtual_class_limit[DST_CLASS];	/* in units of *_mult bytes - class limits */
+    unsigned long refresh_time;				/* in seconds */
+    unsigned long slice_len;				/* in seconds */
+    unsigned int virtual_limit_mult;
+    unsigned int virtual_class_limit_mult[DST_CLASS];
+    unsigned long virtual_upload_limit;			/* in units of *_mult bytes - request bodies */
+    unsigned int virtual_upload_limit_mult;
+    unsigned long virtual_roll_limit;			/* in units of *_mult bytes - CBandRollingLimit */
+    unsigned int virtual_roll_limit_mult;
+    unsigned long roll_window;				/* in seconds */
+    unsigned long long virtual_methods;			/* bit 1 << method_number of every counted method, 0 = GET only */
+    mod_cband_speed virtual_class_speed[DST_CLASS];
+    int virtual_key;					/* CBandKey, CBAND_KEY_* of mod_cband.h */
+    char *virtual_key_name;				/* header, cookie or variable of CBandKey */
+    mod_cband_schedule *virtual_schedule;		/* CBandSchedule, the first one which matches applies */
+    mod_cband_speed virtual_base_speed[SCHEDULE_SPEEDS];	/* the speeds outside of the schedules */
+    mod_cband_shmem_data *shmem_data;
+    mod_cband_virtualhost_config_entry *next;
+};
+
+struct mod_cband_user_config_entry {
+    char *user_name;
+    char *user_limit_exceeded;
+    char *user_scoreboard;
+    unsigned long user_limit;  				/* in units of *_mult bytes - total limit  */
+    unsigned long user_class_limit[DST_CLASS]; 		/* in units of *_mult bytes - class limits */
+    unsigned long refresh_time;	
+    unsigned long slice_len;	
+    unsigned int user_limit_mult;
+    unsigned int user_class_limit_mult[DST_CLASS];
+    unsigned long user_upload_limit;			/* in units of *_mult bytes - request bodies */
+    unsigned int user_upload_limit_mult;
+    unsigned long user_roll_limit;			/* in units of *_mult bytes - CBandUserRollingLimit */
+    unsigned int user_roll_limit_mult;
+    unsigned long roll_window;				/* in seconds */
+    mod_cband_speed user_class_speed[DST_CLASS];
+    mod_cband_shmem_data *shmem_data;			/* in seconds */
+    mod_cband_user_config_entry *next;
+};
+
+/*
+ * one CBandSchedule window, e.g. "Mon-Fri 08:00-20:00". Minutes of the day, 
+ * with end <= start the window ends the next day
+ */
+struct mod_cband_schedule {
+    char *spec;
+    unsigned int days;					/* bit 1 << tm_wday of every day */
+    unsigned int start, end;
+    int speed_set;					/* bit 1 << SCHEDULE_* of every speed in speed[] */
+    mod_cband_speed speed[SCHEDULE_SPEEDS];
+    mod_cband_schedule *next;
+};
+
+struct mod_cband_class_config_entry {
+    char *class_name;
+    unsigned int class_nr;
+    mod_cband_shmem_data *shmem_data;
+    mod_cband_class_config_entry *next;
+};
+
+typedef struct mod_cband_remote_host {
+    int used;
+    unsigned long long remote_key;			/* the address or the hash of the CBandKey value */
+    unsigned long remote_addr;
+    char remote_name[MAX_REMOTE_NAME];			/* address or network of the client, printable */
+    unsigned long remote_conn;
+    unsigned long remote_kbps, remote_max_conn;
+    unsigned long remote_last_time;
+    unsigned long remote_last_refresh;
+    unsigned long remote_total_conn;
+    char *virtual_name;
+    int remote_outside;					/* 1 when kept outside the probe window of its hash */
+    int remote_home;					/* slot of its hash when remote_outside is set */
+    unsigned long remote_overflow;			/* clients of this hash slot kept outside the window */
+} mod_cband_remote_host;
+
+/* kept in the remote hosts segment, after the hosts */
+typedef struct mod_cband_remote_stats {
+    unsigned long long overflows;			/* clients kept outside the probe window of their hash */
+    unsigned long long refused;				/* clients without a slot, the whole table was in use */
+} mod_cband_remote_stats;
+
+/*
+ * statistics of one call site of mod_cband_sem_down, kept in shared memory.
+ * Only the contended acquisitions are timed
+ */
+typedef struct {
+    unsigned long key;					/* hash of function and line, 0 for a free slot */
+    char name[MAX_LOCK_SITE_NAME];			/* function:line */
+    int remote;						/* 1 for the remote hosts semaphore */
+    unsigned long long acquisitions;
+    unsigned long long contended;
+    unsigned long long wait_nsec;
+    unsigned long long max_wait_nsec;
+} mod_cband_lock_site;
+
+typedef struct mod_cband_remote_hosts {
+    int shmem_id;
+    int sem_id;
+    struct mod_cband_remote_host *hosts;
+    struct mod_cband_remote_stats *stats;
+} mod_cband_remote_hosts;
+
+typedef struct {
+    mod_cband_virtualhost_config_entry *next_virtualhost;
+    mod_cband_user_config_entry *next_user;
+    mod_cband_class_config_entry *next_class;
+    mod_cband_virtualhost_config_entry *next_dir;	/* <Location> and <Directory> limits */
+    mod_cband_virtualhost_config_entry *global;		/* CBandGlobalSpeed, CBandGlobalMaxConn */
+    void *(*alloc)(void *alloc_ctx, size_t size);	/* memory for entries, never freed */
+    void *alloc_ctx;
+    char *default_limit_exceeded;
+    int default_limit_exceeded_code;
+    patricia_tree_t *tree;
+    unsigned long start_time;				/* in seconds */
+    int sem_id;
+    mod_cband_shmem_segment shmem_seg[MAX_SHMEM_SEGMENTS];
+    mod_cband_remote_hosts remote_hosts;
+    int lock_shmem_id;
+    mod_cband_lock_site *lock_sites;
+    int shmem_seg_idx;
+    int virtualhost_entries;
+    int user_entries;
+    int dir_entries;
+    unsigned long score_flush_period;
+    unsigned long random_pulse;
+    unsigned long max_chunk_len;
+    int class_priority[DST_CLASS];			/* CBandClassPriority */
+    int remote_prefix_v4;				/* CBandRemotePrefixLen, 0 = whole address */
+    int remote_prefix_v6;
+} mod_cband_config_header;
+
+typedef struct {
+    unsigned long limit;
+    unsigned long slice_limit;
+    unsigned long class_limit;
+    unsigned long class_slice_limit;
+    unsigned long long usage;
+    unsigned long long class_usage;
+    unsigned int limit_mult;
+    unsigned int class_limit_mult;
+    char *limit_exceeded;
+    char *scoreboard;
+} mod_cband_limits_usages;
+
+/*
+ * state of the Fairness Bandwidth Sharing algorithm for one response
+ */
+typedef struct {
+    mod_cband_virtualhost_config_entry *entry;
+    mod_cband_user_config_entry *entry_user;
+    int remote_idx;
+    int dst;
+    int not_limit;
+    unsigned long max_remote_kbps;
+    int slow_remote;
+    int shared_case;					/* the chunk is limited by the shared speed */
+    unsigned long shared_bps;				/* in bits per second, taken from the shared speeds in the shared case */
+    int remote_kbps;
+    unsigned long next_bps;				/* in bits per second, bits of the chunk after mod_cband_shaper_chunk */
+    unsigned long measured_bps, measured_bps_old;
+    unsigned long link_bps;				/* speed of the last write in the response, 0 when it isn't known */
+    unsigned long sleep_time;				/* in microseconds, after the current chunk */
+    unsigned long t1;
+    unsigned long remote_bytes_sum;
+    unsigned long slept;				/* in microseconds, whole response */
+    int upload;						/* request body, limited only by CBandUploadSpeed */
+    int chunk_bytes;					/* bytes_split of the last mod_cband_shaper_chunk */
+    mod_cband_virtualhost_config_entry *extra[SHAPER_EXTRA];	/* limits of the directory and of the server, NULL without them */
+    int priority;					/* CBandClassPriority of the destination class */
+    int global_remote_idx;				/* remote host of CBandGlobalRemoteSpeed, -1 without it */
+    unsigned long max_global_kbps;			/* in kbps, CBandGlobalRemoteSpeed */
+} mod_cband_shaper;
+
+/*
+ * sources of time, sleeps and random numbers of libcband, a simulator
+ * replaces them with a virtual clock
+ */
+typedef struct {
+    unsigned long (*now)(void);				/* in microseconds */
+    void (*sleep)(unsigned long usec);
+    int (*rand)(void);
+} mod_cband_clock;
+
+extern void (*mod_cband_sem_wait_hook)(int sem_id, unsigned long long wait_nsec);
+
+/* every call site keeps its own lock statistics, the slot is looked up once per process */
+#define mod_cband_sem_down(sem_id) \
+    do { static int lock_site_ = -1; mod_cband_sem_down_at((sem_id), &lock_site_, __func__, __LINE__); } while (0)
+
+mod_cband_config_header *mod_cband_core_init(void *(*alloc)(void *alloc_ctx, size_t size), void *alloc_ctx);
+void mod_cband_core_remove(void);
+unsigned long mod_cband_time_now(void);
+void mod_cband_set_clock(const mod_cband_clock *clock);
+void mod_cband_sleep(unsigned long usec);
+int mod_cband_rand(void);
+
+int mod_cband_shmem_seg_new(void);
+mod_cband_shmem_data *mod_cband_shmem_init(void);
+void mod_cband_shmem_remove(int shmem_id);
+void mod_cband_sem_init(int sem_id);
+void mod_cband_sem_remove(int sem_id);
+void mod_cband_sem_down_at(int sem_id, int *site, const char *func, int line);
+void mod_cband_sem_up(int sem_id);
+int mod_cband_lock_sites_read(mod_cband_lock_site *copy);
+void mod_cband_shmem_write_begin(mod_cband_shmem_data *shmem_data);
+void mod_cband_shmem_write_end(mod_cband_shmem_data *shmem_data);
+int mod_cband_shmem_read(mod_cband_shmem_data *shmem_data, mod_cband_shmem_data *copy);
+int mod_cband_remote_hosts_init(void);
+
+mod_cband_virtualhost_config_entry *mod_cband_get_virtualhost_entry_(char *virtualhost, unsigned short port, unsigned line, int create);
+mod_cband_virtualhost_config_entry *mod_cband_get_dir_entry_(char *path, unsigned line, int create);
+mod_cband_virtualhost_config_entry *mod_cband_get_global_entry_(int create);
+mod_cband_schedule *mod_cband_get_schedule_(mod_cband_virtualhost_config_entry *entry, char *spec, int create);
+int mod_cband_schedule_init(void);
+void mod_cband_check_schedule(mod_cband_virtualhost_config_entry *entry, unsigned long time_now);
+mod_cband_user_config_entry *mod_cband_get_user_entry_(char *user, int create);
+mod_cband_class_config_entry *mod_cband_get_class_entry_(char *dest, int create);
+
+int mod_cband_get_dst_(in_addr_t addr);
+int mod_cband_add_class_dst(char *dst, int class_nr);
+
+unsigned long long mod_cband_key_hash(const char *str);
+unsigned long long mod_cband_remote_addr_key(const char *ip, in_addr_t *addr, char *name);
+int mod_cband_get_remote_key_(unsigned long long key, in_addr_t addr, const char *name, char *virtual_name, int create);
+int mod_cband_get_remote_host_(in_addr_t addr, char *virtual_name, int create);
+void mod_cband_safe_change(unsigned long *val, int diff);
+int mod_cband_change_remote_connections_lock(int index, int diff);
+int mod_cband_set_remote_request_time(int index, unsigned long time);
+int mod_cband_set_remote_current_speed(int index, unsigned long kbps);
+int mod_cband_set_remote_max_connections(int index, unsigned long max);
+int mod_cband_set_remote_last_refresh(int index, unsigned long time);
+int mod_cband_set_remote_total_connections(int index, unsigned long set);
+int mod_cband_get_remote_total_connections(int index);
+float mod_cband_get_remote_connections_speed_lock(int index);
+int mod_cband_change_remote_total_connections_lock(int index, unsigned long diff);
+unsigned long mod_cband_get_remote_connection_time(int index);
+int mod_cband_get_remote_connections(int index);
+int mod_cband_remove_remote_host(int index);
+int mod_cband_get_dst_speed_lock(mod_cband_virtualhost_config_entry *entry, mod_cband_user_config_entry *entry_user, unsigned long *remote_kbps, unsigned long *remote_rps, unsigned long *remote_max_conn, int dst);
+
+int mod_cband_get_score(char *path, unsigned long long *val, int dst, mod_cband_shmem_data *shmem_data);
+int mod_cband_get_score_all(char *path, mod_cband_scoreboard_entry *val, mod_cband_roll *roll);
+int mod_cband_save_score(char *path, mod_cband_scoreboard_entry *scoreboard, mod_cband_roll *roll);
+int mod_cband_flush_score_lock(char *path, mod_cband_shmem_data *shmem_data);
+int mod_cband_update_score(char *path, unsigned long long *bytes_served, int dst, mod_cband_scoreboard_entry *scoreboard);
+int mod_cband_clear_score_lock(mod_cband_shmem_data *shmem_data, unsigned long start_time);
+int mod_cband_update_score_cache(void);
+int mod_cband_save_score_cache(void);
+unsigned long mod_cband_get_start_time(mod_cband_scoreboard_entry *scoreboard);
+int mod_cband_set_start_time(mod_cband_scoreboard_entry *scoreboard, unsigned long start_time);
+
+void mod_cband_hist_add(mod_cband_hist *hist, unsigned long value);
+void mod_cband_hist_summarize(mod_cband_hist *hist, mod_cband_hist_summary *summary);
+void mod_cband_log_hist(mod_cband_virtualhost_config_entry *entry, mod_cband_user_config_entry *entry_user, int type, unsigned long value);
+void mod_cband_rate_add(mod_cband_rate *rate, unsigned long time_now, unsigned long bytes, unsigned long conn);
+void mod_cband_rate_get(mod_cband_rate *rate, unsigned long time_now, float *bps, float *rps);
+int mod_cband_get_speed_lock(mod_cband_shmem_data *shmem_data, float *bps, float *rps);
+int mod_cband_get_real_speed(mod_cband_shmem_data *shmem_data, float *bps, float *rps);
+int mod_cband_update_speed(mod_cband_shmem_data *shmem_data, unsigned long bytes_served, int new_connection, int remote_idx);
+int mod_cband_update_speed_lock(mod_cband_shmem_data *shmem_data, unsigned long bytes_served, int new_connection, int remote_idx);
+int mod_cband_set_overlimit_speed(mod_cband_shmem_data *shmem_data);
+int mod_cband_set_overlimit_speed_lock(mod_cband_shmem_data *shmem_data);
+int mod_cband_set_normal_speed(mod_cband_shmem_data *shmem_data);
+int mod_cband_set_normal_speed_lock(mod_cband_shmem_data *shmem_data);
+void mod_cband_check_virtualhost_refresh(mod_cband_virtualhost_config_entry *entry_virtual, unsigned long sec);
+void mod_cband_check_user_refresh(mod_cband_user_config_entry *entry_user, unsigned long sec);
+void mod_cband_status_snapshot(mod_cband_shmem_data *shmem_data, unsigned long refresh_time, unsigned long sec, mod_cband_shmem_data *copy);
+int mod_cband_reset(mod_cband_shmem_data *shmem_data);
+int mod_cband_reset_virtualhost(char *name);
+int mod_cband_reset_user(char *name);
+unsigned long mod_cband_get_slice_limit(unsigned long start_time, unsigned long refresh_time, unsigned long slice_len, unsigned long limit);
+
+int mod_cband_get_virtualhost_limits(mod_cband_virtualhost_config_entry *entry, mod_cband_limits_usages *lu, int dst);
+int mod_cband_get_virtualhost_usages(mod_cband_virtualhost_config_entry *entry, mod_cband_limits_usages *lu, int dst);
+int mod_cband_get_user_limits(mod_cband_user_config_entry *entry_user, mod_cband_limits_usages *lu, int dst);
+int mod_cband_get_user_usages(mod_cband_user_config_entry *entry_user, mod_cband_limits_usages *lu, int dst);
+int mod_cband_limit_reached(unsigned long limit, unsigned long slice_limit, unsigned int mult, unsigned long long usage);
+unsigned long long mod_cband_get_roll_usage_lock(mod_cband_shmem_data *shmem_data, unsigned long window, unsigned long limit, 
+	unsigned int mult, int *was_overlimit);
+
+long mod_cband_get_shared_speed_lock(mod_cband_virtualhost_config_entry *entry, mod_cband_user_config_entry *entry_user, int priority);
+int mod_cband_log_bytes(mod_cband_virtualhost_config_entry *entry, mod_cband_user_config_entry *entry_user, unsigned long bucket_bytes, int dst, int remote_idx);
+void mod_cband_change_total_connections_lock(mod_cband_virtualhost_config_entry *entry, mod_cband_user_config_entry *entry_user, int diff);
+void mod_cband_change_shared_connections_lock(mod_cband_virtualhost_config_entry *entry, mod_cband_user_config_entry *entry_user, int priority, int diff, unsigned long bps);
+void mod_cband_change_shared_speed_lock(mod_cband_virtualhost_config_entry *entry, mod_cband_user_config_entry *entry_user, int diff);
+
+int mod_cband_admit(mod_cband_virtualhost_config_entry *entry, mod_cband_user_config_entry *entry_user, int remote_idx, int dst);
+void mod_cband_shaper_open(mod_cband_shaper *s, mod_cband_virtualhost_config_entry *entry, mod_cband_user_config_entry *entry_user, int remote_idx, int dst);
+void mod_cband_shaper_set_dir(mod_cband_shaper *s, mod_cband_virtualhost_config_entry *entry_dir);
+void mod_cband_shaper_set_global_remote(mod_cband_shaper *s, int global_remote_idx);
+void mod_cband_shaper_bucket(mod_cband_shaper *s);
+int mod_cband_shaper_chunk(mod_cband_shaper *s, int bytes);
+void mod_cband_shaper_sent(mod_cband_shaper *s, int bytes_split, unsigned long send_time);
+void mod_cband_shaper_close(mod_cband_shaper *s);
+void mod_cband_shaper_log_sleep(mod_cband_shaper *s, unsigned long slept);
+
+unsigned long mod_cband_get_upload_speed_lock(mod_cband_virtualhost_config_entry *entry, mod_cband_user_config_entry *entry_user);
+void mod_cband_change_upload_connections_lock(mod_cband_virtualhost_config_entry *entry, mod_cband_user_config_entry *entry_user, int diff);
+int mod_cband_log_upload_bytes(mod_cband_virtualhost_config_entry *entry, mod_cband_user_config_entry *entry_user, unsigned long bytes);
+int mod_cband_upload_limit_reached(mod_cband_virtualhost_config_entry *entry, mod_cband_user_config_entry *entry_user);
+void mod_cband_upload_open(mod_cband_shaper *s, mod_cband_virtualhost_config_entry *entry, mod_cband_user_config_entry *entry_user);
+void mod_cband_upload_close(mod_cband_shaper *s);
+
+#endif /* _CBAND_CORE_H */
@@ -0,0 +1,62 @@
+/*
+ * mod_cband - A per-user, per-virtualhost and per-destination bandwidth limiter for the Apache HTTP Server Version 2
+ *
+ * Copyright (c) 2005 Lukasz Dembinski <dembol@cband.linux.pl>
+ * All Rights Reserved
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+
+/*
+ * Static tracepoints (USDT) of the provider "cband" for bpftrace, perf and
+ * SystemTap. With <sys/sdt.h> (systemtap-sdt-dev, systemtap-sdt-devel) every
+ * probe is a single nop and a note in the ELF file, without it or with
+ * -DCBAND_NO_PROBES they compile to nothing.
+ *
+ *   request__admitted	(vhost, user, dst)
+ *   request__rejected	(vhost, user, dst, status)
+ *   chunk		(vhost, bytes_split, sleep_time, shared_case)
+ *   limit__reached	(server, usage, limit, status)
+ *   overlimit		(shmem_data, overlimit)		- transitions only
+ *   score__flush	(path, total_bytes)
+ *
+ * vhost, user, server and path are strings (NULL when there is none), sizes
+ * in bytes, times in microseconds.
+ *
+ *   bpftrace -e 'usdt:/usr/lib/apache2/modules/mod_cband.so:cband:chunk { @sleep_us = hist(arg2); }'
+ */
+
+#ifndef _CBAND_PROBES_H
+#define _CBAND_PROBES_H
+
+#if !defined(CBAND_NO_PROBES) && defined(__has_include)
+#if __has_include(<sys/sdt.h>)
+#include <sys/sdt.h>
+#define CBAND_HAVE_PROBES		1
+#endif
+#endif
+
+#ifdef CBAND_HAVE_PROBES
+#define CBAND_PROBE2(name, a, b)		DTRACE_PROBE2(cband, name, a, b)
+#define CBAND_PROBE3(name, a, b, c)		DTRACE_PROBE3(cband, name, a, b, c)
+#define CBAND_PROBE4(name, a, b, c, d)		DTRACE_PROBE4(cband, name, a, b, c, d)
+#else
+#define CBAND_PROBE2(name, a, b)		do { } while (0)
+#define CBAND_PROBE3(name, a, b, c)		do { } while (0)
+#define CBAND_PROBE4(name, a, b, c, d)		do { } while (0)
+#endif
+
+#endif /* _CBAND_PROBES_H */
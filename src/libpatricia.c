@@ -17,91 +17,7 @@ static char copyright[] =
 "Network, Inc., and their contributors.";
 */
 
-#ifndef _PATRICIA_H
-#define _PATRICIA_H
-
-/* typedef unsigned int u_int; */
-typedef void (*void_fn_t)();
-/* { from defs.h */
-#define prefix_touchar(prefix) ((u_char *)&(prefix)->add.sin)
-#define MAXLINE 1024
-#define BIT_TEST(f, b)  ((f) & (b))
-/* } */
-
-#define addroute make_and_lookup
-
-#include <netinet/in.h> /* for struct in_addr */
-
-#include <sys/socket.h> /* for AF_INET */
-
-/* { from mrt.h */
-
-typedef struct _prefix4_t {
-    u_short family;		/* AF_INET | AF_INET6 */
-    u_short bitlen;		/* same as mask? */
-    int ref_count;		/* reference count */
-    struct in_addr sin;
-} prefix4_t;
-
-typedef struct _prefix_t {
-    u_short family;		/* AF_INET | AF_INET6 */
-    u_short bitlen;		/* same as mask? */
-    int ref_count;		/* reference count */
-    union {
-		struct in_addr sin;
-#ifdef HAVE_IPV6
-		struct in6_addr sin6;
-#endif /* IPV6 */
-    } add;
-} prefix_t;
-
-/* } */
-
-typedef struct _patricia_node_t {
-   u_int bit;			/* flag if this node used */
-   prefix_t *prefix;		/* who we are in patricia tree */
-   struct _patricia_node_t *l, *r;	/* left and right children */
-   struct _patricia_node_t *parent;/* may be used */
-   void *data;			/* pointer to data */
-   void	*user1;			/* pointer to usr data (ex. route flap info) */
-} patricia_node_t;
-
-typedef struct _patricia_tree_t {
-   patricia_node_t 	*head;
-   u_int		maxbits;	/* for IP, 32 bit addresses */
-   int num_active_node;		/* for debug purpose */
-} patricia_tree_t;
-
-
-patricia_node_t *patricia_search_best (patricia_tree_t *patricia, prefix_t *prefix);
-patricia_node_t * patricia_search_best2 (patricia_tree_t *patricia, prefix_t *prefix, 
-				   int inclusive);
-patricia_node_t *patricia_lookup (patricia_tree_t *patricia, prefix_t *prefix);
-void patricia_remove (patricia_tree_t *patricia, patricia_node_t *node);
-patricia_tree_t *New_Patricia (int maxbits);
-void Clear_Patricia (patricia_tree_t *patricia, void_fn_t func);
-void Destroy_Patricia (patricia_tree_t *patricia, void_fn_t func);
-void patricia_process (patricia_tree_t *patricia, void_fn_t func);
-
-/* { from demo.c */
-
-prefix_t *
-ascii2prefix (int family, char *string);
-
-patricia_node_t *
-make_and_lookup (patricia_tree_t *tree, char *string);
-
-/* } */
-
-#define PATRICIA_MAXBITS 128
-#define PATRICIA_NBIT(x)        (0x80 >> ((x) & 0x7f))
-#define PATRICIA_NBYTE(x)       ((x) >> 3)
-
-#define PATRICIA_DATA_GET(node, type) (type *)((node)->data)
-#define PATRICIA_DATA_SET(node, value) ((node)->data = (void *)(value))
-
-
-#endif /* _PATRICIA_H */
+#include "libpatricia.h"
 
 
 
@@ -152,7 +68,9 @@ comp_with_mask (void *addr, void *dest, u_int mask)
  * unsigned long and copies the result to dst.
  * Only supports AF_INET.  Follows standard error return conventions of 
  * inet_pton.
+ * Only for NT, elsewhere it would hide the IPv6 capable inet_pton of libc.
  */
+#ifdef NT
 int
 inet_pton (int af, const char *src, void *dst)
 {
@@ -183,6 +101,7 @@ inet_pton (int af, const char *src, void *dst)
     }
 #endif /* NT */
 }
+#endif /* NT */
 
 /* this allows imcomplete prefix */
 int
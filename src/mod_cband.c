@@ -57,6 +57,7 @@
 #include <sys/ipc.h>
 #include <sys/sem.h>
 #include <unistd.h>
+#include <arpa/inet.h>
 
 #include "mod_cband.h"
 
@@ -85,297 +86,123 @@ unsigned long mod_cband_conf_get_speed_kbps(char *speed);
 
 module AP_MODULE_DECLARE_DATA cband_module;
 
-int mod_cband_shmem_seg_new(void)
-{
-    int seg_idx;
-    int shmem_id;
-
-    seg_idx  = ++config->shmem_seg_idx;
-    shmem_id = config->shmem_seg[seg_idx].shmem_id;
-    
-    if (shmem_id == 0) {
-	shmem_id = shmget(IPC_PRIVATE, sizeof(mod_cband_shmem_data) * MAX_SHMEM_ENTRIES, IPC_CREAT | 0666);
-	
-	if (shmem_id < 0) {
-	    fprintf(stderr, "apache2_mod_cband: cannot create shared memory segment for virtual hosts\n");
-	    fflush(stderr);
-	    return -1;
-	}
-	
-        config->shmem_seg[seg_idx].shmem_id = shmem_id;
-	config->shmem_seg[seg_idx].shmem_data = (mod_cband_shmem_data *)shmat(shmem_id, 0, 0);
-	memset(config->shmem_seg[seg_idx].shmem_data, 0, sizeof(mod_cband_shmem_data) * MAX_SHMEM_ENTRIES);
-    }
-
-    config->shmem_seg[seg_idx].shmem_entry_idx = 0;
 
-    return seg_idx;
-}
-
-mod_cband_shmem_data *mod_cband_shmem_init(void)
+ 
+mod_cband_virtualhost_config_entry *mod_cband_get_virtualhost_entry(server_rec *s, ap_conf_vector_t *module_config, int create)
 {
-    mod_cband_shmem_data *data;
-    int seg_idx, entry_idx;
-    
-    seg_idx = config->shmem_seg_idx;
-    if ((seg_idx < 0) || (config->shmem_seg[seg_idx].shmem_entry_idx >= MAX_SHMEM_ENTRIES - 1))
-	config->shmem_seg_idx = seg_idx = mod_cband_shmem_seg_new();
+    char *virtualhost;
+    apr_port_t port;
+    unsigned line;
 
-    if (seg_idx < 0)
+    if (s == NULL)
 	return NULL;
 
-    entry_idx = config->shmem_seg[seg_idx].shmem_entry_idx++;
-    data = (mod_cband_shmem_data *)(config->shmem_seg[seg_idx].shmem_data + entry_idx * sizeof(mod_cband_shmem_data));
-    data->total_last_refresh = apr_time_now();
-
-    return data;
-}
-
-void mod_cband_shmem_remove(int shmem_id)
-{
-    shmctl(shmem_id, IPC_RMID, 0);
-}
-
-void mod_cband_sem_init(int sem_id)
-{
-    union semun arg;
-    unsigned short values[1];
-    
-    values[0] = 1;
-    arg.val   = 1;
-    arg.array = values;
-    
-    semctl(sem_id, 0, SETALL, arg);    
-    
-    /* 
-     * We should also set owner of the semaphore ...
-     */
-}
-
-void mod_cband_sem_remove(int sem_id)
-{
-    union semun arg;
+    virtualhost = s->server_hostname;
+    port        = s->port;
+    line        = s->defn_line_number;
 
-    arg.val   = 0;    
-    semctl(sem_id, 0, IPC_RMID, arg);    
+    return mod_cband_get_virtualhost_entry_(virtualhost, port, line, create);
 }
 
-void mod_cband_sem_down(int sem_id)
+mod_cband_user_config_entry *mod_cband_get_user_entry(char *user, ap_conf_vector_t *module_config, int create)
 {
-    struct sembuf sops;
-    
-    sops.sem_num  = 0;
-    sops.sem_op   = -1;
-    sops.sem_flg  = SEM_UNDO;
-    
-    semop(sem_id, &sops, 1);
+    return mod_cband_get_user_entry_(user, create);
 }
 
-void mod_cband_sem_up(int sem_id)
+mod_cband_class_config_entry *mod_cband_get_class_entry(char *dest, ap_conf_vector_t *module_config, int create)
 {
-    struct sembuf sops;
-        
-    sops.sem_num  = 0;
-    sops.sem_op   = 1;
-    sops.sem_flg  = SEM_UNDO;
-    
-    semop(sem_id, &sops, 1);
+    return mod_cband_get_class_entry_(dest, create);
 }
 
-int mod_cband_remote_hosts_init(void)
+int mod_cband_get_dst(request_rec *r) 
 {
-    int shmem_id, sem_id;
-    int seg_size;
-
-    shmem_id = config->remote_hosts.shmem_id;
-    seg_size = sizeof(mod_cband_remote_host) * MAX_REMOTE_HOSTS;
-
-    if (shmem_id == 0) {
-	config->remote_hosts.shmem_id = shmem_id = shmget(IPC_PRIVATE, seg_size , IPC_CREAT | 0666);
-        if (shmem_id < 0) {
-	    fprintf(stderr, "apache2_mod_cband: cannot create shared memory segment for remote hosts\n");
-	    fflush(stderr);
-	    return -1;
-	}
-	
-        config->remote_hosts.hosts = (mod_cband_remote_host *)shmat(shmem_id, 0, 0);
-    }
-    
-    if (config->remote_hosts.hosts != NULL)
-	memset(config->remote_hosts.hosts, 0, seg_size);
-    
-    config->remote_hosts.sem_id = sem_id = semget(IPC_PRIVATE, 1, IPC_CREAT | 0666);
-    mod_cband_sem_init(sem_id);
-    
-    return 0;
+#if (AP_SERVER_MAJORVERSION_NUMBER) >= 2 && (AP_SERVER_MINORVERSION_NUMBER) >= 4
+    return mod_cband_get_dst_(inet_addr(r->connection->client_ip));
+#else
+    return mod_cband_get_dst_(inet_addr(r->connection->remote_ip));
+#endif
 }
 
-/**
- * get virtualhost entry or create new one
+/*
+ * value of the cookie name from the Cookie header, NULL when there is none
  */
-mod_cband_virtualhost_config_entry *mod_cband_get_virtualhost_entry_(char *virtualhost, apr_port_t port, unsigned line, int create)
+static const char *mod_cband_get_cookie(request_rec *r, const char *name)
 {
-    mod_cband_virtualhost_config_entry *entry;
-    mod_cband_virtualhost_config_entry *new_entry;
-    int i;
+    const char *cookies, *p, *end;
+    size_t len = strlen(name);
 
-    if (virtualhost == NULL || config == NULL)
+    if ((cookies = apr_table_get(r->headers_in, "Cookie")) == NULL)
 	return NULL;
-    
-    entry = config->next_virtualhost;
-    
-    while(entry != NULL) {
-
-        if (!strcmp(entry->virtual_name, virtualhost) && (line == entry->virtual_defn_line))
-	    return entry;
-    
-	if (entry->next == NULL)
-	    break;
-	    
-	entry = entry->next;
-    }
 
-    if (create) {
-	if ((new_entry = apr_palloc(config->p, sizeof(mod_cband_virtualhost_config_entry))) == NULL) {
-	    fprintf(stderr, "apache2_mod_cband: cannot alloc memory for virtualhost entry\n");
-	    fflush(stderr);
-	    return NULL;
+    for (p = cookies; (p = strstr(p, name)) != NULL; p += len) {
+	if (((p == cookies) || (p[-1] == ' ') || (p[-1] == ';')) && (p[len] == '=')) {
+	    p  += len + 1;
+	    end = strchr(p, ';');
+	    return (end != NULL) ? apr_pstrndup(r->pool, p, end - p) : p;
 	}
-	
-	memset(new_entry, 0, sizeof(mod_cband_virtualhost_config_entry));
-	new_entry->virtual_name       = virtualhost;
-	new_entry->virtual_defn_line  = line;
-	new_entry->virtual_port       = port;
-	new_entry->virtual_limit_mult = 1024;
-	
-	if (new_entry->shmem_data == NULL)
-	    new_entry->shmem_data = mod_cband_shmem_init();
-
-	for (i = 0; i < DST_CLASS; i++)
-	    new_entry->virtual_class_limit_mult[i] = 1024;
-	
-	if (entry == NULL)
-	    config->next_virtualhost = new_entry;
-	else
-	    entry->next = new_entry;
-	
-	return new_entry;    
     }
-    
-    return NULL;    
-}
- 
-mod_cband_virtualhost_config_entry *mod_cband_get_virtualhost_entry(server_rec *s, ap_conf_vector_t *module_config, int create)
-{
-    char *virtualhost;
-    apr_port_t port;
-    unsigned line;
-
-    if (s == NULL)
-	return NULL;
-
-    virtualhost = s->server_hostname;
-    port        = s->port;
-    line        = s->defn_line_number;
 
-    return mod_cband_get_virtualhost_entry_(virtualhost, port, line, create);
+    return NULL;
 }
 
-/**
- * get user entry or create new one
+/*
+ * remote client of the request, identified by the CBandKey of the virtualhost.
+ * Without the key value (no such header ...) the address of the connection is used
  */
-mod_cband_user_config_entry *mod_cband_get_user_entry(char *user, ap_conf_vector_t *module_config, int create)
+int mod_cband_get_remote_host(request_rec *r, int create, mod_cband_virtualhost_config_entry *entry)
 {
-    mod_cband_user_config_entry *entry;
-    mod_cband_user_config_entry *new_entry;
-    int i;
-
-    if (user == NULL || config == NULL)
-	return NULL;
-    
-    entry = config->next_user;
+    conn_rec *c = r->connection;
+    const char *value = NULL;
+    unsigned long long key;
+    in_addr_t addr;
+    char name[MAX_REMOTE_NAME];
     
-    while(entry != NULL) {
-	if (!strcmp(entry->user_name, user))
-	    return entry;
+    if (entry == NULL)
+	return -1;
+
+    name[0] = 0;
     
-	if (entry->next == NULL)
+#if (AP_SERVER_MAJORVERSION_NUMBER) >= 2 && (AP_SERVER_MINORVERSION_NUMBER) >= 4
+    if (c->client_ip != NULL)
+	key = mod_cband_remote_addr_key(c->client_ip, &addr, name);
+    else
+	key = addr = c->client_addr->sa.sin.sin_addr.s_addr;
+#else
+    if (c->remote_ip != NULL)
+	key = mod_cband_remote_addr_key(c->remote_ip, &addr, name);
+    else
+	key = addr = c->remote_addr->sa.sin.sin_addr.s_addr;
+#endif
+
+    switch (entry->virtual_key) {
+	case CBAND_KEY_CLIENT:
+#if (AP_SERVER_MAJORVERSION_NUMBER) >= 2 && (AP_SERVER_MINORVERSION_NUMBER) >= 4
+	    if (r->useragent_ip != NULL)
+		key = mod_cband_remote_addr_key(r->useragent_ip, &addr, name);
+#endif
 	    break;
-	    
-	entry = entry->next;
+	case CBAND_KEY_HEADER: value = apr_table_get(r->headers_in, entry->virtual_key_name); break;
+	case CBAND_KEY_COOKIE: value = mod_cband_get_cookie(r, entry->virtual_key_name); break;
+	case CBAND_KEY_USER:   value = r->user; break;
+	case CBAND_KEY_ENV:    value = apr_table_get(r->subprocess_env, entry->virtual_key_name); break;
     }
-    
-    if (create) {
-	if ((new_entry = apr_palloc(config->p, sizeof(mod_cband_user_config_entry))) == NULL) {
-	    fprintf(stderr, "apache2_mod_cband: cannot alloc memory for user entry\n");
-	    fflush(stderr);
-	    return NULL;
-	}
-	
-	memset(new_entry, 0, sizeof(mod_cband_user_config_entry));
-	new_entry->user_name       = user;
-	new_entry->user_limit_mult = 1024;
 
-	if (new_entry->shmem_data == NULL)
-	    new_entry->shmem_data = mod_cband_shmem_init();
+    if ((value != NULL) && (*value != 0))
+	return mod_cband_get_remote_key_(mod_cband_key_hash(value), addr, name, entry->virtual_name, create);
 
-	for (i = 0; i < DST_CLASS; i++)
-	    new_entry->user_class_limit_mult[i] = 1024;
-
-	if (entry == NULL)
-	    config->next_user = new_entry;
-	else
-	    entry->next = new_entry;
-	
-	return new_entry;    
-    }
-	
-    return NULL;    
+    return mod_cband_get_remote_key_(key, addr, name, entry->virtual_name, create);
 }
 
-/**
- * get class entry or create new one
+
+/*
+ * entries of libcband live as long as the configuration pool
  */
-mod_cband_class_config_entry *mod_cband_get_class_entry(char *dest, ap_conf_vector_t *module_config, int create)
+static void *mod_cband_palloc(void *pool, size_t size)
 {
-    mod_cband_class_config_entry *entry;
-    mod_cband_class_config_entry *new_entry;
+    return apr_palloc((apr_pool_t *)pool, size);
+}
 
-    if (dest == NULL || config == NULL)
-	return NULL;
-    
-    entry = config->next_class;
-    
-    while(entry != NULL) {
-	if (!strcmp(entry->class_name, dest))
-	    return entry;
-    
-	if (entry->next == NULL)
-	    break;
-	    
-	entry = entry->next;
-    }
 
-    if (create) {
-	if ((new_entry = apr_palloc(config->p, sizeof(mod_cband_class_config_entry))) == NULL) {
-	    fprintf(stderr, "apache2_mod_cband: cannot alloc memory for class entry\n");
-	    fflush(stderr);
-	    return NULL;
-	}
-	
-	memset(new_entry, 0, sizeof(mod_cband_class_config_entry));
-	new_entry->class_name = dest;
-    
-	if (entry == NULL)
-	    config->next_class = new_entry;
-	else
-	    entry->next = new_entry;
-	
-	return new_entry;    
-    }
-    
-    return NULL;    
-}
 
 static char *username_arg  = NULL;
 static char *classname_arg = NULL;
@@ -405,6 +232,28 @@ int mod_cband_check_virtualhost_command(mod_cband_virtualhost_config_entry **ent
     return 1;
 }
 
+/*
+ * entry of the <Location> or <Directory> section of the command, created with
+ * the first command of the section
+ */
+int mod_cband_check_dir_command(mod_cband_virtualhost_config_entry **entry, cmd_parms *parms, mod_cband_dir_config *dconf, const char *command)
+{
+    ap_directive_t *section = parms->directive->parent;
+
+    /* requests are handled only in virtualhosts with an entry, even an unlimited one */
+    mod_cband_get_virtualhost_entry(parms->server, parms->server->module_config, 1);
+
+    if ((dconf->entry == NULL) && (parms->path != NULL))
+	dconf->entry = mod_cband_get_dir_entry_(parms->path, (section != NULL) ? section->line_num : parms->directive->line_num, 1);
+
+    if ((*entry = dconf->entry) == NULL) {
+	ap_log_error(APLOG_MARK, APLOG_WARNING, 0, parms->server, "Invalid command '%s', undefined directory", command);
+	return 0;
+    }
+
+    return 1;
+}
+
 int mod_cband_check_virtualhost_class_command(mod_cband_virtualhost_config_entry **entry_virtual, mod_cband_class_config_entry **entry, cmd_parms *parms, const char *command, const char *arg)
 {
     if ((*entry = mod_cband_get_class_entry((char *)arg, parms->server->module_config, 0)) == NULL) {
@@ -504,6 +353,19 @@ static const char *mod_cband_set_period_slice(cmd_parms *parms, void *mconfig, c
     return NULL;
 }
 
+static const char *mod_cband_set_rolling_limit(cmd_parms *parms, void *mconfig, const char *limit, const char *window)
+{
+    mod_cband_virtualhost_config_entry *entry;
+
+    if (mod_cband_check_virtualhost_command(&entry, parms, "CBandRollingLimit") &&
+       (!mod_cband_check_duplicate((void *)entry->virtual_roll_limit, "CBandRollingLimit", limit, parms->server))) {
+	entry->virtual_roll_limit = mod_cband_conf_get_limit_kb((char *)limit, &entry->virtual_roll_limit_mult);
+	entry->roll_window = mod_cband_conf_get_period_sec((char *)window);
+    }
+    
+    return NULL;
+}
+
 static const char *mod_cband_set_url(cmd_parms *parms, void *mconfig, const char *arg)
 {
     mod_cband_virtualhost_config_entry *entry;
@@ -544,108 +406,352 @@ static const char *mod_cband_set_remote_speed(cmd_parms *parms, void *mconfig, c
     return NULL;
 }
 
-char *mod_cband_get_next_char(const char *str, char val)
+static const char *mod_cband_set_upload_speed(cmd_parms *parms, void *mconfig, const char *arg)
 {
-    int i;
-
-    if (str == NULL)
-	return NULL;
+    mod_cband_virtualhost_config_entry *entry;
 
-    for (i = 0; i < strlen(str); i++) {
-	if (str[i] == val) {
-	    return (char *)(str + i);
-	}
-    }
+    if (mod_cband_check_virtualhost_command(&entry, parms, "CBandUploadSpeed") &&
+       (!mod_cband_check_duplicate((void *)entry->shmem_data->upload_kbps, "CBandUploadSpeed", arg, parms->server)))
+	entry->shmem_data->upload_kbps = mod_cband_conf_get_speed_kbps((char *)arg);
     
     return NULL;
 }
 
-char *mod_cband_get_next_notchar(const char *str, char val, int offset)
+static const char *mod_cband_set_upload_limit(cmd_parms *parms, void *mconfig, const char *arg)
 {
-    int i;
-    char *ptr;
-
-    if (str == NULL)
-	return NULL;
-
-    if (offset)
-	str += strlen(str) + 1;
+    mod_cband_virtualhost_config_entry *entry;
 
-    for (i = 0; i < strlen(str); i++) {
-	if (str[i] != val) {
-	    if ((ptr = mod_cband_get_next_char(str, val)) != NULL)
-		*ptr = 0;
-	    	    
-	    return (char *)(str + i);
-	}
-    }
+    if (mod_cband_check_virtualhost_command(&entry, parms, "CBandUploadLimit") &&
+       (!mod_cband_check_duplicate((void *)entry->virtual_upload_limit, "CBandUploadLimit", arg, parms->server)))
+	entry->virtual_upload_limit = mod_cband_conf_get_limit_kb((char *)arg, &entry->virtual_upload_limit_mult);
     
     return NULL;
 }
 
-static const char *mod_cband_set_class_remote_speed(cmd_parms *parms, void *mconfig, const char *args)
+static const char *mod_cband_set_remote_prefix_len(cmd_parms *parms, void *mconfig, const char *arg1, const char *arg2)
 {
-    mod_cband_class_config_entry *entry;
-    mod_cband_virtualhost_config_entry *entry_virtual;
-    char *arg1, *arg2, *arg3, *arg4;
-    
-    arg1 = mod_cband_get_next_notchar(args, ' ', 0);
-    arg2 = mod_cband_get_next_notchar((const char *)arg1, ' ', 1);
-    arg3 = mod_cband_get_next_notchar((const char *)arg2, ' ', 1);
-    arg4 = mod_cband_get_next_notchar((const char *)arg3, ' ', 1);
-    
-    if (arg1 == NULL || arg2 == NULL || arg3 == NULL || arg4 == NULL) {
-	ap_log_error(APLOG_MARK, APLOG_WARNING, 0, parms->server, "CBandClassRemoteSpeed takes four arguments");
-	return NULL;
-    }
-    
-    if (mod_cband_check_virtualhost_class_command(&entry_virtual, &entry, parms, "CBandClassRemoteSpeed", arg1)) {
-	entry_virtual->virtual_class_speed[entry->class_nr].kbps     = mod_cband_conf_get_speed_kbps((char *)arg2);
-        entry_virtual->virtual_class_speed[entry->class_nr].rps      = atol((char *)arg3);
-	entry_virtual->virtual_class_speed[entry->class_nr].max_conn = atol((char *)arg4);
-    }
-    
+    const char *err;
+    int v4, v6 = 128;
+
+    if ((err = ap_check_cmd_context(parms, GLOBAL_ONLY)) != NULL)
+	return err;
+
+    v4 = atoi((char *)arg1);
+    if (arg2 != NULL)
+	v6 = atoi((char *)arg2);
+
+    if ((v4 < 1) || (v4 > 32) || (v6 < 1) || (v6 > 128))
+	return "CBandRemotePrefixLen: the prefix length must be 1-32 for IPv4 and 1-128 for IPv6";
+
+    config->remote_prefix_v4 = v4;
+    config->remote_prefix_v6 = v6;
+
     return NULL;
 }
 
-static const char *mod_cband_set_exceeded_speed(cmd_parms *parms, void *mconfig, const char *arg1, const char *arg2, const char *arg3)
+static const char *mod_cband_set_global_speed(cmd_parms *parms, void *mconfig, const char *arg)
 {
     mod_cband_virtualhost_config_entry *entry;
+    const char *err;
 
-    if (mod_cband_check_virtualhost_command(&entry, parms, "CBandExceededSpeed") &&
-       (!mod_cband_check_duplicate((void *)entry->shmem_data->over_speed.kbps, "CBandExceededSpeed", arg1, parms->server))) {
-    	entry->shmem_data->over_speed.kbps     = mod_cband_conf_get_speed_kbps((char *)arg1);
-	entry->shmem_data->over_speed.rps      = atol((char *)arg2);
-	entry->shmem_data->over_speed.max_conn = atol((char *)arg3);
+    if ((err = ap_check_cmd_context(parms, GLOBAL_ONLY)) != NULL)
+	return err;
+
+    if (((entry = mod_cband_get_global_entry_(1)) != NULL) &&
+       (!mod_cband_check_duplicate((void *)entry->shmem_data->max_speed.kbps, "CBandGlobalSpeed", arg, parms->server))) {
+	entry->shmem_data->max_speed.kbps = entry->shmem_data->curr_speed.kbps = mod_cband_conf_get_speed_kbps((char *)arg);
+	entry->shmem_data->shared_kbps    = entry->shmem_data->curr_speed.kbps;
     }
-    
+
     return NULL;
 }
 
-static const char *mod_cband_set_scoreboard(cmd_parms *parms, void *mconfig, const char *arg)
+static const char *mod_cband_set_global_max_conn(cmd_parms *parms, void *mconfig, const char *arg)
 {
     mod_cband_virtualhost_config_entry *entry;
-    
-    if (mod_cband_check_virtualhost_command(&entry, parms, "CBandScoreboard") &&
-       (!mod_cband_check_duplicate(entry->virtual_scoreboard, "CBandScoreboard", arg, parms->server)))
-	entry->virtual_scoreboard = (char *)arg;
-      
+    const char *err;
+
+    if ((err = ap_check_cmd_context(parms, GLOBAL_ONLY)) != NULL)
+	return err;
+
+    if (((entry = mod_cband_get_global_entry_(1)) != NULL) &&
+       (!mod_cband_check_duplicate((void *)entry->shmem_data->max_speed.max_conn, "CBandGlobalMaxConn", arg, parms->server)))
+	entry->shmem_data->max_speed.max_conn = entry->shmem_data->curr_speed.max_conn = atol((char *)arg);
+
     return NULL;
 }
 
-static const char *mod_cband_set_user(cmd_parms *parms, void *mconfig, const char *arg)
+static const char *mod_cband_set_global_remote_speed(cmd_parms *parms, void *mconfig, const char *arg1, const char *arg2, const char *arg3)
 {
     mod_cband_virtualhost_config_entry *entry;
-    
-    if ((entry = mod_cband_get_virtualhost_entry(parms->server, parms->server->module_config, 1)) == NULL) {
-    	ap_log_error(APLOG_MARK, APLOG_WARNING, 0, parms->server, "Invalid command 'CBandUser %s', undefined virtualhost name", (char *)arg);
-	return NULL;
-    }
+    const char *err;
 
-    if (mod_cband_get_user_entry((char *)arg, parms->server->module_config, 0) == NULL)  {
-    	ap_log_error(APLOG_MARK, APLOG_WARNING, 0, parms->server, "Invalid command 'CBandUser %s', undefined user", (char *)arg);
-	return NULL;
-    }
+    if ((err = ap_check_cmd_context(parms, GLOBAL_ONLY)) != NULL)
+	return err;
+
+    if (((entry = mod_cband_get_global_entry_(1)) != NULL) &&
+       (!mod_cband_check_duplicate((void *)entry->shmem_data->remote_speed.kbps, "CBandGlobalRemoteSpeed", arg1, parms->server))) {
+    	entry->shmem_data->remote_speed.kbps     = mod_cband_conf_get_speed_kbps((char *)arg1);
+	entry->shmem_data->remote_speed.rps      = atol((char *)arg2);
+	entry->shmem_data->remote_speed.max_conn = atol((char *)arg3);
+    }
+
+    return NULL;
+}
+
+static const char *mod_cband_set_dir_speed(cmd_parms *parms, void *mconfig, const char *arg1, const char *arg2, const char *arg3)
+{
+    mod_cband_virtualhost_config_entry *entry;
+
+    if (mod_cband_check_dir_command(&entry, parms, (mod_cband_dir_config *)mconfig, "CBandDirSpeed") &&
+       (!mod_cband_check_duplicate((void *)entry->shmem_data->max_speed.kbps, "CBandDirSpeed", arg1, parms->server))) {
+    	entry->shmem_data->max_speed.kbps     = entry->shmem_data->curr_speed.kbps     = mod_cband_conf_get_speed_kbps((char *)arg1);
+	entry->shmem_data->max_speed.rps      = entry->shmem_data->curr_speed.rps      = atol((char *)arg2);
+	entry->shmem_data->max_speed.max_conn = entry->shmem_data->curr_speed.max_conn = atol((char *)arg3);
+	entry->shmem_data->shared_kbps        = entry->shmem_data->curr_speed.kbps;
+    }
+    
+    return NULL;
+}
+
+static const char *mod_cband_set_dir_limit(cmd_parms *parms, void *mconfig, const char *arg)
+{
+    mod_cband_virtualhost_config_entry *entry;
+
+    if (mod_cband_check_dir_command(&entry, parms, (mod_cband_dir_config *)mconfig, "CBandDirLimit") &&
+       (!mod_cband_check_duplicate((void *)entry->virtual_limit, "CBandDirLimit", arg, parms->server)))
+	entry->virtual_limit = mod_cband_conf_get_limit_kb((char *)arg, &entry->virtual_limit_mult);
+    
+    return NULL;
+}
+
+static const char *mod_cband_set_dir_period(cmd_parms *parms, void *mconfig, const char *arg)
+{
+    mod_cband_virtualhost_config_entry *entry;
+
+    if (mod_cband_check_dir_command(&entry, parms, (mod_cband_dir_config *)mconfig, "CBandDirPeriod") &&
+       (!mod_cband_check_duplicate((void *)entry->refresh_time, "CBandDirPeriod", arg, parms->server)))
+	entry->refresh_time = mod_cband_conf_get_period_sec((char *)arg);
+    
+    return NULL;
+}
+
+static const char *mod_cband_set_dir_scoreboard(cmd_parms *parms, void *mconfig, const char *arg)
+{
+    mod_cband_virtualhost_config_entry *entry;
+
+    if (mod_cband_check_dir_command(&entry, parms, (mod_cband_dir_config *)mconfig, "CBandDirScoreboard") &&
+       (!mod_cband_check_duplicate(entry->virtual_scoreboard, "CBandDirScoreboard", arg, parms->server)))
+	entry->virtual_scoreboard = (char *)arg;
+    
+    return NULL;
+}
+
+static const char *mod_cband_set_key(cmd_parms *parms, void *mconfig, const char *arg1, const char *arg2)
+{
+    mod_cband_virtualhost_config_entry *entry;
+    int key;
+
+    if (!strcasecmp(arg1, "ip"))
+	key = CBAND_KEY_IP;
+    else
+    if (!strcasecmp(arg1, "client"))
+	key = CBAND_KEY_CLIENT;
+    else
+    if (!strcasecmp(arg1, "header"))
+	key = CBAND_KEY_HEADER;
+    else
+    if (!strcasecmp(arg1, "cookie"))
+	key = CBAND_KEY_COOKIE;
+    else
+    if (!strcasecmp(arg1, "user"))
+	key = CBAND_KEY_USER;
+    else
+    if (!strcasecmp(arg1, "env"))
+	key = CBAND_KEY_ENV;
+    else
+	return apr_psprintf(parms->pool, "CBandKey: unknown key '%s'", arg1);
+
+    if (((key == CBAND_KEY_HEADER) || (key == CBAND_KEY_COOKIE) || (key == CBAND_KEY_ENV)) && (arg2 == NULL))
+	return apr_psprintf(parms->pool, "CBandKey %s needs a name", arg1);
+
+    if (mod_cband_check_virtualhost_command(&entry, parms, "CBandKey") &&
+       (!mod_cband_check_duplicate((void *)(long)entry->virtual_key, "CBandKey", arg1, parms->server))) {
+	entry->virtual_key      = key;
+	entry->virtual_key_name = (char *)arg2;
+    }
+
+    return NULL;
+}
+
+static const char *mod_cband_set_methods(cmd_parms *parms, void *mconfig, const char *arg)
+{
+    mod_cband_virtualhost_config_entry *entry;
+    int method;
+
+    if (!mod_cband_check_virtualhost_command(&entry, parms, "CBandMethods"))
+	return NULL;
+
+    if (!strcasecmp(arg, "ALL")) {
+	entry->virtual_methods = ~0ULL;
+	return NULL;
+    }
+
+    /* HEAD has the method number of GET */
+    if (((method = ap_method_number_of(arg)) == M_INVALID) || (method >= 64))
+	return apr_psprintf(parms->pool, "CBandMethods: unknown method '%s'", arg);
+
+    entry->virtual_methods |= (1ULL << method);
+
+    return NULL;
+}
+
+char *mod_cband_get_next_char(const char *str, char val)
+{
+    int i;
+
+    if (str == NULL)
+	return NULL;
+
+    for (i = 0; i < strlen(str); i++) {
+	if (str[i] == val) {
+	    return (char *)(str + i);
+	}
+    }
+    
+    return NULL;
+}
+
+char *mod_cband_get_next_notchar(const char *str, char val, int offset)
+{
+    int i;
+    char *ptr;
+
+    if (str == NULL)
+	return NULL;
+
+    if (offset)
+	str += strlen(str) + 1;
+
+    for (i = 0; i < strlen(str); i++) {
+	if (str[i] != val) {
+	    if ((ptr = mod_cband_get_next_char(str, val)) != NULL)
+		*ptr = 0;
+	    	    
+	    return (char *)(str + i);
+	}
+    }
+    
+    return NULL;
+}
+
+static const char *mod_cband_set_class_remote_speed(cmd_parms *parms, void *mconfig, const char *args)
+{
+    mod_cband_class_config_entry *entry;
+    mod_cband_virtualhost_config_entry *entry_virtual;
+    char *arg1, *arg2, *arg3, *arg4;
+    
+    arg1 = mod_cband_get_next_notchar(args, ' ', 0);
+    arg2 = mod_cband_get_next_notchar((const char *)arg1, ' ', 1);
+    arg3 = mod_cband_get_next_notchar((const char *)arg2, ' ', 1);
+    arg4 = mod_cband_get_next_notchar((const char *)arg3, ' ', 1);
+    
+    if (arg1 == NULL || arg2 == NULL || arg3 == NULL || arg4 == NULL) {
+	ap_log_error(APLOG_MARK, APLOG_WARNING, 0, parms->server, "CBandClassRemoteSpeed takes four arguments");
+	return NULL;
+    }
+    
+    if (mod_cband_check_virtualhost_class_command(&entry_virtual, &entry, parms, "CBandClassRemoteSpeed", arg1)) {
+	entry_virtual->virtual_class_speed[entry->class_nr].kbps     = mod_cband_conf_get_speed_kbps((char *)arg2);
+        entry_virtual->virtual_class_speed[entry->class_nr].rps      = atol((char *)arg3);
+	entry_virtual->virtual_class_speed[entry->class_nr].max_conn = atol((char *)arg4);
+    }
+    
+    return NULL;
+}
+
+static const char *mod_cband_set_exceeded_speed(cmd_parms *parms, void *mconfig, const char *arg1, const char *arg2, const char *arg3)
+{
+    mod_cband_virtualhost_config_entry *entry;
+
+    if (mod_cband_check_virtualhost_command(&entry, parms, "CBandExceededSpeed") &&
+       (!mod_cband_check_duplicate((void *)entry->shmem_data->over_speed.kbps, "CBandExceededSpeed", arg1, parms->server))) {
+    	entry->shmem_data->over_speed.kbps     = mod_cband_conf_get_speed_kbps((char *)arg1);
+	entry->shmem_data->over_speed.rps      = atol((char *)arg2);
+	entry->shmem_data->over_speed.max_conn = atol((char *)arg3);
+    }
+    
+    return NULL;
+}
+
+/*
+ * CBandSchedule "Mon-Fri 08:00-20:00" CBandSpeed 10Mbps 10 30
+ */
+static const char *mod_cband_set_schedule(cmd_parms *parms, void *mconfig, const char *args)
+{
+    mod_cband_virtualhost_config_entry *entry;
+    mod_cband_schedule *sched;
+    char *spec, *command, *arg1, *arg2, *arg3;
+    int idx;
+
+    spec    = ap_getword_conf(parms->pool, &args);
+    command = ap_getword_conf(parms->pool, &args);
+    arg1    = ap_getword_conf(parms->pool, &args);
+    arg2    = ap_getword_conf(parms->pool, &args);
+    arg3    = ap_getword_conf(parms->pool, &args);
+
+    if (!strcasecmp(command, "CBandSpeed"))
+	idx = SCHEDULE_SPEED;
+    else
+    if (!strcasecmp(command, "CBandRemoteSpeed"))
+	idx = SCHEDULE_REMOTE;
+    else
+    if (!strcasecmp(command, "CBandExceededSpeed"))
+	idx = SCHEDULE_EXCEEDED;
+    else
+	return "CBandSchedule: only CBandSpeed, CBandRemoteSpeed and CBandExceededSpeed can be scheduled";
+
+    if (*arg1 == 0)
+	return apr_pstrcat(parms->pool, "CBandSchedule: ", command, " kbps rps max_conn expected", NULL);
+
+    if (!mod_cband_check_virtualhost_command(&entry, parms, "CBandSchedule"))
+	return NULL;
+
+    if ((sched = mod_cband_get_schedule_(entry, spec, 1)) == NULL)
+	return apr_pstrcat(parms->pool, "CBandSchedule: invalid schedule \"", spec, "\", e.g. \"Mon-Fri 08:00-20:00\"", NULL);
+
+    sched->speed[idx].kbps     = mod_cband_conf_get_speed_kbps(arg1);
+    sched->speed[idx].rps      = atol(arg2);
+    sched->speed[idx].max_conn = atol(arg3);
+    sched->speed_set          |= 1 << idx;
+
+    return NULL;
+}
+
+static const char *mod_cband_set_scoreboard(cmd_parms *parms, void *mconfig, const char *arg)
+{
+    mod_cband_virtualhost_config_entry *entry;
+    
+    if (mod_cband_check_virtualhost_command(&entry, parms, "CBandScoreboard") &&
+       (!mod_cband_check_duplicate(entry->virtual_scoreboard, "CBandScoreboard", arg, parms->server)))
+	entry->virtual_scoreboard = (char *)arg;
+      
+    return NULL;
+}
+
+static const char *mod_cband_set_user(cmd_parms *parms, void *mconfig, const char *arg)
+{
+    mod_cband_virtualhost_config_entry *entry;
+    
+    if ((entry = mod_cband_get_virtualhost_entry(parms->server, parms->server->module_config, 1)) == NULL) {
+    	ap_log_error(APLOG_MARK, APLOG_WARNING, 0, parms->server, "Invalid command 'CBandUser %s', undefined virtualhost name", (char *)arg);
+	return NULL;
+    }
+
+    if (mod_cband_get_user_entry((char *)arg, parms->server->module_config, 0) == NULL)  {
+    	ap_log_error(APLOG_MARK, APLOG_WARNING, 0, parms->server, "Invalid command 'CBandUser %s', undefined user", (char *)arg);
+	return NULL;
+    }
     
     if (!mod_cband_check_duplicate(entry->virtual_user, "CBandUser", arg, parms->server))
 	entry->virtual_user = (char *)arg;
@@ -697,6 +803,20 @@ static const char *mod_cband_set_user_limit(cmd_parms *parms, void *mconfig, con
     return err;
 }
 
+static const char *mod_cband_set_user_rolling_limit(cmd_parms *parms, void *mconfig, const char *limit, const char *window)
+{
+    mod_cband_user_config_entry *entry;
+    const char *err;
+
+    if (mod_cband_check_user_command(&entry, parms, "CBandUserRollingLimit", &err) &&
+       (!mod_cband_check_duplicate((void *)entry->user_roll_limit, "CBandUserRollingLimit", limit, parms->server))) {
+	entry->user_roll_limit = mod_cband_conf_get_limit_kb((char *)limit, &entry->user_roll_limit_mult);
+	entry->roll_window = mod_cband_conf_get_period_sec((char *)window);
+    }
+
+    return err;
+}
+
 static const char *mod_cband_set_user_period(cmd_parms *parms, void *mconfig, const char *arg)
 {
     mod_cband_user_config_entry *entry;
@@ -764,6 +884,30 @@ static const char *mod_cband_set_user_remote_speed(cmd_parms *parms, void *mconf
     return err;
 }
 
+static const char *mod_cband_set_user_upload_speed(cmd_parms *parms, void *mconfig, const char *arg)
+{
+    mod_cband_user_config_entry *entry;
+    const char *err;
+
+    if (mod_cband_check_user_command(&entry, parms, "CBandUserUploadSpeed", &err) &&
+       (!mod_cband_check_duplicate((void *)entry->shmem_data->upload_kbps, "CBandUserUploadSpeed", arg, parms->server)))
+	entry->shmem_data->upload_kbps = mod_cband_conf_get_speed_kbps((char *)arg);
+
+    return err;
+}
+
+static const char *mod_cband_set_user_upload_limit(cmd_parms *parms, void *mconfig, const char *arg)
+{
+    mod_cband_user_config_entry *entry;
+    const char *err;
+
+    if (mod_cband_check_user_command(&entry, parms, "CBandUserUploadLimit", &err) &&
+       (!mod_cband_check_duplicate((void *)entry->user_upload_limit, "CBandUserUploadLimit", arg, parms->server)))
+	entry->user_upload_limit = mod_cband_conf_get_limit_kb((char *)arg, &entry->user_upload_limit_mult);
+
+    return err;
+}
+
 static const char *mod_cband_set_user_exceeded_speed(cmd_parms *parms, void *mconfig, const char *arg1, const char *arg2, const char *arg3)
 {
     mod_cband_user_config_entry *entry;
@@ -871,23 +1015,13 @@ static const char *mod_cband_class_section(cmd_parms *parms, void *mconfig, cons
 
 static const char *mod_cband_set_class_dst(cmd_parms *parms, void *mconfig, const char *arg)
 {
-    patricia_node_t *node;
-    char class_nr_str[MAX_CLASS_STR_LEN];
-
-    if (config->tree == NULL)
-	config->tree = New_Patricia(32); 
-
     if ((class_nr < DST_CLASS) && (mod_cband_check_IP((char *)arg))) {
 #ifdef DEBUG
 	fprintf(stderr, "apache2_mod_cband: class dst %s (class %d)\n", (char *)arg, class_nr);
 	fflush(stderr);
 #endif
     
-        sprintf(class_nr_str, "%d", class_nr);
-	node = make_and_lookup(config->tree, (char *)arg);
-		
-	if (node)
-    	    node->user1 = apr_pstrdup(config->p, class_nr_str);
+	mod_cband_add_class_dst((char *)arg, class_nr);
     } else {
 	if (class_nr >= DST_CLASS) {
 	    ap_log_error(APLOG_MARK, APLOG_WARNING, 0, parms->server, "You can define only %d destination classes", DST_CLASS);
@@ -899,6 +1033,21 @@ static const char *mod_cband_set_class_dst(cmd_parms *parms, void *mconfig, cons
     return NULL;
 }
 
+static const char *mod_cband_set_class_priority(cmd_parms *parms, void *mconfig, const char *arg)
+{
+    int priority = atoi((char *)arg);
+
+    if ((class_nr < 0) || (class_nr >= DST_CLASS))
+	return NULL;
+
+    if ((priority < 0) || (priority >= MAX_PRIORITY))
+	return apr_psprintf(parms->pool, "CBandClassPriority: the priority must be 0-%d", MAX_PRIORITY - 1);
+
+    config->class_priority[class_nr] = priority;
+
+    return NULL;
+}
+
 static const char *mod_cband_set_class_limit(cmd_parms *parms, void *mconfig, const char *arg, const char *limit)
 {
     mod_cband_class_config_entry *entry;
@@ -1147,6 +1296,14 @@ static const command_rec mod_cband_cmds[] =
       "CBandPeriodSlice - Specifies number of bandwidth slices"
     ),
 
+  AP_INIT_TAKE2(
+      "CBandRollingLimit",
+      mod_cband_set_rolling_limit,
+      NULL,
+      RSRC_CONF,
+      "CBandRollingLimit - The limit bandwidth in KB for virtualhost within any window of the given time"
+    ),
+
   AP_INIT_TAKE1(
       "CBandExceededURL",
       mod_cband_set_url,
@@ -1155,6 +1312,14 @@ static const command_rec mod_cband_cmds[] =
       "CBandExceededURL - The URL to redirect when virtualhost's bandwidth is exceeded."
     ),
 
+  AP_INIT_RAW_ARGS(
+      "CBandSchedule",
+      mod_cband_set_schedule,
+      NULL,
+      RSRC_CONF,
+      "CBandSchedule - CBandSpeed, CBandRemoteSpeed or CBandExceededSpeed in a time window, e.g. \"Mon-Fri 08:00-20:00\"."
+    ),
+
   AP_INIT_TAKE3 (
       "CBandSpeed",
       mod_cband_set_speed,
@@ -1187,38 +1352,142 @@ static const command_rec mod_cband_cmds[] =
       "CBandExceededSpeed - Over limit speed for virtualhost."
     ),
 
-  AP_INIT_TAKE1(
-      "CBandScoreboard",
-      mod_cband_set_scoreboard,
+  AP_INIT_TAKE12(
+      "CBandRemotePrefixLen",
+      mod_cband_set_remote_prefix_len,
       NULL,
       RSRC_CONF,
-      "CBandScoreboard - The path to the virtualhost's scoreboard file."
+      "CBandRemotePrefixLen - Prefix length of the IPv4 and IPv6 networks whose clients share the remote limits."
     ),
 
   AP_INIT_TAKE1(
-      "CBandUser",
-      mod_cband_set_user,
+      "CBandGlobalSpeed",
+      mod_cband_set_global_speed,
       NULL,
       RSRC_CONF,
-      "CBandUser - virtualhost user owner."
+      "CBandGlobalSpeed - Maximal speed of the whole server, shared by all virtualhosts."
     ),
 
-  AP_INIT_RAW_ARGS(
-      "<CBandUser", 
-      mod_cband_user_section, 
+  AP_INIT_TAKE1(
+      "CBandGlobalMaxConn",
+      mod_cband_set_global_max_conn,
       NULL,
       RSRC_CONF,
-      "CBandUser section"
+      "CBandGlobalMaxConn - Maximal number of connections of the whole server."
     ),
 
-  AP_INIT_TAKE1(
-      "CBandUserLimit",
-      mod_cband_set_user_limit,
+  AP_INIT_TAKE3(
+      "CBandGlobalRemoteSpeed",
+      mod_cband_set_global_remote_speed,
+      NULL,
+      RSRC_CONF,
+      "CBandGlobalRemoteSpeed - Maximal speed of one remote client in all virtualhosts."
+    ),
+
+  AP_INIT_TAKE3(
+      "CBandDirSpeed",
+      mod_cband_set_dir_speed,
+      NULL,
+      ACCESS_CONF,
+      "CBandDirSpeed - Maximal speed for <Location> or <Directory>."
+    ),
+
+  AP_INIT_TAKE1(
+      "CBandDirLimit",
+      mod_cband_set_dir_limit,
+      NULL,
+      ACCESS_CONF,
+      "CBandDirLimit - The limit bandwidth in KB for <Location> or <Directory>."
+    ),
+
+  AP_INIT_TAKE1(
+      "CBandDirPeriod",
+      mod_cband_set_dir_period,
+      NULL,
+      ACCESS_CONF,
+      "CBandDirPeriod - The time after the usage of <Location> or <Directory> will be cleared"
+    ),
+
+  AP_INIT_TAKE1(
+      "CBandDirScoreboard",
+      mod_cband_set_dir_scoreboard,
+      NULL,
+      ACCESS_CONF,
+      "CBandDirScoreboard - The path to the scoreboard file of <Location> or <Directory>."
+    ),
+
+  AP_INIT_TAKE12(
+      "CBandKey",
+      mod_cband_set_key,
+      NULL,
+      RSRC_CONF,
+      "CBandKey - What identifies a remote client: ip, client, header name, cookie name, user or env name."
+    ),
+
+  AP_INIT_ITERATE(
+      "CBandMethods",
+      mod_cband_set_methods,
+      NULL,
+      RSRC_CONF,
+      "CBandMethods - HTTP methods which are counted, limited and shaped, GET by default."
+    ),
+
+  AP_INIT_TAKE1(
+      "CBandUploadSpeed",
+      mod_cband_set_upload_speed,
+      NULL,
+      RSRC_CONF,
+      "CBandUploadSpeed - Maximal speed of request bodies for virtualhost."
+    ),
+
+  AP_INIT_TAKE1(
+      "CBandUploadLimit",
+      mod_cband_set_upload_limit,
+      NULL,
+      RSRC_CONF,
+      "CBandUploadLimit - The limit of request bodies in KB for virtualhost."
+    ),
+
+  AP_INIT_TAKE1(
+      "CBandScoreboard",
+      mod_cband_set_scoreboard,
+      NULL,
+      RSRC_CONF,
+      "CBandScoreboard - The path to the virtualhost's scoreboard file."
+    ),
+
+  AP_INIT_TAKE1(
+      "CBandUser",
+      mod_cband_set_user,
+      NULL,
+      RSRC_CONF,
+      "CBandUser - virtualhost user owner."
+    ),
+
+  AP_INIT_RAW_ARGS(
+      "<CBandUser", 
+      mod_cband_user_section, 
+      NULL,
+      RSRC_CONF,
+      "CBandUser section"
+    ),
+
+  AP_INIT_TAKE1(
+      "CBandUserLimit",
+      mod_cband_set_user_limit,
       NULL,
       RSRC_CONF,
       "CBandUserLimit - The limit bandwidth in KB for user."
     ),
 
+  AP_INIT_TAKE2(
+      "CBandUserRollingLimit",
+      mod_cband_set_user_rolling_limit,
+      NULL,
+      RSRC_CONF,
+      "CBandUserRollingLimit - The limit bandwidth in KB for user within any window of the given time"
+    ),
+
   AP_INIT_TAKE1(
       "CBandUserPeriod",
       mod_cband_set_user_period,
@@ -1267,6 +1536,22 @@ static const command_rec mod_cband_cmds[] =
       "CBandUserExceededSpeed - Over limit speed for user."
     ),
 
+  AP_INIT_TAKE1(
+      "CBandUserUploadSpeed",
+      mod_cband_set_user_upload_speed,
+      NULL,
+      RSRC_CONF,
+      "CBandUserUploadSpeed - Maximal speed of request bodies for user."
+    ),
+
+  AP_INIT_TAKE1(
+      "CBandUserUploadLimit",
+      mod_cband_set_user_upload_limit,
+      NULL,
+      RSRC_CONF,
+      "CBandUserUploadLimit - The limit of request bodies in KB for user."
+    ),
+
   AP_INIT_TAKE1(
       "CBandUserScoreboard",
       mod_cband_set_user_scoreboard,
@@ -1291,6 +1576,14 @@ static const command_rec mod_cband_cmds[] =
       "CBandClassDst"
     ),
 
+  AP_INIT_TAKE1(
+      "CBandClassPriority",
+      mod_cband_set_class_priority,
+      NULL,
+      RSRC_CONF,
+      "CBandClassPriority - Priority of the class for the shared speeds, 0 is the lowest."
+    ),
+
   AP_INIT_TAKE2(
       "CBandClassLimit",
       mod_cband_set_class_limit,
@@ -1318,1758 +1611,2005 @@ apr_status_t patricia_cleanup(void *p)
     return APR_SUCCESS;
 }
 
-int mod_cband_get_dst(request_rec *r) 
+
+
+
+
+void mod_cband_status_print_limit(request_rec *req, unsigned long limit, unsigned long usage, char *unit, unsigned int mult, unsigned long slice_limit)
 {
-    patricia_node_t *node;
-    prefix_t p;
-    char *leaf;
-	      
-    if (config->tree == NULL)
-	return -1;
+    unsigned char normal_r, normal_g, normal_b;
+    unsigned char exceeded_r, exceeded_g, exceeded_b;
+    unsigned char r, g, b;
+    const char *color;
+    float u;
+
+    if (slice_limit == 0)
+	slice_limit = limit;
+        
+    exceeded_r = 0xff;
+    exceeded_g = 0x30;
+    exceeded_b = 0x50;
+    normal_r = 0x30;
+    normal_g = 0xf0;
+    normal_b = 0x30;
+        
+    if (limit == (unsigned long)0) 
+        ap_rprintf(req, "<td style=\"background-color: yellow\">U/U/%s</td>\n", mod_cband_create_traffic_size(req->pool, usage, unit, mult));
+    else {
+	if (usage < limit) {
+	    r = normal_r;
+	    g = normal_g;
+	    b = normal_b;
+	    if (usage > 0) {
+		u = (float)usage / limit;
+		r += (unsigned char)((float)(exceeded_r - normal_r) * u);
+		g -= (unsigned char)((float)(normal_g - exceeded_g) * u);
+		b += (unsigned char)((float)(exceeded_b - normal_b) * u);
+	    }
+	} else {
+	    r = exceeded_r;
+	    g = exceeded_g;
+	    b = exceeded_b;
+	}
     
-    p.bitlen = 32;
-    p.ref_count = 0;
-    p.family = AF_INET;
-#if (AP_SERVER_MAJORVERSION_NUMBER) >= 2 && (AP_SERVER_MINORVERSION_NUMBER) >= 4
-    p.add.sin.s_addr = inet_addr(r->connection->client_ip);
-#else
-    p.add.sin.s_addr = inet_addr(r->connection->remote_ip);
-#endif
-	      
-    node = patricia_search_best(config->tree, &p);
-				    
-    if (node) {
-        leaf = node->user1;
-					            
-        if (leaf) {
-#ifdef DEBUG
-#if (AP_SERVER_MAJORVERSION_NUMBER) >= 2 && (AP_SERVER_MINORVERSION_NUMBER) >= 4
-            fprintf(stderr,"%s leaf %s\n",r->connection->client_ip,leaf);
-#else
-            fprintf(stderr,"%s leaf %s\n",r->connection->remote_ip,leaf);
-#endif
-            fflush(stderr);
-#endif
-	    return atoi(leaf);
-        }
+	if (usage < limit / 2)
+	    color = "black";
+	else
+	    color = "white";
+	    
+	ap_rprintf(req, "<td style=\"color: %s; background-color: #%02X%02X%02X\">%s/%s/%s</td>\n", color, r, g, b, mod_cband_create_traffic_size(req->pool, limit, unit, mult), mod_cband_create_traffic_size(req->pool, slice_limit, unit, mult), mod_cband_create_traffic_size(req->pool, usage, unit, mult));
     }
-    
-    return -1;
 }
 
-int mod_cband_get_remote_host(struct conn_rec *c, int create, mod_cband_virtualhost_config_entry *entry)
+void mod_cband_status_print_speed(request_rec *req, unsigned long limit, float usage)
 {
-    int i;
-    mod_cband_remote_host *hosts;
-    unsigned long time_now, time_delta;
-    in_addr_t addr;
-    
-    if (entry == NULL)
-	return -1;
+    unsigned char normal_r, normal_g, normal_b;
+    unsigned char exceeded_r, exceeded_g, exceeded_b;
+    unsigned char r, g, b;
+    const char *color;
+    float u;
     
-#if (AP_SERVER_MAJORVERSION_NUMBER) >= 2 && (AP_SERVER_MINORVERSION_NUMBER) >= 4
-    if (c->client_ip != NULL)
-	addr = inet_addr(c->client_ip);    
-    else
-	addr = c->client_addr->sa.sin.sin_addr.s_addr;
-#else
-    if (c->remote_ip != NULL)
-	addr = inet_addr(c->remote_ip);    
-    else
-	addr = c->remote_addr->sa.sin.sin_addr.s_addr;
-#endif
+    exceeded_r = 0xff;
+    exceeded_g = 0x20;
+    exceeded_b = 0x20;
+    normal_r = 0xf0;
+    normal_g = 0xa1;
+    normal_b = 0xa1;
+        
+    if (limit == (unsigned long)0) 
+        ap_rprintf(req, "<td class=\"speed\">U/%0.2f</td>\n", usage);
+    else {
+	if (usage < limit) {
+	    r = normal_r;
+	    g = normal_g;
+	    b = normal_b;
 	
-    time_now = apr_time_now();     
-    hosts = config->remote_hosts.hosts;
+	    if (usage > 0) {
+		u = (float)usage / limit;
+		g -= (unsigned char)((float)(normal_g - exceeded_g) * u);
+	    	b -= (unsigned char)((float)(normal_b - exceeded_b) * u);
+	    }
+	} else {
+	    r = exceeded_r;
+	    g = exceeded_g;
+	    b = exceeded_b;
+	}
 
-    if (hosts == NULL)
-	return -1;
+	if (usage < limit / 2)
+	    color = "black";
+	else
+	    color = "white";
     
-    /* BEGIN CRITICAL SECTION */
-    mod_cband_sem_down(config->remote_hosts.sem_id);
-    for (i = 0; i < MAX_REMOTE_HOSTS; i++) {
-	time_delta = (time_now - hosts[i].remote_last_time) / 1e6;
-	if (hosts[i].used && ((time_delta <= MAX_REMOTE_HOST_LIFE) || (hosts[i].remote_conn > 0)) &&
-	   (hosts[i].remote_addr == addr) && (hosts[i].virtual_name == entry->virtual_name)) {
-	    mod_cband_sem_up(config->remote_hosts.sem_id);
-	    /* END CRITICAL SECTION */
-	    return i; 
-	}
+	ap_rprintf(req, "<td style=\"color: %s; background-color: #%02X%02X%02X\">%lu/%0.2f</td>\n", color, r, g, b, limit, usage);
     }
+}
 
-    if (create) {    
-	for (i = 0; i < MAX_REMOTE_HOSTS; i++) {
-	    time_delta = (time_now - hosts[i].remote_last_time) / 1e6;
-	    if ((hosts[i].used == 0) || ((time_delta > MAX_REMOTE_HOST_LIFE) && (hosts[i].remote_conn <= 0))) {
-		memset(&hosts[i], 0, sizeof(mod_cband_remote_host));
-		hosts[i].used                = 1;
-		hosts[i].remote_addr         = addr;
-		hosts[i].remote_last_time    = time_now;
-		hosts[i].remote_last_refresh = time_now;
-		hosts[i].virtual_name        = entry->virtual_name;
-		mod_cband_sem_up(config->remote_hosts.sem_id);
-		/* END CRITICAL SECTION */
-		return i; 
+void mod_cband_status_print_connections(request_rec *req, unsigned long limit, unsigned long usage)
+{
+    unsigned char normal_r, normal_g, normal_b;
+    unsigned char exceeded_r, exceeded_g, exceeded_b;
+    unsigned char r, g, b;
+    const char *color;
+    float u;
+
+    exceeded_r = 0x36;
+    exceeded_g = 0x55;
+    exceeded_b = 0xad;
+    normal_r = 0xb4;
+    normal_g = 0xbf;
+    normal_b = 0xff;
+        
+    if (limit == (unsigned long)0) 
+        ap_rprintf(req, "<td class=remote_odd>U/%lu</td>\n", usage);
+    else {
+	if (usage < limit) {
+	    r = normal_r;
+	    g = normal_g;
+	    b = normal_b;
+	    if (usage > 0) {
+		u = (float)usage / limit;
+		r -= (unsigned char)((float)(normal_r - exceeded_r) * u);
+		g -= (unsigned char)((float)(normal_g - exceeded_g) * u);
+		b -= (unsigned char)((float)(normal_b - exceeded_b) * u);
 	    }
+	} else {
+	    r = exceeded_r;
+	    g = exceeded_g;
+	    b = exceeded_b;
 	}
-    }
-    mod_cband_sem_up(config->remote_hosts.sem_id);
-    /* END CRITICAL SECTION */
 
-    return -1;
+	if (usage <= limit / 2)
+	    color = "black";
+	else
+	    color = "white";
+    
+	ap_rprintf(req, "<td style=\"color: %s; background-color: #%02X%02X%02X\">%lu/%lu</td>\n", color, r, g, b, limit, usage);
+    }
 }
 
-void mod_cband_safe_change(unsigned long *val, int diff)
-{
-    if (val == NULL)
-	return;
+void mod_cband_status_print_virtualhost_row(request_rec *r, mod_cband_virtualhost_config_entry *entry,
+	mod_cband_shmem_data *data, int handler_type, int refresh, char *unit) {
+    
+    mod_cband_scoreboard_entry *virtual_usage;
+    unsigned long slice_limit;
+    float bps, rps;
+    int i;
 
-    if ((diff > 0) || (diff < 0 && *val >= -diff))
-	*val += diff;
-    else
-	*val = 0;
-}
+    virtual_usage = &data->total_usage;
+	    
+    ap_rputs("<tr>\n", r);
+    ap_rprintf(r, "<td><a href=\"http://%s\">%s</a>:%d:(%d)</td>\n", entry->virtual_name, entry->virtual_name, entry->virtual_port, entry->virtual_defn_line);	
+    if (handler_type == CBAND_HANDLER_ALL)
+	ap_rprintf(r, "<td><a href=\"?reset=%s:%d:%d&amp;refresh=%d&amp;unit=%s\">reset</a></td>\n", entry->virtual_name, entry->virtual_port, entry->virtual_defn_line, refresh, unit);
+    ap_rprintf(r, "<td class=\"refresh\">%s</td>\n", mod_cband_create_period(r->pool, virtual_usage->start_time, entry->refresh_time));	
 
-int mod_cband_change_remote_connections_lock(int index, int diff)
-{
-    if (index < 0)
-	return -1;
+    slice_limit = mod_cband_get_slice_limit(virtual_usage->start_time, entry->refresh_time, entry->slice_len, entry->virtual_limit);
+    mod_cband_status_print_limit(r, entry->virtual_limit, (unsigned long)(virtual_usage->total_bytes / entry->virtual_limit_mult),
+	unit, entry->virtual_limit_mult, slice_limit);
 
-    /* BEGIN CRITICAL SECTION */
-    mod_cband_sem_down(config->remote_hosts.sem_id);
-    mod_cband_safe_change(&config->remote_hosts.hosts[index].remote_conn, diff);
-    mod_cband_sem_up(config->remote_hosts.sem_id);
-    /* END CRITICAL SECTION */
+    for (i = 0; i < DST_CLASS; i++) {
+        slice_limit = mod_cband_get_slice_limit(virtual_usage->start_time, entry->refresh_time, entry->slice_len, entry->virtual_class_limit[i]);
+	mod_cband_status_print_limit(r, entry->virtual_class_limit[i], (unsigned long)(virtual_usage->class_bytes[i] / entry->virtual_class_limit_mult[i]),
+	    unit, entry->virtual_class_limit_mult[i], slice_limit);
+    }
 
-    return 0;
+    mod_cband_get_real_speed(data, &bps, &rps);
+    mod_cband_status_print_speed(r, data->curr_speed.kbps, bps / 1024);
+    mod_cband_status_print_speed(r, data->curr_speed.rps,  rps);
+    mod_cband_status_print_connections(r, data->curr_speed.max_conn, data->total_conn);
+
+    if (entry->virtual_user)
+        ap_rprintf(r, "<td>%s</td>\n", entry->virtual_user);	
+    else
+	ap_rprintf(r, "<td>none</td>\n");	
+
+    ap_rputs("</tr>\n", r);
 }
 
-/* 
- * Nie trzeba semafora, poniewaz operacje na liczbach 32-bit sa atomowe
- */
-int mod_cband_set_remote_request_time(int index, unsigned long time)
-{
-    if (index < 0)
-	return -1;
+void mod_cband_status_print_user_row(request_rec *r, mod_cband_user_config_entry *entry_user,
+	mod_cband_shmem_data *data, int handler_type, int refresh, char *unit) {
+    
+    mod_cband_scoreboard_entry *user_usage;
+    unsigned long slice_limit;
+    float bps, rps;
+    int i;
 
-    config->remote_hosts.hosts[index].remote_last_time = time;
+    user_usage = &data->total_usage;
+	    
+    ap_rputs("<tr>\n", r);
+    ap_rprintf(r, "<td>%s</td>\n", entry_user->user_name);	
+    if (handler_type == CBAND_HANDLER_ALL)
+	ap_rprintf(r, "<td><a href=\"?reset_user=%s&amp;refresh=%d&amp;unit=%s\">reset</a></td>\n", entry_user->user_name, refresh, unit);
+    ap_rprintf(r, "<td class=\"refresh\">%s</td>\n", mod_cband_create_period(r->pool, user_usage->start_time, entry_user->refresh_time));
 
-    return 0;
-}
+    slice_limit = mod_cband_get_slice_limit(user_usage->start_time, entry_user->refresh_time, entry_user->slice_len, entry_user->user_limit);
+    mod_cband_status_print_limit(r, entry_user->user_limit, (unsigned long)(user_usage->total_bytes / entry_user->user_limit_mult),
+	unit, entry_user->user_limit_mult, slice_limit);
 
-/* 
- * Nie trzeba semafora, poniewaz operacje na liczbach 32-bit sa atomowe
- */
-int mod_cband_set_remote_current_speed(int index, unsigned long kbps)
-{
-    if (index < 0)
-	return -1;
+    for (i = 0; i < DST_CLASS; i++) {
+        slice_limit = mod_cband_get_slice_limit(user_usage->start_time, entry_user->refresh_time, entry_user->slice_len, entry_user->user_class_limit[i]);
+	mod_cband_status_print_limit(r, entry_user->user_class_limit[i], (unsigned long)(user_usage->class_bytes[i] / entry_user->user_class_limit_mult[i]),
+	    unit, entry_user->user_class_limit_mult[i], slice_limit);
+    }
 
-    config->remote_hosts.hosts[index].remote_kbps = kbps;
+    mod_cband_get_real_speed(data, &bps, &rps);
+    mod_cband_status_print_speed(r, data->curr_speed.kbps, bps / 1024);
+    mod_cband_status_print_speed(r, data->curr_speed.rps,  rps);
+    mod_cband_status_print_connections(r, data->curr_speed.max_conn, data->total_conn);
 
-    return 0;
+    ap_rputs("</tr>\n", r);
 }
 
-/* 
- * Nie trzeba semafora, poniewaz operacje na liczbach 32-bit sa atomowe
- */
-int mod_cband_set_remote_max_connections(int index, unsigned long max)
-{
-    if (index < 0)
-	return -1;
+static const char *mod_cband_hist_names[HIST_TYPES] = { "sleep_us", "admission_wait_us", "admission_loops" };
 
-    config->remote_hosts.hosts[index].remote_max_conn = max;
+void mod_cband_status_print_delays_XML(request_rec *r, mod_cband_shmem_data *data)
+{
+    mod_cband_hist_summary summary;
+    int i;
 
-    return 0;
+    ap_rprintf(r, "\t\t\t<delays>\n");
+    for (i = 0; i < HIST_TYPES; i++) {
+	mod_cband_hist_summarize(&data->hist[i], &summary);
+	ap_rprintf(r, "\t\t\t\t<%s count=\"%llu\" sum=\"%llu\" p50=\"%lu\" p90=\"%lu\" p99=\"%lu\"/>\n", mod_cband_hist_names[i],
+	    summary.count, summary.sum, summary.p50, summary.p90, summary.p99);
+    }
+    ap_rprintf(r, "\t\t\t</delays>\n");
 }
 
-/* 
- * Nie trzeba semafora, poniewaz operacje na liczbach 32-bit sa atomowe
- */
-int mod_cband_set_remote_last_refresh(int index, unsigned long time)
-{
-    if (index < 0)
-	return -1;
+void mod_cband_status_print_virtualhost_XML_row(request_rec *r, mod_cband_virtualhost_config_entry *entry,
+	mod_cband_shmem_data *data, int handler_type) {
 
-    config->remote_hosts.hosts[index].remote_last_refresh = time;
+    float bps, rps;
+    mod_cband_class_config_entry *entry_class;
+    mod_cband_scoreboard_entry *virtual_usage;
+    int i;
 
-    return 0;
-}
+    virtual_usage = &data->total_usage;
 
-/* 
- * Nie trzeba semafora, poniewaz operacje na liczbach 32-bit sa atomowe
- */
-int mod_cband_set_remote_total_connections(int index, unsigned long set)
-{
-    if (index < 0)
-	return -1;
+    mod_cband_get_real_speed(data, &bps, &rps);
+	    
+    ap_rprintf(r, "\t\t<virtualhost>\n");
+    ap_rprintf(r, "\t\t\t<name>%s</name>\n", entry->virtual_name);
+    ap_rprintf(r, "\t\t\t<port>%d</port>\n", entry->virtual_port);
+    ap_rprintf(r, "\t\t\t<line>%d</line>\n", entry->virtual_defn_line);
+    ap_rprintf(r, "\t\t\t<limits>\n");
+ 	    
+    ap_rprintf(r, "\t\t\t\t<total>%lu%s</total>\n", entry->virtual_limit,
+	      (entry->virtual_limit_mult == 1024 ? "KiB" : "KB"));
 
-    config->remote_hosts.hosts[index].remote_total_conn = set;
+    entry_class = config->next_class;
+    i = 0;
+    while(entry_class != NULL) {
+	ap_rprintf(r, "\t\t\t\t<%s>%lu%s</%s>\n", entry_class->class_name, entry->virtual_class_limit[i],
+        (entry->virtual_class_limit_mult[i] == 1024 ? "KiB" : "KB"), entry_class->class_name);
+	i++;
+        entry_class = entry_class->next;
+    }
+    ap_rprintf(r, "\t\t\t\t<kbps>%lu</kbps>\n", data->curr_speed.kbps);
+    ap_rprintf(r, "\t\t\t\t<rps>%lu</rps>\n", data->curr_speed.rps);
+    ap_rprintf(r, "\t\t\t\t<connections>%lu</connections>\n", data->curr_speed.max_conn);
+    ap_rprintf(r, "\t\t\t</limits>\n");
 
-    return 0;
-}
+    ap_rprintf(r, "\t\t\t<usages>\n");
+    ap_rprintf(r, "\t\t\t\t<total>%luKiB</total>\n", (unsigned long)(virtual_usage->total_bytes / 1024));
+    entry_class = config->next_class;
+    i = 0;
+    while(entry_class != NULL) {
+        ap_rprintf(r, "\t\t\t\t<%s>%lu%s</%s>\n", entry_class->class_name,
+	    (unsigned long)(virtual_usage->class_bytes[i] / entry->virtual_class_limit_mult[i]),
+	    (entry->virtual_class_limit_mult[i] == 1024 ? "KiB" : "KB"), entry_class->class_name);
+        i++;
+        entry_class = entry_class->next;
+    }
+    ap_rprintf(r, "\t\t\t\t<kbps>%0.2f</kbps>\n", bps / 1024);
+    ap_rprintf(r, "\t\t\t\t<rps>%0.2f</rps>\n", rps);
+    ap_rprintf(r, "\t\t\t\t<connections>%lu</connections>\n", data->total_conn);
+    ap_rprintf(r, "\t\t\t</usages>\n");
+    mod_cband_status_print_delays_XML(r, data);
 
-/* 
- * Nie trzeba semafora, poniewaz operacje na liczbach 32-bit sa atomowe
- */
-int mod_cband_get_remote_total_connections(int index)
-{
-    if (index < 0)
-	return -1;
+    ap_rprintf(r, "<time_to_refresh>%s</time_to_refresh>", mod_cband_create_period(r->pool, virtual_usage->start_time, entry->refresh_time));
+    
+    if (entry->virtual_user)
+	ap_rprintf(r, "\t\t\t<user>%s</user>\n", entry->virtual_user);
+    else
+    	ap_rprintf(r, "\t\t\t<user>none</user>\n");	
+
+    if (entry->virtual_scoreboard)
+	ap_rprintf(r, "\t\t\t<scoreboard>%s</scoreboard>\n", entry->virtual_scoreboard);	
+    else
+    	ap_rprintf(r, "\t\t\t<scoreboard>none</scoreboard>\n");	
+
+    if (entry->virtual_limit_exceeded)
+	ap_rprintf(r, "\t\t\t<limit_exceeded_URL>%s</limit_exceeded_URL>\n", entry->virtual_limit_exceeded);	
+    else
+    	ap_rprintf(r, "\t\t\t<limit_exceeded_URL>none</limit_exceeded_URL>\n");	
 
-    return config->remote_hosts.hosts[index].remote_conn;
+    ap_rprintf(r, "\t\t</virtualhost>\n");
 }
 
-float mod_cband_get_remote_connections_speed_lock(int index)
-{
-    unsigned long time_now;
-    float time_delta;
-    float rps = 0;
+void mod_cband_status_print_user_XML_row(request_rec *r, mod_cband_user_config_entry *entry_user,
+	mod_cband_shmem_data *data, int handler_type) {
     
-    if (index < 0)
-	return 0;
+    float bps, rps;
+    mod_cband_class_config_entry *entry_class;
+    mod_cband_scoreboard_entry *user_usage;
+    int i;
 
-    time_now = apr_time_now();
+    user_usage = &data->total_usage;
+
+    mod_cband_get_real_speed(data, &bps, &rps);
     
-    /* BEGIN CRITICAL SECTION */
-    mod_cband_sem_down(config->remote_hosts.sem_id);
-    time_delta = (float)(time_now - config->remote_hosts.hosts[index].remote_last_refresh) / 1e6;
-    if (time_delta > 0)
-	rps = (float)(config->remote_hosts.hosts[index].remote_total_conn) / time_delta;
-    mod_cband_sem_up(config->remote_hosts.sem_id);
-    /* END CRITICAL SECTION */
+    ap_rprintf(r, "\t\t<%s>\n", entry_user->user_name);	
+    ap_rprintf(r, "\t\t\t<limits>\n");
+    ap_rprintf(r, "\t\t\t\t<total>%lu%s</total>\n", entry_user->user_limit,
+    (entry_user->user_limit_mult == 1024 ? "KiB" : "KB"));
 
-    return rps;
-}
+    entry_class = config->next_class;
+    i = 0;
+    while(entry_class != NULL) {
+	ap_rprintf(r, "\t\t\t\t<%s>%lu%s</%s>\n", entry_class->class_name, entry_user->user_class_limit[i],
+	          (entry_user->user_class_limit_mult[i] == 1024 ? "KiB" : "KB"), entry_class->class_name);
+	i++;
+        entry_class = entry_class->next;
+    }
+    
+    ap_rprintf(r, "\t\t\t\t<kbps>%lu</kbps>\n", data->curr_speed.kbps);
+    ap_rprintf(r, "\t\t\t\t<rps>%lu</rps>\n", data->curr_speed.rps);
+    ap_rprintf(r, "\t\t\t\t<connections>%lu</connections>\n", data->curr_speed.max_conn);
+    ap_rprintf(r, "\t\t\t</limits>\n");
 
-int mod_cband_change_remote_total_connections_lock(int index, unsigned long diff)
-{
-    if (index < 0)
-	return -1;
+    ap_rprintf(r, "\t\t\t<usages>\n");
+    ap_rprintf(r, "\t\t\t\t<total>%luKiB</total>\n", (unsigned long)(user_usage->total_bytes / 1024));
+    entry_class = config->next_class;
+    i = 0;
+    while(entry_class != NULL) {
+        ap_rprintf(r, "\t\t\t\t<%s>%lu%s</%s>\n", entry_class->class_name,
+	    (unsigned long)(user_usage->class_bytes[i] / entry_user->user_class_limit_mult[i]),
+	    (entry_user->user_class_limit_mult[i] == 1024 ? "KiB" : "KB"), entry_class->class_name);
+        i++;
+        entry_class = entry_class->next;
+    }
+    ap_rprintf(r, "\t\t\t\t<kbps>%0.2f</kbps>\n", bps / 1024);
+    ap_rprintf(r, "\t\t\t\t<rps>%0.2f</rps>\n", rps);
+    ap_rprintf(r, "\t\t\t\t<connections>%lu</connections>\n", data->total_conn);
+    ap_rprintf(r, "\t\t\t</usages>\n");
+    mod_cband_status_print_delays_XML(r, data);
 
-    /* BEGIN CRITICAL SECTION */
-    mod_cband_sem_down(config->remote_hosts.sem_id);
-    mod_cband_safe_change(&config->remote_hosts.hosts[index].remote_total_conn, diff);
-    mod_cband_sem_up(config->remote_hosts.sem_id);
-    /* END CRITICAL SECTION */
+    ap_rprintf(r, "<time_to_refresh>%s</time_to_refresh>", mod_cband_create_period(r->pool, user_usage->start_time, entry_user->refresh_time));
 
-    return 0;
+    if (entry_user->user_limit_exceeded)
+	ap_rprintf(r, "\t\t\t<limit_exceeded_URL>%s</limit_exceeded_URL>\n", entry_user->user_limit_exceeded);	
+    else
+    	ap_rprintf(r, "\t\t\t<limit_exceeded_URL>none</limit_exceeded_URL>\n");	
+	    
+    if (entry_user->user_scoreboard)
+	ap_rprintf(r, "\t\t\t<scoreboard>%s</scoreboard>\n", entry_user->user_scoreboard);	
+    else
+    	ap_rprintf(r, "\t\t\t<scoreboard>none</scoreboard>\n");	
+
+    ap_rprintf(r, "\t\t</%s>\n", entry_user->user_name);
 }
 
-/* 
- * Nie trzeba semafora, poniewaz operacje na liczbach 32-bit sa atomowe
+/*
+ * stores the status handler's query arguments in r->notes
  */
-unsigned long mod_cband_get_remote_connection_time(int index)
+void mod_cband_status_parse_args(request_rec *r)
 {
-    if (index < 0)
-	return 0;
+    char *arg;
+    char *val, *key;
+
+    if (r->args == NULL)
+	return;
 
-    return config->remote_hosts.hosts[index].remote_last_time;
+    arg = r->args;
+    while(*arg != 0) {
+	val = ap_getword_nc(r->pool, &arg, '&');
+	    
+	if (val == NULL)
+	    break;
+	
+	key = ap_getword_nc(r->pool, &val, '=');
+	
+	if (key == NULL)
+	    break;
+		
+	apr_table_setn(r->notes, key, val);
+    }
 }
 
-/* 
- * Nie trzeba semafora, poniewaz operacje na liczbach 32-bit sa atomowe
- */
-int mod_cband_get_remote_connections(int index)
+void mod_cband_heap_init(apr_pool_t *p, mod_cband_heap *heap, int max)
 {
-    if (index < 0)
-	return 0;
-	
-    return config->remote_hosts.hosts[index].remote_conn;
+    heap->size  = 0;
+    heap->max   = max;
+    heap->items = apr_palloc(p, sizeof(mod_cband_heap_item) * (max + 1));
 }
 
-/* 
- * Nie trzeba semafora, poniewaz operacje na liczbach 32-bit sa atomowe
- */
-int mod_cband_remove_remote_host(int index)
+void mod_cband_heap_sift_down(mod_cband_heap *heap, int i, int size)
 {
-    if (index < 0)
-	return -1;
+    mod_cband_heap_item tmp;
+    int child;
 
-    config->remote_hosts.hosts[index].used = 0;
+    while ((child = 2 * i + 1) < size) {
+	if ((child + 1 < size) && (heap->items[child + 1].key < heap->items[child].key))
+	    child++;
 
-    return 0;
+	if (heap->items[i].key <= heap->items[child].key)
+	    break;
+
+	tmp                 = heap->items[i];
+	heap->items[i]      = heap->items[child];
+	heap->items[child]  = tmp;
+	i = child;
+    }
 }
 
-int mod_cband_get_dst_speed_lock(mod_cband_virtualhost_config_entry *entry, mod_cband_user_config_entry *entry_user, unsigned long *remote_kbps, unsigned long *remote_rps, unsigned long *remote_max_conn, int dst)
+/*
+ * keeps the heap->max biggest keys, the smallest of them is on the top
+ */
+void mod_cband_heap_push(mod_cband_heap *heap, float key, void *ptr)
 {
-    unsigned long virtualhost_kbps = 0;
-    unsigned long user_kbps = 0;
-    unsigned long virtualhost_rps = 0;
-    unsigned long user_rps = 0;
-    unsigned long virtualhost_max_conn = 0;
-    unsigned long user_max_conn = 0;
+    mod_cband_heap_item tmp;
+    int i, parent;
 
-    if (entry != NULL) {
-        /* BEGIN CRITICAL SECTION */
-	mod_cband_sem_down(config->sem_id);
-        virtualhost_kbps     = entry->shmem_data->remote_speed.kbps;
-	virtualhost_rps      = entry->shmem_data->remote_speed.rps;	
-	virtualhost_max_conn = entry->shmem_data->remote_speed.max_conn;	
-        mod_cband_sem_up(config->sem_id);
-	/* BEGIN CRITICAL SECTION */
-
-	if (dst >= 0 && dst <= DST_CLASS) {
-	    if (entry->virtual_class_speed[dst].kbps > 0)
-		virtualhost_kbps = entry->virtual_class_speed[dst].kbps;
-		
-	    if (entry->virtual_class_speed[dst].rps > 0)
-		virtualhost_rps  = entry->virtual_class_speed[dst].rps;
+    if (heap->max <= 0)
+	return;
 
-	    if (entry->virtual_class_speed[dst].max_conn > 0)
-		virtualhost_max_conn  = entry->virtual_class_speed[dst].max_conn;
-	}
-    }
+    if (heap->size < heap->max) {
+	i = heap->size++;
+	heap->items[i].key = key;
+	heap->items[i].ptr = ptr;
 
-    if (entry_user != NULL) {
-        /* BEGIN CRITICAL SECTION */
-	mod_cband_sem_down(config->sem_id);
-        user_kbps     = entry_user->shmem_data->remote_speed.kbps;
-	user_rps      = entry_user->shmem_data->remote_speed.rps;	
-	user_max_conn = entry_user->shmem_data->remote_speed.max_conn;	
-        mod_cband_sem_up(config->sem_id);
-	/* BEGIN CRITICAL SECTION */
-	
-	if (dst >= 0 && dst <= DST_CLASS) {
-	    if (entry_user->user_class_speed[dst].kbps > 0)
-		user_kbps = entry_user->user_class_speed[dst].kbps;
-	    
-	    if (entry_user->user_class_speed[dst].rps > 0)
-		user_rps  = entry_user->user_class_speed[dst].rps;
+	while (i > 0) {
+	    parent = (i - 1) / 2;
+	    if (heap->items[parent].key <= heap->items[i].key)
+		break;
 
-	    if (entry_user->user_class_speed[dst].max_conn > 0)
-		user_max_conn  = entry_user->user_class_speed[dst].max_conn;
+	    tmp                 = heap->items[i];
+	    heap->items[i]      = heap->items[parent];
+	    heap->items[parent] = tmp;
+	    i = parent;
 	}
+    } else
+    if (key > heap->items[0].key) {
+	heap->items[0].key = key;
+	heap->items[0].ptr = ptr;
+	mod_cband_heap_sift_down(heap, 0, heap->size);
     }
+}
 
-    if (remote_kbps != NULL) {
-	if ((user_kbps > 0) && (virtualhost_kbps > user_kbps)) 
-	    *remote_kbps = user_kbps;
-        else
-	if (virtualhost_kbps > 0)
-	    *remote_kbps = virtualhost_kbps;
-        else
-	    *remote_kbps = user_kbps;
-    }
-
-    if (remote_rps != NULL) {
-	if ((user_rps > 0) && (virtualhost_rps > user_rps)) 
-	    *remote_rps = virtualhost_rps;
-        else
-	if (virtualhost_rps > 0)
-	    *remote_rps = virtualhost_rps;
-        else
-    	    *remote_rps = user_rps;
-    }
+/*
+ * heapsort, leaves the items ordered from the biggest key
+ */
+void mod_cband_heap_sort(mod_cband_heap *heap)
+{
+    mod_cband_heap_item tmp;
+    int i;
 
-    if (remote_max_conn != NULL) {
-    	if ((user_max_conn > 0) && (virtualhost_max_conn > user_max_conn)) 
-	    *remote_max_conn = virtualhost_max_conn;
-        else
-	if (virtualhost_max_conn > 0)
-	    *remote_max_conn = virtualhost_max_conn;
-        else
-    	    *remote_max_conn = user_max_conn;
+    for (i = heap->size - 1; i > 0; i--) {
+	tmp             = heap->items[0];
+	heap->items[0]  = heap->items[i];
+	heap->items[i]  = tmp;
+	mod_cband_heap_sift_down(heap, 0, i);
     }
-    
-    return 0;
 }
 
-/* 
- * Nie trzeba semafora, poniewaz operacje na liczbach 32-bit sa atomowe
+/*
+ * virtualhost names whose remote clients are shown, NULL means all of them. Remote hosts
+ * keep the virtual_name pointer of their entry, so the names are compared as pointers
  */
-int mod_cband_get_score(server_rec *s, char *path, unsigned long long *val, int dst, mod_cband_shmem_data *shmem_data)
+char **mod_cband_status_remote_names(request_rec *r, mod_cband_virtualhost_config_entry *entry_me,
+	mod_cband_user_config_entry *entry_user_me, int handler_type, int *names_number)
 {
-    if (val == NULL || shmem_data == NULL)
-	return -1;
+    mod_cband_virtualhost_config_entry *entry;
+    char **names;
+    int i = 0;
 
-    if (dst < 0)
-	*val = shmem_data->total_usage.total_bytes;
-    else
-	*val = shmem_data->total_usage.class_bytes[dst];
-    
-    return 0;
-}
+    *names_number = 0;
 
+    if (handler_type == CBAND_HANDLER_ALL)
+	return NULL;
 
-/*
- * semafor opuszczany w mod_cband_update_score_cache
- */
-int mod_cband_get_score_all(server_rec *s, char *path, mod_cband_scoreboard_entry *val)
+    names = apr_palloc(r->pool, sizeof(char *) * (config->virtualhost_entries + 1));
+
+    if ((entry_user_me != NULL) && (entry_user_me->user_name != NULL)) {
+	for (entry = config->next_virtualhost; entry != NULL; entry = entry->next) {
+	    if ((entry->virtual_user != NULL) && !strcasecmp(entry->virtual_user, entry_user_me->user_name))
+		names[i++] = entry->virtual_name;
+	}
+    } else
+    if (entry_me != NULL)
+	names[i++] = entry_me->virtual_name;
+
+    *names_number = i;
+
+    return names;
+}
+
+int mod_cband_status_remote_match(mod_cband_remote_host *host, unsigned long time_now, char **names, int names_number)
 {
-    apr_file_t *fd;
-    apr_size_t nbuf;
-    apr_pool_t *subpool;
-    
-    if (path == NULL || val == NULL)
-	return -1;
-    
-    apr_pool_create(&subpool, config->p);
-    
-    if ((apr_file_open(&fd, path, APR_READ | APR_BINARY, 0, subpool)) != APR_SUCCESS) {
-	apr_pool_destroy(subpool);
-	return -1;
+    unsigned long time_delta;
+    int i;
+
+    time_delta = (time_now - host->remote_last_time) / 1e6;
+	
+    if ((!host->used) || ((time_delta > MAX_REMOTE_HOST_LIFE) && (host->remote_conn <= 0)))
+	return 0;
+
+    if (names == NULL)
+	return 1;
+
+    for (i = 0; i < names_number; i++) {
+	if (host->virtual_name == names[i])
+	    return 1;
     }
-    
-    nbuf = sizeof(mod_cband_scoreboard_entry);
-    apr_file_read(fd, val, &nbuf);
-    apr_file_close(fd);
-    apr_pool_destroy(subpool);
-    
+
     return 0;
 }
 
-/* 
- * semafor opuszczany w mod_cband_save_score_cache i mod_cband_flush_score_lock
+/*
+ * idle clients are shown with zero speed, their last speed is left in the table
  */
-int mod_cband_save_score(char *path, mod_cband_scoreboard_entry *scoreboard)
+unsigned long mod_cband_status_remote_kbps(mod_cband_remote_host *host, unsigned long time_now)
 {
-    apr_file_t *fd;
-    apr_size_t nbuf;
-    apr_pool_t *subpool;
-    
-    if (path == NULL || scoreboard == NULL || scoreboard->was_request == 0)
-	return -1;
-	
-    apr_pool_create(&subpool, config->p);
+    unsigned long time_delta;
 
-    if ((apr_file_open(&fd, path,
-		APR_CREATE | APR_READ | APR_WRITE | APR_BINARY, APR_UREAD | APR_UWRITE, subpool)) != APR_SUCCESS) {
-	
-	fprintf(stderr, "apache2_mod_cband: cannot open scoreboard file %s\n", path);
-	fflush(stderr);
-	
-	return -1;
-    }
-   
-    apr_file_lock(fd, APR_FLOCK_EXCLUSIVE);
-    nbuf = sizeof(mod_cband_scoreboard_entry);
-    apr_file_write(fd, scoreboard, &nbuf);
-    apr_file_unlock(fd);
-    apr_file_close(fd);
-    apr_pool_destroy(subpool);
-    
-    return 0;
-}
+    time_delta = (time_now - host->remote_last_time) / 1e6;
 
-int mod_cband_flush_score_lock(char *path, mod_cband_scoreboard_entry *scoreboard)
-{
-    if ((path == NULL) || (scoreboard == NULL))
-	return -1;
+    if ((time_delta > (MAX_REMOTE_HOST_LIFE / 3)) && (host->remote_conn <= 0))
+	return 0;
 
-    /* BEGIN CRITICAL SECTION */
-    mod_cband_sem_down(config->sem_id);
-    
-    scoreboard->was_request = 1;
-    if (--(scoreboard->score_flush_count) <= 0) {
-	mod_cband_save_score(path, scoreboard);
-	scoreboard->score_flush_count = config->score_flush_period;
-    }
-    
-    mod_cband_sem_up(config->sem_id);
-    /* END CRITICAL SECTION */        
-    
-    return 0;
+    return host->remote_kbps;
 }
 
 /*
- * semafor opuszczany poza funkcje mod_cband_log_bucket
+ * reads ?remote_top=N[&remote_by=kbps|conn], returns N or 0 when the whole table is wanted
  */
-int mod_cband_update_score(char *path, unsigned long long *bytes_served, int dst, mod_cband_scoreboard_entry *scoreboard)
-{
-    if (scoreboard == NULL || bytes_served == NULL)
-	return -1;
-
-    scoreboard->total_bytes	     += (unsigned long long)(*bytes_served);
-    if (dst >= 0)
-	scoreboard->class_bytes[dst] += (unsigned long long)(*bytes_served);
-
-    return 0;
-}
-
-int mod_cband_clear_score_lock(mod_cband_scoreboard_entry *scoreboard)
-{
-    if (scoreboard == NULL)
-	return -1;
-
-    /* BEGIN CRITICAL SECTION */        
-    mod_cband_sem_down(config->sem_id);
-    memset(scoreboard, 0, sizeof(mod_cband_scoreboard_entry));    
-    mod_cband_sem_up(config->sem_id);
-    /* END CRITICAL SECTION */        
-
-    return 0;
-}
-
-/* semafor opuszczany przez funkcje mod_cband_post_config */
-int mod_cband_update_score_cache(server_rec *s)
-{
-    mod_cband_virtualhost_config_entry *entry = NULL;
-    mod_cband_user_config_entry *entry_user = NULL;
-
-    entry = config->next_virtualhost;
-    while(entry != NULL) {
-        mod_cband_get_score_all(s, entry->virtual_scoreboard, &(entry->shmem_data->total_usage));
-        if ((entry = entry->next) == NULL)
-	    break;
-    }
-
-    entry_user = config->next_user;
-    while(entry_user != NULL) {
-        mod_cband_get_score_all(s, entry_user->user_scoreboard, &(entry_user->shmem_data->total_usage));
-        if ((entry_user = entry_user->next) == NULL)
-	    break;
-    }
-    
-    return OK;
-}
-
-int mod_cband_save_score_cache(void)
+int mod_cband_status_remote_args(request_rec *r, int *by_conn)
 {
-    mod_cband_virtualhost_config_entry *entry = NULL;
-    mod_cband_user_config_entry *entry_user = NULL;
-
-    entry = config->next_virtualhost;
-    while(entry != NULL) {
-        mod_cband_save_score(entry->virtual_scoreboard, &(entry->shmem_data->total_usage));
-        if ((entry = entry->next) == NULL)
-	    break;
-    }
+    const char *arg;
+    int top = 0;
 
-    entry_user = config->next_user;
-    while(entry_user != NULL) {
-        mod_cband_save_score(entry_user->user_scoreboard, &(entry_user->shmem_data->total_usage));
-        if ((entry_user = entry_user->next) == NULL)
-	    break;
-    }
-    
-    return OK;
-}
+    *by_conn = 0;
 
-unsigned long mod_cband_get_start_time(mod_cband_scoreboard_entry *scoreboard)
-{
-    if (scoreboard == NULL)
-	return 0;
+    if ((arg = apr_table_get(r->notes, "remote_top")) != NULL)
+	top = atoi(arg);
 
-    return scoreboard->start_time;
-}
+    if ((arg = apr_table_get(r->notes, "remote_by")) != NULL)
+	*by_conn = !strcasecmp(arg, "conn");
 
-int mod_cband_set_start_time(mod_cband_scoreboard_entry *scoreboard, unsigned long start_time)
-{
-    if (scoreboard == NULL)
-	return 0;
+    if (top < 0)
+	top = 0;
+    if (top > MAX_REMOTE_HOSTS)
+	top = MAX_REMOTE_HOSTS;
 
-    scoreboard->start_time = start_time;
-    
-    return 0;
+    return top;
 }
 
 /*
- * speed aproximation function
+ * one pass over the remote hosts table keeping the top fastest clients, or the clients
+ * with most open connections, sorted from the biggest
  */
-int mod_cband_get_speed_lock(mod_cband_shmem_data *shmem_data, float *bps, float *rps)
+void mod_cband_status_top_remotes(request_rec *r, mod_cband_heap *heap, int top, int by_conn,
+	char **names, int names_number)
 {
-    float time_delta;
-
-    if (shmem_data == NULL)
-	return -1;
-
-    /* BEGIN CRITICAL SECTION */
-    mod_cband_sem_down(config->sem_id);
-
-    time_delta = (float)(shmem_data->time_delta) / 1e6;
-
-    if (time_delta <= 0)
-	time_delta = PERIOD_LEN;
-
-    if (bps != NULL)
-	*bps = ((float)(shmem_data->old_TX * 8)) / time_delta;    
-    
-    if (rps != NULL)
-	*rps = ((float)(shmem_data->old_conn)) / time_delta;
-
-    mod_cband_sem_up(config->sem_id);
-    /* END CRITICAL SECTION */
-
-    return 0;
-}
+    mod_cband_remote_host *host;
+    unsigned long time_now;
+    int i;
 
-/* 
- * semafor opuszczany przez funkcje check_connections_speed
- */
-int mod_cband_get_real_speed(mod_cband_shmem_data *shmem_data, float *bps, float *rps)
-{
-    if (shmem_data == NULL)
-	return -1;
+    mod_cband_heap_init(r->pool, heap, top);
 
-    if (bps != NULL)
-	*bps = ((float)(shmem_data->current_TX * 8) / PERIOD_LEN);  
-    
-    if (rps != NULL)
-        *rps = ((float)(shmem_data->current_conn) / PERIOD_LEN);    
+    if (config->remote_hosts.hosts == NULL)
+	return;
 
-    return 0;
-}
+    time_now = apr_time_now();
+    for (i = 0; i < MAX_REMOTE_HOSTS; i++) {
+	host = &config->remote_hosts.hosts[i];
+	
+	if (!mod_cband_status_remote_match(host, time_now, names, names_number))
+	    continue;
 
-/*
- * semafor opuszczany przez mod_cband_log_bucket, mod_cband_update_speed_lock, mod_cband_check_connections_speed
- */
-int mod_cband_update_speed(mod_cband_shmem_data *shmem_data, unsigned long bytes_served, int new_connection, int remote_idx)
-{
-    unsigned long time_delta;
-    //unsigned long time_last_request;
-    unsigned long time_now;
-    unsigned long time_delta_real;
-    
-    if (shmem_data == NULL)
-	return -1;
-    
-    time_now          = apr_time_now();
-    time_delta_real   = time_now - shmem_data->total_last_refresh;
-    time_delta        = (time_now - shmem_data->total_last_refresh) / 1e6;
-    //time_last_request = (time_now - shmem_data->total_last_time) / 1e6;
-    
-    if (bytes_served > 0)
-	shmem_data->current_TX += bytes_served;
-    
-    if (new_connection) {
-    	shmem_data->total_last_time = time_now;
-        mod_cband_set_remote_request_time(remote_idx, time_now);
-	mod_cband_change_remote_total_connections_lock(remote_idx, 1);
-        shmem_data->current_conn += new_connection;
+	if (by_conn)
+	    mod_cband_heap_push(heap, (float)host->remote_conn, host);
+	else
+	    mod_cband_heap_push(heap, (float)mod_cband_status_remote_kbps(host, time_now), host);
     }
 
-    if (time_delta > PERIOD_LEN) {    
-	shmem_data->total_last_refresh = time_now;
-	mod_cband_set_remote_total_connections(remote_idx, 0);
-        mod_cband_set_remote_last_refresh(remote_idx, time_now);
-	shmem_data->time_delta   = time_delta_real;
-    }
-    
-    if (time_delta > PERIOD_LEN && time_delta < 2 * PERIOD_LEN) {
-        shmem_data->old_TX       = shmem_data->current_TX;
-	shmem_data->old_conn     = shmem_data->current_conn;
-        shmem_data->current_TX   = 0;
-	shmem_data->current_conn = 0;
-    } else 
-    if (time_delta >= 2 * PERIOD_LEN) {
-	shmem_data->old_TX       = shmem_data->current_TX;
-	shmem_data->old_conn     = shmem_data->current_conn;
-        shmem_data->current_TX   = 0;
-	shmem_data->current_conn = 0;
-    }
-        
-    return 0;
+    mod_cband_heap_sort(heap);
 }
 
-int mod_cband_update_speed_lock(mod_cband_shmem_data *shmem_data, unsigned long bytes_served, int new_connection, int remote_idx)
+void mod_cband_status_print_remote_row(request_rec *r, mod_cband_remote_host *host, unsigned long time_now, const char *odd_str)
 {
-    /* BEGIN CRITICAL SECTION */
-    mod_cband_sem_down(config->sem_id);
-    mod_cband_update_speed(shmem_data, bytes_served, new_connection, remote_idx);
-    mod_cband_sem_up(config->sem_id);
-    /* END CRITICAL SECTION */
-
-    return 0;
+    ap_rputs("<tr>", r);
+    ap_rprintf(r, "<td class=remote_%s>%s</td>", odd_str, host->remote_name);
+    ap_rprintf(r, "<td class=remote_%s>%s</td>", odd_str, host->virtual_name);
+    mod_cband_status_print_connections(r, host->remote_max_conn, host->remote_conn);
+    ap_rprintf(r, "<td class=remote_%s>%lu</td>", odd_str, mod_cband_status_remote_kbps(host, time_now));
+    ap_rputs("</tr>", r);
 }
 
-int mod_cband_set_overlimit_speed(mod_cband_shmem_data *shmem_data)
+void mod_cband_status_print_remote_XML_row(request_rec *r, mod_cband_remote_host *host, unsigned long time_now)
 {
-    if (shmem_data == NULL)
-	return -1;
-
-    shmem_data->curr_speed.kbps     = shmem_data->over_speed.kbps;
-    shmem_data->curr_speed.rps      = shmem_data->over_speed.rps;
-    shmem_data->curr_speed.max_conn = shmem_data->over_speed.max_conn;
-    shmem_data->shared_kbps         = shmem_data->over_speed.kbps;
-    shmem_data->overlimit           = 1;
-
-    return 0;
+    ap_rprintf(r, "\t\t<remote>\n");
+    ap_rprintf(r, "\t\t\t<ip>%s</ip>\n", host->remote_name);
+    ap_rprintf(r, "\t\t\t<virtualhost>%s</virtualhost>\n", host->virtual_name);
+    ap_rprintf(r, "\t\t\t<connections_limit>%lu</connections_limit>\n", host->remote_max_conn);
+    ap_rprintf(r, "\t\t\t<connections>%lu</connections>\n", host->remote_conn);
+    ap_rprintf(r, "\t\t\t<kbps>%lu</kbps>\n", mod_cband_status_remote_kbps(host, time_now));
+    ap_rprintf(r, "\t\t</remote>\n");
 }
 
-int mod_cband_set_overlimit_speed_lock(mod_cband_shmem_data *shmem_data)
+static int mod_cband_lock_site_cmp(const void *a, const void *b)
 {
-    if (shmem_data == NULL)
-	return -1;
-
-    /* BEGIN CRITICAL SECTION */
-    mod_cband_sem_down(config->sem_id);
-    mod_cband_set_overlimit_speed(shmem_data);
-    mod_cband_sem_up(config->sem_id);
-    /* END CRITICAL SECTION */
+    const mod_cband_lock_site *x = (const mod_cband_lock_site *)a, *y = (const mod_cband_lock_site *)b;
 
-    return 0;
+    return (x->wait_nsec < y->wait_nsec) - (x->wait_nsec > y->wait_nsec);
 }
 
-int mod_cband_set_normal_speed(mod_cband_shmem_data *shmem_data)
+/*
+ * copy of the lock statistics, the call sites with the longest total wait first
+ */
+int mod_cband_status_lock_sites(request_rec *r, mod_cband_lock_site **sites)
 {
-    if (shmem_data == NULL)
-	return -1;
+    int sites_number;
 
-    shmem_data->curr_speed.kbps     = shmem_data->max_speed.kbps;
-    shmem_data->curr_speed.rps      = shmem_data->max_speed.rps;
-    shmem_data->curr_speed.max_conn = shmem_data->max_speed.max_conn;
-    shmem_data->shared_kbps         = shmem_data->max_speed.kbps;
-    shmem_data->overlimit           = 0;
+    *sites = apr_palloc(r->pool, sizeof(mod_cband_lock_site) * MAX_LOCK_SITES);
+    sites_number = mod_cband_lock_sites_read(*sites);
+    qsort(*sites, sites_number, sizeof(mod_cband_lock_site), mod_cband_lock_site_cmp);
 
-    return 0;
+    return sites_number;
 }
 
-int mod_cband_set_normal_speed_lock(mod_cband_shmem_data *shmem_data)
+void mod_cband_status_print_locks(request_rec *r, int refresh, char *unit)
 {
-    if (shmem_data == NULL)
-	return -1;
-
-    /* BEGIN CRITICAL SECTION */
-    mod_cband_sem_down(config->sem_id);
-    mod_cband_set_normal_speed(shmem_data);
-    mod_cband_sem_up(config->sem_id);
-    /* END CRITICAL SECTION */
+    mod_cband_lock_site *sites;
+    int i, sites_number;
+    const char *odd_str;
 
-    return 0;
-}
+    sites_number = mod_cband_status_lock_sites(r, &sites);
 
-void mod_cband_check_virtualhost_refresh(mod_cband_virtualhost_config_entry *entry_virtual, unsigned long sec)
-{
-    mod_cband_scoreboard_entry *scoreboard;
+    ap_rputs("<div class=\"section\">", r);
+    ap_rputs("<br><h2 style=\"display: inline;\">Lock contention</h2>\n", r);
+    ap_rprintf(r, "<p style=\"display: inline;\"><a href=\"?refresh=%d&amp;unit=%s\">[refresh]</a></p>\n", refresh, unit);
+    ap_rputs("</div>", r);
 
-    if (entry_virtual == NULL || entry_virtual->refresh_time == 0)
+    if (sites_number == 0) {
+	ap_rputs("<p>No semaphore has been taken yet.</p>\n", r);
 	return;
+    }
 
-    scoreboard = &(entry_virtual->shmem_data->total_usage);
-
-    if (mod_cband_get_start_time(scoreboard) < 0)
-    	mod_cband_set_start_time(scoreboard, sec);
-    
-    if ((mod_cband_get_start_time(scoreboard) + entry_virtual->refresh_time) < sec) {
-    	mod_cband_clear_score_lock(scoreboard);
-	mod_cband_set_normal_speed_lock(entry_virtual->shmem_data);
-	mod_cband_set_start_time(scoreboard, sec);
+    ap_rputs("<table cellspacing=\"0\" cellpadding=\"0\">", r);
+    ap_rputs("<tr><td>Call site</td><td>Semaphore</td><td>Acquisitions</td><td>Contended</td>", r);
+    ap_rputs("<td>Total wait [ms]</td><td>Avg wait [us]</td><td>Max wait [ms]</td></tr>\n", r);
+
+    for (i = 0; i < sites_number; i++) {
+	odd_str = (i % 2) ? "odd" : "even";
+	ap_rputs("<tr>", r);
+	ap_rprintf(r, "<td class=remote_%s>%s</td>", odd_str, ap_escape_html(r->pool, sites[i].name));
+	ap_rprintf(r, "<td class=remote_%s>%s</td>", odd_str, sites[i].remote ? "remote hosts" : "global");
+	ap_rprintf(r, "<td class=remote_%s>%llu</td>", odd_str, sites[i].acquisitions);
+	ap_rprintf(r, "<td class=remote_%s>%llu</td>", odd_str, sites[i].contended);
+	ap_rprintf(r, "<td class=remote_%s>%0.2f</td>", odd_str, sites[i].wait_nsec / 1e6);
+	ap_rprintf(r, "<td class=remote_%s>%0.2f</td>", odd_str, sites[i].contended ? sites[i].wait_nsec / 1e3 / sites[i].contended : 0);
+	ap_rprintf(r, "<td class=remote_%s>%0.2f</td>", odd_str, sites[i].max_wait_nsec / 1e6);
+	ap_rputs("</tr>\n", r);
     }
+    ap_rputs("</table>\n", r);
 }
 
-void mod_cband_check_user_refresh(mod_cband_user_config_entry *entry_user, unsigned long sec)
+void mod_cband_status_print_locks_XML(request_rec *r)
 {
-    mod_cband_scoreboard_entry *scoreboard;
-
-    if (entry_user == NULL || entry_user->refresh_time == 0)
-	return;
-
-    scoreboard = &(entry_user->shmem_data->total_usage);
-
-    if (mod_cband_get_start_time(scoreboard) < 0)
-    	mod_cband_set_start_time(scoreboard, sec);
-    
-    if ((mod_cband_get_start_time(scoreboard) + entry_user->refresh_time) < sec) {
-    	mod_cband_clear_score_lock(scoreboard);
-	mod_cband_set_normal_speed_lock(entry_user->shmem_data);
-	mod_cband_set_start_time(scoreboard, sec);
+    mod_cband_lock_site *sites;
+    int i, sites_number;
+
+    sites_number = mod_cband_status_lock_sites(r, &sites);
+
+    ap_rputs("\t<Locks>\n", r);
+    for (i = 0; i < sites_number; i++) {
+	ap_rprintf(r, "\t\t<lock>\n");
+	ap_rprintf(r, "\t\t\t<site>%s</site>\n", sites[i].name);
+	ap_rprintf(r, "\t\t\t<semaphore>%s</semaphore>\n", sites[i].remote ? "remote" : "global");
+	ap_rprintf(r, "\t\t\t<acquisitions>%llu</acquisitions>\n", sites[i].acquisitions);
+	ap_rprintf(r, "\t\t\t<contended>%llu</contended>\n", sites[i].contended);
+	ap_rprintf(r, "\t\t\t<wait_ns>%llu</wait_ns>\n", sites[i].wait_nsec);
+	ap_rprintf(r, "\t\t\t<max_wait_ns>%llu</max_wait_ns>\n", sites[i].max_wait_nsec);
+	ap_rprintf(r, "\t\t</lock>\n");
     }
+    ap_rputs("\t</Locks>\n", r);
 }
 
-int mod_cband_reset(mod_cband_shmem_data *shmem_data)
+void mod_cband_status_print_delays_row(request_rec *r, const char *name, const char *kind, mod_cband_shmem_data *data, const char *odd_str)
 {
-    if (shmem_data == NULL)
-	return -1;
-
-    mod_cband_clear_score_lock(&(shmem_data->total_usage));
-    mod_cband_set_start_time(&(shmem_data->total_usage), (unsigned long)(apr_time_now() / 1e6));
-    mod_cband_set_normal_speed_lock(shmem_data);
+    mod_cband_hist_summary summary;
+    int i;
 
-    return 0;
+    ap_rputs("<tr>", r);
+    ap_rprintf(r, "<td class=remote_%s>%s</td>", odd_str, ap_escape_html(r->pool, name));
+    ap_rprintf(r, "<td class=remote_%s>%s</td>", odd_str, kind);
+    
+    for (i = 0; i < HIST_TYPES; i++) {
+	mod_cband_hist_summarize(&data->hist[i], &summary);
+	
+	if (i == HIST_LOOPS)
+	    ap_rprintf(r, "<td class=remote_%s>%lu / %lu / %lu</td>", odd_str, summary.p50, summary.p90, summary.p99);
+	else
+	    ap_rprintf(r, "<td class=remote_%s>%llu</td><td class=remote_%s>%0.1f / %0.1f / %0.1f</td>", odd_str, summary.count, 
+		odd_str, summary.p50 / 1e3, summary.p90 / 1e3, summary.p99 / 1e3);
+    }
+    ap_rputs("</tr>\n", r);
 }
 
-int mod_cband_reset_virtualhost(char *name)
+/*
+ * injected sleep, admission wait and admission retry loops, the percentiles 
+ * are upper bounds of log-linear buckets
+ */
+void mod_cband_status_print_delays(request_rec *r, mod_cband_virtualhost_config_entry *entry_me,
+	mod_cband_user_config_entry *entry_user_me, int handler_type, int refresh, char *unit)
 {
     mod_cband_virtualhost_config_entry *entry;
-    char virtualhost[MAX_VIRTUALHOST_NAME];
-    unsigned port, line;
+    mod_cband_user_config_entry *entry_user;
+    mod_cband_shmem_data data;
+    int rows = 0;
 
-    if (name == NULL)
-	return -1;
+    ap_rputs("<div class=\"section\">", r);
+    ap_rputs("<br><h2 style=\"display: inline;\">Throttle delays</h2>\n", r);
+    ap_rprintf(r, "<p style=\"display: inline;\"><a href=\"?refresh=%d&amp;unit=%s\">[refresh]</a></p>\n", refresh, unit);
+    ap_rputs("</div>", r);
 
-    if (!strcasecmp(name, "all")) {
-        entry = config->next_virtualhost;
-    
-	while(entry != NULL) {
-	    mod_cband_reset(entry->shmem_data);
+    ap_rputs("<table cellspacing=\"0\" cellpadding=\"0\">", r);
+    ap_rputs("<tr><td>Name</td><td>Type</td><td>Responses</td><td>Sleep [ms]<br>p50/p90/p99</td>", r);
+    ap_rputs("<td>Requests</td><td>Admission wait [ms]<br>p50/p90/p99</td><td>Admission loops<br>p50/p90/p99</td></tr>\n", r);
 
-	    if (entry->next == NULL)
-		break;
+    for (entry = config->next_virtualhost; entry != NULL; entry = entry->next) {
+	if ((handler_type == CBAND_HANDLER_ME) && (entry != entry_me))
+	    continue;
 	    
-	    entry = entry->next;
-        }
-    } else {
-	sscanf(name, "%[^:]:%u:%u", virtualhost, &port, &line);
-	
-	if ((entry = mod_cband_get_virtualhost_entry_(virtualhost, (apr_port_t)port, line, 0)) != NULL)
-	    mod_cband_reset(entry->shmem_data);
+	mod_cband_shmem_read(entry->shmem_data, &data);
+	mod_cband_status_print_delays_row(r, entry->virtual_name, "virtualhost", &data, ((rows++ % 2) ? "odd" : "even"));
     }
-    
-    return 0;
-}
-
-int mod_cband_reset_user(char *name)
-{
-    mod_cband_user_config_entry *entry;
-
-    if (name == NULL)
-	return -1;
 
-    if (!strcasecmp(name, "all")) {
-        entry = config->next_user;
-    
-	while(entry != NULL) {
-	    mod_cband_reset(entry->shmem_data);
-    
-	    if (entry->next == NULL)
-		break;
+    for (entry_user = config->next_user; entry_user != NULL; entry_user = entry_user->next) {
+	if ((handler_type == CBAND_HANDLER_ME) && (entry_user != entry_user_me))
+	    continue;
 	    
-	    entry = entry->next;
-        }
-    } else {
-	if ((entry = mod_cband_get_user_entry(name, NULL, 0)) != NULL)
-	    mod_cband_reset(entry->shmem_data);
+	mod_cband_shmem_read(entry_user->shmem_data, &data);
+	mod_cband_status_print_delays_row(r, entry_user->user_name, "user", &data, ((rows++ % 2) ? "odd" : "even"));
     }
     
-    return 0;
+    ap_rputs("</table>\n", r);
 }
 
-unsigned long mod_cband_get_slice_limit(unsigned long start_time, unsigned long refresh_time, 
-	unsigned long slice_len, unsigned long limit)
-{
-    unsigned long slice_limit, slice;
-    unsigned int slice_no;
+static const char mod_cband_status_handler_style[] = 
+"\n<style type=\"text/css\">\n"
+"body 		{ font-family: sans-serif; font-size: 0.6em; }\n"
+"table		{ font-family: tachoma, helvetica, verdana, sans-serif; border: 1px solid #d0d0d0; }\n"
+"tr		{ font-family: tachoma, helvetica, verdana, sans-serif; border: 1px solid #d0d0d0; }\n"
+"td		{ padding-left: 0.5em; padding-right: 0.5em; }\n"
+"td.refresh	{ background-color: #0de2cb; text-align: right; }\n"
+"td.speed	{ background-color: #ffa1a1; text-align: left; }\n"
+"td.speedc	{ background-color: #ffb1b1; text-align: left; }\n"
+"td.remote_odd	{ background-color: #b4bfff; text-align: left; }\n"
+"td.remote_even	{ background-color: #bfcfff; text-align: left; }\n"
+"a		{ text-decoration: none; color: #606060; }\n"
+"a:hover	{ text-decoration: underline; }\n"
+"h1, h2		{ font-family: tachoma, helvetica, verdana, sans-serif}\n"
+".small 	{ font-size: smaller; }\n"
+"div.section	{ margin-top: 1.5em; margin-bottom: 0.5em; }\n"
+"div.footer	{ margin-top: 2.5em; text-align: center; font-size: smaller; }\n"
+"</style>\n\n";
 
-    if (slice_len > 0 && refresh_time > 0) {
-        slice_limit = (unsigned long)(((float)slice_len / refresh_time) * limit);
-	slice_no    = (((unsigned long)(apr_time_now() / 1e6) - start_time) / slice_len) + 1;
-	slice       = slice_no * slice_limit;
-	
-	if (slice > limit)
-	    slice = limit;
-	
-	return slice;
-    }
-    
-    return limit;
-}
+static const char mod_cband_status_handler_foot[] = 
+"\n<div class=\"footer\"><br>\n"
+"<p><a href=\"http://cband.linux.pl\">mod_cband 0.9.7.5</a><br>\n"
+"Copyright 2005 by <a href=\"mailto: dembol _at_ cband.linux.pl\">Lukasz Dembinski</a><br>\n"
+"All rights reserved.<br>\n"
+"<br><a href=\"http://validator.w3.org/check?uri=http%3A%2F%2Fdembol.nasa.pl%2Fcband-status\">[HTML 4.0 Strict]</a>\n"
+"</p></div>\n";
 
-void mod_cband_status_print_limit(request_rec *req, unsigned long limit, unsigned long usage, char *unit, unsigned int mult, unsigned long slice_limit)
+/**
+ * /cband-status handler output in HTML
+ */
+static int mod_cband_status_handler_HTML (request_rec *r, int handler_type)
 {
-    unsigned char normal_r, normal_g, normal_b;
-    unsigned char exceeded_r, exceeded_g, exceeded_b;
-    unsigned char r, g, b;
-    const char *color;
-    float u;
+    mod_cband_virtualhost_config_entry *entry = NULL, *entry_me = NULL;
+    mod_cband_user_config_entry *entry_user, *entry_user_me = NULL;
+    mod_cband_class_config_entry *entry_class;
+    unsigned long uptime, sec;
+    unsigned i;
+    char *arg;
+    int refresh = -1;
+    char *unit = "";
+    int vhosts_number = 0, users_number = 0;
+    unsigned long long total_traffic = 0;
+    mod_cband_shmem_data data;
+    unsigned long total_connections = 0;
+    float bps, current_speed_bps = 0;
+    float rps, current_speed_rps = 0;
+    unsigned long time_now;
+    mod_cband_heap heap;
+    char **names;
+    int names_number, remotes_number = 0;
+    int remote_top, remote_by_conn;
 
-    if (slice_limit == 0)
-	slice_limit = limit;
-        
-    exceeded_r = 0xff;
-    exceeded_g = 0x30;
-    exceeded_b = 0x50;
-    normal_r = 0x30;
-    normal_g = 0xf0;
-    normal_b = 0x30;
-        
-    if (limit == (unsigned long)0) 
-        ap_rprintf(req, "<td style=\"background-color: yellow\">U/U/%s</td>\n", mod_cband_create_traffic_size(req->pool, usage, unit, mult));
-    else {
-	if (usage < limit) {
-	    r = normal_r;
-	    g = normal_g;
-	    b = normal_b;
-	    if (usage > 0) {
-		u = (float)usage / limit;
-		r += (unsigned char)((float)(exceeded_r - normal_r) * u);
-		g -= (unsigned char)((float)(normal_g - exceeded_g) * u);
-		b += (unsigned char)((float)(exceeded_b - normal_b) * u);
+    if ((arg = (char *)apr_table_get(r->notes, "refresh")) != NULL)
+	refresh = atoi(arg);
+
+    remote_top = mod_cband_status_remote_args(r, &remote_by_conn);
+
+    if ((arg = (char *)apr_table_get(r->notes, "unit")) != NULL) {
+	if (arg[0] == 'G' || arg[0] == 'g' || arg[0] == 'M' || arg[0] == 'm' || arg[0] == 'K' || arg[0] == 'k') {
+	    arg[0] = toupper(arg[0]);
+	    if (arg[1] == 'I' || arg[1] == 'i') {
+		arg[1] = 'i';
+		arg[2] = 0;
+		unit = arg;
+	    } else {
+		arg[1] = 0;
+		unit = arg;
 	    }
-	} else {
-	    r = exceeded_r;
-	    g = exceeded_g;
-	    b = exceeded_b;
 	}
-    
-	if (usage < limit / 2)
-	    color = "black";
-	else
-	    color = "white";
-	    
-	ap_rprintf(req, "<td style=\"color: %s; background-color: #%02X%02X%02X\">%s/%s/%s</td>\n", color, r, g, b, mod_cband_create_traffic_size(req->pool, limit, unit, mult), mod_cband_create_traffic_size(req->pool, slice_limit, unit, mult), mod_cband_create_traffic_size(req->pool, usage, unit, mult));
     }
-}
-
-void mod_cband_status_print_speed(request_rec *req, unsigned long limit, float usage)
-{
-    unsigned char normal_r, normal_g, normal_b;
-    unsigned char exceeded_r, exceeded_g, exceeded_b;
-    unsigned char r, g, b;
-    const char *color;
-    float u;
     
-    exceeded_r = 0xff;
-    exceeded_g = 0x20;
-    exceeded_b = 0x20;
-    normal_r = 0xf0;
-    normal_g = 0xa1;
-    normal_b = 0xa1;
-        
-    if (limit == (unsigned long)0) 
-        ap_rprintf(req, "<td class=\"speed\">U/%0.2f</td>\n", usage);
-    else {
-	if (usage < limit) {
-	    r = normal_r;
-	    g = normal_g;
-	    b = normal_b;
+    if (refresh < 0)
+	refresh = DEFAULT_REFRESH;
 	
-	    if (usage > 0) {
-		u = (float)usage / limit;
-		g -= (unsigned char)((float)(normal_g - exceeded_g) * u);
-	    	b -= (unsigned char)((float)(normal_b - exceeded_b) * u);
-	    }
-	} else {
-	    r = exceeded_r;
-	    g = exceeded_g;
-	    b = exceeded_b;
+    if (handler_type == CBAND_HANDLER_ALL) {
+	if ((arg = (char *)apr_table_get(r->notes, "reset")) != NULL) {
+    	    mod_cband_reset_virtualhost(arg);
+	
+	    apr_table_setn(r->headers_out, "Location", apr_psprintf(r->pool, "%s?refresh=%d&unit=%s", r->uri, refresh, unit));
+	    return HTTP_MOVED_PERMANENTLY;
 	}
 
-	if (usage < limit / 2)
-	    color = "black";
-	else
-	    color = "white";
-    
-	ap_rprintf(req, "<td style=\"color: %s; background-color: #%02X%02X%02X\">%lu/%0.2f</td>\n", color, r, g, b, limit, usage);
+	if ((arg = (char *)apr_table_get(r->notes, "reset_user")) != NULL) {
+    	    mod_cband_reset_user(arg);
+	
+	    apr_table_setn(r->headers_out, "Location", apr_psprintf(r->pool, "%s?refresh=%d&unit=%s", r->uri, refresh, unit));
+	    return HTTP_MOVED_PERMANENTLY;
+	}
+    } else {
+    	if ((entry_me = mod_cband_get_virtualhost_entry(r->server, r->server->module_config, 0)) != NULL) {
+	    if (entry_me->virtual_user != NULL)  
+		entry_user_me = mod_cband_get_user_entry(entry_me->virtual_user, r->server->module_config, 0);
+	    else
+		entry_user_me = NULL;
+	}
     }
-}
 
-void mod_cband_status_print_connections(request_rec *req, unsigned long limit, unsigned long usage)
-{
-    unsigned char normal_r, normal_g, normal_b;
-    unsigned char exceeded_r, exceeded_g, exceeded_b;
-    unsigned char r, g, b;
-    const char *color;
-    float u;
+    sec = (unsigned long)(apr_time_now() / 1e6);
+    uptime = (unsigned long)(sec - config->start_time);
 
-    exceeded_r = 0x36;
-    exceeded_g = 0x55;
-    exceeded_b = 0xad;
-    normal_r = 0xb4;
-    normal_g = 0xbf;
-    normal_b = 0xff;
-        
-    if (limit == (unsigned long)0) 
-        ap_rprintf(req, "<td class=remote_odd>U/%lu</td>\n", usage);
+    apr_table_setn(r->headers_out, "Refresh", apr_psprintf(r->pool, "%d", refresh));
+    ap_set_content_type(r, "text/html");
+
+    ap_rputs(DOCTYPE_HTML_4_0S "<html>\n<head>\n<title>mod_cband status</title>\n", r);
+    ap_rputs("<meta http-equiv=\"Content-Type\" content=\"text/html;charset=utf-8\">\n", r);
+    ap_rputs(mod_cband_status_handler_style, r);
+    ap_rputs("</head>\n", r);
+    ap_rputs("<body>\n", r);
+    ap_rputs("<h1 style=\"text-align: center\"><a href=\"http://cband.linux.pl\">mod_cband</a> status page</h1>\n", r);
+    ap_rprintf(r, "<h2 style=\"text-align: center\">Server uptime %s</h2>\n", mod_cband_create_time(r->pool, uptime));
+    ap_rputs("<div class=\"section\">", r);
+    ap_rputs("<h2 style=\"display: inline;\">Virtual hosts</h2>\n", r);
+    ap_rprintf(r, "<p style=\"display: inline;\"><a href=\"?refresh=%d&amp;unit=%s\">[refresh]</a> &nbsp; <a href=\"?refresh=%d\">[human-readable]</a> <a href=\"?refresh=%d&amp;unit=G\">[GB]</a> <a href=\"?refresh=%d&amp;unit=M\">[MB]</a> <a href=\"?refresh=%d&amp;unit=K\">[KB]</a></p>\n", refresh, unit, refresh, refresh, refresh, refresh);
+    ap_rputs("</div>\n", r);
+    
+    if (((handler_type == CBAND_HANDLER_ME) && (entry_me == NULL)) || 
+        ((handler_type == CBAND_HANDLER_ALL) && (config->next_virtualhost == NULL)))
+	ap_rputs("<p>There are no limits set for virtual hosts.</p>\n", r);
     else {
-	if (usage < limit) {
-	    r = normal_r;
-	    g = normal_g;
-	    b = normal_b;
-	    if (usage > 0) {
-		u = (float)usage / limit;
-		r -= (unsigned char)((float)(normal_r - exceeded_r) * u);
-		g -= (unsigned char)((float)(normal_g - exceeded_g) * u);
-		b -= (unsigned char)((float)(normal_b - exceeded_b) * u);
+	ap_rputs("<table cellspacing=\"0\" cellpadding=\"0\">\n", r);
+	ap_rputs("<tr>\n<td>Virtual host name</td>\n", r);
+
+	if (handler_type == CBAND_HANDLER_ALL) {
+	    ap_rputs("<td>", r);
+	    ap_rprintf(r, "<a href=\"?reset=all&amp;refresh=%d&amp;unit=%s\">reset all</a></td>\n", refresh, unit);
+	}
+	
+	ap_rputs("<td>time to refresh</td>\n", r);
+	ap_rprintf(r,"<td>Total<br>Limit/Slice/Used</td>\n");
+	entry_class = config->next_class;
+	
+	i = 0;
+	while(entry_class != NULL) {
+	    ap_rprintf(r,"<td>%s<br>Limit/Slice/Used</td>\n", entry_class->class_name);
+	
+	    entry_class = entry_class->next;
+            i++;
+	}
+	
+	for (; i < DST_CLASS; i++)
+	    ap_rprintf(r,"<td>Class %d<br>Limit/Slice/Used</td>\n",i);
+		
+	ap_rprintf(r,"<td>kbps<br>Limit/Current</td>\n");
+	ap_rprintf(r,"<td>rps<br>Limit/Current</td>\n");
+	ap_rprintf(r,"<td>Connections<br>Limit/Current</td>\n");
+	
+	ap_rputs("<td>user</td>\n", r);
+	ap_rputs("</tr>\n", r);
+	
+	current_speed_bps = 0;
+	current_speed_rps = 0;
+	if (handler_type == CBAND_HANDLER_ALL) {	
+	    entry = config->next_virtualhost;
+	    while(entry != NULL) {
+		mod_cband_status_snapshot(entry->shmem_data, entry->refresh_time, sec, &data);
+	        mod_cband_status_print_virtualhost_row(r, entry, &data, handler_type, refresh, unit);
+		total_traffic += data.total_usage.total_bytes;
+		total_connections += data.total_conn;
+		vhosts_number++;
+		
+		mod_cband_get_real_speed(&data, &bps, &rps);
+		current_speed_bps += bps;
+		current_speed_rps += rps;
+	    	    
+		if ((entry = entry->next) == NULL)
+		    break;
 	    }
 	} else {
-	    r = exceeded_r;
-	    g = exceeded_g;
-	    b = exceeded_b;
+	    if ((entry_user_me != NULL) && (entry_user_me->user_name != NULL)) {
+	        entry = config->next_virtualhost;
+		while(entry != NULL) {
+		    if ((entry->virtual_user != NULL) && !strcasecmp(entry->virtual_user, entry_user_me->user_name)) {
+			mod_cband_status_snapshot(entry->shmem_data, entry->refresh_time, sec, &data);
+		        mod_cband_status_print_virtualhost_row(r, entry, &data, handler_type, refresh, unit);
+		    }
+		    
+		    if ((entry = entry->next) == NULL)
+			break;
+		}
+	    } else	
+	    if (entry_me != NULL) {
+	    	mod_cband_status_snapshot(entry_me->shmem_data, entry_me->refresh_time, sec, &data);
+	        mod_cband_status_print_virtualhost_row(r, entry_me, &data, handler_type, refresh, unit);
+	    }
 	}
-
-	if (usage <= limit / 2)
-	    color = "black";
-	else
-	    color = "white";
-    
-	ap_rprintf(req, "<td style=\"color: %s; background-color: #%02X%02X%02X\">%lu/%lu</td>\n", color, r, g, b, limit, usage);
+	
+	ap_rputs("</table>\n", r);
     }
-}
-
-void mod_cband_status_print_virtualhost_row(request_rec *r, mod_cband_virtualhost_config_entry *entry,
-	int handler_type, int refresh, char *unit, unsigned long long *total_traffic) {
-    
-    mod_cband_scoreboard_entry *virtual_usage;
-    unsigned long slice_limit;
-    float bps, rps;
-    int i;
 
-    virtual_usage = &entry->shmem_data->total_usage;
-	    
-    ap_rputs("<tr>\n", r);
-    ap_rprintf(r, "<td><a href=\"http://%s\">%s</a>:%d:(%d)</td>\n", entry->virtual_name, entry->virtual_name, entry->virtual_port, entry->virtual_defn_line);	
-    if (handler_type == CBAND_HANDLER_ALL)
-	ap_rprintf(r, "<td><a href=\"?reset=%s:%d:%d&amp;refresh=%d&amp;unit=%s\">reset</a></td>\n", entry->virtual_name, entry->virtual_port, entry->virtual_defn_line, refresh, unit);
-    ap_rprintf(r, "<td class=\"refresh\">%s</td>\n", mod_cband_create_period(r->pool, virtual_usage->start_time, entry->refresh_time));	
+    ap_rputs("<div class=\"section\">", r);
+    ap_rputs("<br><h2 style=\"display: inline;\">Users</h2>\n", r);
+    ap_rprintf(r, "<p style=\"display: inline;\"><a href=\"?refresh=%d&amp;unit=%s\">[refresh]</a> &nbsp; <a href=\"?refresh=%d\">[human-readable]</a> <a href=\"?refresh=%d&amp;unit=G\">[GB]</a> <a href=\"?refresh=%d&amp;unit=M\">[MB]</a> <a href=\"?refresh=%d&amp;unit=K\">[KB]</a></p>\n", refresh, unit, refresh, refresh, refresh, refresh);
+    ap_rputs("</div>\n", r);
 
-    slice_limit = mod_cband_get_slice_limit(entry->shmem_data->total_usage.start_time, entry->refresh_time, entry->slice_len, entry->virtual_limit);
-    mod_cband_status_print_limit(r, entry->virtual_limit, (unsigned long)(virtual_usage->total_bytes / entry->virtual_limit_mult),
-	unit, entry->virtual_limit_mult, slice_limit);
+    if (((handler_type == CBAND_HANDLER_ME) && (entry_user_me == NULL)) || 
+        ((handler_type == CBAND_HANDLER_ALL) && (config->next_user == NULL)))
+        ap_rputs("<p>There are no limits set for users.</p>\n", r);
+    else {
+	ap_rputs("<table cellspacing=\"0\" cellpadding=\"0\">\n", r);
+	ap_rputs("<tr>\n<td>Username</td>\n", r);
+	
+	if (handler_type == CBAND_HANDLER_ALL) {
+	    ap_rputs("<td>", r);
+	    ap_rprintf(r, "<a href=\"?reset_user=all&amp;refresh=%d&amp;unit=%s\">reset all</a></td>\n", refresh, unit);
+	}
+	
+	ap_rputs("<td>time to refresh</td>\n", r);    
+	ap_rprintf(r,"<td>Total<br>Limit/Slice/Used</td>\n");
+	entry_class = config->next_class;
+	
+	i = 0;
+	while(entry_class != NULL) {
+	    ap_rprintf(r,"<td>%s<br>Limit/Slice/Used</td>\n", entry_class->class_name);
+	
+	    entry_class = entry_class->next;
+            i++;
+	}
+	
+	for (; i < DST_CLASS; i++)
+	    ap_rprintf(r,"<td>Class %d<br>Limit/Slice/Used</td>\n",i);
 
-    for (i = 0; i < DST_CLASS; i++) {
-        slice_limit = mod_cband_get_slice_limit(entry->shmem_data->total_usage.start_time, entry->refresh_time, entry->slice_len, entry->virtual_class_limit[i]);
-	mod_cband_status_print_limit(r, entry->virtual_class_limit[i], (unsigned long)(virtual_usage->class_bytes[i] / entry->virtual_class_limit_mult[i]),
-	    unit, entry->virtual_class_limit_mult[i], slice_limit);
+	ap_rprintf(r,"<td>kbps<br>Limit/Current</td>\n");
+	ap_rprintf(r,"<td>rps<br>Limit/Current</td>\n");
+	ap_rprintf(r,"<td>Connections<br>Limit/Current</td>\n");
+	
+	ap_rputs("</tr>\n", r);
+	
+	if (handler_type == CBAND_HANDLER_ALL) {	
+	    entry_user = config->next_user;
+	
+	    while(entry_user != NULL) {
+		mod_cband_status_snapshot(entry_user->shmem_data, entry_user->refresh_time, sec, &data);
+		mod_cband_status_print_user_row(r, entry_user, &data, handler_type, refresh, unit);
+		users_number++;
+		
+		if ((entry_user = entry_user->next) == NULL)
+		    break;
+	    }
+	} else {
+	    if (entry_user_me != NULL) {
+	        mod_cband_status_snapshot(entry_user_me->shmem_data, entry_user_me->refresh_time, sec, &data);
+		mod_cband_status_print_user_row(r, entry_user_me, &data, handler_type, refresh, unit);
+	    }
+	}
+	
+	ap_rputs("</table>\n", r);
     }
 
-    mod_cband_update_speed_lock(entry->shmem_data, 0, 0, -1);
-    mod_cband_get_speed_lock(entry->shmem_data, &bps, &rps);
-    mod_cband_status_print_speed(r, entry->shmem_data->curr_speed.kbps, bps / 1024);
-    mod_cband_status_print_speed(r, entry->shmem_data->curr_speed.rps,  rps);
-    mod_cband_status_print_connections(r, entry->shmem_data->curr_speed.max_conn, entry->shmem_data->total_conn);
+    ap_rputs("<table width=\"100%\" cellspacing=\"0\" cellpadding=\"0\" style=\"border: 0; margin: 0; padding: 0\">", r);
+    ap_rputs("<tr>", r);
+    ap_rputs("<td valign=top>", r);
 
-    if (entry->virtual_user)
-        ap_rprintf(r, "<td>%s</td>\n", entry->virtual_user);	
-    else
-	ap_rprintf(r, "<td>none</td>\n");	
+    ap_rputs("<div class=\"section\">", r);
+    ap_rputs("<br><h2 style=\"display: inline;\">Remote clients</h2>\n", r);
+    ap_rprintf(r, "<p style=\"display: inline;\"><a href=\"?refresh=%d&amp;unit=%s\">[refresh]</a> &nbsp; <a href=\"?refresh=%d\">[human-readable]</a> <a href=\"?refresh=%d&amp;unit=G\">[GB]</a> <a href=\"?refresh=%d&amp;unit=M\">[MB]</a> <a href=\"?refresh=%d&amp;unit=K\">[KB]</a></p>\n", refresh, unit, refresh, refresh, refresh, refresh);
+    ap_rprintf(r, "<p style=\"display: inline;\">&nbsp; <a href=\"?refresh=%d&amp;unit=%s\">[all]</a> <a href=\"?refresh=%d&amp;unit=%s&amp;remote_top=%d\">[top %d by speed]</a> <a href=\"?refresh=%d&amp;unit=%s&amp;remote_top=%d&amp;remote_by=conn\">[top %d by connections]</a></p>\n", 
+	refresh, unit, refresh, unit, DEFAULT_REMOTE_TOP, DEFAULT_REMOTE_TOP, refresh, unit, DEFAULT_REMOTE_TOP, DEFAULT_REMOTE_TOP);
+    ap_rputs("</div>", r);
+    ap_rputs("<table width=500 cellspacing=\"0\" cellpadding=\"0\">", r);
 
-    ap_rputs("</tr>\n", r);
-    
-    *total_traffic = virtual_usage->total_bytes;
-}
+    ap_rputs("<tr>", r);
+    ap_rprintf(r, "<td>Remote IP</td>");
+    ap_rprintf(r, "<td>Virtualhost</td>");
+    ap_rprintf(r, "<td>Connections<br>Limit/Current</td>");
+    ap_rprintf(r, "<td>Last speed/conn [kbps]</td>");
+    ap_rputs("</tr>", r);
 
-void mod_cband_status_print_user_row(request_rec *r, mod_cband_user_config_entry *entry_user,
-	int handler_type, int refresh, char *unit) {
-    
-    mod_cband_scoreboard_entry *user_usage;
-    unsigned long slice_limit;
-    float bps, rps;
-    int i;
+    time_now = apr_time_now();
+    names = mod_cband_status_remote_names(r, entry_me, entry_user_me, handler_type, &names_number);
 
-    user_usage = &entry_user->shmem_data->total_usage;
+    if (remote_top > 0) {
+	mod_cband_status_top_remotes(r, &heap, remote_top, remote_by_conn, names, names_number);
+	
+	for (i = 0; i < heap.size; i++)
+	    mod_cband_status_print_remote_row(r, (mod_cband_remote_host *)heap.items[i].ptr, time_now, ((i % 2) ? "odd" : "even"));
+    } else {
+	for (i = 0; i < MAX_REMOTE_HOSTS; i++) {
+	    if (!mod_cband_status_remote_match(&config->remote_hosts.hosts[i], time_now, names, names_number))
+		continue;
 	    
-    ap_rputs("<tr>\n", r);
-    ap_rprintf(r, "<td>%s</td>\n", entry_user->user_name);	
-    if (handler_type == CBAND_HANDLER_ALL)
-	ap_rprintf(r, "<td><a href=\"?reset_user=%s&amp;refresh=%d&amp;unit=%s\">reset</a></td>\n", entry_user->user_name, refresh, unit);
-    ap_rprintf(r, "<td class=\"refresh\">%s</td>\n", mod_cband_create_period(r->pool, user_usage->start_time, entry_user->refresh_time));
-
-    slice_limit = mod_cband_get_slice_limit(entry_user->shmem_data->total_usage.start_time, entry_user->refresh_time, entry_user->slice_len, entry_user->user_limit);
-    mod_cband_status_print_limit(r, entry_user->user_limit, (unsigned long)(user_usage->total_bytes / entry_user->user_limit_mult),
-	unit, entry_user->user_limit_mult, slice_limit);
-
-    for (i = 0; i < DST_CLASS; i++) {
-        slice_limit = mod_cband_get_slice_limit(entry_user->shmem_data->total_usage.start_time, entry_user->refresh_time, entry_user->slice_len, entry_user->user_class_limit[i]);
-	mod_cband_status_print_limit(r, entry_user->user_class_limit[i], (unsigned long)(user_usage->class_bytes[i] / entry_user->user_class_limit_mult[i]),
-	    unit, entry_user->user_class_limit_mult[i], slice_limit);
+	    mod_cband_status_print_remote_row(r, &config->remote_hosts.hosts[i], time_now, ((remotes_number++ % 2) ? "odd" : "even"));
+	}
     }
+    ap_rputs("</table>", r);
+    ap_rputs("</td>", r);
 
-    mod_cband_update_speed_lock(entry_user->shmem_data, 0, 0, -1);
-    mod_cband_get_speed_lock(entry_user->shmem_data, &bps, &rps);
-    mod_cband_status_print_speed(r, entry_user->shmem_data->curr_speed.kbps, bps / 1024);
-    mod_cband_status_print_speed(r, entry_user->shmem_data->curr_speed.rps,  rps);
-    mod_cband_status_print_connections(r, entry_user->shmem_data->curr_speed.max_conn, entry_user->shmem_data->total_conn);
+    ap_rputs("<td valign=top>", r);
+    if (handler_type == CBAND_HANDLER_ALL) {	
+        ap_rputs("<div class=\"section\">", r);
+        ap_rputs("<br><h2 style=\"display: inline;\">Server summary</h2>\n", r);
+	ap_rprintf(r, "<p style=\"display: inline;\"><a href=\"?refresh=%d&amp;unit=%s\">[refresh]</a> &nbsp; <a href=\"?refresh=%d\">[human-readable]</a> <a href=\"?refresh=%d&amp;unit=G\">[GB]</a> <a href=\"?refresh=%d&amp;unit=M\">[MB]</a> <a href=\"?refresh=%d&amp;unit=K\">[KB]</a></p>\n", refresh, unit, refresh, refresh, refresh, refresh);
+	ap_rputs("</div>", r);
+	ap_rputs("<table width=400>", r);
 
-    ap_rputs("</tr>\n", r);
-}
+        ap_rputs("<tr>", r);
+	ap_rputs("<td>Server uptime</td>", r);
+        ap_rprintf(r, "<td>%s</td>", mod_cband_create_time(r->pool, uptime));
+	ap_rputs("</tr>", r);
 
-void mod_cband_status_print_virtualhost_XML_row(request_rec *r, mod_cband_virtualhost_config_entry *entry,
-	int handler_type) {
+        ap_rputs("<tr>", r);
+	ap_rputs("<td>Total virtualhosts</td>", r);
+        ap_rprintf(r, "<td>%d</td>", vhosts_number);
+	ap_rputs("</tr>", r);
 
-    float bps, rps;
-    mod_cband_class_config_entry *entry_class;
-    mod_cband_scoreboard_entry *virtual_usage;
-    int i;
+        ap_rputs("<tr>", r);
+	ap_rputs("<td>Total users</td>", r);
+        ap_rprintf(r, "<td>%d</td>", users_number);
+	ap_rputs("</tr>", r);
 
-    virtual_usage = &entry->shmem_data->total_usage;
+        ap_rputs("<tr>", r);
+	ap_rputs("<td>Total connections</td>", r);
+        ap_rprintf(r, "<td>%lu</td>", total_connections);
+	ap_rputs("</tr>", r);
 
-    mod_cband_update_speed_lock(entry->shmem_data, 0, 0, -1);
-    mod_cband_get_speed_lock(entry->shmem_data, &bps, &rps);
-	    
-    ap_rprintf(r, "\t\t<virtualhost>\n");
-    ap_rprintf(r, "\t\t\t<name>%s</name>\n", entry->virtual_name);
-    ap_rprintf(r, "\t\t\t<port>%d</port>\n", entry->virtual_port);
-    ap_rprintf(r, "\t\t\t<line>%d</line>\n", entry->virtual_defn_line);
-    ap_rprintf(r, "\t\t\t<limits>\n");
- 	    
-    ap_rprintf(r, "\t\t\t\t<total>%lu%s</total>\n", entry->virtual_limit,
-	      (entry->virtual_limit_mult == 1024 ? "KiB" : "KB"));
+        ap_rputs("<tr>", r);
+	ap_rputs("<td>Total traffic</td>", r);
+        ap_rprintf(r, "<td>%s</td>", mod_cband_create_traffic_size(r->pool, total_traffic / 1000, unit, 1000));
+	ap_rputs("</tr>", r);
 
-    entry_class = config->next_class;
-    i = 0;
-    while(entry_class != NULL) {
-	ap_rprintf(r, "\t\t\t\t<%s>%lu%s</%s>\n", entry_class->class_name, entry->virtual_class_limit[i],
-        (entry->virtual_class_limit_mult[i] == 1024 ? "KiB" : "KB"), entry_class->class_name);
-	i++;
-        entry_class = entry_class->next;
-    }
-    ap_rprintf(r, "\t\t\t\t<kbps>%lu</kbps>\n", entry->shmem_data->curr_speed.kbps);
-    ap_rprintf(r, "\t\t\t\t<rps>%lu</rps>\n", entry->shmem_data->curr_speed.rps);
-    ap_rprintf(r, "\t\t\t\t<connections>%lu</connections>\n", entry->shmem_data->curr_speed.max_conn);
-    ap_rprintf(r, "\t\t\t</limits>\n");
+        ap_rputs("<tr>", r);
+	ap_rputs("<td>Current speed</td>", r);
+        ap_rprintf(r, "<td>%0.2f kbps / %0.2f rps</td>", current_speed_bps / 1024, current_speed_rps);
+	ap_rputs("</tr>", r);
 
-    ap_rprintf(r, "\t\t\t<usages>\n");
-    ap_rprintf(r, "\t\t\t\t<total>%luKiB</total>\n", (unsigned long)(virtual_usage->total_bytes / 1024));
-    entry_class = config->next_class;
-    i = 0;
-    while(entry_class != NULL) {
-        ap_rprintf(r, "\t\t\t\t<%s>%lu%s</%s>\n", entry_class->class_name,
-	    (unsigned long)(virtual_usage->class_bytes[i] / entry->virtual_class_limit_mult[i]),
-	    (entry->virtual_class_limit_mult[i] == 1024 ? "KiB" : "KB"), entry_class->class_name);
-        i++;
-        entry_class = entry_class->next;
+	if (config->remote_hosts.stats != NULL) {
+    	    ap_rputs("<tr>", r);
+	    ap_rputs("<td>Remote clients table<br>overflows/refused</td>", r);
+    	    ap_rprintf(r, "<td>%llu / %llu</td>", config->remote_hosts.stats->overflows, config->remote_hosts.stats->refused);
+	    ap_rputs("</tr>", r);
+	}
+        ap_rputs("</table>", r);
     }
-    ap_rprintf(r, "\t\t\t\t<kbps>%0.2f</kbps>\n", bps / 1024);
-    ap_rprintf(r, "\t\t\t\t<rps>%0.2f</rps>\n", rps);
-    ap_rprintf(r, "\t\t\t\t<connections>%lu</connections>\n", entry->shmem_data->total_conn);
-    ap_rprintf(r, "\t\t\t</usages>\n");
 
-    ap_rprintf(r, "<time_to_refresh>%s</time_to_refresh>", mod_cband_create_period(r->pool, virtual_usage->start_time, entry->refresh_time));
-    
-    if (entry->virtual_user)
-	ap_rprintf(r, "\t\t\t<user>%s</user>\n", entry->virtual_user);
-    else
-    	ap_rprintf(r, "\t\t\t<user>none</user>\n");	
+    ap_rputs("</td>", r);
+    ap_rputs("</tr>", r);
+    ap_rputs("</table>", r);
 
-    if (entry->virtual_scoreboard)
-	ap_rprintf(r, "\t\t\t<scoreboard>%s</scoreboard>\n", entry->virtual_scoreboard);	
-    else
-    	ap_rprintf(r, "\t\t\t<scoreboard>none</scoreboard>\n");	
+    mod_cband_status_print_delays(r, entry_me, entry_user_me, handler_type, refresh, unit);
 
-    if (entry->virtual_limit_exceeded)
-	ap_rprintf(r, "\t\t\t<limit_exceeded_URL>%s</limit_exceeded_URL>\n", entry->virtual_limit_exceeded);	
-    else
-    	ap_rprintf(r, "\t\t\t<limit_exceeded_URL>none</limit_exceeded_URL>\n");	
+    if (handler_type == CBAND_HANDLER_ALL)
+	mod_cband_status_print_locks(r, refresh, unit);
 
-    ap_rprintf(r, "\t\t</virtualhost>\n");
+    ap_rputs(mod_cband_status_handler_foot, r);
+    ap_rputs("</body>\n</html>\n", r);
+    
+    return OK;
 }
 
-void mod_cband_status_print_user_XML_row(request_rec *r, mod_cband_user_config_entry *entry_user,
-	int handler_type) {
-    
-    float bps, rps;
-    mod_cband_class_config_entry *entry_class;
-    mod_cband_scoreboard_entry *user_usage;
+/**
+ * /cband-status handler output in XML
+ */
+static int mod_cband_status_handler_XML (request_rec *r, int handler_type)
+{
+    mod_cband_virtualhost_config_entry *entry, *entry_me = NULL;
+    mod_cband_user_config_entry *entry_user, *entry_user_me = NULL;
+    mod_cband_shmem_data data;
+    mod_cband_heap heap;
+    unsigned long sec, uptime, time_now;
+    char **names;
+    int names_number, remote_top, remote_by_conn;
     int i;
 
-    user_usage = &entry_user->shmem_data->total_usage;
+    if (handler_type == CBAND_HANDLER_ME) {
+    	if ((entry_me = mod_cband_get_virtualhost_entry(r->server, r->server->module_config, 0)) != NULL) {
+	    if (entry_me->virtual_user != NULL)  
+	       entry_user_me = mod_cband_get_user_entry(entry_me->virtual_user, r->server->module_config, 0);
+	}
+    }
+
+    sec = (unsigned long)(apr_time_now() / 1e6);
+    uptime = (unsigned long)(sec - config->start_time);
 
-    mod_cband_update_speed_lock(entry_user->shmem_data, 0, 0, -1);
-    mod_cband_get_speed_lock(entry_user->shmem_data, &bps, &rps);
-    
-    ap_rprintf(r, "\t\t<%s>\n", entry_user->user_name);	
-    ap_rprintf(r, "\t\t\t<limits>\n");
-    ap_rprintf(r, "\t\t\t\t<total>%lu%s</total>\n", entry_user->user_limit,
-    (entry_user->user_limit_mult == 1024 ? "KiB" : "KB"));
+    ap_set_content_type(r, "text/xml");
 
-    entry_class = config->next_class;
-    i = 0;
-    while(entry_class != NULL) {
-	ap_rprintf(r, "\t\t\t\t<%s>%lu%s</%s>\n", entry_class->class_name, entry_user->user_class_limit[i],
-	          (entry_user->user_class_limit_mult[i] == 1024 ? "KiB" : "KB"), entry_class->class_name);
-	i++;
-        entry_class = entry_class->next;
+    ap_rputs("<?xml version=\"1.0\" encoding=\"iso-8859-1\"?>\n", r);
+    ap_rputs("<mod_cband>\n", r);
+    ap_rputs("\t<Server>\n", r);
+    ap_rprintf(r, "\t\t<uptime>%s</uptime>\n", mod_cband_create_time(r->pool, uptime));    
+    if ((handler_type == CBAND_HANDLER_ALL) && (config->remote_hosts.stats != NULL)) {
+	ap_rprintf(r, "\t\t<remote_overflows>%llu</remote_overflows>\n", config->remote_hosts.stats->overflows);
+	ap_rprintf(r, "\t\t<remote_refused>%llu</remote_refused>\n", config->remote_hosts.stats->refused);
     }
+    ap_rputs("\t</Server>\n", r);
     
-    ap_rprintf(r, "\t\t\t\t<kbps>%lu</kbps>\n", entry_user->shmem_data->curr_speed.kbps);
-    ap_rprintf(r, "\t\t\t\t<rps>%lu</rps>\n", entry_user->shmem_data->curr_speed.rps);
-    ap_rprintf(r, "\t\t\t\t<connections>%lu</connections>\n", entry_user->shmem_data->curr_speed.max_conn);
-    ap_rprintf(r, "\t\t\t</limits>\n");
-
-    ap_rprintf(r, "\t\t\t<usages>\n");
-    ap_rprintf(r, "\t\t\t\t<total>%luKiB</total>\n", (unsigned long)(user_usage->total_bytes / 1024));
-    entry_class = config->next_class;
-    i = 0;
-    while(entry_class != NULL) {
-        ap_rprintf(r, "\t\t\t\t<%s>%lu%s</%s>\n", entry_class->class_name,
-	    (unsigned long)(user_usage->class_bytes[i] / entry_user->user_class_limit_mult[i]),
-	    (entry_user->user_class_limit_mult[i] == 1024 ? "KiB" : "KB"), entry_class->class_name);
-        i++;
-        entry_class = entry_class->next;
+    ap_rputs("\t<Virtualhosts>\n", r);
+    if (handler_type == CBAND_HANDLER_ALL) {	
+        entry = config->next_virtualhost;
+    
+	while(entry != NULL) {
+    	    mod_cband_status_snapshot(entry->shmem_data, entry->refresh_time, sec, &data);
+	    mod_cband_status_print_virtualhost_XML_row(r, entry, &data, handler_type);
+	    	    
+	    if ((entry = entry->next) == NULL)
+		break;
+	}
+    } else {
+    	if ((entry_user_me != NULL) && (entry_user_me->user_name != NULL)) {
+	    entry = config->next_virtualhost;
+	    while(entry != NULL) {
+		if ((entry->virtual_user != NULL) && !strcasecmp(entry->virtual_user, entry_user_me->user_name)) {
+		    mod_cband_status_snapshot(entry->shmem_data, entry->refresh_time, sec, &data);
+		    mod_cband_status_print_virtualhost_XML_row(r, entry, &data, handler_type);
+		}
+		    
+		if ((entry = entry->next) == NULL)
+		    break;
+	    }
+	} else	
+	if (entry_me != NULL) {
+	    mod_cband_status_snapshot(entry_me->shmem_data, entry_me->refresh_time, sec, &data);
+	    mod_cband_status_print_virtualhost_XML_row(r, entry_me, &data, handler_type);
+	}
     }
-    ap_rprintf(r, "\t\t\t\t<kbps>%0.2f</kbps>\n", bps / 1024);
-    ap_rprintf(r, "\t\t\t\t<rps>%0.2f</rps>\n", rps);
-    ap_rprintf(r, "\t\t\t\t<connections>%lu</connections>\n", entry_user->shmem_data->total_conn);
-    ap_rprintf(r, "\t\t\t</usages>\n");
-
-    ap_rprintf(r, "<time_to_refresh>%s</time_to_refresh>", mod_cband_create_period(r->pool, user_usage->start_time, entry_user->refresh_time));
+	
+    ap_rputs("\t</Virtualhosts>\n", r);
+    ap_rputs("\t<Users>\n", r);
 
-    if (entry_user->user_limit_exceeded)
-	ap_rprintf(r, "\t\t\t<limit_exceeded_URL>%s</limit_exceeded_URL>\n", entry_user->user_limit_exceeded);	
-    else
-    	ap_rprintf(r, "\t\t\t<limit_exceeded_URL>none</limit_exceeded_URL>\n");	
+    if (handler_type == CBAND_HANDLER_ALL) {	
+        entry_user = config->next_user;
+	
+	while(entry_user != NULL) {
+	    mod_cband_status_snapshot(entry_user->shmem_data, entry_user->refresh_time, sec, &data);
+	    mod_cband_status_print_user_XML_row(r, entry_user, &data, handler_type);
 	    
-    if (entry_user->user_scoreboard)
-	ap_rprintf(r, "\t\t\t<scoreboard>%s</scoreboard>\n", entry_user->user_scoreboard);	
-    else
-    	ap_rprintf(r, "\t\t\t<scoreboard>none</scoreboard>\n");	
+	    if ((entry_user = entry_user->next) == NULL)
+		break;
+	}
+    } else {
+	if (entry_user_me != NULL) {
+	    mod_cband_status_snapshot(entry_user_me->shmem_data, entry_user_me->refresh_time, sec, &data);
+	    mod_cband_status_print_user_XML_row(r, entry_user_me, &data, handler_type);
+	}
+    }
+	
+    ap_rputs("\t</Users>\n", r);
 
-    ap_rprintf(r, "\t\t</%s>\n", entry_user->user_name);
+    if ((remote_top = mod_cband_status_remote_args(r, &remote_by_conn)) > 0) {
+	names = mod_cband_status_remote_names(r, entry_me, entry_user_me, handler_type, &names_number);
+	mod_cband_status_top_remotes(r, &heap, remote_top, remote_by_conn, names, names_number);
+	time_now = apr_time_now();
+	
+	ap_rputs("\t<Remotes>\n", r);
+	for (i = 0; i < heap.size; i++)
+	    mod_cband_status_print_remote_XML_row(r, (mod_cband_remote_host *)heap.items[i].ptr, time_now);
+	ap_rputs("\t</Remotes>\n", r);
+    }
+    
+    if (handler_type == CBAND_HANDLER_ALL)
+	mod_cband_status_print_locks_XML(r);
+    
+    ap_rputs("</mod_cband>", r);
+
+    return OK;
 }
 
-static const char mod_cband_status_handler_style[] = 
-"\n<style type=\"text/css\">\n"
-"body 		{ font-family: sans-serif; font-size: 0.6em; }\n"
-"table		{ font-family: tachoma, helvetica, verdana, sans-serif; border: 1px solid #d0d0d0; }\n"
-"tr		{ font-family: tachoma, helvetica, verdana, sans-serif; border: 1px solid #d0d0d0; }\n"
-"td		{ padding-left: 0.5em; padding-right: 0.5em; }\n"
-"td.refresh	{ background-color: #0de2cb; text-align: right; }\n"
-"td.speed	{ background-color: #ffa1a1; text-align: left; }\n"
-"td.speedc	{ background-color: #ffb1b1; text-align: left; }\n"
-"td.remote_odd	{ background-color: #b4bfff; text-align: left; }\n"
-"td.remote_even	{ background-color: #bfcfff; text-align: left; }\n"
-"a		{ text-decoration: none; color: #606060; }\n"
-"a:hover	{ text-decoration: underline; }\n"
-"h1, h2		{ font-family: tachoma, helvetica, verdana, sans-serif}\n"
-".small 	{ font-size: smaller; }\n"
-"div.section	{ margin-top: 1.5em; margin-bottom: 0.5em; }\n"
-"div.footer	{ margin-top: 2.5em; text-align: center; font-size: smaller; }\n"
-"</style>\n\n";
+void mod_cband_json_print_string(request_rec *r, const char *str)
+{
+    const char *start;
 
-static const char mod_cband_status_handler_foot[] = 
-"\n<div class=\"footer\"><br>\n"
-"<p><a href=\"http://cband.linux.pl\">mod_cband 0.9.7.5</a><br>\n"
-"Copyright 2005 by <a href=\"mailto: dembol _at_ cband.linux.pl\">Lukasz Dembinski</a><br>\n"
-"All rights reserved.<br>\n"
-"<br><a href=\"http://validator.w3.org/check?uri=http%3A%2F%2Fdembol.nasa.pl%2Fcband-status\">[HTML 4.0 Strict]</a>\n"
-"</p></div>\n";
+    if (str == NULL) {
+	ap_rputs("null", r);
+	return;
+    }
 
-/**
- * /cband-status handler output in HTML
- */
-static int mod_cband_status_handler_HTML (request_rec *r, int handler_type)
+    ap_rputs("\"", r);
+    for (start = str; *str != 0; str++) {
+	if ((*str == '"') || (*str == '\\') || ((unsigned char)*str < 0x20)) {
+	    ap_rwrite(start, str - start, r);
+	    ap_rprintf(r, "\\u%04x", (unsigned char)*str);
+	    start = str + 1;
+	}
+    }
+    ap_rwrite(start, str - start, r);
+    ap_rputs("\"", r);
+}
+
+void mod_cband_status_print_locks_JSON(request_rec *r)
 {
-    mod_cband_virtualhost_config_entry *entry = NULL, *entry_me = NULL;
-    mod_cband_user_config_entry *entry_user, *entry_user_me = NULL;
-    mod_cband_class_config_entry *entry_class;
-    unsigned long uptime, sec;
-    unsigned i;
-    char *arg;
-    char *val, *key;
-    int refresh = -1;
-    char *unit = "";
-    int vhosts_number = 0, users_number = 0;
-    unsigned long long traffic, total_traffic = 0;
-    unsigned long total_connections = 0;
-    float bps, current_speed_bps = 0;
-    float rps, current_speed_rps = 0;
-    struct in_addr remote_addr;
-    unsigned long time_now, time_delta;
-    int odd = 0, ok = 0;
-    const char *odd_str;
+    mod_cband_lock_site *sites;
+    int i, sites_number;
 
-    if (r->args != NULL) {
+    sites_number = mod_cband_status_lock_sites(r, &sites);
 
-	arg = r->args;
-	while(*arg != 0) {
-	    val = ap_getword_nc(r->pool, &arg, '&');
-	    
-	    if (val == NULL)
-		break;
+    ap_rputs("[", r);
+    for (i = 0; i < sites_number; i++) {
+	if (i > 0)
+	    ap_rputs(",", r);
 	
-	    key = ap_getword_nc(r->pool, &val, '=');
-	
-	    if (key == NULL)
-		break;
-		
-	    apr_table_setn(r->notes, key, val);
-	}
+	ap_rputs("{\"site\":", r);
+	mod_cband_json_print_string(r, sites[i].name);
+	ap_rprintf(r, ",\"semaphore\":\"%s\",\"acquisitions\":%llu,\"contended\":%llu,\"wait_ns\":%llu,\"max_wait_ns\":%llu}",
+	    sites[i].remote ? "remote" : "global", sites[i].acquisitions, sites[i].contended, sites[i].wait_nsec, sites[i].max_wait_nsec);
     }
+    ap_rputs("]", r);
+}
 
-    if ((arg = (char *)apr_table_get(r->notes, "refresh")) != NULL)
-	refresh = atoi(arg);
+void mod_cband_status_print_JSON_usage(request_rec *r, mod_cband_shmem_data *data, 
+	unsigned long limit, unsigned int limit_mult, unsigned long *class_limit, unsigned int *class_limit_mult,
+	unsigned long refresh_time, unsigned long slice_len, char **class_names, int classes)
+{
+    mod_cband_scoreboard_entry *usage;
+    mod_cband_hist_summary summary;
+    unsigned long sec;
+    float bps, rps;
+    int i;
 
-    if ((arg = (char *)apr_table_get(r->notes, "unit")) != NULL) {
-	if (arg[0] == 'G' || arg[0] == 'g' || arg[0] == 'M' || arg[0] == 'm' || arg[0] == 'K' || arg[0] == 'k') {
-	    arg[0] = toupper(arg[0]);
-	    if (arg[1] == 'I' || arg[1] == 'i') {
-		arg[1] = 'i';
-		arg[2] = 0;
-		unit = arg;
-	    } else {
-		arg[1] = 0;
-		unit = arg;
-	    }
-	}
+    usage = &data->total_usage;
+    sec   = (unsigned long)(apr_time_now() / 1e6);
+    mod_cband_get_real_speed(data, &bps, &rps);
+
+    ap_rprintf(r, ",\"limits\":{\"bytes\":%llu,\"slice_bytes\":%llu,\"kbps\":%lu,\"rps\":%lu,\"connections\":%lu,\"classes\":{",
+	(unsigned long long)limit * limit_mult, 
+	(unsigned long long)mod_cband_get_slice_limit(usage->start_time, refresh_time, slice_len, limit) * limit_mult,
+	data->curr_speed.kbps, data->curr_speed.rps, data->curr_speed.max_conn);
+
+    for (i = 0; i < classes; i++) {
+	if (i > 0)
+	    ap_rputs(",", r);
+	mod_cband_json_print_string(r, class_names[i]);
+	ap_rprintf(r, ":%llu", (unsigned long long)class_limit[i] * class_limit_mult[i]);
     }
-    
-    if (refresh < 0)
-	refresh = DEFAULT_REFRESH;
-	
-    if (handler_type == CBAND_HANDLER_ALL) {
-	if ((arg = (char *)apr_table_get(r->notes, "reset")) != NULL) {
-    	    mod_cband_reset_virtualhost(arg);
-	
-	    apr_table_setn(r->headers_out, "Location", apr_psprintf(r->pool, "%s?refresh=%d&unit=%s", r->uri, refresh, unit));
-	    return HTTP_MOVED_PERMANENTLY;
-	}
 
-	if ((arg = (char *)apr_table_get(r->notes, "reset_user")) != NULL) {
-    	    mod_cband_reset_user(arg);
-	
-	    apr_table_setn(r->headers_out, "Location", apr_psprintf(r->pool, "%s?refresh=%d&unit=%s", r->uri, refresh, unit));
-	    return HTTP_MOVED_PERMANENTLY;
-	}
-    } else {
-    	if ((entry_me = mod_cband_get_virtualhost_entry(r->server, r->server->module_config, 0)) != NULL) {
-	    if (entry_me->virtual_user != NULL)  
-		entry_user_me = mod_cband_get_user_entry(entry_me->virtual_user, r->server->module_config, 0);
-	    else
-		entry_user_me = NULL;
-	}
+    ap_rprintf(r, "}},\"usages\":{\"bytes\":%llu,\"requests\":%llu,\"kbps\":%0.2f,\"rps\":%0.2f,\"connections\":%lu,\"classes\":{",
+	usage->total_bytes, data->total_requests, bps / 1024, rps, data->total_conn);
+
+    for (i = 0; i < classes; i++) {
+	if (i > 0)
+	    ap_rputs(",", r);
+	mod_cband_json_print_string(r, class_names[i]);
+	ap_rprintf(r, ":%llu", usage->class_bytes[i]);
     }
+    ap_rputs("}}", r);
 
-    sec = (unsigned long)(apr_time_now() / 1e6);
-    uptime = (unsigned long)(sec - config->start_time);
+    if ((usage->start_time == 0) || (refresh_time == 0))
+	ap_rputs(",\"time_to_refresh\":null", r);
+    else
+	ap_rprintf(r, ",\"time_to_refresh\":%ld", (long)(usage->start_time + refresh_time) - (long)sec);
 
-    apr_table_setn(r->headers_out, "Refresh", apr_psprintf(r->pool, "%d", refresh));
-    ap_set_content_type(r, "text/html");
+    ap_rprintf(r, ",\"overlimit\":%d,\"delays\":{", data->overlimit);
 
-    ap_rputs(DOCTYPE_HTML_4_0S "<html>\n<head>\n<title>mod_cband status</title>\n", r);
-    ap_rputs("<meta http-equiv=\"Content-Type\" content=\"text/html;charset=utf-8\">\n", r);
-    ap_rputs(mod_cband_status_handler_style, r);
-    ap_rputs("</head>\n", r);
-    ap_rputs("<body>\n", r);
-    ap_rputs("<h1 style=\"text-align: center\"><a href=\"http://cband.linux.pl\">mod_cband</a> status page</h1>\n", r);
-    ap_rprintf(r, "<h2 style=\"text-align: center\">Server uptime %s</h2>\n", mod_cband_create_time(r->pool, uptime));
-    ap_rputs("<div class=\"section\">", r);
-    ap_rputs("<h2 style=\"display: inline;\">Virtual hosts</h2>\n", r);
-    ap_rprintf(r, "<p style=\"display: inline;\"><a href=\"?refresh=%d&amp;unit=%s\">[refresh]</a> &nbsp; <a href=\"?refresh=%d\">[human-readable]</a> <a href=\"?refresh=%d&amp;unit=G\">[GB]</a> <a href=\"?refresh=%d&amp;unit=M\">[MB]</a> <a href=\"?refresh=%d&amp;unit=K\">[KB]</a></p>\n", refresh, unit, refresh, refresh, refresh, refresh);
-    ap_rputs("</div>\n", r);
-    
-    if (((handler_type == CBAND_HANDLER_ME) && (entry_me == NULL)) || 
-        ((handler_type == CBAND_HANDLER_ALL) && (config->next_virtualhost == NULL)))
-	ap_rputs("<p>There are no limits set for virtual hosts.</p>\n", r);
-    else {
-	ap_rputs("<table cellspacing=\"0\" cellpadding=\"0\">\n", r);
-	ap_rputs("<tr>\n<td>Virtual host name</td>\n", r);
+    for (i = 0; i < HIST_TYPES; i++) {
+	mod_cband_hist_summarize(&data->hist[i], &summary);
+	ap_rprintf(r, "%s\"%s\":{\"count\":%llu,\"sum\":%llu,\"p50\":%lu,\"p90\":%lu,\"p99\":%lu}", (i > 0 ? "," : ""),
+	    mod_cband_hist_names[i], summary.count, summary.sum, summary.p50, summary.p90, summary.p99);
+    }
+    ap_rputs("}", r);
+}
 
-	if (handler_type == CBAND_HANDLER_ALL) {
-	    ap_rputs("<td>", r);
-	    ap_rprintf(r, "<a href=\"?reset=all&amp;refresh=%d&amp;unit=%s\">reset all</a></td>\n", refresh, unit);
-	}
-	
-	ap_rputs("<td>time to refresh</td>\n", r);
-	ap_rprintf(r,"<td>Total<br>Limit/Slice/Used</td>\n");
-	entry_class = config->next_class;
+void mod_cband_status_print_virtualhost_JSON_row(request_rec *r, mod_cband_virtualhost_config_entry *entry, 
+	mod_cband_shmem_data *data, char **class_names, int classes)
+{
+    ap_rputs("{\"name\":", r);
+    mod_cband_json_print_string(r, entry->virtual_name);
+    ap_rprintf(r, ",\"port\":%d,\"line\":%d,\"user\":", entry->virtual_port, entry->virtual_defn_line);
+    mod_cband_json_print_string(r, entry->virtual_user);
+
+    mod_cband_status_print_JSON_usage(r, data, entry->virtual_limit, entry->virtual_limit_mult,
+	entry->virtual_class_limit, entry->virtual_class_limit_mult, entry->refresh_time, entry->slice_len,
+	class_names, classes);
+    
+    ap_rputs(",\"scoreboard\":", r);
+    mod_cband_json_print_string(r, entry->virtual_scoreboard);
+    ap_rputs(",\"limit_exceeded_URL\":", r);
+    mod_cband_json_print_string(r, entry->virtual_limit_exceeded);
+    ap_rputs("}", r);
+}
+
+void mod_cband_status_print_user_JSON_row(request_rec *r, mod_cband_user_config_entry *entry_user, 
+	mod_cband_shmem_data *data, char **class_names, int classes)
+{
+    ap_rputs("{\"name\":", r);
+    mod_cband_json_print_string(r, entry_user->user_name);
+
+    mod_cband_status_print_JSON_usage(r, data, entry_user->user_limit, entry_user->user_limit_mult,
+	entry_user->user_class_limit, entry_user->user_class_limit_mult, entry_user->refresh_time, entry_user->slice_len,
+	class_names, classes);
+    
+    ap_rputs(",\"scoreboard\":", r);
+    mod_cband_json_print_string(r, entry_user->user_scoreboard);
+    ap_rputs(",\"limit_exceeded_URL\":", r);
+    mod_cband_json_print_string(r, entry_user->user_limit_exceeded);
+    ap_rputs("}", r);
+}
+
+void mod_cband_status_print_remotes_JSON(request_rec *r, mod_cband_heap *heap)
+{
+    mod_cband_remote_host *host;
+    unsigned long time_now;
+    int i;
+
+    time_now = apr_time_now();
+
+    ap_rputs("[", r);
+    for (i = 0; i < heap->size; i++) {
+	host = (mod_cband_remote_host *)heap->items[i].ptr;
 	
-	i = 0;
-	while(entry_class != NULL) {
-	    ap_rprintf(r,"<td>%s<br>Limit/Slice/Used</td>\n", entry_class->class_name);
+	if (i > 0)
+	    ap_rputs(",", r);
 	
-	    entry_class = entry_class->next;
-            i++;
-	}
+	ap_rprintf(r, "{\"ip\":\"%s\",\"virtualhost\":", host->remote_name);
+	mod_cband_json_print_string(r, host->virtual_name);
+	ap_rprintf(r, ",\"connections\":%lu,\"connections_limit\":%lu,\"kbps\":%lu}",
+	    host->remote_conn, host->remote_max_conn, mod_cband_status_remote_kbps(host, time_now));
+    }
+    ap_rputs("]", r);
+}
+
+int mod_cband_status_JSON_match(mod_cband_status_filter *filter, char *name, char *exact)
+{
+    if ((exact != NULL) && ((name == NULL) || strcmp(exact, name)))
+	return 0;
+
+    if ((filter->prefix != NULL) && ((name == NULL) || strncmp(filter->prefix, name, strlen(filter->prefix))))
+	return 0;
+
+    return 1;
+}
+
+int mod_cband_status_JSON_virtualhost_match(request_rec *r, mod_cband_virtualhost_config_entry *entry, mod_cband_status_filter *filter,
+	mod_cband_virtualhost_config_entry *entry_me, mod_cband_user_config_entry *entry_user_me, int handler_type)
+{
+    if (handler_type == CBAND_HANDLER_ME) {
+	if ((entry_user_me != NULL) && (entry_user_me->user_name != NULL)) {
+	    if ((entry->virtual_user == NULL) || strcasecmp(entry->virtual_user, entry_user_me->user_name))
+		return 0;
+	} else
+	if (entry != entry_me)
+	    return 0;
+    }
+
+    if ((filter->user != NULL) && ((entry->virtual_user == NULL) || strcmp(filter->user, entry->virtual_user)))
+	return 0;
+
+    return mod_cband_status_JSON_match(filter, entry->virtual_name, filter->virtualhost);
+}
+
+/*
+ * prints the selected page of virtualhosts. Without top the list is streamed, with top
+ * the speed is computed for every matching entry and only N fastest are kept
+ */
+void mod_cband_status_print_virtualhosts_JSON(request_rec *r, mod_cband_status_filter *filter, 
+	mod_cband_virtualhost_config_entry *entry_me, mod_cband_user_config_entry *entry_user_me, 
+	int handler_type, char **class_names, int classes)
+{
+    mod_cband_virtualhost_config_entry *entry;
+    mod_cband_shmem_data data;
+    mod_cband_heap heap;
+    unsigned long sec;
+    float bps;
+    int matched = 0, printed = 0;
+    int i;
+
+    sec = (unsigned long)(apr_time_now() / 1e6);
+
+    ap_rputs("{\"items\":[", r);
+
+    if (filter->top > 0) {
+	mod_cband_heap_init(r->pool, &heap, filter->top);
 	
-	for (; i < DST_CLASS; i++)
-	    ap_rprintf(r,"<td>Class %d<br>Limit/Slice/Used</td>\n",i);
+	for (entry = config->next_virtualhost; entry != NULL; entry = entry->next) {
+	    if (!mod_cband_status_JSON_virtualhost_match(r, entry, filter, entry_me, entry_user_me, handler_type))
+		continue;
 		
-	ap_rprintf(r,"<td>kbps<br>Limit/Current</td>\n");
-	ap_rprintf(r,"<td>rps<br>Limit/Current</td>\n");
-	ap_rprintf(r,"<td>Connections<br>Limit/Current</td>\n");
+	    matched++;
+	    mod_cband_shmem_read(entry->shmem_data, &data);
+	    mod_cband_get_real_speed(&data, &bps, NULL);
+	    mod_cband_heap_push(&heap, bps, entry);
+	}
 	
-	ap_rputs("<td>user</td>\n", r);
-	ap_rputs("</tr>\n", r);
+	mod_cband_heap_sort(&heap);
 	
-	current_speed_bps = 0;
-	current_speed_rps = 0;
-	if (handler_type == CBAND_HANDLER_ALL) {	
-	    entry = config->next_virtualhost;
-	    while(entry != NULL) {
-		mod_cband_check_virtualhost_refresh(entry, sec);
-	        mod_cband_status_print_virtualhost_row(r, entry, handler_type, refresh, unit, &traffic);
-		total_traffic += traffic;
-		total_connections += entry->shmem_data->total_conn;
-		vhosts_number++;
-		
-		mod_cband_get_speed_lock(entry->shmem_data, &bps, &rps);
-		current_speed_bps += bps;
-		current_speed_rps += rps;
-	    	    
-		if ((entry = entry->next) == NULL)
-		    break;
-	    }
-	} else {
-	    if ((entry_user_me != NULL) && (entry_user_me->user_name != NULL)) {
-	        entry = config->next_virtualhost;
-		while(entry != NULL) {
-		    if ((entry->virtual_user != NULL) && !strcasecmp(entry->virtual_user, entry_user_me->user_name)) {
-			mod_cband_check_virtualhost_refresh(entry, sec);
-		        mod_cband_status_print_virtualhost_row(r, entry, handler_type, refresh, unit, &traffic);
-		    }
-		    
-		    if ((entry = entry->next) == NULL)
-			break;
-		}
-	    } else	
-	    if (entry_me != NULL) {
-	    	mod_cband_check_virtualhost_refresh(entry_me, sec);
-	        mod_cband_status_print_virtualhost_row(r, entry_me, handler_type, refresh, unit, &traffic);
-	    }
+	for (i = filter->offset; (i < heap.size) && ((filter->limit < 0) || (printed < filter->limit)); i++) {
+	    entry = (mod_cband_virtualhost_config_entry *)heap.items[i].ptr;
+	    
+	    if (printed++ > 0)
+		ap_rputs(",", r);
+	    
+	    mod_cband_status_snapshot(entry->shmem_data, entry->refresh_time, sec, &data);
+	    mod_cband_status_print_virtualhost_JSON_row(r, entry, &data, class_names, classes);
 	}
+    } else {
+	for (entry = config->next_virtualhost; entry != NULL; entry = entry->next) {
+	    if (!mod_cband_status_JSON_virtualhost_match(r, entry, filter, entry_me, entry_user_me, handler_type))
+		continue;
 	
-	ap_rputs("</table>\n", r);
+	    if ((matched++ < filter->offset) || ((filter->limit >= 0) && (printed >= filter->limit)))
+		continue;
+	    
+	    if (printed++ > 0)
+		ap_rputs(",", r);
+	    
+	    mod_cband_status_snapshot(entry->shmem_data, entry->refresh_time, sec, &data);
+	    mod_cband_status_print_virtualhost_JSON_row(r, entry, &data, class_names, classes);
+	}
     }
+    
+    ap_rprintf(r, "],\"total\":%d,\"offset\":%d,\"count\":%d}", matched, filter->offset, printed);
+}
 
-    ap_rputs("<div class=\"section\">", r);
-    ap_rputs("<br><h2 style=\"display: inline;\">Users</h2>\n", r);
-    ap_rprintf(r, "<p style=\"display: inline;\"><a href=\"?refresh=%d&amp;unit=%s\">[refresh]</a> &nbsp; <a href=\"?refresh=%d\">[human-readable]</a> <a href=\"?refresh=%d&amp;unit=G\">[GB]</a> <a href=\"?refresh=%d&amp;unit=M\">[MB]</a> <a href=\"?refresh=%d&amp;unit=K\">[KB]</a></p>\n", refresh, unit, refresh, refresh, refresh, refresh);
-    ap_rputs("</div>\n", r);
+/*
+ * prints the selected page of users, see mod_cband_status_print_virtualhosts_JSON
+ */
+void mod_cband_status_print_users_JSON(request_rec *r, mod_cband_status_filter *filter, 
+	mod_cband_user_config_entry *entry_user_me, int handler_type, char **class_names, int classes)
+{
+    mod_cband_user_config_entry *entry_user;
+    mod_cband_shmem_data data;
+    mod_cband_heap heap;
+    unsigned long sec;
+    float bps;
+    int matched = 0, printed = 0;
+    int i;
 
-    if (((handler_type == CBAND_HANDLER_ME) && (entry_user_me == NULL)) || 
-        ((handler_type == CBAND_HANDLER_ALL) && (config->next_user == NULL)))
-        ap_rputs("<p>There are no limits set for users.</p>\n", r);
-    else {
-	ap_rputs("<table cellspacing=\"0\" cellpadding=\"0\">\n", r);
-	ap_rputs("<tr>\n<td>Username</td>\n", r);
+    sec = (unsigned long)(apr_time_now() / 1e6);
+
+    ap_rputs("{\"items\":[", r);
+
+    if (filter->top > 0) {
+	mod_cband_heap_init(r->pool, &heap, filter->top);
 	
-	if (handler_type == CBAND_HANDLER_ALL) {
-	    ap_rputs("<td>", r);
-	    ap_rprintf(r, "<a href=\"?reset_user=all&amp;refresh=%d&amp;unit=%s\">reset all</a></td>\n", refresh, unit);
+	for (entry_user = config->next_user; entry_user != NULL; entry_user = entry_user->next) {
+	    if (((handler_type == CBAND_HANDLER_ME) && (entry_user != entry_user_me)) ||
+		!mod_cband_status_JSON_match(filter, entry_user->user_name, filter->user))
+		continue;
+		
+	    matched++;
+	    mod_cband_shmem_read(entry_user->shmem_data, &data);
+	    mod_cband_get_real_speed(&data, &bps, NULL);
+	    mod_cband_heap_push(&heap, bps, entry_user);
 	}
 	
-	ap_rputs("<td>time to refresh</td>\n", r);    
-	ap_rprintf(r,"<td>Total<br>Limit/Slice/Used</td>\n");
-	entry_class = config->next_class;
-	
-	i = 0;
-	while(entry_class != NULL) {
-	    ap_rprintf(r,"<td>%s<br>Limit/Slice/Used</td>\n", entry_class->class_name);
+	mod_cband_heap_sort(&heap);
 	
-	    entry_class = entry_class->next;
-            i++;
+	for (i = filter->offset; (i < heap.size) && ((filter->limit < 0) || (printed < filter->limit)); i++) {
+	    entry_user = (mod_cband_user_config_entry *)heap.items[i].ptr;
+	    
+	    if (printed++ > 0)
+		ap_rputs(",", r);
+	    
+	    mod_cband_status_snapshot(entry_user->shmem_data, entry_user->refresh_time, sec, &data);
+	    mod_cband_status_print_user_JSON_row(r, entry_user, &data, class_names, classes);
 	}
+    } else {
+	for (entry_user = config->next_user; entry_user != NULL; entry_user = entry_user->next) {
+	    if (((handler_type == CBAND_HANDLER_ME) && (entry_user != entry_user_me)) ||
+		!mod_cband_status_JSON_match(filter, entry_user->user_name, filter->user))
+		continue;
 	
-	for (; i < DST_CLASS; i++)
-	    ap_rprintf(r,"<td>Class %d<br>Limit/Slice/Used</td>\n",i);
+	    if ((matched++ < filter->offset) || ((filter->limit >= 0) && (printed >= filter->limit)))
+		continue;
+	    
+	    if (printed++ > 0)
+		ap_rputs(",", r);
+	    
+	    mod_cband_status_snapshot(entry_user->shmem_data, entry_user->refresh_time, sec, &data);
+	    mod_cband_status_print_user_JSON_row(r, entry_user, &data, class_names, classes);
+	}
+    }
+    
+    ap_rprintf(r, "],\"total\":%d,\"offset\":%d,\"count\":%d}", matched, filter->offset, printed);
+}
 
-	ap_rprintf(r,"<td>kbps<br>Limit/Current</td>\n");
-	ap_rprintf(r,"<td>rps<br>Limit/Current</td>\n");
-	ap_rprintf(r,"<td>Connections<br>Limit/Current</td>\n");
-	
-	ap_rputs("</tr>\n", r);
-	
-	if (handler_type == CBAND_HANDLER_ALL) {	
-	    entry_user = config->next_user;
-	
-	    while(entry_user != NULL) {
-		mod_cband_check_user_refresh(entry_user, sec);
-		mod_cband_status_print_user_row(r, entry_user, handler_type, refresh, unit);
-		users_number++;
-		
-		if ((entry_user = entry_user->next) == NULL)
-		    break;
-	    }
-	} else {
-	    if (entry_user_me != NULL) {
-	        mod_cband_check_user_refresh(entry_user_me, sec);
-		mod_cband_status_print_user_row(r, entry_user_me, handler_type, refresh, unit);
-	    }
+/**
+ * /cband-status handler output in JSON
+ *
+ * ?json[&virtualhost=name][&user=name][&prefix=str][&top=N][&offset=N][&limit=N]
+ */
+static int mod_cband_status_handler_JSON (request_rec *r, int handler_type)
+{
+    mod_cband_virtualhost_config_entry *entry_me = NULL;
+    mod_cband_user_config_entry *entry_user_me = NULL;
+    mod_cband_class_config_entry *entry_class;
+    mod_cband_status_filter filter;
+    mod_cband_heap heap;
+    char *class_names[DST_CLASS];
+    char **names;
+    int classes = 0;
+    int names_number, remote_top, remote_by_conn;
+    unsigned long sec;
+    const char *arg;
+
+    if (handler_type == CBAND_HANDLER_ME) {
+    	if ((entry_me = mod_cband_get_virtualhost_entry(r->server, r->server->module_config, 0)) != NULL) {
+	    if (entry_me->virtual_user != NULL)  
+	       entry_user_me = mod_cband_get_user_entry(entry_me->virtual_user, r->server->module_config, 0);
 	}
-	
-	ap_rputs("</table>\n", r);
     }
 
-    ap_rputs("<table width=\"100%\" cellspacing=\"0\" cellpadding=\"0\" style=\"border: 0; margin: 0; padding: 0\">", r);
-    ap_rputs("<tr>", r);
-    ap_rputs("<td valign=top>", r);
+    memset(&filter, 0, sizeof(mod_cband_status_filter));
+    filter.limit       = -1;
+    filter.virtualhost = (char *)apr_table_get(r->notes, "virtualhost");
+    filter.user        = (char *)apr_table_get(r->notes, "user");
+    filter.prefix      = (char *)apr_table_get(r->notes, "prefix");
+
+    if ((arg = apr_table_get(r->notes, "top")) != NULL)
+	filter.top = atoi(arg);
+    if ((arg = apr_table_get(r->notes, "offset")) != NULL)
+	filter.offset = atoi(arg);
+    if ((arg = apr_table_get(r->notes, "limit")) != NULL)
+	filter.limit = atoi(arg);
+
+    if (filter.offset < 0)
+	filter.offset = 0;
+    if (filter.top > config->virtualhost_entries + config->user_entries)
+	filter.top = config->virtualhost_entries + config->user_entries;
+
+    entry_class = config->next_class;
+    while ((entry_class != NULL) && (classes < DST_CLASS)) {
+	class_names[classes++] = entry_class->class_name;
+	entry_class = entry_class->next;
+    }
+
+    sec = (unsigned long)(apr_time_now() / 1e6);
 
-    ap_rputs("<div class=\"section\">", r);
-    ap_rputs("<br><h2 style=\"display: inline;\">Remote clients</h2>\n", r);
-    ap_rprintf(r, "<p style=\"display: inline;\"><a href=\"?refresh=%d&amp;unit=%s\">[refresh]</a> &nbsp; <a href=\"?refresh=%d\">[human-readable]</a> <a href=\"?refresh=%d&amp;unit=G\">[GB]</a> <a href=\"?refresh=%d&amp;unit=M\">[MB]</a> <a href=\"?refresh=%d&amp;unit=K\">[KB]</a></p>\n", refresh, unit, refresh, refresh, refresh, refresh);
-    ap_rputs("</div>", r);
-    ap_rputs("<table width=500 cellspacing=\"0\" cellpadding=\"0\">", r);
+    ap_set_content_type(r, "application/json");
 
-    ap_rputs("<tr>", r);
-    ap_rprintf(r, "<td>Remote IP</td>");
-    ap_rprintf(r, "<td>Virtualhost</td>");
-    ap_rprintf(r, "<td>Connections<br>Limit/Current</td>");
-    ap_rprintf(r, "<td>Last speed/conn [kbps]</td>");
-    ap_rputs("</tr>", r);
+    if (r->header_only)
+	return OK;
 
-    time_now = apr_time_now();
-    for (i = 0; i < MAX_REMOTE_HOSTS; i++) {
-        time_delta = (time_now - config->remote_hosts.hosts[i].remote_last_time) / 1e6;
+    ap_rprintf(r, "{\"uptime\":%lu,\"virtualhosts\":", sec - config->start_time);
+    mod_cband_status_print_virtualhosts_JSON(r, &filter, entry_me, entry_user_me, handler_type, class_names, classes);
+    ap_rputs(",\"users\":", r);
+    mod_cband_status_print_users_JSON(r, &filter, entry_user_me, handler_type, class_names, classes);
+    
+    if ((remote_top = mod_cband_status_remote_args(r, &remote_by_conn)) > 0) {
+	names = mod_cband_status_remote_names(r, entry_me, entry_user_me, handler_type, &names_number);
+	mod_cband_status_top_remotes(r, &heap, remote_top, remote_by_conn, names, names_number);
 	
-	if ((!config->remote_hosts.hosts[i].used) || ((time_delta > MAX_REMOTE_HOST_LIFE) && (config->remote_hosts.hosts[i].remote_conn <= 0)))
-	    continue;
+	ap_rputs(",\"remotes\":", r);
+	mod_cband_status_print_remotes_JSON(r, &heap);
+    }
+    
+    if ((handler_type == CBAND_HANDLER_ALL) && (config->remote_hosts.stats != NULL))
+	ap_rprintf(r, ",\"remote_table\":{\"overflows\":%llu,\"refused\":%llu}", config->remote_hosts.stats->overflows, 
+	    config->remote_hosts.stats->refused);
     
-	if (handler_type != CBAND_HANDLER_ALL) {	
-	    ok = 0;
+    if (handler_type == CBAND_HANDLER_ALL) {
+	ap_rputs(",\"locks\":", r);
+	mod_cband_status_print_locks_JSON(r);
+    }
 
-	    if ((entry_user_me != NULL) && (entry_user_me->user_name != NULL)) {
-	    
-		entry = config->next_virtualhost;
-	        while(entry != NULL) {
-		
-		    if ((entry->virtual_name != NULL) && (config->remote_hosts.hosts[i].virtual_name != NULL) && 
-		        (entry->virtual_user != NULL) &&
-			(!strcasecmp(entry->virtual_name, config->remote_hosts.hosts[i].virtual_name)) &&
-			(!strcasecmp(entry_user_me->user_name, entry->virtual_user))) {
-			ok = 1;
-			break;
-		    }
-		    
-		    if ((entry = entry->next) == NULL)
-			break;
-		}
-	    } else 
-	    if (!strcasecmp(r->server->server_hostname, config->remote_hosts.hosts[i].virtual_name))
-		ok = 1;
-	    
-	    if (!ok)
-		continue;
-	}
+    ap_rputs("}\n", r);
 
-	if (odd == 0) {
-	    odd_str = "even";
-	    odd = 1;
-	} else {
-	    odd_str = "odd";
-	    odd = 0;
-	}
-	    	    
-	remote_addr.s_addr = config->remote_hosts.hosts[i].remote_addr;
-        ap_rputs("<tr>", r);
-	ap_rprintf(r, "<td class=remote_%s>%s</td>", odd_str, inet_ntoa((struct in_addr)remote_addr));
-        ap_rprintf(r, "<td class=remote_%s>%s</td>", odd_str, config->remote_hosts.hosts[i].virtual_name);
-	mod_cband_status_print_connections(r, config->remote_hosts.hosts[i].remote_max_conn, config->remote_hosts.hosts[i].remote_conn);
-	
-	ap_rprintf(r, "<td class=remote_%s>%lu</td>", odd_str, config->remote_hosts.hosts[i].remote_kbps);
-	ap_rputs("</tr>", r);
-	
-	if ((time_delta > (MAX_REMOTE_HOST_LIFE / 3)) && (config->remote_hosts.hosts[i].remote_conn <= 0))
-	    mod_cband_set_remote_current_speed(i, 0);
+    return OK;
+}
+
+static const mod_cband_metric mod_cband_metrics[] =
+{
+    {"bytes",                "counter", "Bytes sent in the current period",             METRIC_BYTES},
+    {"class_bytes",          "counter", "Bytes sent to the destination class in the current period", METRIC_CLASS_BYTES},
+    {"requests",             "counter", "Requests since the server start",              METRIC_REQUESTS},
+    {"connections",          "gauge",   "Open connections",                             METRIC_CONNECTIONS},
+    {"kbps",                 "gauge",   "Current speed in kbps",                        METRIC_KBPS},
+    {"rps",                  "gauge",   "Current requests per second",                  METRIC_RPS},
+    {"limit_bytes",          "gauge",   "Transfer limit in bytes, 0 means unlimited",   METRIC_LIMIT},
+    {"class_limit_bytes",    "gauge",   "Destination class transfer limit in bytes, 0 means unlimited", METRIC_CLASS_LIMIT},
+    {"kbps_limit",           "gauge",   "Speed limit in kbps, 0 means unlimited",       METRIC_KBPS_LIMIT},
+    {"rps_limit",            "gauge",   "Requests per second limit, 0 means unlimited", METRIC_RPS_LIMIT},
+    {"connections_limit",    "gauge",   "Open connections limit, 0 means unlimited",    METRIC_CONN_LIMIT},
+    {"overlimit",            "gauge",   "1 when the transfer limit has been exceeded",  METRIC_OVERLIMIT},
+    {"upload_bytes",         "counter", "Request body bytes received in the current period", METRIC_UPLOAD_BYTES},
+    {"upload_limit_bytes",   "gauge",   "Request body transfer limit in bytes, 0 means unlimited", METRIC_UPLOAD_LIMIT},
+    {"upload_kbps_limit",    "gauge",   "Request body speed limit in kbps, 0 means unlimited", METRIC_UPLOAD_KBPS_LIMIT},
+    {"uploads",              "gauge",   "Request bodies being received",                METRIC_UPLOADS},
+    {NULL}
+};
+
+static const mod_cband_metric mod_cband_delay_metrics[] =
+{
+    {"sleep_seconds",        "summary", "Sleep injected into a response by the shaper", HIST_SLEEP},
+    {"admission_wait_seconds", "summary", "Wait of a request for the admission",        HIST_ADMIT},
+    {"admission_loops",      "summary", "Admission retry loops of a request",           HIST_LOOPS},
+    {NULL}
+};
+
+static const mod_cband_metric mod_cband_lock_metrics[] =
+{
+    {"acquisitions",         "counter", "Acquisitions of the semaphore at the call site", METRIC_LOCK_ACQUISITIONS},
+    {"contended",            "counter", "Acquisitions which had to wait for the semaphore", METRIC_LOCK_CONTENDED},
+    {"wait_seconds",         "counter", "Time spent waiting for the semaphore",         METRIC_LOCK_WAIT},
+    {"max_wait_seconds",     "gauge",   "Longest wait for the semaphore",               METRIC_LOCK_MAX_WAIT},
+    {NULL}
+};
+
+/*
+ * escapes backslash, double quote and new line in an OpenMetrics label value
+ */
+char *mod_cband_metrics_label(char *dst, const char *src)
+{
+    int i = 0;
+
+    if (src == NULL)
+	src = "";
 
+    while ((*src != 0) && (i < MAX_METRIC_LABEL_LEN - 3)) {
+	if (*src == '\\' || *src == '"') {
+	    dst[i++] = '\\';
+	    dst[i++] = *src;
+	} else
+	if (*src == '\n') {
+	    dst[i++] = '\\';
+	    dst[i++] = 'n';
+	} else
+	    dst[i++] = *src;
+	
+	src++;
     }
-    ap_rputs("</table>", r);
-    ap_rputs("</td>", r);
+    dst[i] = 0;
 
-    ap_rputs("<td valign=top>", r);
-    if (handler_type == CBAND_HANDLER_ALL) {	
-        ap_rputs("<div class=\"section\">", r);
-        ap_rputs("<br><h2 style=\"display: inline;\">Server summary</h2>\n", r);
-	ap_rprintf(r, "<p style=\"display: inline;\"><a href=\"?refresh=%d&amp;unit=%s\">[refresh]</a> &nbsp; <a href=\"?refresh=%d\">[human-readable]</a> <a href=\"?refresh=%d&amp;unit=G\">[GB]</a> <a href=\"?refresh=%d&amp;unit=M\">[MB]</a> <a href=\"?refresh=%d&amp;unit=K\">[KB]</a></p>\n", refresh, unit, refresh, refresh, refresh, refresh);
-	ap_rputs("</div>", r);
-	ap_rputs("<table width=400>", r);
+    return dst;
+}
 
-        ap_rputs("<tr>", r);
-	ap_rputs("<td>Server uptime</td>", r);
-        ap_rprintf(r, "<td>%s</td>", mod_cband_create_time(r->pool, uptime));
-	ap_rputs("</tr>", r);
+void mod_cband_metrics_copy(mod_cband_metrics_entry *m, mod_cband_shmem_data *shmem_data, unsigned long time_now)
+{
+    mod_cband_shmem_data data;
+    int i;
 
-        ap_rputs("<tr>", r);
-	ap_rputs("<td>Total virtualhosts</td>", r);
-        ap_rprintf(r, "<td>%d</td>", vhosts_number);
-	ap_rputs("</tr>", r);
+    mod_cband_shmem_read(shmem_data, &data);
+    
+    m->total_bytes    = data.total_usage.total_bytes;
+    for (i = 0; i < DST_CLASS; i++)
+	m->class_bytes[i] = data.total_usage.class_bytes[i];
+    m->total_requests = data.total_requests;
+    m->total_conn     = data.total_conn;
+    m->curr_speed     = data.curr_speed;
+    m->overlimit      = data.overlimit;
+    m->upload_bytes   = data.upload_bytes;
+    m->upload_kbps    = data.upload_kbps;
+    m->upload_conn    = data.upload_connections;
+    mod_cband_rate_get(&data.rate, time_now, &m->bps, &m->rps);
+    
+    for (i = 0; i < HIST_TYPES; i++)
+	mod_cband_hist_summarize(&data.hist[i], &m->delays[i]);
+}
 
-        ap_rputs("<tr>", r);
-	ap_rputs("<td>Total users</td>", r);
-        ap_rprintf(r, "<td>%d</td>", users_number);
-	ap_rputs("</tr>", r);
+/*
+ * TYPE and HELP of a metric family. OpenMetrics names a counter without
+ * _total, the Prometheus text format 0.0.4 with the name of its samples
+ */
+void mod_cband_metrics_print_family(request_rec *r, const char *prefix, const char *name, const char *type, const char *help, 
+	int openmetrics)
+{
+    const char *suffix = (!openmetrics && !strcmp(type, "counter")) ? "_total" : "";
 
-        ap_rputs("<tr>", r);
-	ap_rputs("<td>Total connections</td>", r);
-        ap_rprintf(r, "<td>%lu</td>", total_connections);
-	ap_rputs("</tr>", r);
+    ap_rprintf(r, "# TYPE %s%s%s %s\n", prefix, name, suffix, type);
+    ap_rprintf(r, "# HELP %s%s%s %s\n", prefix, name, suffix, help);
+}
 
-        ap_rputs("<tr>", r);
-	ap_rputs("<td>Total traffic</td>", r);
-        ap_rprintf(r, "<td>%s</td>", mod_cband_create_traffic_size(r->pool, total_traffic / 1000, unit, 1000));
-	ap_rputs("</tr>", r);
+void mod_cband_metrics_print_labels(request_rec *r, const char *kind, mod_cband_metrics_entry *m)
+{
+    char label[MAX_METRIC_LABEL_LEN];
 
-        ap_rputs("<tr>", r);
-	ap_rputs("<td>Current speed</td>", r);
-        ap_rprintf(r, "<td>%0.2f kbps / %0.2f rps</td>", current_speed_bps / 1024, current_speed_rps);
-	ap_rputs("</tr>", r);
-        ap_rputs("</table>", r);
-    }
+    ap_rprintf(r, "{%s=\"%s\"", kind, mod_cband_metrics_label(label, m->name));
 
-    ap_rputs("</td>", r);
-    ap_rputs("</tr>", r);
-    ap_rputs("</table>", r);
+    if (m->line > 0)
+	ap_rprintf(r, ",port=\"%u\",line=\"%u\"", m->port, m->line);
+}
 
-    ap_rputs(mod_cband_status_handler_foot, r);
-    ap_rputs("</body>\n</html>\n", r);
-    
-    return OK;
+void mod_cband_metrics_print_sample(request_rec *r, const char *kind, const mod_cband_metric *metric, 
+	mod_cband_metrics_entry *m, const char *class_name, int class_nr)
+{
+    char label[MAX_METRIC_LABEL_LEN];
+
+    ap_rprintf(r, "cband_%s_%s%s", kind, metric->name, (!strcmp(metric->type, "counter") ? "_total" : ""));
+    mod_cband_metrics_print_labels(r, kind, m);
+
+    if (class_name != NULL)
+	ap_rprintf(r, ",class=\"%s\"", mod_cband_metrics_label(label, class_name));
+
+    ap_rputs("} ", r);
+
+    switch (metric->field) {
+	case METRIC_BYTES:       ap_rprintf(r, "%llu\n", m->total_bytes); break;
+	case METRIC_CLASS_BYTES: ap_rprintf(r, "%llu\n", m->class_bytes[class_nr]); break;
+	case METRIC_REQUESTS:    ap_rprintf(r, "%llu\n", m->total_requests); break;
+	case METRIC_CONNECTIONS: ap_rprintf(r, "%lu\n", m->total_conn); break;
+	case METRIC_KBPS:        ap_rprintf(r, "%0.2f\n", m->bps / 1024); break;
+	case METRIC_RPS:         ap_rprintf(r, "%0.2f\n", m->rps); break;
+	case METRIC_LIMIT:       ap_rprintf(r, "%llu\n", m->limit); break;
+	case METRIC_CLASS_LIMIT: ap_rprintf(r, "%llu\n", m->class_limit[class_nr]); break;
+	case METRIC_KBPS_LIMIT:  ap_rprintf(r, "%lu\n", m->curr_speed.kbps); break;
+	case METRIC_RPS_LIMIT:   ap_rprintf(r, "%lu\n", m->curr_speed.rps); break;
+	case METRIC_CONN_LIMIT:  ap_rprintf(r, "%lu\n", m->curr_speed.max_conn); break;
+	case METRIC_OVERLIMIT:   ap_rprintf(r, "%d\n", m->overlimit); break;
+	case METRIC_UPLOAD_BYTES: ap_rprintf(r, "%llu\n", m->upload_bytes); break;
+	case METRIC_UPLOAD_LIMIT: ap_rprintf(r, "%llu\n", m->upload_limit); break;
+	case METRIC_UPLOAD_KBPS_LIMIT: ap_rprintf(r, "%lu\n", m->upload_kbps); break;
+	case METRIC_UPLOADS:     ap_rprintf(r, "%lu\n", m->upload_conn); break;
+    }
 }
 
-/**
- * /cband-status handler output in XML
+/*
+ * the delay histograms as summaries, times in seconds
  */
-static int mod_cband_status_handler_XML (request_rec *r, int handler_type)
+void mod_cband_metrics_print_delays(request_rec *r, const char *kind, mod_cband_metrics_entry *m, int entries)
 {
-    mod_cband_virtualhost_config_entry *entry, *entry_me = NULL;
-    mod_cband_user_config_entry *entry_user, *entry_user_me = NULL;
-    unsigned long sec, uptime;
+    static const char *quantiles[3] = { "0.5", "0.9", "0.99" };
+    const mod_cband_metric *metric;
+    mod_cband_hist_summary *summary;
+    unsigned long values[3];
+    double scale;
+    int i, j;
+
+    for (metric = mod_cband_delay_metrics; metric->name != NULL; metric++) {
+	ap_rprintf(r, "# TYPE cband_%s_%s summary\n", kind, metric->name);
+	ap_rprintf(r, "# HELP cband_%s_%s %s\n", kind, metric->name, metric->help);
+	scale = (metric->field == HIST_LOOPS) ? 1 : 1e6;
+	
+	for (i = 0; i < entries; i++) {
+	    summary = &m[i].delays[metric->field];
+	    values[0] = summary->p50;
+	    values[1] = summary->p90;
+	    values[2] = summary->p99;
+	    
+	    for (j = 0; j < 3; j++) {
+		ap_rprintf(r, "cband_%s_%s", kind, metric->name);
+		mod_cband_metrics_print_labels(r, kind, &m[i]);
+		ap_rprintf(r, ",quantile=\"%s\"} %0.6f\n", quantiles[j], values[j] / scale);
+	    }
+	    
+	    ap_rprintf(r, "cband_%s_%s_sum", kind, metric->name);
+	    mod_cband_metrics_print_labels(r, kind, &m[i]);
+	    ap_rprintf(r, "} %0.6f\n", summary->sum / scale);
+	    ap_rprintf(r, "cband_%s_%s_count", kind, metric->name);
+	    mod_cband_metrics_print_labels(r, kind, &m[i]);
+	    ap_rprintf(r, "} %llu\n", summary->count);
+	}
+    }
+}
 
-    if (handler_type == CBAND_HANDLER_ME) {
-    	if ((entry_me = mod_cband_get_virtualhost_entry(r->server, r->server->module_config, 0)) != NULL) {
-	    if (entry_me->virtual_user != NULL)  
-	       entry_user_me = mod_cband_get_user_entry(entry_me->virtual_user, r->server->module_config, 0);
+/*
+ * prints every metric family for a snapshot of virtualhosts or users,
+ * samples of one family must be printed together
+ */
+void mod_cband_metrics_print_entries(request_rec *r, const char *kind, mod_cband_metrics_entry *m, int entries, 
+	char **class_names, int classes, int openmetrics)
+{
+    const mod_cband_metric *metric;
+    int i, j;
+
+    for (metric = mod_cband_metrics; metric->name != NULL; metric++) {
+	mod_cband_metrics_print_family(r, apr_psprintf(r->pool, "cband_%s_", kind), metric->name, metric->type, metric->help, openmetrics);
+	
+	for (i = 0; i < entries; i++) {
+	    if ((metric->field == METRIC_CLASS_BYTES) || (metric->field == METRIC_CLASS_LIMIT)) {
+		for (j = 0; j < classes; j++)
+		    mod_cband_metrics_print_sample(r, kind, metric, &m[i], class_names[j], j);
+	    } else
+		mod_cband_metrics_print_sample(r, kind, metric, &m[i], NULL, 0);
 	}
     }
+}
 
-    sec = (unsigned long)(apr_time_now() / 1e6);
-    uptime = (unsigned long)(sec - config->start_time);
+/*
+ * /cband-metrics handler, OpenMetrics text format when the client accepts it,
+ * the Prometheus text format 0.0.4 otherwise
+ */
+static int mod_cband_metrics_handler(request_rec *r)
+{
+    mod_cband_virtualhost_config_entry *entry;
+    mod_cband_user_config_entry *entry_user;
+    mod_cband_class_config_entry *entry_class;
+    mod_cband_metrics_entry *vhosts, *users;
+    mod_cband_remote_host *remotes;
+    mod_cband_lock_site *sites;
+    const mod_cband_metric *metric;
+    char *class_names[DST_CLASS];
+    char label[MAX_METRIC_LABEL_LEN];
+    unsigned long time_now, time_delta;
+    int vhosts_number = 0, users_number = 0, remotes_number = 0, classes = 0, sites_number;
+    const char *accept;
+    int openmetrics;
+    int i;
 
-    ap_set_content_type(r, "text/xml");
+    if (strcmp(r->handler, "cband-metrics"))
+	return DECLINED;
 
-    ap_rputs("<?xml version=\"1.0\" encoding=\"iso-8859-1\"?>\n", r);
-    ap_rputs("<mod_cband>\n", r);
-    ap_rputs("\t<Server>\n", r);
-    ap_rprintf(r, "\t\t<uptime>%s</uptime>\n", mod_cband_create_time(r->pool, uptime));    
-    ap_rputs("\t</Server>\n", r);
-    
-    ap_rputs("\t<Virtualhosts>\n", r);
-    if (handler_type == CBAND_HANDLER_ALL) {	
-        entry = config->next_virtualhost;
-    
-	while(entry != NULL) {
-    	    mod_cband_check_virtualhost_refresh(entry, sec);
-	    mod_cband_status_print_virtualhost_XML_row(r, entry, handler_type);
-	    	    
-	    if ((entry = entry->next) == NULL)
-		break;
-	}
-    } else {
-    	if ((entry_user_me != NULL) && (entry_user_me->user_name != NULL)) {
-	    entry = config->next_virtualhost;
-	    while(entry != NULL) {
-		if ((entry->virtual_user != NULL) && !strcasecmp(entry->virtual_user, entry_user_me->user_name)) {
-		    mod_cband_check_virtualhost_refresh(entry, sec);
-		    mod_cband_status_print_virtualhost_XML_row(r, entry, handler_type);
-		}
-		    
-		if ((entry = entry->next) == NULL)
-		    break;
-	    }
-	} else	
-	if (entry_me != NULL) {
-	    mod_cband_check_virtualhost_refresh(entry_me, sec);
-	    mod_cband_status_print_virtualhost_XML_row(r, entry_me, handler_type);
-	}
+    time_now = apr_time_now();
+
+    entry_class = config->next_class;
+    while ((entry_class != NULL) && (classes < DST_CLASS)) {
+	class_names[classes++] = entry_class->class_name;
+	entry_class = entry_class->next;
+    }
+
+    /* one allocation per table, the snapshot is taken in a single pass over shared memory */
+    vhosts  = apr_palloc(r->pool, sizeof(mod_cband_metrics_entry) * (config->virtualhost_entries + 1));
+    users   = apr_palloc(r->pool, sizeof(mod_cband_metrics_entry) * (config->user_entries + 1));
+    remotes = apr_palloc(r->pool, sizeof(mod_cband_remote_host) * MAX_REMOTE_HOSTS);
+
+    for (entry = config->next_virtualhost; (entry != NULL) && (vhosts_number < config->virtualhost_entries); entry = entry->next) {
+	vhosts[vhosts_number].name = entry->virtual_name;
+	vhosts[vhosts_number].port = entry->virtual_port;
+	vhosts[vhosts_number].line = entry->virtual_defn_line;
+	vhosts[vhosts_number].limit = (unsigned long long)entry->virtual_limit * entry->virtual_limit_mult;
+	for (i = 0; i < DST_CLASS; i++)
+	    vhosts[vhosts_number].class_limit[i] = (unsigned long long)entry->virtual_class_limit[i] * entry->virtual_class_limit_mult[i];
+	vhosts[vhosts_number].upload_limit = (unsigned long long)entry->virtual_upload_limit * entry->virtual_upload_limit_mult;
+	mod_cband_metrics_copy(&vhosts[vhosts_number++], entry->shmem_data, time_now);
+    }
+
+    for (entry_user = config->next_user; (entry_user != NULL) && (users_number < config->user_entries); entry_user = entry_user->next) {
+	users[users_number].name = entry_user->user_name;
+	users[users_number].port = 0;
+	users[users_number].line = 0;
+	users[users_number].limit = (unsigned long long)entry_user->user_limit * entry_user->user_limit_mult;
+	for (i = 0; i < DST_CLASS; i++)
+	    users[users_number].class_limit[i] = (unsigned long long)entry_user->user_class_limit[i] * entry_user->user_class_limit_mult[i];
+	users[users_number].upload_limit = (unsigned long long)entry_user->user_upload_limit * entry_user->user_upload_limit_mult;
+	mod_cband_metrics_copy(&users[users_number++], entry_user->shmem_data, time_now);
     }
+
+    /* the remote table is read without its semaphore, a slot may be seen in the middle of an update */
+    if (config->remote_hosts.hosts != NULL) {
+	for (i = 0; i < MAX_REMOTE_HOSTS; i++) {
+    	    time_delta = (time_now - config->remote_hosts.hosts[i].remote_last_time) / 1e6;
 	
-    ap_rputs("\t</Virtualhosts>\n", r);
-    ap_rputs("\t<Users>\n", r);
+	    if ((!config->remote_hosts.hosts[i].used) || ((time_delta > MAX_REMOTE_HOST_LIFE) && (config->remote_hosts.hosts[i].remote_conn <= 0)))
+		continue;
 
-    if (handler_type == CBAND_HANDLER_ALL) {	
-        entry_user = config->next_user;
+	    remotes[remotes_number++] = config->remote_hosts.hosts[i];
+	}
+    }
+
+    accept = apr_table_get(r->headers_in, "Accept");
+    openmetrics = ((accept != NULL) && (strstr(accept, "application/openmetrics-text") != NULL));
+    if (openmetrics)
+	ap_set_content_type(r, "application/openmetrics-text; version=1.0.0; charset=utf-8");
+    else
+	ap_set_content_type(r, "text/plain; version=0.0.4; charset=utf-8");
+
+    if (r->header_only)
+	return OK;
+
+    ap_rputs("# TYPE cband_uptime_seconds gauge\n", r);
+    ap_rputs("# HELP cband_uptime_seconds Seconds since the server start\n", r);
+    ap_rprintf(r, "cband_uptime_seconds %lu\n", (unsigned long)(time_now / 1e6) - config->start_time);
+
+    mod_cband_metrics_print_entries(r, "virtualhost", vhosts, vhosts_number, class_names, classes, openmetrics);
+    mod_cband_metrics_print_entries(r, "user", users, users_number, class_names, classes, openmetrics);
+    mod_cband_metrics_print_delays(r, "virtualhost", vhosts, vhosts_number);
+    mod_cband_metrics_print_delays(r, "user", users, users_number);
+
+    ap_rputs("# TYPE cband_remote_connections gauge\n", r);
+    ap_rputs("# HELP cband_remote_connections Open connections of the remote client\n", r);
+    for (i = 0; i < remotes_number; i++) {
+	ap_rprintf(r, "cband_remote_connections{remote=\"%s\",key=\"%016llx\",virtualhost=\"%s\"} %lu\n", remotes[i].remote_name, 
+	    remotes[i].remote_key, mod_cband_metrics_label(label, remotes[i].virtual_name), remotes[i].remote_conn);
+    }
+
+    ap_rputs("# TYPE cband_remote_connections_limit gauge\n", r);
+    ap_rputs("# HELP cband_remote_connections_limit Open connections limit of the remote client, 0 means unlimited\n", r);
+    for (i = 0; i < remotes_number; i++) {
+	ap_rprintf(r, "cband_remote_connections_limit{remote=\"%s\",key=\"%016llx\",virtualhost=\"%s\"} %lu\n", remotes[i].remote_name, 
+	    remotes[i].remote_key, mod_cband_metrics_label(label, remotes[i].virtual_name), remotes[i].remote_max_conn);
+    }
+
+    ap_rputs("# TYPE cband_remote_kbps gauge\n", r);
+    ap_rputs("# HELP cband_remote_kbps Last measured speed of the remote client in kbps\n", r);
+    for (i = 0; i < remotes_number; i++) {
+	ap_rprintf(r, "cband_remote_kbps{remote=\"%s\",key=\"%016llx\",virtualhost=\"%s\"} %lu\n", remotes[i].remote_name, 
+	    remotes[i].remote_key, mod_cband_metrics_label(label, remotes[i].virtual_name), remotes[i].remote_kbps);
+    }
+
+    if (config->remote_hosts.stats != NULL) {
+	mod_cband_metrics_print_family(r, "cband_remote_table_", "overflows", "counter", "Remote clients kept outside the probe window of their hash", openmetrics);
+	ap_rprintf(r, "cband_remote_table_overflows_total %llu\n", config->remote_hosts.stats->overflows);
+	mod_cband_metrics_print_family(r, "cband_remote_table_", "refused", "counter", "Remote clients without a slot, the remote clients table was full", openmetrics);
+	ap_rprintf(r, "cband_remote_table_refused_total %llu\n", config->remote_hosts.stats->refused);
+    }
+
+    sites_number = mod_cband_status_lock_sites(r, &sites);
+    for (metric = mod_cband_lock_metrics; metric->name != NULL; metric++) {
+	mod_cband_metrics_print_family(r, "cband_lock_", metric->name, metric->type, metric->help, openmetrics);
 	
-	while(entry_user != NULL) {
-	    mod_cband_check_user_refresh(entry_user, sec);
-	    mod_cband_status_print_user_XML_row(r, entry_user, handler_type);
+	for (i = 0; i < sites_number; i++) {
+	    ap_rprintf(r, "cband_lock_%s%s{site=\"%s\",semaphore=\"%s\"} ", metric->name, (!strcmp(metric->type, "counter") ? "_total" : ""),
+		mod_cband_metrics_label(label, sites[i].name), sites[i].remote ? "remote" : "global");
 	    
-	    if ((entry_user = entry_user->next) == NULL)
-		break;
-	}
-    } else {
-	if (entry_user_me != NULL) {
-	    mod_cband_check_user_refresh(entry_user_me, sec);
-	    mod_cband_status_print_user_XML_row(r, entry_user_me, handler_type);
+	    switch (metric->field) {
+		case METRIC_LOCK_ACQUISITIONS: ap_rprintf(r, "%llu\n", sites[i].acquisitions); break;
+		case METRIC_LOCK_CONTENDED:    ap_rprintf(r, "%llu\n", sites[i].contended); break;
+		case METRIC_LOCK_WAIT:         ap_rprintf(r, "%0.9f\n", sites[i].wait_nsec / 1e9); break;
+		case METRIC_LOCK_MAX_WAIT:     ap_rprintf(r, "%0.9f\n", sites[i].max_wait_nsec / 1e9); break;
+	    }
 	}
     }
-	
-    ap_rputs("\t</Users>\n", r);
-    ap_rputs("</mod_cband>", r);
+
+    if (openmetrics)
+	ap_rputs("# EOF\n", r);
 
     return OK;
 }
 
-int mod_cband_check_connections_speed(mod_cband_virtualhost_config_entry *entry, mod_cband_user_config_entry *entry_user, request_rec *r, int dst)
+/*
+ * the entry of the virtualhost, virtualhosts without one are still limited 
+ * by CBandGlobalSpeed and CBandGlobalMaxConn
+ */
+static mod_cband_virtualhost_config_entry *mod_cband_get_request_entry(request_rec *r)
 {
-    float virtualhost_rps, virtualhost_curr_rps;
-    float user_rps, user_curr_rps;
-    float remote_rps;
-    unsigned long max_remote_kbps, remote_curr_rps, remote_max_conn, remote_total_conn;
-    int remote_idx;
-    //unsigned long time_now;
-    int loops;
-    int overlimit;
-
-    remote_idx = mod_cband_get_remote_host(r->connection, 1, entry);
-    mod_cband_get_dst_speed_lock(entry, entry_user, &max_remote_kbps, &remote_curr_rps, &remote_max_conn, dst);
-    mod_cband_set_remote_max_connections(remote_idx, remote_max_conn);
-
-    virtualhost_curr_rps   = 0;
-    user_curr_rps          = 0;
-    virtualhost_rps        = 0;
-    user_rps               = 0;
-    remote_rps             = 0;
-    //time_now               = apr_time_now();
+    mod_cband_virtualhost_config_entry *entry;
 
-    loops = 0;
-    do {
-        /* BEGIN CRITICAL SECTION */
-	mod_cband_sem_down(config->sem_id);
-    
-        if (entry != NULL) {
-	
-	    mod_cband_update_speed(entry->shmem_data, 0, 0, remote_idx);            
-	    if ((entry->shmem_data->curr_speed.max_conn > 0) && 
-		(entry->shmem_data->total_conn >= entry->shmem_data->curr_speed.max_conn)) {
-		    
-		    mod_cband_sem_up(config->sem_id);
-		    /* END CRITICAL SECTION */
+    if ((entry = mod_cband_get_virtualhost_entry(r->server, r->server->module_config, 0)) == NULL)
+	entry = config->global;
 
-		    return HTTP_SERVICE_UNAVAILABLE;
-		}
-	    
-            mod_cband_get_real_speed(entry->shmem_data, NULL, &virtualhost_rps);
-	    virtualhost_curr_rps = entry->shmem_data->curr_speed.rps;
-	}
-		
-        if (entry_user != NULL) {
+    return entry;
+}
 
-	    mod_cband_update_speed(entry_user->shmem_data, 0, 0, remote_idx);            
-	    if ((entry_user->shmem_data->curr_speed.max_conn > 0) && 
-		(entry_user->shmem_data->total_conn >= entry_user->shmem_data->curr_speed.max_conn)) {
-		
-		mod_cband_sem_up(config->sem_id);
-		/* END CRITICAL SECTION */
+/*
+ * the remote host of CBandGlobalRemoteSpeed, the same client in all 
+ * virtualhosts, -1 without the directive
+ */
+static int mod_cband_get_global_remote_host(request_rec *r, mod_cband_virtualhost_config_entry *entry)
+{
+    mod_cband_speed *speed;
 
-		return HTTP_SERVICE_UNAVAILABLE;
-	    }
+    if ((config->global == NULL) || (entry == config->global))
+	return -1;
 
-	    mod_cband_get_real_speed(entry_user->shmem_data, NULL, &user_rps);
-    	    user_curr_rps = entry_user->shmem_data->curr_speed.rps;
-	}
+    speed = &config->global->shmem_data->remote_speed;
+    if ((speed->kbps == 0) && (speed->rps == 0) && (speed->max_conn == 0))
+	return -1;
 
-	if (remote_idx >= 0) {
-	    if (remote_max_conn > 0) {
-		remote_total_conn = mod_cband_get_remote_total_connections(remote_idx);
-	    
-		if ((remote_total_conn > 0) && (remote_max_conn <= remote_total_conn)) {
-		
-		    mod_cband_sem_up(config->sem_id);
-		    /* END CRITICAL SECTION */
+    return mod_cband_get_remote_host(r, 1, config->global);
+}
 
-		    return HTTP_SERVICE_UNAVAILABLE;
-		}
-	    } 
-			
-	    /* semafor na remote_hosts */
-	    remote_rps = mod_cband_get_remote_connections_speed_lock(remote_idx);
-	}
+int mod_cband_check_connections_speed(mod_cband_virtualhost_config_entry *entry, mod_cband_user_config_entry *entry_user, 
+	mod_cband_virtualhost_config_entry *entry_dir, request_rec *r, int dst)
+{
+    apr_time_t t1;
+    int remote_idx, ret = 0;
 
-	overlimit = 0;
-	if ((entry != NULL) && (virtualhost_curr_rps > 0) && (virtualhost_rps > virtualhost_curr_rps))
-	    overlimit = 1;
+    remote_idx = mod_cband_get_remote_host(r, 1, entry);
 
-	if ((entry_user != NULL) && (user_curr_rps > 0) && (user_rps > user_curr_rps))
-	    overlimit = 1;
+    t1  = apr_time_now();
 
-	if ((remote_idx >= 0) && (remote_curr_rps > 0) && (remote_rps > remote_curr_rps))
-	    overlimit = 1;
+    /* the server and the remote client in all virtualhosts first */
+    if ((config->global != NULL) && (entry != config->global))
+	ret = mod_cband_admit(config->global, NULL, mod_cband_get_global_remote_host(r, entry), dst);
 
-	if (overlimit) {
-	    mod_cband_sem_up(config->sem_id);
-	    /* END CRITICAL SECTION */
-	    
-	    usleep(MAX_SLEEP_TIME + (rand() % MAX_SLEEP_TIME));
-	}
-        
-	mod_cband_sem_up(config->sem_id);
-	/* END CRITICAL SECTION */
+    if (ret == 0)
+	ret = mod_cband_admit(entry, entry_user, remote_idx, dst);
 
-	loops++;
-    } while (overlimit && loops <= MAX_DELAY_LOOPS);
+    /* the remote client has been checked with the virtualhost */
+    if ((ret == 0) && (entry_dir != NULL))
+	ret = mod_cband_admit(entry_dir, NULL, -1, dst);
+    apr_table_setn(r->notes, "cband_wait", apr_psprintf(r->pool, "%lu", (unsigned long)(apr_time_now() - t1)));
 
-    if (loops > MAX_DELAY_LOOPS)
+    if (ret < 0) {
+	apr_table_setn(r->notes, "cband_reject", (ret == ADMIT_RPS) ? "rps" : "connections");
 	return HTTP_SERVICE_UNAVAILABLE;
+    }
 	
     return OK;
 }
@@ -3079,34 +3619,27 @@ int mod_cband_check_connections_speed(mod_cband_virtualhost_config_entry *entry,
  */
 static int mod_cband_status_handler (request_rec *r)
 {
-    mod_cband_virtualhost_config_entry *entry = NULL;
-    mod_cband_user_config_entry *entry_user = NULL;
-    unsigned long remote_max_conn;
     int handler_type;
-    int remote_idx, dst;
 
+    /*
+     * the status pages only read the shared memory, the client is neither
+     * registered in the remote table nor throttled
+     */
     if (strcmp(r->handler, "cband-status") && strcmp(r->handler, "cband-status-me"))
 	return DECLINED;
 
-    entry = mod_cband_get_virtualhost_entry(r->server, r->server->module_config, 0);
-
-    if ((entry != NULL) && (entry->virtual_user != NULL)) 
-	entry_user = mod_cband_get_user_entry(entry->virtual_user, r->server->module_config, 0);
-
-    dst = mod_cband_get_dst(r);
-    remote_idx = mod_cband_get_remote_host(r->connection, 1, entry);
-    mod_cband_get_dst_speed_lock(entry, entry_user, NULL, NULL, &remote_max_conn, dst);
-    mod_cband_set_remote_max_connections(remote_idx, remote_max_conn);
-
-    ap_add_output_filter("mod_cband", NULL, r, r->connection);
-
     if (!strcmp(r->handler, "cband-status"))
 	handler_type = CBAND_HANDLER_ALL;
     else
     	handler_type = CBAND_HANDLER_ME;
 	
-    if ((r->args != NULL) && (!strcasecmp(r->args, "xml")))
+    mod_cband_status_parse_args(r);
+
+    if (apr_table_get(r->notes, "xml") != NULL)
 	return mod_cband_status_handler_XML(r, handler_type);
+    else
+    if (apr_table_get(r->notes, "json") != NULL)
+	return mod_cband_status_handler_JSON(r, handler_type);
     else
 	return mod_cband_status_handler_HTML(r, handler_type);
 }
@@ -3114,123 +3647,142 @@ static int mod_cband_status_handler (request_rec *r)
 int mod_cband_check_limit(request_rec *r, mod_cband_shmem_data *shmem_data, unsigned long limit, unsigned long slice_limit, unsigned int mult, unsigned long long usage, char *limit_exceeded)
 {
     /* Check if the bandwidth limit has been reached */
-    if ((limit > 0) && ((((unsigned long long)limit * (unsigned long long)mult) < usage) || 
-			(((unsigned long long)slice_limit * (unsigned long long)mult) < usage))) {
+    if (mod_cband_limit_reached(limit, slice_limit, mult, usage)) {
+	CBAND_PROBE4(limit__reached, r->server->server_hostname, usage, (unsigned long long)limit * mult, r->status);
 			
 	if (limit_exceeded != NULL) {
+	    apr_table_setn(r->notes, "cband_reject", "limit");
 	    apr_table_setn(r->headers_out, "Location", limit_exceeded);
 	    return HTTP_MOVED_PERMANENTLY;
 	}
 	else
-	if ((shmem_data->over_speed.kbps > (unsigned long)0) || (shmem_data->over_speed.rps > (unsigned long)0))
+	if ((shmem_data->over_speed.kbps > (unsigned long)0) || (shmem_data->over_speed.rps > (unsigned long)0)) {
+	    apr_table_setn(r->notes, "cband_overlimit", "1");
 	    mod_cband_set_overlimit_speed_lock(shmem_data);
-	else
+	} else
 	if (config->default_limit_exceeded != NULL) {
+	    apr_table_setn(r->notes, "cband_reject", "limit");
 	    apr_table_setn(r->headers_out, "Location", config->default_limit_exceeded);
 	    return HTTP_MOVED_PERMANENTLY;
-	} else
+	} else {
+	    apr_table_setn(r->notes, "cband_reject", "limit");
 	    return config->default_limit_exceeded_code;
+	}
     }
     
     return OK;
 }
 
-int mod_cband_get_virtualhost_limits(mod_cband_virtualhost_config_entry *entry, mod_cband_limits_usages *lu, int dst)
+
+int mod_cband_check_limits(request_rec *r, mod_cband_shmem_data *shmem_data, mod_cband_limits_usages *lu, int dst)
 {
-    if (entry == NULL || lu == NULL)
-	return -1;
+    int ret;
 
-    lu->limit       = entry->virtual_limit;
-    lu->limit_mult  = entry->virtual_limit_mult;
-    lu->slice_limit = mod_cband_get_slice_limit(entry->shmem_data->total_usage.start_time, 
-                      entry->refresh_time, entry->slice_len, entry->virtual_limit);
-    lu->limit_exceeded = entry->virtual_limit_exceeded;
-    lu->scoreboard  = entry->virtual_scoreboard;
-    
-    if (dst >= 0) {
-	lu->class_limit        = entry->virtual_class_limit[dst];
-	lu->class_limit_mult   = entry->virtual_class_limit_mult[dst];
-	lu->class_slice_limit  = mod_cband_get_slice_limit(entry->shmem_data->total_usage.start_time, 
-                                 entry->refresh_time, entry->slice_len, entry->virtual_class_limit[dst]);
-    }
+    if (shmem_data == NULL || lu == NULL)
+	return OK;
 
-    return 0;
+    if ((lu->usage == 0) && (lu->class_usage == 0))
+	return OK;
+
+    if ((lu->limit == 0) && (lu->class_limit == 0))
+        return OK;
+
+    if ((ret = mod_cband_check_limit(r, shmem_data, lu->limit, lu->slice_limit, lu->limit_mult, lu->usage, lu->limit_exceeded)) != OK)
+	return ret;
+
+    if ((ret = mod_cband_check_limit(r, shmem_data, lu->class_limit, lu->class_slice_limit, lu->class_limit_mult, lu->class_usage, lu->limit_exceeded)) != OK)
+	return ret;
+
+    return OK;
 }
 
 /*
- * semafor opuszczany przez funkcje mod_cband_request_handler
+ * CBandRollingLimit: the bytes of the last window seconds against the limit.
+ * The overlimit speed is cleared once the usage falls below the limit again,
+ * a reached CBandLimit sets it once more in mod_cband_check_limits
  */
-int mod_cband_get_virtualhost_usages(request_rec *r, mod_cband_virtualhost_config_entry *entry, mod_cband_limits_usages *lu, int dst)
+static int mod_cband_check_roll_limit(request_rec *r, mod_cband_shmem_data *shmem_data, unsigned long limit, unsigned int mult, unsigned long window, char *limit_exceeded)
 {
-    if (entry == NULL || lu == NULL)
-	return -1;
+    unsigned long long usage;
+    int was_overlimit, ret;
 
-    mod_cband_get_score(r->server, entry->virtual_scoreboard, &lu->usage, -1, entry->shmem_data);
-    
-    if (dst >= 0) 
-	mod_cband_get_score(r->server, lu->scoreboard, &lu->class_usage, dst, entry->shmem_data);
+    if ((shmem_data == NULL) || (limit == 0) || (window == 0))
+	return OK;
 
-    return 0;
+    usage = mod_cband_get_roll_usage_lock(shmem_data, window, limit, mult, &was_overlimit);
+
+    if (mod_cband_limit_reached(limit, limit, mult, usage)) {
+	ret = mod_cband_check_limit(r, shmem_data, limit, limit, mult, usage, limit_exceeded);
+	if (ret != OK)
+	    apr_table_setn(r->notes, "cband_reject", "rolling_limit");
+	return ret;
+    }
+
+    /* only the request which cleared roll_overlimit restores the normal speed */
+    if (was_overlimit)
+	mod_cband_set_normal_speed_lock(shmem_data);
+
+    return OK;
 }
 
-int mod_cband_get_user_limits(mod_cband_user_config_entry *entry_user, mod_cband_limits_usages *lu, int dst)
+/*
+ * name of the destination class, NULL when the destination has no class
+ */
+char *mod_cband_get_class_name(int dst)
 {
-    if (entry_user == NULL || lu == NULL)
-	return -1;
+    mod_cband_class_config_entry *entry_class;
 
-    lu->limit          = entry_user->user_limit;
-    lu->limit_mult     = entry_user->user_limit_mult;
-    lu->limit_exceeded = entry_user->user_limit_exceeded;
-    lu->slice_limit    = mod_cband_get_slice_limit(entry_user->shmem_data->total_usage.start_time, 
-                         entry_user->refresh_time, entry_user->slice_len, entry_user->user_limit);
-    lu->scoreboard     = entry_user->user_scoreboard;
-    
-    if (dst >= 0) {
-        lu->class_limit       = entry_user->user_class_limit[dst];
-        lu->class_limit_mult  = entry_user->user_class_limit_mult[dst];
-        lu->class_slice_limit = mod_cband_get_slice_limit(entry_user->shmem_data->total_usage.start_time, 
-	                        entry_user->refresh_time, entry_user->slice_len, entry_user->user_class_limit[dst]);
-    }
-    
-    return 0;
+    if (dst < 0)
+	return NULL;
+
+    for (entry_class = config->next_class; entry_class != NULL; entry_class = entry_class->next)
+	if (entry_class->class_nr == dst)
+	    return entry_class->class_name;
+
+    return NULL;
 }
 
 /*
- * semafor opuszczany przez funkcje mod_cband_request_handler
+ * 1 when requests of the method are counted, limited and shaped in the
+ * virtualhost (CBandMethods, only GET and HEAD when it isn't set)
  */
-int mod_cband_get_user_usages(request_rec *r, mod_cband_user_config_entry *entry_user, mod_cband_limits_usages *lu, int dst)
+int mod_cband_method_counted(mod_cband_virtualhost_config_entry *entry, request_rec *r)
 {
-    if (entry_user == NULL || lu == NULL)
-	return -1;
-
-    mod_cband_get_score(r->server, lu->scoreboard, &lu->usage, -1, entry_user->shmem_data);
+    if ((entry == NULL) || (entry->virtual_methods == 0))
+	return (r->method_number == M_GET);
 
-    if (dst >= 0)
-	mod_cband_get_score(r->server, lu->scoreboard, &lu->class_usage, dst, entry_user->shmem_data);
-	
-    return 0;
+    return (r->method_number < 64) && ((entry->virtual_methods & (1ULL << r->method_number)) != 0);
 }
 
-int mod_cband_check_limits(request_rec *r, mod_cband_shmem_data *shmem_data, mod_cband_limits_usages *lu, int dst)
+/*
+ * requests other than GET: rejects the request when CBandUploadLimit has been
+ * reached, otherwise the request body is shaped by the mod_cband_upload filter
+ */
+static int mod_cband_upload_handler(request_rec *r, mod_cband_virtualhost_config_entry *entry)
 {
-    int ret;
+    mod_cband_user_config_entry *entry_user = NULL;
+    unsigned long time_now;
 
-    if (shmem_data == NULL || lu == NULL)
-	return OK;
+    if (entry->virtual_user != NULL)
+	entry_user = mod_cband_get_user_entry(entry->virtual_user, r->server->module_config, 0);
 
-    if ((lu->usage == 0) && (lu->class_usage == 0))
-	return OK;
+    if ((entry->shmem_data->upload_kbps == 0) && (entry->virtual_upload_limit == 0) &&
+	((entry_user == NULL) || ((entry_user->shmem_data->upload_kbps == 0) && (entry_user->user_upload_limit == 0))))
+	return DECLINED;
 
-    if ((lu->limit == 0) && (lu->class_limit == 0))
-        return OK;
+    time_now = (unsigned long)(apr_time_now() / 1e6);
+    mod_cband_check_virtualhost_refresh(entry, time_now);
+    mod_cband_check_user_refresh(entry_user, time_now);
 
-    if ((ret = mod_cband_check_limit(r, shmem_data, lu->limit, lu->slice_limit, lu->limit_mult, lu->usage, lu->limit_exceeded)) != OK)
-	return ret;
+    if (mod_cband_upload_limit_reached(entry, entry_user)) {
+	CBAND_PROBE4(request__rejected, entry->virtual_name, entry->virtual_user, -1, config->default_limit_exceeded_code);
+	apr_table_setn(r->notes, "cband_reject", "upload_limit");
+	return config->default_limit_exceeded_code;
+    }
 
-    if ((ret = mod_cband_check_limit(r, shmem_data, lu->class_limit, lu->class_slice_limit, lu->class_limit_mult, lu->class_usage, lu->limit_exceeded)) != OK)
-	return ret;
+    ap_add_input_filter("mod_cband_upload", NULL, r, r->connection);
 
-    return OK;
+    return DECLINED;
 }
 
 /**
@@ -3241,21 +3793,33 @@ static int mod_cband_request_handler (request_rec *r)
 {
     mod_cband_virtualhost_config_entry *entry = NULL;
     mod_cband_user_config_entry *entry_user = NULL;
+    mod_cband_virtualhost_config_entry *entry_dir;
     mod_cband_limits_usages virtual_lu;
     mod_cband_limits_usages user_lu;
+    mod_cband_limits_usages dir_lu;
     unsigned long time_now;
     int dst = -1;
     mod_cband_shmem_data *shmem_data = NULL;
+    char *class_name;
     int ret;
 
-    if (r->main || (r->method_number != M_GET) || (r->status >= 300))
+    if (r->main || (r->status >= 300))
 	return DECLINED;
 
-    if ((entry = mod_cband_get_virtualhost_entry(r->server, r->server->module_config, 0)) == NULL)
+    if ((entry = mod_cband_get_request_entry(r)) == NULL)
+	return DECLINED;
+
+    if ((r->method_number != M_GET) && ((ret = mod_cband_upload_handler(r, entry)) != DECLINED))
+	return ret;
+
+    if (!mod_cband_method_counted(entry, r))
 	return DECLINED;
 
     memset(&virtual_lu, 0, sizeof(mod_cband_limits_usages));
     memset(&user_lu, 0, sizeof(mod_cband_limits_usages));
+    memset(&dir_lu, 0, sizeof(mod_cband_limits_usages));
+
+    entry_dir = ((mod_cband_dir_config *)ap_get_module_config(r->per_dir_config, &cband_module))->entry;
 
     shmem_data = entry->shmem_data;
     shmem_data->total_usage.was_request = 1;
@@ -3263,16 +3827,27 @@ static int mod_cband_request_handler (request_rec *r)
     time_now = (unsigned long)(apr_time_now() / 1e6);
     dst = mod_cband_get_dst(r);
 
+    if ((class_name = mod_cband_get_class_name(dst)) != NULL)
+	apr_table_setn(r->notes, "cband_class", class_name);
+
     mod_cband_get_virtualhost_limits(entry, &virtual_lu, dst);
     mod_cband_check_virtualhost_refresh(entry, time_now);
+    mod_cband_check_schedule(entry, time_now);
     
     if ((entry->virtual_user != NULL) && ((entry_user = mod_cband_get_user_entry(entry->virtual_user, r->server->module_config, 0)) != NULL)) {
         mod_cband_get_user_limits(entry_user, &user_lu, dst);
 	mod_cband_check_user_refresh(entry_user, time_now);
     }
 
-    if ((ret = mod_cband_check_connections_speed(entry, entry_user, r, dst)) != OK)
+    if (entry_dir != NULL) {
+	mod_cband_get_virtualhost_limits(entry_dir, &dir_lu, dst);
+	mod_cband_check_virtualhost_refresh(entry_dir, time_now);
+    }
+
+    if ((ret = mod_cband_check_connections_speed(entry, entry_user, entry_dir, r, dst)) != OK) {
+	CBAND_PROBE4(request__rejected, entry->virtual_name, entry->virtual_user, dst, ret);
 	return ret;
+    }
 
     ap_add_output_filter("mod_cband", NULL, r, r->connection);
 
@@ -3281,209 +3856,113 @@ static int mod_cband_request_handler (request_rec *r)
 
     /* BEGIN CRITICAL SECTION */
     mod_cband_sem_down(config->sem_id);
-    mod_cband_get_virtualhost_usages(r, entry, &virtual_lu, dst);
-    mod_cband_get_user_usages(r, entry_user, &user_lu, dst);
+    mod_cband_get_virtualhost_usages(entry, &virtual_lu, dst);
+    mod_cband_get_user_usages(entry_user, &user_lu, dst);
+    mod_cband_get_virtualhost_usages(entry_dir, &dir_lu, dst);
     mod_cband_sem_up(config->sem_id);
     /* END CRITICAL SECTION */
 
-    if ((entry != NULL) && ((ret = mod_cband_check_limits(r, entry->shmem_data, &virtual_lu, dst)) != OK))
+    if (((ret = mod_cband_check_roll_limit(r, entry->shmem_data, entry->virtual_roll_limit, entry->virtual_roll_limit_mult, entry->roll_window, entry->virtual_limit_exceeded)) != OK) ||
+	((entry_user != NULL) && ((ret = mod_cband_check_roll_limit(r, entry_user->shmem_data, entry_user->user_roll_limit, entry_user->user_roll_limit_mult, entry_user->roll_window, entry_user->user_limit_exceeded)) != OK))) {
+	CBAND_PROBE4(request__rejected, entry->virtual_name, entry->virtual_user, dst, ret);
         return ret;
+    }
 
-    if ((entry_user != NULL) && ((ret = mod_cband_check_limits(r, entry_user->shmem_data, &user_lu, dst)) != OK))
+    if (((entry != NULL) && ((ret = mod_cband_check_limits(r, entry->shmem_data, &virtual_lu, dst)) != OK)) ||
+	((entry_user != NULL) && ((ret = mod_cband_check_limits(r, entry_user->shmem_data, &user_lu, dst)) != OK)) ||
+	((entry_dir != NULL) && ((ret = mod_cband_check_limits(r, entry_dir->shmem_data, &dir_lu, dst)) != OK))) {
+	CBAND_PROBE4(request__rejected, entry->virtual_name, entry->virtual_user, dst, ret);
         return ret;
-        
-    return DECLINED;
-}
-
-float mod_cband_get_shared_speed_lock(mod_cband_virtualhost_config_entry *entry, mod_cband_user_config_entry *entry_user)
-{
-    float next_user_bps = 0, next_virtualhost_bps = 0;
-
-    if (entry == NULL)
-        return -1;
-
-    if ((entry->shmem_data->curr_speed.kbps <= 0) && 
-	((entry_user == NULL) || (entry_user->shmem_data->curr_speed.kbps <= 0)))
-	return -1;
-
-    /* BEGIN CRITICAL SECTION */
-    mod_cband_sem_down(config->sem_id);
-
-    next_user_bps = 0;
-    next_virtualhost_bps = entry->shmem_data->shared_kbps * 1024;
-
-    if (entry_user != NULL) {
-	next_user_bps = entry_user->shmem_data->shared_kbps * 1024;
-	if (entry_user->shmem_data->shared_connections > 0)
-    	    next_user_bps /= (entry_user->shmem_data->shared_connections + 1);
     }
+        
+    CBAND_PROBE3(request__admitted, entry->virtual_name, entry->virtual_user, dst);
 
-    if (entry->shmem_data->shared_connections > 0)
-        next_virtualhost_bps /= (entry->shmem_data->shared_connections + 1);
-
-    mod_cband_sem_up(config->sem_id);
-    /* END CRITICAL SECTION */
-
-    if ((next_user_bps > 0) && (next_virtualhost_bps > next_user_bps))
-	return next_user_bps;
-    else
-    if (next_virtualhost_bps > 0)
-	return next_virtualhost_bps;
-    else
-	return next_user_bps;
-}
-
-int mod_cband_log_bucket(request_rec *r, mod_cband_virtualhost_config_entry *entry, 
-		    mod_cband_user_config_entry *entry_user, unsigned long bucket_bytes, int remote_idx)
-{
-    unsigned long long bytes;
-    int dst = -1;
-    
-    bytes = (unsigned long long)bucket_bytes;
-
-    if (r->method_number != M_GET)
-	return 0;
-
-    if (entry == NULL)
-        return 0;
-
-    dst = mod_cband_get_dst(r);
-
-    /* BEGIN CRITICAL SECTION */
-    mod_cband_sem_down(config->sem_id);
-    mod_cband_update_speed(entry->shmem_data, bucket_bytes, 0, remote_idx);            
-    mod_cband_update_score(entry->virtual_scoreboard, &bytes, dst, &(entry->shmem_data->total_usage));
-    	
-    if (entry_user != NULL) {
-        mod_cband_update_speed(entry_user->shmem_data, bucket_bytes, 0, remote_idx);            
-	mod_cband_update_score(entry_user->user_scoreboard, &bytes, dst, &(entry_user->shmem_data->total_usage));
-    }
-    
-    mod_cband_sem_up(config->sem_id);
-    /* END CRITICAL SECTION */
-    
-    return 0;
+    return DECLINED;
 }
 
-void mod_cband_change_total_connections_lock(mod_cband_virtualhost_config_entry *entry, mod_cband_user_config_entry *entry_user, int diff)
-{
-    /* BEGIN CRITICAL SECTION */
-    mod_cband_sem_down(config->sem_id);
 
-    if ((entry != NULL) && (entry->shmem_data != NULL))
-        mod_cband_safe_change(&entry->shmem_data->total_conn, diff);
 
-    if ((entry_user != NULL) && (entry_user->shmem_data != NULL))
-        mod_cband_safe_change(&entry_user->shmem_data->total_conn, diff);
-    
-    mod_cband_sem_up(config->sem_id);
-    /* END CRITICAL SECTION */
-}
 
-void mod_cband_change_shared_connections_lock(mod_cband_virtualhost_config_entry *entry, mod_cband_user_config_entry *entry_user, int diff)
+/*
+ * closes the shaper of one brigade, at the end of the response (EOS or an
+ * aborted connection) logs the shaping to r->notes for mod_log_config
+ * (%{cband_delay}n etc.) and its sleep to the histograms, once
+ */
+void mod_cband_filter_close(ap_filter_t *f, mod_cband_shaper *shaper, int last)
 {
-    /* BEGIN CRITICAL SECTION */
-    mod_cband_sem_down(config->sem_id);
-
-    if (entry != NULL)
-        mod_cband_safe_change(&entry->shmem_data->shared_connections, diff);
+    mod_cband_filter_ctx *ctx = (mod_cband_filter_ctx *)f->ctx;
+    request_rec *r = f->r;
+    const char *wait;
+    double elapsed;
 
-    if (entry_user != NULL)
-        mod_cband_safe_change(&entry_user->shmem_data->shared_connections, diff);
-
-    mod_cband_sem_up(config->sem_id);
-    /* END CRITICAL SECTION */
-}
+    mod_cband_shaper_close(shaper);
+    ctx->slept += shaper->slept;
 
-void mod_cband_change_shared_speed_lock(mod_cband_virtualhost_config_entry *entry, mod_cband_user_config_entry *entry_user, int diff)
-{
-    /* BEGIN CRITICAL SECTION */
-    mod_cband_sem_down(config->sem_id);
+    if (!last)
+	return;
 
-    if (entry != NULL) {
-        mod_cband_safe_change(&entry->shmem_data->shared_kbps, diff);
-	if (entry->shmem_data->overlimit && (entry->shmem_data->shared_kbps > entry->shmem_data->over_speed.kbps))
-	    mod_cband_set_overlimit_speed(entry->shmem_data);
-	else
-	if (!entry->shmem_data->overlimit && (entry->shmem_data->shared_kbps > entry->shmem_data->max_speed.kbps))
-	    mod_cband_set_normal_speed(entry->shmem_data);
-    }
+    if (!ctx->closed)
+	mod_cband_shaper_log_sleep(shaper, ctx->slept);
+    ctx->closed = 1;
 
-    if (entry_user != NULL) {
-        mod_cband_safe_change(&entry_user->shmem_data->shared_kbps, diff);
-	if (entry_user->shmem_data->overlimit && (entry_user->shmem_data->shared_kbps > entry_user->shmem_data->over_speed.kbps))
-	    mod_cband_set_overlimit_speed(entry_user->shmem_data);
-	else
-	if (!entry_user->shmem_data->overlimit && (entry_user->shmem_data->shared_kbps > entry_user->shmem_data->max_speed.kbps))
-	    mod_cband_set_normal_speed(entry_user->shmem_data);
-    }
+    elapsed = (apr_time_now() - ctx->start) / 1e6;
+    wait    = apr_table_get(r->notes, "cband_wait");
 
-    mod_cband_sem_up(config->sem_id);
-    /* END CRITICAL SECTION */
+    apr_table_setn(r->notes, "cband_sleep", apr_psprintf(r->pool, "%lu", ctx->slept));
+    apr_table_setn(r->notes, "cband_delay", apr_psprintf(r->pool, "%lu", ctx->slept + ((wait != NULL) ? strtoul(wait, NULL, 10) : 0)));
+    apr_table_setn(r->notes, "cband_bytes", apr_psprintf(r->pool, "%" APR_OFF_T_FMT, ctx->bytes));
+    apr_table_setn(r->notes, "cband_kbps", apr_psprintf(r->pool, "%0.2f", (elapsed > 0) ? ctx->bytes * 8 / 1024.0 / elapsed : 0));
 }
 
 static int mod_cband_filter(ap_filter_t *f, apr_bucket_brigade *bb)
 {
     mod_cband_virtualhost_config_entry *entry = NULL;
     mod_cband_user_config_entry *entry_user = NULL;
+    mod_cband_shaper shaper;
     apr_bucket *b = APR_BRIGADE_FIRST(bb);
     apr_bucket_brigade *bbOut;
     const char *buf;
     int bytes;
     int bytes_split;
     apr_size_t bytes_bucket;
-    float next_bps, shared_bps, remote_bps, measured_bps, measured_bps_old;
-    unsigned long max_remote_kbps, remote_rps, remote_connections;
-    int remote_kbps;
-    int shared_case = 0;
-    int slow_remote = 0;
-    int dst;
     int remote_idx = -1;
-    unsigned long sleep_time, diff_time;
-    int not_limit = 0;
-    float div;
-    unsigned long remote_bytes_in_second;
-    unsigned long t1, t2, t1m, t2m;
-    unsigned long remote_bytes_sum = 0;
+    unsigned long t1m, t2m;
     conn_rec *c = f->r->connection;
+    mod_cband_filter_ctx *ctx;
+
+    entry = mod_cband_get_request_entry(f->r);
 
-    if (f->r->main || (f->r->method_number != M_GET)) {
+    if (f->r->main || !mod_cband_method_counted(entry, f->r)) {
 	ap_remove_output_filter(f);
 	ap_pass_brigade(f->next, bb);
 	return APR_SUCCESS;
     }
     
-    bbOut = apr_brigade_create(f->r->pool, c->bucket_alloc);
-    
-    if ((entry = mod_cband_get_virtualhost_entry(f->r->server, f->r->server->module_config, 0)) != NULL) {
-        mod_cband_flush_score_lock(entry->virtual_scoreboard, &(entry->shmem_data->total_usage));
-	remote_idx = mod_cband_get_remote_host(f->r->connection, 1, entry);
-        mod_cband_update_speed_lock(entry->shmem_data, 0, 1, remote_idx);            
+    if ((ctx = f->ctx) == NULL) {
+	f->ctx = ctx = apr_pcalloc(f->r->pool, sizeof(mod_cband_filter_ctx));
+	ctx->start = apr_time_now();
     }
 
-    dst = mod_cband_get_dst(f->r);
-
-    if ((entry != NULL) && (entry->virtual_user != NULL) && ((entry_user = mod_cband_get_user_entry(entry->virtual_user, f->r->server->module_config, 0)) != NULL)) {
-    	mod_cband_flush_score_lock(entry_user->user_scoreboard, &(entry_user->shmem_data->total_usage));
-    	mod_cband_update_speed_lock(entry_user->shmem_data, 0, 1, remote_idx);            
+    bbOut = apr_brigade_create(f->r->pool, c->bucket_alloc);
+    
+    if (entry != NULL) {
+	remote_idx = mod_cband_get_remote_host(f->r, 1, entry);
+	
+	if (entry->virtual_user != NULL)
+	    entry_user = mod_cband_get_user_entry(entry->virtual_user, f->r->server->module_config, 0);
     }
 
-    mod_cband_get_dst_speed_lock(entry, entry_user, &max_remote_kbps, &remote_rps, NULL, dst);
-
-    not_limit = 0;
-    if ((mod_cband_get_shared_speed_lock(entry, entry_user) < 0) && (max_remote_kbps == 0))
-	not_limit = 1;
-	
-    mod_cband_change_total_connections_lock(entry, entry_user, 1);
-    mod_cband_change_remote_connections_lock(remote_idx, 1);
+    mod_cband_shaper_open(&shaper, entry, entry_user, remote_idx, mod_cband_get_dst(f->r));
+    mod_cband_shaper_set_dir(&shaper, ((mod_cband_dir_config *)ap_get_module_config(f->r->per_dir_config, &cband_module))->entry);
+    mod_cband_shaper_set_global_remote(&shaper, mod_cband_get_global_remote_host(f->r, entry));
 
     /* 
-     * Fairness Bandwidth Sharing algorithm 
+     * Fairness Bandwidth Sharing algorithm, the chunk sizes and sleep times are 
+     * computed by mod_cband_shaper_chunk
      */
     while(b != APR_BRIGADE_SENTINEL(bb)) {
 	if (f->r->connection->aborted) {
-	    mod_cband_change_total_connections_lock(entry, entry_user, -1);
-	    mod_cband_change_remote_connections_lock(remote_idx, -1);
+	    mod_cband_filter_close(f, &shaper, 1);
 	    return APR_SUCCESS;
 	}
     
@@ -3491,93 +3970,16 @@ static int mod_cband_filter(ap_filter_t *f, apr_bucket_brigade *bb)
 	    APR_BUCKET_REMOVE(b);
 	    APR_BRIGADE_INSERT_TAIL(bbOut, b);
 	    ap_pass_brigade(f->next, bbOut);
-	    mod_cband_change_total_connections_lock(entry, entry_user, -1);
-	    mod_cband_change_remote_connections_lock(remote_idx, -1);
+	    mod_cband_filter_close(f, &shaper, APR_BUCKET_IS_EOS(b));
 	    return APR_SUCCESS;
 	}
 
-	measured_bps = 0;	
-	measured_bps_old = 0;
-	t1 = t2 = apr_time_now();
+	mod_cband_shaper_bucket(&shaper);
 	if (apr_bucket_read(b, &buf, &bytes_bucket, APR_NONBLOCK_READ) == APR_SUCCESS) {
 
 	    bytes = (int)bytes_bucket;
 	    while(bytes > 0) {
-		mod_cband_set_remote_request_time(remote_idx, apr_time_now());
-    		
-		if (!not_limit) {
-		    shared_bps = mod_cband_get_shared_speed_lock(entry, entry_user);
-		    remote_bps = (float)(max_remote_kbps * 1024);
-		    remote_connections = mod_cband_get_remote_connections(remote_idx);
-		
-		    if (remote_connections > 0)
-			remote_bps /= remote_connections;
-
-		    if (shared_bps < 0)
-			shared_bps = 0;
-
-		    if (config->random_pulse)
-			sleep_time = ((MAX_PULSE_LEN / 2) + (rand() % (MAX_PULSE_LEN / 2))) * ((rand() % (MAX_PULSES)) + 1);
-		    else
-			sleep_time = MAX_PULSE_LEN * MAX_PULSES;
-
-		    if ((measured_bps) > 0 && ((remote_bps > measured_bps) || (shared_bps > measured_bps))) {
-			slow_remote = MAX_SLOW_REMOTE_LOOPS;
-			measured_bps_old = measured_bps;
-		    }
-	
-		    if (slow_remote > 0) {
-			remote_bps = measured_bps_old;
-			slow_remote--;
-		    }
-		    
-		    remote_kbps = (remote_bps / 1024);
-		    next_bps    = remote_bps;	    
-
-		    shared_case = 0;
-		    if (((shared_bps > 0) && (shared_bps < remote_bps)) || (remote_bps <= 0)) {
-			next_bps    = shared_bps;
-			shared_case = 1;
-			mod_cband_change_shared_connections_lock(entry, entry_user, 1);
-		    } else
-			mod_cband_change_shared_speed_lock(entry, entry_user, -remote_kbps);
-
-		    if (next_bps <= MIN_SPEED)
-			next_bps = MIN_SPEED;
-
-		    next_bps = (next_bps * sleep_time) / (CONST_PULSE_LEN);
-		    bytes_split = (int)(next_bps / 8);
-		} else {
-		    next_bps = 0;
-		    remote_kbps = 0;
-		    sleep_time  = 0;
-		    bytes_split = MAX_CHUNK_LEN;
-		    
-		    if (bytes_split > bytes)
-			bytes_split = bytes;
-		}
-
-		/* 
-		 * jezeli mamy mniej do przeslania niz bytes_split bajtow w sekundzie
-		 * to wysylamy wszystko, ale czekamy tylko t = ile_bajtow/speed zeby male dokumenty
-		 * albo ich koncowki tez byly transportowane z zadana predkoscia
-		 */
-		if (!not_limit && (bytes_split > bytes)) {
-		    if (bytes_split > 0)
-		        sleep_time = (unsigned long)((float)((float)bytes / bytes_split) * 1e6);
-		    else
-		        sleep_time = 0;
-		
-		    bytes_split = bytes;
-		}
-
-		if (bytes_split > MAX_CHUNK_LEN) {
-		    div = (float)bytes_split / MAX_CHUNK_LEN;
-		    if (div > 0)
-			sleep_time /= div;
-			
-		    bytes_split = MAX_CHUNK_LEN;
-		}
+		bytes_split = mod_cband_shaper_chunk(&shaper, bytes);
 	    			
 		apr_bucket_split(b, bytes_split);
 		APR_BUCKET_REMOVE(b);
@@ -3589,41 +3991,11 @@ static int mod_cband_filter(ap_filter_t *f, apr_bucket_brigade *bb)
 		t2m = apr_time_now();
 
 	    	b = APR_BRIGADE_FIRST(bb);
-		mod_cband_log_bucket(f->r, entry, entry_user, (unsigned long)bytes_split, remote_idx);
-
-		remote_bytes_sum += bytes_split;		
-		t2 = apr_time_now();
-
-	        if (t2 > t1 + 1e6) {
-		    div = (float)(t2 - t1) / 1e6;
-		    
-		    if (div > 0)
-			remote_bytes_in_second = remote_bytes_sum / div; 
-		    else
-			remote_bytes_in_second = remote_bytes_sum;
-			
-		    mod_cband_set_remote_current_speed(remote_idx, (remote_bytes_in_second * 8) / 1024);
-		    t1 = apr_time_now();
-		    remote_bytes_sum = 0;
-		}
-
-		if (!not_limit) {
-		    if ((diff_time = (t2m - t1m)) > 0)
-			measured_bps = ((bytes_split * 8) / diff_time) * 1e6;
-		    else
-			measured_bps = next_bps;
-
-		    usleep(sleep_time);
-
-		    if (shared_case)
-			mod_cband_change_shared_connections_lock(entry, entry_user, -1);
-		    else
-			mod_cband_change_shared_speed_lock(entry, entry_user, remote_kbps);
-		}
+		mod_cband_shaper_sent(&shaper, bytes_split, t2m - t1m);
+		ctx->bytes += bytes_split;
 
 		if (f->r->connection->aborted) {
-	    	    mod_cband_change_total_connections_lock(entry, entry_user, -1);
-	            mod_cband_change_remote_connections_lock(remote_idx, -1);
+		    mod_cband_filter_close(f, &shaper, 1);
 		    return APR_SUCCESS;
 		}
 	    }
@@ -3635,28 +4007,82 @@ static int mod_cband_filter(ap_filter_t *f, apr_bucket_brigade *bb)
 	ap_pass_brigade(f->next, bbOut);
     }
 
-    mod_cband_change_total_connections_lock(entry, entry_user, -1);
-    mod_cband_change_remote_connections_lock(remote_idx, -1);
+    mod_cband_filter_close(f, &shaper, 0);
     
     return APR_SUCCESS;
 }
 
-static apr_status_t mod_cband_cleanup1(void *s)
+static apr_status_t mod_cband_upload_cleanup(void *data)
 {
-    int i;
+    mod_cband_upload_ctx *ctx = (mod_cband_upload_ctx *)data;
+
+    if (!ctx->closed) {
+	mod_cband_upload_close(&ctx->shaper);
+	ctx->closed = 1;
+    }
+
+    return APR_SUCCESS;
+}
+
+/*
+ * input filter of request bodies, every read is cut to the chunk given by
+ * mod_cband_shaper_chunk and followed by its pause. The upload ends with
+ * the EOS bucket or with the request pool
+ */
+static apr_status_t mod_cband_upload_filter(ap_filter_t *f, apr_bucket_brigade *bb, ap_input_mode_t mode, 
+					    apr_read_type_e block, apr_off_t readbytes)
+{
+    mod_cband_virtualhost_config_entry *entry;
+    mod_cband_user_config_entry *entry_user = NULL;
+    mod_cband_upload_ctx *ctx;
+    apr_status_t rv;
+    apr_off_t bytes = 0;
+    int bytes_split;
+    unsigned long t1m, t2m;
+
+    if ((ctx = f->ctx) == NULL) {
+	if ((entry = mod_cband_get_virtualhost_entry(f->r->server, f->r->server->module_config, 0)) == NULL) {
+	    ap_remove_input_filter(f);
+	    return ap_get_brigade(f->next, bb, mode, block, readbytes);
+	}
+
+	if (entry->virtual_user != NULL)
+	    entry_user = mod_cband_get_user_entry(entry->virtual_user, f->r->server->module_config, 0);
+
+	f->ctx = ctx = apr_pcalloc(f->r->pool, sizeof(mod_cband_upload_ctx));
+	mod_cband_upload_open(&ctx->shaper, entry, entry_user);
+	apr_pool_cleanup_register(f->r->pool, ctx, mod_cband_upload_cleanup, apr_pool_cleanup_null);
+    }
+
+    if ((mode != AP_MODE_READBYTES) || ctx->closed)
+	return ap_get_brigade(f->next, bb, mode, block, readbytes);
 
+    bytes_split = mod_cband_shaper_chunk(&ctx->shaper, (readbytes > MAX_CHUNK_LEN) ? MAX_CHUNK_LEN : (int)readbytes);
+
+    t1m = apr_time_now();
+    rv  = ap_get_brigade(f->next, bb, mode, block, bytes_split);
+    t2m = apr_time_now();
+
+    if (rv == APR_SUCCESS)
+	apr_brigade_length(bb, 1, &bytes);
+
+    mod_cband_shaper_sent(&ctx->shaper, (int)bytes, t2m - t1m);
+
+    if ((rv != APR_SUCCESS) || (!APR_BRIGADE_EMPTY(bb) && APR_BUCKET_IS_EOS(APR_BRIGADE_LAST(bb))))
+	mod_cband_upload_cleanup(ctx);
+
+    return rv;
+}
+
+static apr_status_t mod_cband_cleanup1(void *s)
+{
     /* BEGIN CRITICAL SECTION */
     mod_cband_sem_down(config->sem_id);
     mod_cband_save_score_cache();
     mod_cband_sem_up(config->sem_id);
     /* END CRITICAL SECTION */
 
-    for (i = 0; i <= config->shmem_seg_idx; i++)
-	mod_cband_shmem_remove(config->shmem_seg[i].shmem_id);
-
-    mod_cband_shmem_remove(config->remote_hosts.shmem_id);
-    mod_cband_sem_remove(config->remote_hosts.sem_id);
-    mod_cband_sem_remove(config->sem_id);
+    mod_cband_core_remove();
     
     return APR_SUCCESS;
 }
@@ -3671,10 +4097,12 @@ static apr_status_t mod_cband_post_config(apr_pool_t *p, apr_pool_t *plog, apr_p
 {
     /* BEGIN CRITICAL SECTION */
     mod_cband_sem_down(config->sem_id);
-    mod_cband_update_score_cache(s);
+    mod_cband_update_score_cache();
     mod_cband_sem_up(config->sem_id);
     /* END CRITICAL SECTION */
 
+    mod_cband_schedule_init();
+
     return OK;
 }
 
@@ -3684,36 +4112,43 @@ static apr_status_t mod_cband_post_config(apr_pool_t *p, apr_pool_t *plog, apr_p
 static void mod_cband_register_hooks (apr_pool_t *p)
 {
     ap_hook_handler(mod_cband_status_handler, NULL, NULL, APR_HOOK_FIRST);
+    ap_hook_handler(mod_cband_metrics_handler, NULL, NULL, APR_HOOK_FIRST);
     ap_hook_handler(mod_cband_request_handler, NULL, NULL, APR_HOOK_FIRST);
     apr_pool_cleanup_register(p, NULL, mod_cband_cleanup1, mod_cband_cleanup2);
     ap_hook_post_config(mod_cband_post_config, NULL, NULL, APR_HOOK_MIDDLE);
     ap_register_output_filter("mod_cband", mod_cband_filter, NULL, AP_FTYPE_TRANSCODE);
+    ap_register_input_filter("mod_cband_upload", mod_cband_upload_filter, NULL, AP_FTYPE_RESOURCE);
 }
 
 /**
  * allocate config_header for mod_cband - this will store module 
  * settings, as read from config file
  */
+static void *mod_cband_create_dir_config(apr_pool_t *p, char *dir)
+{
+    return apr_pcalloc(p, sizeof(mod_cband_dir_config));
+}
+
+/*
+ * the innermost section with limits wins, the request handler and the filter
+ * only read the merged entry
+ */
+static void *mod_cband_merge_dir_config(apr_pool_t *p, void *basev, void *addv)
+{
+    mod_cband_dir_config *base = (mod_cband_dir_config *)basev;
+    mod_cband_dir_config *add  = (mod_cband_dir_config *)addv;
+    mod_cband_dir_config *new  = (mod_cband_dir_config *)apr_pcalloc(p, sizeof(mod_cband_dir_config));
+
+    new->entry = (add->entry != NULL) ? add->entry : base->entry;
+
+    return new;
+}
+
 static void *mod_cband_create_config(apr_pool_t *p, server_rec *s)
 {
     if (config == NULL) {
-	config = (mod_cband_config_header *) apr_palloc(p, sizeof(mod_cband_config_header));
-	config->next_virtualhost = NULL;
-	config->next_user = NULL;
-	config->next_class = NULL;
-	config->default_limit_exceeded = NULL;
-	config->p = p;
-	config->tree = NULL;
-	config->start_time = (unsigned long)(apr_time_now() / 1e6);
-	config->score_flush_period = 0;
-	config->sem_id = semget(IPC_PRIVATE, 1, IPC_CREAT | 0666);
-	config->shmem_seg_idx = -1;
+	config = mod_cband_core_init(mod_cband_palloc, p);
 	config->default_limit_exceeded_code = HTTP_SERVICE_UNAVAILABLE;
-	config->max_chunk_len = MAX_CHUNK_LEN;
-	
-	mod_cband_remote_hosts_init();
-	mod_cband_sem_init(config->sem_id);
-	mod_cband_shmem_init();
     } 
     
     return (void *)config;
@@ -3722,8 +4157,8 @@ static void *mod_cband_create_config(apr_pool_t *p, server_rec *s)
 module AP_MODULE_DECLARE_DATA cband_module =
 {
 	STANDARD20_MODULE_STUFF,
-	NULL,
-	NULL,
+	mod_cband_create_dir_config,
+	mod_cband_merge_dir_config,
 	mod_cband_create_config,
 	NULL,
 	mod_cband_cmds,
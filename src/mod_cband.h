@@ -41,170 +41,127 @@
 #include <sys/shm.h>
 #include <unistd.h>
 
-#include "libpatricia.c"
+#include "cband_core.h"
 
-#define MAX_CLASS_STR_LEN		16
 #define MAX_DST_LEN			16
-#define MAX_VIRTUALHOST_NAME		0x100
 #define MAX_PERIOD_LEN			0x20
 #define MAX_TRAFFIC_LEN			0x100
-#define MAX_REMOTE_HOSTS		8192
 #define MAX_HASH_TABLE_LEN		0x100
-#define MAX_SHMEM_SEGMENTS		0x1000
-#define MAX_SHMEM_ENTRIES		0x1000
-#define MAX_SLOW_REMOTE_LOOPS		5
-#define MAX_DELAY_LOOPS			100
 #define MAX_OVERLIMIT_DELAY		10
-#define MAX_PULSE_LEN			250000
-#define MAX_PULSES			4
-#define MAX_CHUNK_LEN			0x8000
-#define CONST_PULSE_LEN			1000000
-#define MAX_SLEEP_TIME			100000
-#define MAX_REMOTE_HOST_LIFE		10
-#define MIN_SPEED			1024
 #define MIN_SLEEP_TIME			50000
-#define PERIOD_LEN			1
 #define DEFAULT_REFRESH			15
+#define DEFAULT_REMOTE_TOP		20
 #define CBAND_HANDLER_ALL		0
 #define CBAND_HANDLER_ME		1
+#define CBAND_KEY_IP			0		/* CBandKey: address of the connection */
+#define CBAND_KEY_CLIENT		1		/* useragent address (mod_remoteip) */
+#define CBAND_KEY_HEADER		2
+#define CBAND_KEY_COOKIE		3
+#define CBAND_KEY_USER			4		/* authenticated user */
+#define CBAND_KEY_ENV			5		/* request environment variable */
+#define MAX_METRIC_LABEL_LEN		0x200
+#define METRIC_BYTES			0
+#define METRIC_CLASS_BYTES		1
+#define METRIC_REQUESTS			2
+#define METRIC_CONNECTIONS		3
+#define METRIC_KBPS			4
+#define METRIC_RPS			5
+#define METRIC_LIMIT			6
+#define METRIC_CLASS_LIMIT		7
+#define METRIC_KBPS_LIMIT		8
+#define METRIC_RPS_LIMIT		9
+#define METRIC_CONN_LIMIT		10
+#define METRIC_OVERLIMIT		11
+#define METRIC_UPLOAD_BYTES		12
+#define METRIC_UPLOAD_LIMIT		13
+#define METRIC_UPLOAD_KBPS_LIMIT	14
+#define METRIC_UPLOADS			15
+#define METRIC_LOCK_ACQUISITIONS	0
+#define METRIC_LOCK_CONTENDED		1
+#define METRIC_LOCK_WAIT		2
+#define METRIC_LOCK_MAX_WAIT		3
 
-#if (defined(__GNU_LIBRARY__) && !defined(_SEM_SEMUN_UNDEFINED)) || defined(__FreeBSD__)
-/* union semun is defined by including <sys/sem.h> */
-#else
-/* according to X/OPEN we have to define it ourselves */
-union semun {
-    int val;
-    struct semid_ds *buf;
-    unsigned short *array;
-    struct seminfo *__buf;
-};					            
-#endif
-
-typedef struct mod_cband_virtualhost_config_entry mod_cband_virtualhost_config_entry;
-typedef struct mod_cband_user_config_entry mod_cband_user_config_entry;
-typedef struct mod_cband_class_config_entry mod_cband_class_config_entry;
-
-typedef struct {
-    unsigned long long total_bytes; 			/* in bytes - total traffic */
-    unsigned long long class_bytes[DST_CLASS]; 		/* in bytes - class traffic */
-    unsigned long start_time;
-    long score_flush_count;
-    int was_request;
-} mod_cband_scoreboard_entry;
-
-typedef struct {
-    unsigned long kbps, rps, max_conn;
-} mod_cband_speed;
-
+/*
+ * copy of the counters of one virtualhost or user taken by the metrics handler
+ */
 typedef struct {
-    mod_cband_speed max_speed;
-    mod_cband_speed over_speed;
+    char *name;
+    apr_port_t port;
+    unsigned line;
+    unsigned long long total_bytes;
+    unsigned long long class_bytes[DST_CLASS];
+    unsigned long long total_requests;
+    unsigned long long limit;				/* in bytes */
+    unsigned long long class_limit[DST_CLASS];		/* in bytes */
+    unsigned long total_conn;
     mod_cband_speed curr_speed;
-    mod_cband_speed remote_speed;
-    unsigned long shared_kbps, shared_connections, total_conn;
-    unsigned long total_last_refresh;
-    unsigned long total_last_time;
-    mod_cband_scoreboard_entry total_usage;
-    float current_TX, old_TX;
-    float current_conn, old_conn;
+    float bps, rps;
     int overlimit;
-    unsigned long time_delta;
-} mod_cband_shmem_data;
+    mod_cband_hist_summary delays[HIST_TYPES];
+    unsigned long long upload_bytes;
+    unsigned long long upload_limit;			/* in bytes */
+    unsigned long upload_kbps, upload_conn;
+} mod_cband_metrics_entry;
 
 typedef struct {
-    int shmem_id;
-    int shmem_entry_idx;
-    void *shmem_data;
-} mod_cband_shmem_segment;
+    const char *name;
+    const char *type;
+    const char *help;
+    int field;
+} mod_cband_metric;
 
-struct mod_cband_virtualhost_config_entry {
-    char *virtual_name;
-    apr_port_t virtual_port;
-    unsigned virtual_defn_line;
-    char *virtual_limit_exceeded;
-    char *virtual_scoreboard;
-    char *virtual_user;
-    unsigned long virtual_limit;  			/* in units of *_mult bytes - total limit  */
-    unsigned long virtual_class_limit[DST_CLASS];	/* in units of *_mult bytes - class limits */
-    unsigned long refresh_time;				/* in seconds */
-    unsigned long slice_len;				/* in seconds */
-    unsigned int virtual_limit_mult;
-    unsigned int virtual_class_limit_mult[DST_CLASS];
-    mod_cband_speed virtual_class_speed[DST_CLASS];
-    mod_cband_shmem_data *shmem_data;
-    mod_cband_virtualhost_config_entry *next;
-};
+/*
+ * bounded min-heap used to select the top N entries in one pass
+ */
+typedef struct {
+    float key;
+    void *ptr;
+} mod_cband_heap_item;
 
-struct mod_cband_user_config_entry {
-    char *user_name;
-    char *user_limit_exceeded;
-    char *user_scoreboard;
-    unsigned long user_limit;  				/* in units of *_mult bytes - total limit  */
-    unsigned long user_class_limit[DST_CLASS]; 		/* in units of *_mult bytes - class limits */
-    unsigned long refresh_time;	
-    unsigned long slice_len;	
-    unsigned int user_limit_mult;
-    unsigned int user_class_limit_mult[DST_CLASS];
-    mod_cband_speed user_class_speed[DST_CLASS];
-    mod_cband_shmem_data *shmem_data;			/* in seconds */
-    mod_cband_user_config_entry *next;
-};
+typedef struct {
+    mod_cband_heap_item *items;
+    int size;
+    int max;
+} mod_cband_heap;
 
-struct mod_cband_class_config_entry {
-    char *class_name;
-    unsigned int class_nr;
-    mod_cband_shmem_data *shmem_data;
-    mod_cband_class_config_entry *next;
-};
+/*
+ * parameters of the JSON status output
+ */
+typedef struct {
+    char *virtualhost;
+    char *user;
+    char *prefix;
+    int top;
+    int offset;
+    int limit;
+} mod_cband_status_filter;
 
-typedef struct mod_cband_remote_host {
-    int used;
-    unsigned long remote_addr;
-    unsigned long remote_conn;
-    unsigned long remote_kbps, remote_max_conn;
-    unsigned long remote_last_time;
-    unsigned long remote_last_refresh;
-    unsigned long remote_total_conn;
-    char *virtual_name;
-} mod_cband_remote_host;
+/*
+ * shaping of one request over all calls of the output filter, logged to r->notes
+ */
+typedef struct {
+    apr_time_t start;
+    unsigned long slept;				/* in microseconds */
+    apr_off_t bytes;
+    int closed;						/* the sleep is in the histograms */
+} mod_cband_filter_ctx;
 
-typedef struct mod_cband_remote_hosts {
-    int shmem_id;
-    int sem_id;
-    struct mod_cband_remote_host *hosts;
-} mod_cband_remote_hosts;
+/*
+ * per-directory configuration, the entry of the innermost <Location> or
+ * <Directory> with limits. The entry has shared memory of its own
+ */
+typedef struct {
+    mod_cband_virtualhost_config_entry *entry;
+} mod_cband_dir_config;
 
+/*
+ * shaping of one request body over all calls of the input filter
+ */
 typedef struct {
-    mod_cband_virtualhost_config_entry *next_virtualhost;
-    mod_cband_user_config_entry *next_user;
-    mod_cband_class_config_entry *next_class;
-    apr_pool_t *p;
-    char *default_limit_exceeded;
-    int default_limit_exceeded_code;
-    patricia_tree_t *tree;
-    unsigned long start_time;				/* in seconds */
-    int sem_id;
-    mod_cband_shmem_segment shmem_seg[MAX_SHMEM_SEGMENTS];
-    mod_cband_remote_hosts remote_hosts;
-    int shmem_seg_idx;
-    unsigned long score_flush_period;
-    unsigned long random_pulse;
-    unsigned long max_chunk_len;
-} mod_cband_config_header;
+    mod_cband_shaper shaper;
+    int closed;
+} mod_cband_upload_ctx;
 
 typedef struct mod_cband_brigade_ctx {
     apr_bucket_brigade *bb;
 } mod_cband_brigade_ctx;
-
-typedef struct {
-    unsigned long limit;
-    unsigned long slice_limit;
-    unsigned long class_limit;
-    unsigned long class_slice_limit;
-    unsigned long long usage;
-    unsigned long long class_usage;
-    unsigned int limit_mult;
-    unsigned int class_limit_mult;
-    char *limit_exceeded;
-    char *scoreboard;
-} mod_cband_limits_usages;